@@ -1,94 +1,186 @@
-#include <assert.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <math.h>
+#include "car_common.h"
+#include "car_file.h"
+#include "car_assets.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_lookup_controller.h"
+#include "car_plugin.h"
+#include "car_planner.h"
+#include "car_lidar.h"
+#include "car_jobs.h"
+#include "car_mpc.h"
+#include "car_policy.h"
+#include "car_recording.h"
+#include "car_replay.h"
+#include "car_checkpoint.h"
+#include "car_loader.h"
+#include "car_scenario.h"
+#include "car_rewind.h"
+
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_net.h>
 
 // #define MFD_IMPLEMENTATION
 // #include "miscellus_file_dialog.h"
 
-#define DEG_TO_RAD 0.017453292519943295f
-#define RAD_TO_DEG 57.29577951308232f
-#define TAU 6.283185307179586f
-#define PI 3.141592653589793f
-
-#define LERP(a,b,t) ((1.0f-(t))*(a) + (t)*(b))
-
-typedef char s8;
-typedef short s16;
-typedef int s32;
-typedef long long s64;
-typedef unsigned char u8;
-typedef unsigned short u16;
-typedef unsigned int u32;
-typedef unsigned long long u64;
-
-typedef u32 b32;
-#ifndef __cplusplus
-enum {false = 0, true = 1};
-#endif
-
-typedef u64 umm;
-typedef s64 smm;
-
-typedef int check_size8[sizeof(u8)==1&&sizeof(s8)==1 ? 1 : -1];
-typedef int check_size16[sizeof(u16)==2&&sizeof(s16)==2 ? 1 : -1];
-typedef int check_size32[sizeof(u32)==4&&sizeof(s32)==4 ? 1 : -1];
-typedef int check_size64[sizeof(u64)==8&&sizeof(s64)==8 ? 1 : -1];
-typedef int check_sizeumm[sizeof(umm)==sizeof((void *)0) ? 1 : -1];
-typedef int check_sizesmm[sizeof(smm)==sizeof((void *)0) ? 1 : -1];
-
-
-typedef struct Length_Buffer {
-	umm length;
-	u8 *data;
-} Length_Buffer;
-
 typedef enum Application_Mode {
 	APP_MODE_VIEW = 0,
 	COUNT_APP_MODE
 } Application_Mode;
 
-typedef struct Car {
-	float x;
+#define ASSET_CACHE_PATH "assets.cache"
+#define CHECKPOINT_DEFAULT_PATH "session.checkpoint"
+
+#define MAX_CAR_COUNT (1 << 17)
+#define FLEET_SPAWN_COUNT 1024
+
+// Replays copy their cars straight into the simulation's arrays
+typedef int check_replay_car_count[REPLAY_MAX_CAR_COUNT <= MAX_CAR_COUNT ? 1 : -1];
+
+#define WORLD_GRID_WIDTH 192
+#define WORLD_GRID_HEIGHT 144
+#define WORLD_GRID_CELL_SIZE 32.0f
+#define PLANNER_EXPANSIONS_PER_FRAME 8192
+
+typedef struct Camera {
+	float x; // World position shown at the center of the window
 	float y;
-	float length;
-	float width;
-	float direction;
-	float velocity;
-	float acceleration;
-	float turning_rate;
-	float turning_span;
-	float rolling_resistance;
-	float breaking_resistance;
-	float front_wheel_angle;
-	float rear_wheel_angle;
-	float half_wheel_base;
-
-	float target_x;
-	float target_y;
-	// SDL_Surface *surface;
+	float zoom; // Window pixels per world unit
+} Camera;
+
+typedef enum Car_Lod {
+	CAR_LOD_SPRITE = 0, // Rotated textured sprite
+	CAR_LOD_RECT,       // Rotated flat rectangle
+	CAR_LOD_POINT,      // Single point
+	CAR_LOD_DENSITY,    // Aggregated into density cells
+	COUNT_CAR_LOD
+} Car_Lod;
+
+// Minimum on-screen car length in pixels for each level of detail
+#define LOD_SPRITE_MIN_PIXELS 16.0f
+#define LOD_RECT_MIN_PIXELS 3.0f
+#define LOD_POINT_MIN_PIXELS 0.75f
+
+#define DENSITY_CELL_PIXELS 4
+#define DENSITY_LEVEL_COUNT 8
+
+typedef enum Debug_Draw_Category {
+	DEBUG_DRAW_TARGET = 0,
+	DEBUG_DRAW_TARGET_LINE,
+	DEBUG_DRAW_HEADING,
+	DEBUG_DRAW_FRAME_GRAPH,
+	DEBUG_DRAW_PATH,
+	DEBUG_DRAW_LIDAR,
+	COUNT_DEBUG_DRAW_CATEGORY
+} Debug_Draw_Category;
+
+#define DEBUG_DRAW_MAX_COLORS 16
+
+// Primitives of one color, accumulated during the frame. Lines are stored as point pairs.
+typedef struct Debug_Draw_Bucket {
+	u32 color; // 0xRRGGBBAA
+
+	u32 line_count;
+	u32 line_capacity;
+	SDL_FPoint *lines;
+
+	u32 rect_count;
+	u32 rect_capacity;
+	SDL_FRect *rects;
+
+	u32 point_count;
+	u32 point_capacity;
+	SDL_FPoint *points;
+} Debug_Draw_Bucket;
+
+typedef struct Debug_Draw {
+	u32 enabled_categories; // Bit per Debug_Draw_Category
+	u32 bucket_count;
+	u32 last_bucket;
+	Debug_Draw_Bucket buckets[DEBUG_DRAW_MAX_COLORS];
+} Debug_Draw;
+
+typedef enum Frame_Phase {
+	FRAME_PHASE_EVENTS = 0,
+	FRAME_PHASE_CONTROL,
+	FRAME_PHASE_PHYSICS,
+	FRAME_PHASE_RECORD,
+	FRAME_PHASE_RENDER,
+	FRAME_PHASE_PRESENT,
+	COUNT_FRAME_PHASE
+} Frame_Phase;
+
+#define FRAME_TIMING_HISTORY 256 // Frames kept in the ring buffer, also the summary period
+
+typedef struct Frame_Timing {
+	u64 frequency;
+	u64 phase_start;
+	u32 frame_count; // Frames completed, the ring buffer row is frame_count % FRAME_TIMING_HISTORY
+	u64 phase_ticks[FRAME_TIMING_HISTORY][COUNT_FRAME_PHASE];
+} Frame_Timing;
+
+typedef enum Trail_Mode {
+	TRAIL_MODE_OFF = 0,
+	TRAIL_MODE_TRAILS, // Recent paths, fading quickly
+	TRAIL_MODE_HEAT,   // Occupancy accumulated over the whole run, fading slowly
+	COUNT_TRAIL_MODE
+} Trail_Mode;
+
+#define TRAIL_CELL_SIZE 8.0f // World units per texel
+#define TRAIL_TILE_SIZE 64   // Texels per tile side
+#define TRAIL_TILES_X 32
+#define TRAIL_TILES_Y 32
+#define TRAIL_WIDTH (TRAIL_TILES_X*TRAIL_TILE_SIZE)
+#define TRAIL_HEIGHT (TRAIL_TILES_Y*TRAIL_TILE_SIZE)
+#define TRAIL_FADE_TILES_PER_FRAME 16
+#define TRAIL_FADE_TRAILS 64 // Intensity lost per update, in 1/16ths
+#define TRAIL_FADE_HEAT 1
+
+// Persistent trail accumulation in a tiled streaming texture. Only tiles
+// touched since the last frame are uploaded, and fading visits a fixed
+// number of tiles per frame, so the per-frame cost follows car movement
+// rather than history length. A visited tile fades by the updates since its
+// last fade, so trails fade at the same rate however many tiles are active.
+typedef struct Trail_Layer {
+	Trail_Mode mode;
+
+	float origin_x; // World position of texel (0, 0)
+	float origin_y;
+
+	u8 *intensity; // TRAIL_WIDTH*TRAIL_HEIGHT
+	b32 tile_dirty[TRAIL_TILES_X*TRAIL_TILES_Y];  // Needs upload
+	b32 tile_active[TRAIL_TILES_X*TRAIL_TILES_Y]; // Has non-zero texels, needs fading
+	u32 tile_faded_at[TRAIL_TILES_X*TRAIL_TILES_Y]; // Update the fade has caught up to
+	u32 fade_cursor;
+	u32 update_count;
+
+	u32 palette[COUNT_TRAIL_MODE][256];
 	SDL_Texture *texture;
-} Car;
-
-typedef struct Control_Input {
-	// Control_Input_Button_Flags buttons;
-	s16 acceleration_axis;
-	s16 turn_axis;
-} __attribute__((packed)) Control_Input;
-
-typedef struct Sensor_Data {
-	float delta_x;
-	float delta_y;
-	float heading_direction;
-	float velocity;
-	u64 time;
-} __attribute__((packed)) Sensor_Data;
+} Trail_Layer;
+
+typedef struct Lod_Renderer {
+	SDL_Texture *car_texture;
+	SDL_Texture *flat_texture; // 1x1 white, so flat rectangles batch like sprites
+
+	u32 *sprite_indices;
+	u32 *rect_indices;
+	SDL_FPoint *points;
+
+	s32 density_columns;
+	s32 density_rows;
+	u32 *density_cells;
+	SDL_FRect *density_rects;
+
+	u32 lod_counts[COUNT_CAR_LOD];
+} Lod_Renderer;
 
 typedef struct Application_State Application_State;
 
-#define DEFINE_CONTROL_FUNCTION(name) Control_Input name(Application_State *app_state, Sensor_Data sensor_data)
+// Evaluates a controller for `count` cars at once: sensor_data, controller_states
+// and inputs are parallel arrays. inputs hold the previous tick's values on entry.
+// lidar_distances holds lidar_config.ray_count readings per car in the same
+// order, or is NULL while the lidar is off.
+#define DEFINE_CONTROL_FUNCTION(name) void name(Application_State *app_state, u32 count, Sensor_Data *sensor_data, const float *lidar_distances, Controller_State *controller_states, Control_Input *inputs)
 typedef DEFINE_CONTROL_FUNCTION(Control_Function);
 
 struct Application_State {
@@ -101,237 +193,1237 @@ struct Application_State {
 	IPaddress controller_address;
 	UDPpacket *udp_packet;
 
-	Control_Input car_input;
-	Control_Function *control_function;
+	u32 controller_sequence;
+	u32 *controller_reply_sequences; // Per car, of the last reply applied to it
+
+	Control_Function *control_function;       // Drives cars[0]
+	Control_Function *fleet_control_function; // Drives cars[1..car_count)
+	Controller_Plugin controller_plugin;
+	Lookup_Table_Controller lookup_table;
+	Mpc_Controller mpc;
+	Policy_Controller policy;
+	Job_System jobs;
+
+	Recorder recorder;
+	b32 recording;
+
+	Replayer replayer;
+	b32 replaying;      // Cars follow the replay instead of the controllers
+	b32 replay_paused;
+
+	File_Loader loader;
+
+	Checkpoint snapshot; // In memory, restored as often as wanted
+	b32 has_snapshot;
+	b32 restore_requested;
+	Checkpoint loaded_checkpoint; // The loader thread's while checkpoint_loading
+	b32 checkpoint_loading;
+
+	Rewind_Buffer rewind;
+	b32 rewinding;   // The simulation stands still on rewind_tick
+	u64 rewind_tick;
 
 	b32 human_control;
 
-	Car cars[2];
+	Car *cars;
+	Sensor_Data *car_sensors;
+	Controller_State *controller_states;
+	Control_Input *car_inputs;
+	u32 car_count;
+
+	Camera camera;
+	Lod_Renderer lod_renderer;
+	Debug_Draw debug_draw;
+	Trail_Layer trail_layer;
+	Frame_Timing frame_timing;
+
+	Occupancy_Grid world_grid;
+	Path_Planner planner;
+	b32 planning;           // Every car drives to cars[0]'s target along the planned path
+	u32 planner_lookahead;  // Waypoint distance down the path, in cells
+
+	b32 lidar_enabled;
+	Lidar_Config lidar_config;
+	Lidar_Scene lidar_scene;
+	Lidar_Body *lidar_bodies;
+	float *lidar_distances; // lidar_config.ray_count per car, parallel to car_sensors
 
 	float target_radius;
 };
 
-static Length_Buffer read_entire_file(s8 *path) {
+Sensor_Data car_get_sensor_data(Car *car) {
+	Sensor_Data result = {0};
+
+	result.delta_x = car->target_x - car->x;
+	result.delta_y = car->target_y - car->y;
+	result.heading_direction = car->direction;
+	result.velocity = car->velocity;
+
+	return result;
+}
+
+DEFINE_CONTROL_FUNCTION(local_human_input_from_sensor_data) {
+	(void) sensor_data;
+	(void) lidar_distances;
+	(void) controller_states;
+
+	Control_Input result = (Control_Input){0};
+
+	const u8 *keys = app_state->keys;
+
+	if (keys[SDL_SCANCODE_UP])    result.acceleration_axis = 0x7fff;
+	if (keys[SDL_SCANCODE_DOWN])  result.acceleration_axis = -0x8000;
+	if (keys[SDL_SCANCODE_LEFT])  result.turn_axis = -0x8000;
+	if (keys[SDL_SCANCODE_RIGHT]) result.turn_axis = 0x7fff;
+
+	for (u32 i = 0; i < count; ++i) {
+		inputs[i] = result;
+	}
+}
+
+
+DEFINE_CONTROL_FUNCTION(local_ai_input_from_sensor_data) {
+	(void)app_state; // Unused
+	(void)lidar_distances;
+
+	pursuit_controller_evaluate(count, sensor_data, controller_states, inputs);
+}
+
+
+DEFINE_CONTROL_FUNCTION(lookup_table_input_from_sensor_data) {
+	(void)lidar_distances;
+
+	lookup_table_evaluate(&app_state->lookup_table, count, sensor_data, controller_states, inputs);
+}
+
+
+DEFINE_CONTROL_FUNCTION(mpc_input_from_sensor_data) {
+	(void)controller_states; // The plans live in the controller
+	(void)lidar_distances;
+
+	u32 first_car = (u32)(inputs - app_state->car_inputs);
+	mpc_controller_evaluate(&app_state->mpc, app_state->cars + first_car, sensor_data, first_car, count, inputs);
+}
+
 
-	Length_Buffer result = {0};
+DEFINE_CONTROL_FUNCTION(policy_input_from_sensor_data) {
+	(void)lidar_distances;
 
-	FILE *file = fopen(path, "rb");
+	policy_controller_evaluate(&app_state->policy, count, sensor_data, controller_states, inputs);
+}
+
+
+DEFINE_CONTROL_FUNCTION(plugin_input_from_sensor_data) {
+	(void)controller_states; // The plugin owns its state layout
+	(void)lidar_distances;   // Not part of the plugin ABI
+
+	Controller_Plugin *plugin = &app_state->controller_plugin;
+	u32 first_car = (u32)(inputs - app_state->car_inputs);
+	u8 *states = controller_plugin_states(plugin, app_state->car_count);
+
+	plugin->api->evaluate(count, sensor_data, states + (umm)first_car*plugin->api->state_size, inputs);
+}
+
+
+DEFINE_CONTROL_FUNCTION(remote_ai_input_from_sensor_data) {
+	(void)controller_states; // The controller state lives on the server
+	(void)lidar_distances;   // Not part of the controller protocol
 
-	if (file) {
+	UDPpacket *packet = app_state->udp_packet;
+	u32 first_car = (u32)(inputs - app_state->car_inputs);
 
-		u64 length;
-		u8 *contents;
+	for (u32 offset = 0; offset < count; offset += CONTROLLER_MAX_BATCH) {
 
-		fseek(file, 0, SEEK_END);
-		length = ftell(file);
-		fseek(file, 0, SEEK_SET);
+		u32 batch_count = count - offset < CONTROLLER_MAX_BATCH ? count - offset : CONTROLLER_MAX_BATCH;
 
-		contents = malloc(length);
+		Controller_Packet_Header *header = (Controller_Packet_Header *)packet->data;
+		header->sequence = app_state->controller_sequence++;
+		header->first_car = first_car + offset;
+		header->count = batch_count;
+		memcpy(header + 1, sensor_data + offset, batch_count*sizeof(Sensor_Data));
 
-		u64 amount_read = fread(contents, 1, length, file);
-		fclose(file);
+		packet->channel = -1;
+		packet->len = sizeof(Controller_Packet_Header) + batch_count*sizeof(Sensor_Data);
+		packet->address = app_state->controller_address;
 
-		if (amount_read == length) {
-			result.length = length;
-			result.data = contents;
-		} else {
-			free(contents);
+		if (0 == SDLNet_UDP_Send(app_state->udp_socket, -1, packet)) {
+			panic("Error: Could not send sensor data. SDLNet Error: '%s'\n", SDLNet_GetError());
 		}
 	}
 
-	return result;
+	// Apply every reply that has arrived, unless a newer one already has.
+	// Cars whose reply is still in flight keep last tick's input.
+	u32 reply_count = 0;
+	while (SDLNet_UDP_Recv(app_state->udp_socket, packet) > 0) {
+		Controller_Packet_Header *header = (Controller_Packet_Header *)packet->data;
+		if (packet->len < (s32)sizeof(Controller_Packet_Header) ||
+			packet->len != (s32)(sizeof(Controller_Packet_Header) + header->count*sizeof(Control_Input)) ||
+			header->count > CONTROLLER_MAX_BATCH ||
+			(u64)header->first_car + header->count > app_state->car_count)
+		{
+			continue;
+		}
+		Control_Input *reply_inputs = (Control_Input *)(header + 1);
+		for (u32 i = 0; i < header->count; ++i) {
+			u32 *last_sequence = &app_state->controller_reply_sequences[header->first_car + i];
+			if ((s32)(header->sequence - *last_sequence) > 0) {
+				app_state->car_inputs[header->first_car + i] = reply_inputs[i];
+				*last_sequence = header->sequence;
+			}
+		}
+		++reply_count;
+	}
+
+	if (!reply_count) {
+		printf("stale input: %d,%d\n", inputs[0].acceleration_axis, inputs[0].turn_axis);
+	}
+}
+
+
+static void camera_screen_to_world(Camera *camera, s32 window_width, s32 window_height, float screen_x, float screen_y, float *world_x, float *world_y) {
+	*world_x = (screen_x - 0.5f*window_width)/camera->zoom + camera->x;
+	*world_y = (screen_y - 0.5f*window_height)/camera->zoom + camera->y;
 }
 
+static void camera_zoom_at(Camera *camera, s32 window_width, s32 window_height, s32 screen_x, s32 screen_y, float factor) {
+	float anchor_x, anchor_y;
+	camera_screen_to_world(camera, window_width, window_height, screen_x, screen_y, &anchor_x, &anchor_y);
 
-__attribute__((noreturn)) static void panic(char *format, ...) {
-	fprintf(stderr, "[ERROR] ");
-	va_list args;
-	va_start(args, format);
-	vfprintf(stderr, format, args);
-	va_end(args);
-	exit(-1);
+	camera->zoom *= factor;
+	if (camera->zoom < 1.0f/512.0f) camera->zoom = 1.0f/512.0f;
+	if (camera->zoom > 8.0f) camera->zoom = 8.0f;
+
+	// Keep the world point under the cursor fixed
+	camera->x = anchor_x - (screen_x - 0.5f*window_width)/camera->zoom;
+	camera->y = anchor_y - (screen_y - 0.5f*window_height)/camera->zoom;
 }
 
-void update_car(Car *car, Control_Input input) {
+#define debug_draw_enabled(debug_draw, category) ((debug_draw)->enabled_categories & (1u << (category)))
 
-	if (input.acceleration_axis > 0) {
-		car->velocity += car->acceleration * ((float)input.acceleration_axis/32768.0f);
+static void *debug_draw_reserve(void *items, u32 *capacity, u32 count, umm item_size) {
+	if (count >= *capacity) {
+		if (!*capacity) *capacity = 256;
+		while (count >= *capacity) *capacity *= 2;
+		items = realloc(items, (*capacity)*item_size);
+		if (!items) panic("Could not grow debug draw buffer.\n");
 	}
+	return items;
+}
 
-	car->front_wheel_angle += car->turning_rate * ((float)input.turn_axis/32768.0f);
-	float effective_turning_span = car->turning_span - fabsf(car->velocity * 0.07f);
-	if (car->front_wheel_angle < -effective_turning_span) car->front_wheel_angle = -effective_turning_span;
-	if (car->front_wheel_angle > effective_turning_span) car->front_wheel_angle = effective_turning_span;
+static Debug_Draw_Bucket *debug_draw_bucket(Debug_Draw *debug_draw, u32 color) {
 
-	float resistance = car->rolling_resistance;
+	// Consecutive pushes are usually the same color
+	Debug_Draw_Bucket *bucket = &debug_draw->buckets[debug_draw->last_bucket];
+	if (debug_draw->bucket_count && bucket->color == color) {
+		return bucket;
+	}
 
-	b32 reverse = input.acceleration_axis < 0;
-	b32 breaking = (reverse && car->velocity > 0) || (!reverse && car->velocity < 0);//input.buttons & (CAR_INPUT_BUTTON_BREAK);
+	for (u32 i = 0; i < debug_draw->bucket_count; ++i) {
+		if (debug_draw->buckets[i].color == color) {
+			debug_draw->last_bucket = i;
+			return &debug_draw->buckets[i];
+		}
+	}
+
+	assert(debug_draw->bucket_count < DEBUG_DRAW_MAX_COLORS);
+	debug_draw->last_bucket = debug_draw->bucket_count++;
+	bucket = &debug_draw->buckets[debug_draw->last_bucket];
+	bucket->color = color;
+	return bucket;
+}
+
+static void debug_draw_line(Debug_Draw *debug_draw, u32 color, float x0, float y0, float x1, float y1) {
+	Debug_Draw_Bucket *bucket = debug_draw_bucket(debug_draw, color);
+	bucket->lines = debug_draw_reserve(bucket->lines, &bucket->line_capacity, 2*bucket->line_count + 1, sizeof(SDL_FPoint));
+	bucket->lines[2*bucket->line_count + 0] = (SDL_FPoint){x0, y0};
+	bucket->lines[2*bucket->line_count + 1] = (SDL_FPoint){x1, y1};
+	++bucket->line_count;
+}
+
+static void debug_draw_rect(Debug_Draw *debug_draw, u32 color, float x, float y, float w, float h) {
+	Debug_Draw_Bucket *bucket = debug_draw_bucket(debug_draw, color);
+	bucket->rects = debug_draw_reserve(bucket->rects, &bucket->rect_capacity, bucket->rect_count, sizeof(SDL_FRect));
+	bucket->rects[bucket->rect_count++] = (SDL_FRect){x, y, w, h};
+}
 
-	if (breaking) {
-		resistance += car->breaking_resistance;
+static void debug_draw_point(Debug_Draw *debug_draw, u32 color, float x, float y) {
+	Debug_Draw_Bucket *bucket = debug_draw_bucket(debug_draw, color);
+	bucket->points = debug_draw_reserve(bucket->points, &bucket->point_capacity, bucket->point_count, sizeof(SDL_FPoint));
+	bucket->points[bucket->point_count++] = (SDL_FPoint){x, y};
+}
+
+// Appends the pixels of a segment, clipped to the screen, to the bucket's points
+static void debug_draw_rasterize_line(Debug_Draw_Bucket *bucket, SDL_FPoint a, SDL_FPoint b, float width, float height) {
+	float dx = b.x - a.x;
+	float dy = b.y - a.y;
+
+	// Liang-Barsky against [0, width] x [0, height]
+	float p[4] = {-dx, dx, -dy, dy};
+	float q[4] = {a.x, width - a.x, a.y, height - a.y};
+	float t0 = 0.0f;
+	float t1 = 1.0f;
+	for (u32 k = 0; k < 4; ++k) {
+		if (p[k] == 0.0f) {
+			if (q[k] < 0.0f) return;
+			continue;
+		}
+		float t = q[k]/p[k];
+		if (p[k] < 0.0f) {
+			if (t > t1) return;
+			if (t > t0) t0 = t;
+		}
+		else {
+			if (t < t0) return;
+			if (t < t1) t1 = t;
+		}
 	}
-	if (reverse) {
-		car->velocity -= 0.45f*car->acceleration;
+
+	float x0 = a.x + t0*dx;
+	float y0 = a.y + t0*dy;
+	float span_x = (t1 - t0)*dx;
+	float span_y = (t1 - t0)*dy;
+	u32 steps = (u32)ceilf(fmaxf(fabsf(span_x), fabsf(span_y)));
+
+	bucket->points = debug_draw_reserve(bucket->points, &bucket->point_capacity, bucket->point_count + steps, sizeof(SDL_FPoint));
+	float inverse_steps = steps ? 1.0f/steps : 0.0f;
+	for (u32 i = 0; i <= steps; ++i) {
+		bucket->points[bucket->point_count++] = (SDL_FPoint){x0 + span_x*i*inverse_steps, y0 + span_y*i*inverse_steps};
 	}
+}
 
-	resistance += 0.002f*((car->front_wheel_angle < 0) ? -car->front_wheel_angle : car->front_wheel_angle);
+static void debug_draw_flush(Debug_Draw *debug_draw, SDL_Renderer *renderer) {
+	int output_width, output_height;
+	SDL_GetRendererOutputSize(renderer, &output_width, &output_height);
+
+	for (u32 i = 0; i < debug_draw->bucket_count; ++i) {
+		Debug_Draw_Bucket *bucket = &debug_draw->buckets[i];
+
+		if (!bucket->line_count && !bucket->rect_count && !bucket->point_count) continue;
+
+		u32 color = bucket->color;
+		SDL_SetRenderDrawColor(renderer, color >> 24, (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+
+		if (bucket->rect_count) {
+			SDL_RenderFillRectsF(renderer, bucket->rects, bucket->rect_count);
+		}
+
+		// SDL has no call for disjoint segments, and SDL_RenderDrawLinesF only
+		// draws connected strips, so the segments become pixels and go out
+		// with the bucket's points in a single call.
+		for (u32 j = 0; j < bucket->line_count; ++j) {
+			SDL_FPoint *line = &bucket->lines[2*j];
+			debug_draw_rasterize_line(bucket, line[0], line[1], (float)output_width, (float)output_height);
+		}
 
-	car->velocity *= (1.0f - resistance);
+		if (bucket->point_count) {
+			SDL_RenderDrawPointsF(renderer, bucket->points, bucket->point_count);
+		}
 
-	if (abs(input.turn_axis) < 0xf) {
-		car->front_wheel_angle *= 0.9f;
+		bucket->line_count = 0;
+		bucket->rect_count = 0;
+		bucket->point_count = 0;
 	}
+}
+
+static void debug_draw_toggle(Debug_Draw *debug_draw, Debug_Draw_Category category) {
+	static const char *category_names[COUNT_DEBUG_DRAW_CATEGORY] = {
+		[DEBUG_DRAW_TARGET] = "target",
+		[DEBUG_DRAW_TARGET_LINE] = "target line",
+		[DEBUG_DRAW_HEADING] = "heading",
+		[DEBUG_DRAW_FRAME_GRAPH] = "frame graph",
+		[DEBUG_DRAW_PATH] = "path",
+		[DEBUG_DRAW_LIDAR] = "lidar",
+	};
 
-	float sin_direction = sinf(car->direction);
-	float cos_direction = cosf(car->direction);
+	debug_draw->enabled_categories ^= 1u << category;
+	printf("debug draw %s: %s\n", category_names[category], debug_draw_enabled(debug_draw, category) ? "on" : "off");
+}
 
-	float wheel_offset_x = cos_direction*car->half_wheel_base;
-	float wheel_offset_y = sin_direction*car->half_wheel_base;
-	float rear_wheel_x = car->x - wheel_offset_x;
-	float rear_wheel_y = car->y - wheel_offset_y;
-	float front_wheel_x = car->x + wheel_offset_x;
-	float front_wheel_y = car->y + wheel_offset_y;
-	float new_front_wheel_x = front_wheel_x + cosf(car->direction + car->front_wheel_angle) * car->velocity;
-	float new_front_wheel_y = front_wheel_y + sinf(car->direction + car->front_wheel_angle) * car->velocity;
-	float new_rear_wheel_x = rear_wheel_x + cos_direction * car->velocity;
-	float new_rear_wheel_y = rear_wheel_y + sin_direction * car->velocity;
+static const char *frame_phase_names[COUNT_FRAME_PHASE] = {
+	"events",
+	"control",
+	"physics",
+	"record",
+	"render",
+	"present",
+};
 
-	car->x = (new_front_wheel_x + new_rear_wheel_x)*0.5f;
-	car->y = (new_front_wheel_y + new_rear_wheel_y)*0.5f;
+static const u32 frame_phase_colors[COUNT_FRAME_PHASE] = {
+	0x60c060ff,
+	0xc0c040ff,
+	0xe07030ff,
+	0xc060c0ff,
+	0x4090e0ff,
+	0x808080ff,
+};
 
-	car->direction = atan2f((new_front_wheel_y - new_rear_wheel_y), (new_front_wheel_x - new_rear_wheel_x));
+static void frame_timing_begin_frame(Frame_Timing *timing) {
+	if (!timing->frequency) {
+		timing->frequency = SDL_GetPerformanceFrequency();
+	}
+	u64 *row = timing->phase_ticks[timing->frame_count % FRAME_TIMING_HISTORY];
+	for (u32 phase = 0; phase < COUNT_FRAME_PHASE; ++phase) {
+		row[phase] = 0;
+	}
+	timing->phase_start = SDL_GetPerformanceCounter();
 }
 
+static void frame_timing_end_phase(Frame_Timing *timing, Frame_Phase phase) {
+	u64 now = SDL_GetPerformanceCounter();
+	timing->phase_ticks[timing->frame_count % FRAME_TIMING_HISTORY][phase] += now - timing->phase_start;
+	timing->phase_start = now;
+}
 
-Sensor_Data car_get_sensor_data(Car *car) {
-	Sensor_Data result = {0};
+static void frame_timing_end_frame(Frame_Timing *timing) {
+	++timing->frame_count;
+}
 
-	result.delta_x = car->target_x - car->x;
-	result.delta_y = car->target_y - car->y;
-	result.heading_direction = car->direction;
-	result.velocity = car->velocity;
+static float frame_timing_ms(Frame_Timing *timing, u64 ticks) {
+	return (float)((double)ticks*1000.0/(double)timing->frequency);
+}
 
-	return result;
+static int compare_u64(const void *a, const void *b) {
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+	return (x > y) - (x < y);
 }
 
-DEFINE_CONTROL_FUNCTION(local_human_input_from_sensor_data) {
-	(void) sensor_data;
+// Prints p50/p95/p99/max of each phase and of the whole frame over the ring buffer
+static void frame_timing_print_summary(Frame_Timing *timing) {
 
-	Control_Input result = (Control_Input){0};
+	u32 count = timing->frame_count < FRAME_TIMING_HISTORY ? timing->frame_count : FRAME_TIMING_HISTORY;
+	if (!count) return;
 
-	const u8 *keys = app_state->keys;
+	u64 sorted[FRAME_TIMING_HISTORY];
 
-	if (keys[SDL_SCANCODE_UP])    result.acceleration_axis = 0x7fff;
-	if (keys[SDL_SCANCODE_DOWN])  result.acceleration_axis = -0x8000;
-	if (keys[SDL_SCANCODE_LEFT])  result.turn_axis = -0x8000;
-	if (keys[SDL_SCANCODE_RIGHT]) result.turn_axis = 0x7fff;
+	printf("frame time over %u frames (ms)    p50     p95     p99     max\n", count);
 
-	return result;
+	for (u32 phase = 0; phase <= COUNT_FRAME_PHASE; ++phase) {
+		for (u32 i = 0; i < count; ++i) {
+			u64 *row = timing->phase_ticks[i];
+			if (phase == COUNT_FRAME_PHASE) {
+				sorted[i] = 0;
+				for (u32 j = 0; j < COUNT_FRAME_PHASE; ++j) sorted[i] += row[j];
+			}
+			else {
+				sorted[i] = row[phase];
+			}
+		}
+		qsort(sorted, count, sizeof(u64), compare_u64);
+
+		printf("  %-30s %7.3f %7.3f %7.3f %7.3f\n",
+			phase == COUNT_FRAME_PHASE ? "frame" : frame_phase_names[phase],
+			frame_timing_ms(timing, sorted[(count - 1)*50/100]),
+			frame_timing_ms(timing, sorted[(count - 1)*95/100]),
+			frame_timing_ms(timing, sorted[(count - 1)*99/100]),
+			frame_timing_ms(timing, sorted[count - 1]));
+	}
 }
 
+// Stacked bar per frame, oldest on the left, with a line at 60 Hz
+static void frame_timing_draw_graph(Frame_Timing *timing, Debug_Draw *debug_draw, s32 window_height) {
 
-DEFINE_CONTROL_FUNCTION(local_ai_input_from_sensor_data) {
-	(void)app_state; // Unused
+	float pixels_per_ms = 4.0f;
+	float bar_width = 2.0f;
+	float left = 8.0f;
+	float bottom = window_height - 8.0f;
+
+	u32 count = timing->frame_count < FRAME_TIMING_HISTORY ? timing->frame_count : FRAME_TIMING_HISTORY;
+	u32 first = timing->frame_count - count;
 
-	static struct {
-		float acceleration_direction; // -1 for backwards or 1 for forwards
-		u32 mode_switch_time;
-	} state = {
-		1,
-		0
+	for (u32 i = 0; i < count; ++i) {
+		u64 *row = timing->phase_ticks[(first + i) % FRAME_TIMING_HISTORY];
+		float y = bottom;
+		for (u32 phase = 0; phase < COUNT_FRAME_PHASE; ++phase) {
+			float height = frame_timing_ms(timing, row[phase])*pixels_per_ms;
+			y -= height;
+			debug_draw_rect(debug_draw, frame_phase_colors[phase], left + i*bar_width, y, bar_width, height);
+		}
+	}
+
+	float budget_y = bottom - (1000.0f/60.0f)*pixels_per_ms;
+	debug_draw_line(debug_draw, 0xffffffa0, left, budget_y, left + FRAME_TIMING_HISTORY*bar_width, budget_y);
+}
+
+static void trail_layer_init(Trail_Layer *trail, SDL_Renderer *renderer, float center_x, float center_y) {
+
+	trail->origin_x = center_x - 0.5f*TRAIL_WIDTH*TRAIL_CELL_SIZE;
+	trail->origin_y = center_y - 0.5f*TRAIL_HEIGHT*TRAIL_CELL_SIZE;
+
+	trail->intensity = calloc(TRAIL_WIDTH*TRAIL_HEIGHT, 1);
+	if (!trail->intensity) {
+		panic("Could not allocate trail layer.\n");
+	}
+
+	trail->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, TRAIL_WIDTH, TRAIL_HEIGHT);
+	if (!trail->texture) {
+		panic("Could not create trail texture: %s\n", SDL_GetError());
+	}
+	SDL_SetTextureBlendMode(trail->texture, SDL_BLENDMODE_BLEND);
+
+	for (u32 i = 0; i < 256; ++i) {
+		// Trails: pale tint with alpha following intensity
+		trail->palette[TRAIL_MODE_TRAILS][i] = (i*3/4) << 24 | 0xffd0a0;
+
+		// Heat: blue -> red -> yellow
+		u32 r = i < 128 ? 2*i : 255;
+		u32 g = i < 128 ? 0 : 2*(i - 128);
+		u32 b = i < 128 ? 255 - 2*i : 0;
+		u32 a = i ? 96 + (i*159)/255 : 0;
+		trail->palette[TRAIL_MODE_HEAT][i] = a << 24 | r << 16 | g << 8 | b;
+	}
+
+	// Streaming texture contents are undefined until written
+	for (u32 tile = 0; tile < TRAIL_TILES_X*TRAIL_TILES_Y; ++tile) {
+		trail->tile_dirty[tile] = true;
+	}
+}
+
+static void trail_layer_set_mode(Trail_Layer *trail, Trail_Mode mode) {
+	static const char *mode_names[COUNT_TRAIL_MODE] = {
+		"off",
+		"trails",
+		"heat",
 	};
 
-	float angle_to_target = atan2f(sensor_data.delta_y, sensor_data.delta_x);
-	float angle_delta = angle_to_target - sensor_data.heading_direction;
-	if (angle_delta > PI) {
-		angle_delta -= TAU;
+	if (mode != trail->mode) {
+		memset(trail->intensity, 0, TRAIL_WIDTH*TRAIL_HEIGHT);
+		for (u32 tile = 0; tile < TRAIL_TILES_X*TRAIL_TILES_Y; ++tile) {
+			trail->tile_dirty[tile] |= trail->tile_active[tile];
+			trail->tile_active[tile] = false;
+		}
+		trail->mode = mode;
 	}
-	else if (angle_delta < -PI) {
-		angle_delta += TAU;
+	printf("trail layer: %s\n", mode_names[mode]);
+}
+
+static void trail_layer_stamp(Trail_Layer *trail, float x, float y) {
+
+	s32 texel_x = (s32)floorf((x - trail->origin_x)*(1.0f/TRAIL_CELL_SIZE));
+	s32 texel_y = (s32)floorf((y - trail->origin_y)*(1.0f/TRAIL_CELL_SIZE));
+
+	if (texel_x < 0 || texel_x >= TRAIL_WIDTH || texel_y < 0 || texel_y >= TRAIL_HEIGHT) return;
+
+	u8 *texel = &trail->intensity[texel_y*TRAIL_WIDTH + texel_x];
+	if (trail->mode == TRAIL_MODE_HEAT) {
+		if (*texel < 255) ++*texel;
+	}
+	else {
+		*texel = 255;
 	}
 
-	float abs_angle_delta = fabsf(angle_delta);
-	assert(abs_angle_delta < (TAU+0.0001f));
+	u32 tile = (texel_y/TRAIL_TILE_SIZE)*TRAIL_TILES_X + texel_x/TRAIL_TILE_SIZE;
+	if (!trail->tile_active[tile]) {
+		trail->tile_faded_at[tile] = trail->update_count;
+	}
+	trail->tile_dirty[tile] = true;
+	trail->tile_active[tile] = true;
+}
+
+static void trail_layer_update(Trail_Layer *trail, Car *cars, u32 car_count) {
 
+	if (trail->mode == TRAIL_MODE_OFF) return;
 
-	float heading_x = cosf(sensor_data.heading_direction);
-	float heading_y = sinf(sensor_data.heading_direction);
-	float distance_to_target = sqrtf(sensor_data.delta_x*sensor_data.delta_x + sensor_data.delta_y*sensor_data.delta_y);
-	float dot = (sensor_data.delta_x*heading_x + sensor_data.delta_y*heading_y) / distance_to_target;
+	++trail->update_count;
 
-	float acceleration_factor = 1.0f;
-	if (distance_to_target < 200*sensor_data.velocity) {
-		acceleration_factor = distance_to_target/(200*sensor_data.velocity);
-		acceleration_factor *= acceleration_factor * acceleration_factor * 0.5f;
+	// Stamp the segment each car covered this frame. The previous position is
+	// reconstructed from velocity, which is exact enough at texel resolution.
+	for (u32 i = 0; i < car_count; ++i) {
+		Car *car = &cars[i];
+		float step_x = cosf(car->direction)*car->velocity;
+		float step_y = sinf(car->direction)*car->velocity;
+		s32 steps = (s32)(fabsf(car->velocity)*(1.0f/TRAIL_CELL_SIZE)) + 1;
+		for (s32 step = 0; step < steps; ++step) {
+			float t = (float)step/steps;
+			trail_layer_stamp(trail, car->x - t*step_x, car->y - t*step_y);
+		}
 	}
 
-	float turn_factor = 1.0;
-	{
-		float threshold = 0.75f*PI;
-		if (abs_angle_delta < threshold) {
-			turn_factor = abs_angle_delta/threshold;
-			turn_factor *= turn_factor * turn_factor * 0.9f;
+	// Fade a fixed budget of active tiles, round robin
+	u32 fade_rate = trail->mode == TRAIL_MODE_HEAT ? TRAIL_FADE_HEAT : TRAIL_FADE_TRAILS;
+	u32 tile_count = TRAIL_TILES_X*TRAIL_TILES_Y;
+	u32 faded = 0;
+	for (u32 visited = 0; visited < tile_count && faded < TRAIL_FADE_TILES_PER_FRAME; ++visited) {
+		u32 tile = trail->fade_cursor;
+		trail->fade_cursor = (trail->fade_cursor + 1) % tile_count;
+
+		if (!trail->tile_active[tile]) continue;
+
+		// Whole steps only, the remainder carries over to the next visit
+		u32 elapsed = trail->update_count - trail->tile_faded_at[tile];
+		u32 fade = elapsed*fade_rate/16;
+		if (!fade) continue;
+		++faded;
+		trail->tile_faded_at[tile] += fade*16/fade_rate;
+		u8 fade_amount = fade < 255 ? (u8)fade : 255;
+
+		b32 any_left = false;
+		u8 *row = trail->intensity + (tile/TRAIL_TILES_X)*TRAIL_TILE_SIZE*TRAIL_WIDTH + (tile%TRAIL_TILES_X)*TRAIL_TILE_SIZE;
+		for (u32 y = 0; y < TRAIL_TILE_SIZE; ++y, row += TRAIL_WIDTH) {
+			for (u32 x = 0; x < TRAIL_TILE_SIZE; ++x) {
+				u8 value = row[x];
+				value = value > fade_amount ? value - fade_amount : 0;
+				row[x] = value;
+				any_left |= value;
+			}
 		}
+
+		trail->tile_active[tile] = any_left;
+		trail->tile_dirty[tile] = true;
 	}
+}
+
+static void trail_layer_upload(Trail_Layer *trail) {
 
-	assert(dot > -1.00001f && dot < 1.00001f);
+	u32 *palette = trail->palette[trail->mode == TRAIL_MODE_HEAT ? TRAIL_MODE_HEAT : TRAIL_MODE_TRAILS];
 
-	Control_Input result = {0};
+	for (u32 tile = 0; tile < TRAIL_TILES_X*TRAIL_TILES_Y; ++tile) {
+		if (!trail->tile_dirty[tile]) continue;
+		trail->tile_dirty[tile] = false;
 
-	if (distance_to_target > 10) {
+		SDL_Rect tile_rect = {
+			(tile%TRAIL_TILES_X)*TRAIL_TILE_SIZE,
+			(tile/TRAIL_TILES_X)*TRAIL_TILE_SIZE,
+			TRAIL_TILE_SIZE,
+			TRAIL_TILE_SIZE,
+		};
 
-		if (state.acceleration_direction > 0.0f && (dot < -0.8f)) {
-			state.acceleration_direction = -1.0f;
+		void *pixels;
+		s32 pitch;
+		if (SDL_LockTexture(trail->texture, &tile_rect, &pixels, &pitch) != 0) {
+			panic("Could not lock trail texture: %s\n", SDL_GetError());
 		}
-		else if (state.acceleration_direction < 0.0f && (dot > 0.5f)) {
-			state.acceleration_direction = 1.0f;
+
+		u8 *source = trail->intensity + tile_rect.y*TRAIL_WIDTH + tile_rect.x;
+		for (u32 y = 0; y < TRAIL_TILE_SIZE; ++y) {
+			u32 *destination = (u32 *)((u8 *)pixels + y*pitch);
+			for (u32 x = 0; x < TRAIL_TILE_SIZE; ++x) {
+				destination[x] = palette[source[x]];
+			}
+			source += TRAIL_WIDTH;
 		}
 
-		result.acceleration_axis = 0x7fff * acceleration_factor * state.acceleration_direction;
-		result.turn_axis = 0x7fff * turn_factor * state.acceleration_direction * ((angle_delta > 0) ? 1.0f : -1.0f);
+		SDL_UnlockTexture(trail->texture);
 	}
+}
 
-	return result;
+static void render_trail_layer(Trail_Layer *trail, SDL_Renderer *renderer, Camera *camera, s32 window_width, s32 window_height) {
+
+	if (trail->mode == TRAIL_MODE_OFF) return;
+
+	trail_layer_upload(trail);
+
+	SDL_FRect layer_rect = {
+		(trail->origin_x - camera->x)*camera->zoom + 0.5f*window_width,
+		(trail->origin_y - camera->y)*camera->zoom + 0.5f*window_height,
+		TRAIL_WIDTH*TRAIL_CELL_SIZE*camera->zoom,
+		TRAIL_HEIGHT*TRAIL_CELL_SIZE*camera->zoom,
+	};
+	SDL_RenderCopyF(renderer, trail->texture, NULL, &layer_rect);
 }
 
+static void render_occupancy_grid(Occupancy_Grid *grid, SDL_Renderer *renderer, Camera *camera, s32 window_width, s32 window_height) {
 
-DEFINE_CONTROL_FUNCTION(remote_ai_input_from_sensor_data) {
+	s32 min_x, min_y, max_x, max_y;
+	float world_min_x, world_min_y, world_max_x, world_max_y;
+	camera_screen_to_world(camera, window_width, window_height, 0, 0, &world_min_x, &world_min_y);
+	camera_screen_to_world(camera, window_width, window_height, window_width, window_height, &world_max_x, &world_max_y);
+	occupancy_grid_cell_at(grid, world_min_x, world_min_y, &min_x, &min_y);
+	occupancy_grid_cell_at(grid, world_max_x, world_max_y, &max_x, &max_y);
+
+	min_x = min_x > 0 ? min_x : 0;
+	min_y = min_y > 0 ? min_y : 0;
+	max_x = max_x < grid->width - 1 ? max_x : grid->width - 1;
+	max_y = max_y < grid->height - 1 ? max_y : grid->height - 1;
 
-	static Control_Input last_input = (Control_Input){0};
+	static SDL_FRect rects[256];
+	u32 rect_count = 0;
+	float cell_pixels = grid->cell_size*camera->zoom;
 
+	SDL_SetRenderDrawColor(renderer, 30, 30, 35, 255);
 
-	UDPpacket packet = {0};
-	u8 payload[128];
-	*(Sensor_Data *)payload = sensor_data;
-	packet.channel = -1;                             // The src/dst channel of the packet
-	packet.data = payload;                           // The packet data
-	packet.len = sizeof(sensor_data);                // The length of the packet data
-	packet.maxlen = sizeof(payload);                 // The size of the data buffer
-	packet.status = 0;                               // packet status after sending
-	packet.address = app_state->controller_address;  // The source/dest address of an incoming/outgoing packet
+	for (s32 y = min_y; y <= max_y; ++y) {
+		for (s32 x = min_x; x <= max_x; ++x) {
+			if (!grid->cells[y*grid->width + x]) continue;
 
-	if (0 == SDLNet_UDP_Send(app_state->udp_socket, -1, &packet)) {
-		panic("Error: Could not send sensor data. SDLNet Error: '%s'\n", SDLNet_GetError());
+			rects[rect_count++] = (SDL_FRect){
+				(grid->origin_x + x*grid->cell_size - camera->x)*camera->zoom + 0.5f*window_width,
+				(grid->origin_y + y*grid->cell_size - camera->y)*camera->zoom + 0.5f*window_height,
+				cell_pixels,
+				cell_pixels,
+			};
+
+			if (rect_count == sizeof(rects)/sizeof(rects[0])) {
+				SDL_RenderFillRectsF(renderer, rects, rect_count);
+				rect_count = 0;
+			}
+		}
 	}
 
-	Control_Input result = (Control_Input){0};
+	SDL_RenderFillRectsF(renderer, rects, rect_count);
+}
+
+static void lod_renderer_init(Lod_Renderer *lod, SDL_Renderer *renderer, SDL_Texture *car_texture) {
+
+	lod->car_texture = car_texture;
+	SDL_SetTextureColorMod(lod->car_texture, 255, 200, 200);
+
+	lod->flat_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, 1, 1);
+	if (!lod->flat_texture) {
+		panic("Could not create flat texture: %s\n", SDL_GetError());
+	}
+	u32 white = 0xffffffff;
+	SDL_UpdateTexture(lod->flat_texture, NULL, &white, sizeof(white));
+	SDL_SetTextureBlendMode(lod->flat_texture, SDL_BLENDMODE_BLEND);
+	SDL_SetTextureColorMod(lod->flat_texture, 255, 200, 200);
+
+	lod->sprite_indices = malloc(MAX_CAR_COUNT*sizeof(u32));
+	lod->rect_indices = malloc(MAX_CAR_COUNT*sizeof(u32));
+	lod->points = malloc(MAX_CAR_COUNT*sizeof(SDL_FPoint));
+
+	if (!lod->sprite_indices || !lod->rect_indices || !lod->points) {
+		panic("Could not allocate level of detail buffers.\n");
+	}
+}
+
+static void lod_renderer_resize_density(Lod_Renderer *lod, s32 window_width, s32 window_height) {
+
+	s32 columns = (window_width + DENSITY_CELL_PIXELS - 1)/DENSITY_CELL_PIXELS;
+	s32 rows = (window_height + DENSITY_CELL_PIXELS - 1)/DENSITY_CELL_PIXELS;
+	if (columns < 1) columns = 1;
+	if (rows < 1) rows = 1;
+
+	if (columns != lod->density_columns || rows != lod->density_rows) {
+		free(lod->density_cells);
+		free(lod->density_rects);
+		lod->density_cells = calloc(columns*rows, sizeof(u32));
+		lod->density_rects = malloc(columns*rows*sizeof(SDL_FRect));
+		if (!lod->density_cells || !lod->density_rects) {
+			panic("Could not allocate density cells.\n");
+		}
+		lod->density_columns = columns;
+		lod->density_rows = rows;
+	}
+}
+
+static void render_car_quad(SDL_Renderer *renderer, SDL_Texture *texture, Camera *camera, Car *car, float half_window_width, float half_window_height) {
+
+	float zoom = camera->zoom;
+	SDL_FRect car_rect = {
+		(car->x - camera->x)*zoom + half_window_width - 0.5f*car->length*zoom,
+		(car->y - camera->y)*zoom + half_window_height - 0.5f*car->width*zoom,
+		car->length*zoom,
+		car->width*zoom,
+	};
+
+	SDL_RenderCopyExF(renderer,
+		texture,
+		NULL,
+		&car_rect,
+		car->direction * RAD_TO_DEG,
+		NULL,
+		SDL_FLIP_NONE);
+}
+
+static void render_cars(Lod_Renderer *lod, SDL_Renderer *renderer, Camera *camera, Car *cars, u32 car_count, s32 window_width, s32 window_height) {
+
+	lod_renderer_resize_density(lod, window_width, window_height);
+
+	float half_window_width = 0.5f*window_width;
+	float half_window_height = 0.5f*window_height;
+	float zoom = camera->zoom;
+
+	u32 sprite_count = 0;
+	u32 rect_count = 0;
+	u32 point_count = 0;
+	u32 density_count = 0;
+
+	s32 columns = lod->density_columns;
+	s32 rows = lod->density_rows;
+
+	//
+	// Classify every visible car by its on-screen size, so that each level
+	// is submitted in one run without render state changes in between.
+	//
+
+	for (u32 i = 0; i < car_count; ++i) {
+		Car *car = &cars[i];
+
+		float screen_length = car->length*zoom;
+		float screen_x = (car->x - camera->x)*zoom + half_window_width;
+		float screen_y = (car->y - camera->y)*zoom + half_window_height;
+		float radius = 0.5f*screen_length;
+
+		if (screen_x + radius < 0 || screen_x - radius > window_width ||
+			screen_y + radius < 0 || screen_y - radius > window_height)
+		{
+			continue;
+		}
+
+		if (screen_length >= LOD_SPRITE_MIN_PIXELS) {
+			lod->sprite_indices[sprite_count++] = i;
+		}
+		else if (screen_length >= LOD_RECT_MIN_PIXELS) {
+			lod->rect_indices[rect_count++] = i;
+		}
+		else if (screen_length >= LOD_POINT_MIN_PIXELS) {
+			lod->points[point_count++] = (SDL_FPoint){screen_x, screen_y};
+		}
+		else {
+			s32 column = (s32)screen_x / DENSITY_CELL_PIXELS;
+			s32 row = (s32)screen_y / DENSITY_CELL_PIXELS;
+			if (column < 0) column = 0;
+			if (column >= columns) column = columns - 1;
+			if (row < 0) row = 0;
+			if (row >= rows) row = rows - 1;
+			++lod->density_cells[row*columns + column];
+			++density_count;
+		}
+	}
+
+	//
+	// Submit. Sprites and flat rectangles each use a single texture, so SDL's
+	// render batching merges the consecutive copies into one draw.
+	//
+
+	for (u32 i = 0; i < sprite_count; ++i) {
+		render_car_quad(renderer, lod->car_texture, camera, &cars[lod->sprite_indices[i]], half_window_width, half_window_height);
+	}
+
+	for (u32 i = 0; i < rect_count; ++i) {
+		render_car_quad(renderer, lod->flat_texture, camera, &cars[lod->rect_indices[i]], half_window_width, half_window_height);
+	}
+
+	if (point_count) {
+		SDL_SetRenderDrawColor(renderer, 255, 200, 200, 255);
+		SDL_RenderDrawPointsF(renderer, lod->points, point_count);
+	}
+
+	if (density_count) {
+		// Bucket the occupied cells by log2 of their population, then draw
+		// each bucket with one fill call.
+		u32 level_counts[DENSITY_LEVEL_COUNT] = {0};
+		u32 level_offsets[DENSITY_LEVEL_COUNT];
+		s32 cell_count = columns*rows;
+
+		for (s32 i = 0; i < cell_count; ++i) {
+			u32 count = lod->density_cells[i];
+			if (count) {
+				u32 level = 31 - __builtin_clz(count);
+				if (level >= DENSITY_LEVEL_COUNT) level = DENSITY_LEVEL_COUNT - 1;
+				++level_counts[level];
+			}
+		}
+
+		u32 offset = 0;
+		for (u32 level = 0; level < DENSITY_LEVEL_COUNT; ++level) {
+			level_offsets[level] = offset;
+			offset += level_counts[level];
+		}
+
+		for (s32 i = 0; i < cell_count; ++i) {
+			u32 count = lod->density_cells[i];
+			if (count) {
+				u32 level = 31 - __builtin_clz(count);
+				if (level >= DENSITY_LEVEL_COUNT) level = DENSITY_LEVEL_COUNT - 1;
+				lod->density_rects[level_offsets[level]++] = (SDL_FRect){
+					(float)((i % columns)*DENSITY_CELL_PIXELS),
+					(float)((i / columns)*DENSITY_CELL_PIXELS),
+					DENSITY_CELL_PIXELS,
+					DENSITY_CELL_PIXELS,
+				};
+				lod->density_cells[i] = 0;
+			}
+		}
+
+		offset = 0;
+		for (u32 level = 0; level < DENSITY_LEVEL_COUNT; ++level) {
+			if (level_counts[level]) {
+				u8 alpha = 64 + (191*level)/(DENSITY_LEVEL_COUNT - 1);
+				SDL_SetRenderDrawColor(renderer, 255, 200, 200, alpha);
+				SDL_RenderFillRectsF(renderer, lod->density_rects + offset, level_counts[level]);
+			}
+			offset += level_counts[level];
+		}
+	}
+
+	lod->lod_counts[CAR_LOD_SPRITE] = sprite_count;
+	lod->lod_counts[CAR_LOD_RECT] = rect_count;
+	lod->lod_counts[CAR_LOD_POINT] = point_count;
+	lod->lod_counts[CAR_LOD_DENSITY] = density_count;
+}
+
+static void spawn_fleet(Application_State *app_state, u32 count) {
+
+	Car *template_car = &app_state->cars[0];
+
+	// Spread the fleet over a disc that grows with its size, so density stays constant
+	float spread = 1.5f*template_car->length*sqrtf((float)(app_state->car_count + count));
+
+	for (u32 i = 0; i < count && app_state->car_count < MAX_CAR_COUNT; ++i) {
+		Car *car = &app_state->cars[app_state->car_count++];
+		*car = *template_car;
+
+		float angle = TAU*(rand() / (float)(RAND_MAX));
+		float distance = spread*sqrtf(rand() / (float)(RAND_MAX));
+		car->x = template_car->x + cosf(angle)*distance;
+		car->y = template_car->y + sinf(angle)*distance;
+		car->direction = TAU*(rand() / (float)(RAND_MAX)) - PI;
+		car->velocity = 8.0f*(rand() / (float)(RAND_MAX));
+		car->front_wheel_angle = 0.0f;
+
+		angle = TAU*(rand() / (float)(RAND_MAX));
+		distance = spread*sqrtf(rand() / (float)(RAND_MAX));
+		car->target_x = template_car->x + cosf(angle)*distance;
+		car->target_y = template_car->y + sinf(angle)*distance;
+
+		u32 index = car - app_state->cars;
+		app_state->controller_states[index] = controller_state_initial();
+		app_state->car_inputs[index] = (Control_Input){0};
+	}
+}
+
+
+// Controllers files can name, by Controller_Id
+static Control_Function *const controller_functions[CONTROLLER_ID_COUNT] = {
+	[CONTROLLER_HUMAN] = local_human_input_from_sensor_data,
+	[CONTROLLER_PURSUIT] = local_ai_input_from_sensor_data,
+	[CONTROLLER_REMOTE] = remote_ai_input_from_sensor_data,
+	[CONTROLLER_LOOKUP_TABLE] = lookup_table_input_from_sensor_data,
+	[CONTROLLER_MPC] = mpc_input_from_sensor_data,
+	[CONTROLLER_POLICY] = policy_input_from_sensor_data,
+	[CONTROLLER_PLUGIN] = plugin_input_from_sensor_data,
+};
 
-	if (SDLNet_UDP_Recv(app_state->udp_socket, &packet)) {
-		last_input = result = *(Control_Input *)packet.data;
+static u32 controller_id_of(Control_Function *function) {
+	for (u32 i = 0; i < CONTROLLER_ID_COUNT; ++i) {
+		if (controller_functions[i] == function) {
+			return i;
+		}
+	}
+	return CONTROLLER_PURSUIT;
+}
+
+// Falls back to the built-in pursuit controller when the named one is not
+// loaded in this session
+static Control_Function *controller_function_for(Application_State *app_state, u32 id) {
+	Control_Function *function = id < CONTROLLER_ID_COUNT ? controller_functions[id] : local_ai_input_from_sensor_data;
+	if ((function == policy_input_from_sensor_data && !app_state->policy.layer_count) ||
+		(function == plugin_input_from_sensor_data && !app_state->controller_plugin.api)) {
+		printf("controller %u is not loaded, using built-in pursuit\n", id);
+		function = local_ai_input_from_sensor_data;
+	}
+	return function;
+}
+
+static void app_state_capture(Application_State *app_state, u64 tick, Checkpoint *checkpoint) {
+
+	Checkpoint_Header *header = &checkpoint->header;
+	Occupancy_Grid *grid = &app_state->world_grid;
+	Mpc_Controller *mpc = &app_state->mpc;
+	Controller_Plugin *plugin = &app_state->controller_plugin;
+
+	*header = (Checkpoint_Header){0};
+	header->tick = tick;
+	header->car_count = app_state->car_count;
+	header->player_controller = controller_id_of(app_state->control_function);
+	header->fleet_controller = controller_id_of(app_state->fleet_control_function);
+	header->planner_lookahead = app_state->planner_lookahead;
+	header->target_radius = app_state->target_radius;
+	header->flags =
+		(app_state->human_control ? CHECKPOINT_HUMAN_CONTROL : 0) |
+		(app_state->planning ? CHECKPOINT_PLANNING : 0) |
+		(app_state->lidar_enabled ? CHECKPOINT_LIDAR : 0) |
+		(app_state->policy.quantized ? CHECKPOINT_POLICY_QUANTIZED : 0);
+
+	header->camera_x = app_state->camera.x;
+	header->camera_y = app_state->camera.y;
+	header->camera_zoom = app_state->camera.zoom;
+
+	header->grid_width = grid->width;
+	header->grid_height = grid->height;
+	header->grid_cell_size = grid->cell_size;
+	header->grid_origin_x = grid->origin_x;
+	header->grid_origin_y = grid->origin_y;
+
+	header->mpc_horizon = mpc->config.horizon;
+	header->mpc_plan_count = mpc->plan_capacity < app_state->car_count ? mpc->plan_capacity : app_state->car_count;
+	header->mpc_seed = mpc->seed;
+
+	// States that own resources cannot be copied byte for byte
+	if (plugin->api && !plugin->api->destroy_state) {
+		snprintf(header->plugin_name, CHECKPOINT_NAME_LENGTH, "%s", plugin->api->name ? plugin->api->name : "");
+		header->plugin_state_size = plugin->api->state_size;
+		header->plugin_state_count = plugin->state_count < app_state->car_count ? plugin->state_count : app_state->car_count;
+	}
+
+	checkpoint_prepare(checkpoint);
+
+	memcpy(checkpoint_section(checkpoint, CHECKPOINT_CARS), app_state->cars, checkpoint_section_length(header, CHECKPOINT_CARS));
+	memcpy(checkpoint_section(checkpoint, CHECKPOINT_CONTROLLER_STATES), app_state->controller_states, checkpoint_section_length(header, CHECKPOINT_CONTROLLER_STATES));
+	memcpy(checkpoint_section(checkpoint, CHECKPOINT_INPUTS), app_state->car_inputs, checkpoint_section_length(header, CHECKPOINT_INPUTS));
+	memcpy(checkpoint_section(checkpoint, CHECKPOINT_GRID), grid->cells, checkpoint_section_length(header, CHECKPOINT_GRID));
+	memcpy(checkpoint_section(checkpoint, CHECKPOINT_MPC_PLANS), mpc->plans, checkpoint_section_length(header, CHECKPOINT_MPC_PLANS));
+	memcpy(checkpoint_section(checkpoint, CHECKPOINT_PLUGIN_STATES), plugin->states, checkpoint_section_length(header, CHECKPOINT_PLUGIN_STATES));
+}
+
+// Returns false, changing nothing, if the checkpoint does not fit this session
+static b32 app_state_restore(Application_State *app_state, Checkpoint *checkpoint, u64 *tick) {
+
+	Checkpoint_Header *header = &checkpoint->header;
+	Occupancy_Grid *grid = &app_state->world_grid;
+	Mpc_Controller *mpc = &app_state->mpc;
+	Controller_Plugin *plugin = &app_state->controller_plugin;
+
+	if (header->car_count == 0 || header->car_count > MAX_CAR_COUNT) {
+		printf("checkpoint: %u cars do not fit, the limit is %u\n", header->car_count, MAX_CAR_COUNT);
+		return false;
+	}
+	if (header->grid_width != grid->width || header->grid_height != grid->height) {
+		printf("checkpoint: the world grid is %dx%d, not %dx%d\n", header->grid_width, header->grid_height, grid->width, grid->height);
+		return false;
+	}
+
+	app_state->car_count = header->car_count;
+	memcpy(app_state->cars, checkpoint_section(checkpoint, CHECKPOINT_CARS), checkpoint_section_length(header, CHECKPOINT_CARS));
+	memcpy(app_state->controller_states, checkpoint_section(checkpoint, CHECKPOINT_CONTROLLER_STATES), checkpoint_section_length(header, CHECKPOINT_CONTROLLER_STATES));
+	memcpy(app_state->car_inputs, checkpoint_section(checkpoint, CHECKPOINT_INPUTS), checkpoint_section_length(header, CHECKPOINT_INPUTS));
+
+	// Through the planner, which keeps the inflated obstacles in step
+	grid->cell_size = header->grid_cell_size;
+	grid->origin_x = header->grid_origin_x;
+	grid->origin_y = header->grid_origin_y;
+	u8 *cells = checkpoint_section(checkpoint, CHECKPOINT_GRID);
+	for (s32 y = 0; y < grid->height; ++y) {
+		for (s32 x = 0; x < grid->width; ++x) {
+			path_planner_set_occupied(&app_state->planner, x, y, cells[y*grid->width + x]);
+		}
+	}
+
+	mpc->seed = header->mpc_seed;
+	if (header->mpc_horizon == mpc->config.horizon) {
+		mpc_controller_reserve_plans(mpc, header->mpc_plan_count);
+		umm plans_length = checkpoint_section_length(header, CHECKPOINT_MPC_PLANS);
+		memcpy(mpc->plans, checkpoint_section(checkpoint, CHECKPOINT_MPC_PLANS), plans_length);
+		// Cars past the restored plans start over, as they would when spawned
+		memset((u8 *)mpc->plans + plans_length, 0, (umm)mpc->plan_capacity*mpc->config.horizon*sizeof(Control_Input) - plans_length);
 	}
 	else {
-		result = last_input;
-		printf("stale input: %d,%d\n", result.acceleration_axis, result.turn_axis);
+		memset(mpc->plans, 0, (umm)mpc->plan_capacity*mpc->config.horizon*sizeof(Control_Input));
+	}
+
+	if (plugin->api) {
+		const char *name = plugin->api->name ? plugin->api->name : "";
+		controller_plugin_destroy_states(plugin);
+		if (header->plugin_state_count && header->plugin_state_size == plugin->api->state_size &&
+			!plugin->api->destroy_state && strcmp(header->plugin_name, name) == 0)
+		{
+			// Without destroy_state the created states own nothing and are simply overwritten
+			controller_plugin_states(plugin, header->plugin_state_count);
+			memcpy(plugin->states, checkpoint_section(checkpoint, CHECKPOINT_PLUGIN_STATES), checkpoint_section_length(header, CHECKPOINT_PLUGIN_STATES));
+		}
+	}
+
+	app_state->control_function = controller_function_for(app_state, header->player_controller);
+	app_state->fleet_control_function = controller_function_for(app_state, header->fleet_controller);
+	app_state->planner_lookahead = header->planner_lookahead;
+	app_state->target_radius = header->target_radius;
+	app_state->human_control = (header->flags & CHECKPOINT_HUMAN_CONTROL) != 0;
+	app_state->planning = (header->flags & CHECKPOINT_PLANNING) != 0;
+	app_state->lidar_enabled = (header->flags & CHECKPOINT_LIDAR) != 0;
+	app_state->policy.quantized = (header->flags & CHECKPOINT_POLICY_QUANTIZED) != 0;
+
+	app_state->camera.x = header->camera_x;
+	app_state->camera.y = header->camera_y;
+	app_state->camera.zoom = header->camera_zoom;
+
+	*tick = header->tick;
+	return true;
+}
+
+
+// Replaces the default start with a scenario's cars, world and controllers.
+// Cars and cells are copied straight out of the mapping.
+static b32 app_state_start_scenario(Application_State *app_state, Scenario *scenario) {
+
+	Scenario_Header *header = scenario->header;
+	if (header->car_count == 0 || header->car_count > MAX_CAR_COUNT) {
+		printf("scenario: %u cars do not fit, the limit is %u\n", header->car_count, MAX_CAR_COUNT);
+		return false;
+	}
+
+	app_state->car_count = header->car_count;
+	memcpy(app_state->cars, scenario->cars, (umm)header->car_count*sizeof(Car));
+	for (u32 i = 0; i < header->car_count; ++i) {
+		app_state->controller_states[i] = controller_state_initial();
+		app_state->car_inputs[i] = (Control_Input){0};
+	}
+
+	if (scenario->cells) {
+		// The world may differ in size, so the planner starts over with it
+		Occupancy_Grid *grid = &app_state->world_grid;
+		s32 inflation_radius = app_state->planner.inflation_radius;
+		path_planner_free(&app_state->planner);
+		occupancy_grid_free(grid);
+		occupancy_grid_init(grid, header->grid_width, header->grid_height, header->grid_cell_size, header->grid_origin_x, header->grid_origin_y);
+		path_planner_init(&app_state->planner, grid, inflation_radius);
+
+		for (s32 y = 0; y < grid->height; ++y) {
+			for (s32 x = 0; x < grid->width; ++x) {
+				if (scenario->cells[y*grid->width + x]) {
+					path_planner_set_occupied(&app_state->planner, x, y, true);
+				}
+			}
+		}
+	}
+
+	app_state->control_function = controller_function_for(app_state, header->player_controller);
+	app_state->fleet_control_function = controller_function_for(app_state, header->fleet_controller);
+	app_state->human_control = app_state->control_function == local_human_input_from_sensor_data;
+	if (header->target_radius > 0.0f) {
+		app_state->target_radius = header->target_radius;
+	}
+	if (header->camera_zoom > 0.0f) {
+		app_state->camera.x = header->camera_x;
+		app_state->camera.y = header->camera_y;
+		app_state->camera.zoom = header->camera_zoom;
+	}
+
+	srand((unsigned)header->seed);
+	app_state->mpc.seed = header->seed;
+	return true;
+}
+
+// Decompressing a large checkpoint happens on the loader thread, only the
+// restore itself is left for the frame
+static b32 checkpoint_file_process(Loaded_File *file, void *data) {
+	Application_State *app_state = data;
+	b32 result = checkpoint_read(&app_state->loaded_checkpoint, file->data, file->length);
+	loaded_file_free(file);
+	return result;
+}
+
+static void checkpoint_file_complete(const char *path, Loaded_File *file, b32 success, void *data) {
+	(void)file;
+	Application_State *app_state = data;
+	app_state->checkpoint_loading = false;
+	if (!success) {
+		fprintf(stderr, "Could not load checkpoint '%s'.\n", path);
+		return;
 	}
 
+	Checkpoint previous = app_state->snapshot;
+	app_state->snapshot = app_state->loaded_checkpoint;
+	app_state->loaded_checkpoint = previous;
+	app_state->has_snapshot = true;
+	app_state->restore_requested = true;
+}
 
+// Parsing and quantizing the weights happens on the loader thread too
+static b32 policy_file_process(Loaded_File *file, void *data) {
+	Application_State *app_state = data;
+	b32 result = policy_controller_read(&app_state->policy, file->data, file->length);
+	loaded_file_free(file);
 	return result;
 }
 
+static void policy_file_complete(const char *path, Loaded_File *file, b32 success, void *data) {
+	(void)file;
+	Application_State *app_state = data;
+	if (!success) {
+		panic("Could not load policy '%s'.\n", path);
+	}
+	app_state->fleet_control_function = policy_input_from_sensor_data;
+	printf("Loaded %u layer policy '%s'\n", app_state->policy.layer_count, path);
+}
+
+typedef struct Startup_Scenario {
+	const char *path;
+	Scenario scenario;
+} Startup_Scenario;
+
+// Validating the scenario hashes the whole file, which overlaps with the
+// rest of startup on the loader thread. The loader has faulted the pages
+// in, so mapping the file again is cheap.
+static b32 scenario_file_process(Loaded_File *file, void *data) {
+	Startup_Scenario *startup = data;
+	loaded_file_free(file);
+	return scenario_open(&startup->scenario, startup->path);
+}
+
 
 int main(int argc, char **argv) {
 
+	const char *controller_ip = "127.0.0.1";
+	u16 controller_port = CONTROLLER_DEFAULT_PORT;
+	const char *controller_plugin_path = NULL;
+	const char *policy_path = NULL;
+	const char *recording_path = NULL;
+	b32 recording_compressed = false;
+	const char *replay_path = NULL;
+	const char *checkpoint_path = CHECKPOINT_DEFAULT_PATH;
+	b32 start_from_checkpoint = false;
+	const char *scenario_path = NULL;
+	Lookup_Table_Config lookup_config = lookup_table_default_config();
+	Lidar_Config lidar_config = lidar_default_config();
+	b32 lidar_enabled = false;
+
+	{
+		u32 positional_count = 0;
+		for (s32 i = 1; i < argc; ++i) {
+			if (strcmp(argv[i], "--controller-plugin") == 0 && i + 1 < argc) {
+				controller_plugin_path = argv[++i];
+			}
+			else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+				recording_path = argv[++i];
+			}
+			else if (strcmp(argv[i], "--record-compressed") == 0 && i + 1 < argc) {
+				recording_path = argv[++i];
+				recording_compressed = true;
+			}
+			else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+				replay_path = argv[++i];
+			}
+			else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+				scenario_path = argv[++i];
+			}
+			else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+				checkpoint_path = argv[++i];
+				start_from_checkpoint = true;
+			}
+			else if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc) {
+				policy_path = argv[++i];
+			}
+			else if (strcmp(argv[i], "--lookup-resolution") == 0 && i + 3 < argc) {
+				lookup_config.angle_steps = atoi(argv[++i]);
+				lookup_config.distance_steps = atoi(argv[++i]);
+				lookup_config.velocity_steps = atoi(argv[++i]);
+				if (lookup_config.angle_steps < 2 || lookup_config.distance_steps < 2 || lookup_config.velocity_steps < 2) {
+					panic("Lookup table resolution must be at least 2 along each axis.\n");
+				}
+			}
+			else if (strcmp(argv[i], "--lidar") == 0 && i + 3 < argc) {
+				lidar_config.ray_count = atoi(argv[++i]);
+				lidar_config.fan_angle = (float)atof(argv[++i])*DEG_TO_RAD;
+				lidar_config.range = (float)atof(argv[++i]);
+				lidar_enabled = true;
+				if (lidar_config.ray_count < 1 || lidar_config.ray_count > LIDAR_MAX_RAYS) {
+					panic("Lidar ray count must be between 1 and %d.\n", LIDAR_MAX_RAYS);
+				}
+			}
+			else if (positional_count == 0) {
+				controller_ip = argv[i];
+				++positional_count;
+			}
+			else if (positional_count == 1) {
+				controller_port = atoi(argv[i]);
+				++positional_count;
+			}
+			else {
+				panic("Usage: %s [--controller-plugin <path>] [--policy <path>] [--record <path> | --record-compressed <path> | --replay <path>] [--scenario <path>] [--checkpoint <path>] [--lookup-resolution <angle> <distance> <velocity>] [--lidar <rays> <fan degrees> <range>] [controller ip] [controller port]\n", argv[0]);
+			}
+		}
+	}
 
 	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
 		panic("SDL_Init Error: %s\n", SDL_GetError());
@@ -363,58 +1455,212 @@ int main(int argc, char **argv) {
 	const u8 *keys = app_state.keys = SDL_GetKeyboardState(&app_state.keys_length);
 
 	app_state.control_function = remote_ai_input_from_sensor_data;
+	app_state.fleet_control_function = local_ai_input_from_sensor_data;
+
+	// The files to start from and the policy load in the background while
+	// the lookup table bakes and the rest is set up. A scenario takes
+	// precedence over a checkpoint.
+	file_loader_init(&app_state.loader);
+	u64 load_start = SDL_GetPerformanceCounter();
+	Startup_Scenario startup_scenario = {0};
+	startup_scenario.path = scenario_path;
+	if (scenario_path) {
+		if (!file_loader_request(&app_state.loader, scenario_path, scenario_file_process, NULL, &startup_scenario)) {
+			panic("Could not open scenario '%s'.\n", scenario_path);
+		}
+	}
+	else if (!replay_path && start_from_checkpoint) {
+		app_state.checkpoint_loading = file_loader_request(&app_state.loader, checkpoint_path,
+			checkpoint_file_process, checkpoint_file_complete, &app_state);
+		if (!app_state.checkpoint_loading) {
+			fprintf(stderr, "Could not load checkpoint '%s'.\n", checkpoint_path);
+		}
+	}
+	if (policy_path) {
+		if (!file_loader_request(&app_state.loader, policy_path, policy_file_process, policy_file_complete, &app_state)) {
+			panic("Could not load policy '%s'.\n", policy_path);
+		}
+	}
+
+	{
+		u64 bake_start = SDL_GetPerformanceCounter();
+		lookup_table_bake(&app_state.lookup_table, lookup_config, pursuit_controller_evaluate);
+		double bake_ms = 1000.0*(SDL_GetPerformanceCounter() - bake_start)/SDL_GetPerformanceFrequency();
+		printf("Baked %ux%ux%u lookup table in %.1f ms\n", lookup_config.angle_steps, lookup_config.distance_steps, lookup_config.velocity_steps, bake_ms);
+	}
+
+	if (controller_plugin_path) {
+		if (!controller_plugin_open(&app_state.controller_plugin, controller_plugin_path)) {
+			panic("Could not load controller plugin '%s'.\n", controller_plugin_path);
+		}
+		app_state.fleet_control_function = plugin_input_from_sensor_data;
+	}
+
+	if (recording_path && replay_path) {
+		panic("Cannot record and replay at the same time.\n");
+	}
+
+	if (replay_path) {
+		if (!replayer_open(&app_state.replayer, replay_path)) {
+			panic("Could not open recording '%s'.\n", replay_path);
+		}
+		app_state.replaying = true;
+		Recording_Header *header = app_state.replayer.reader.header;
+		printf("Replaying ticks %llu to %llu with %u keyframes from '%s'\n", (unsigned long long)header->first_tick,
+			(unsigned long long)header->last_tick, app_state.replayer.reader.keyframe_count, replay_path);
+	}
+
+	if (recording_path) {
+		if (!recorder_open(&app_state.recorder, recording_path, recording_compressed)) {
+			panic("Could not create recording '%s'.\n", recording_path);
+		}
+		app_state.recording = true;
+	}
+
+	app_state.debug_draw.enabled_categories = (1u << COUNT_DEBUG_DRAW_CATEGORY) - 1;
 
 	s32 window_width;
 	s32 window_height;
 	SDL_GetWindowSize(window, &window_width, &window_height);
 
+	app_state.camera.x = 0.5f*window_width;
+	app_state.camera.y = 0.5f*window_height;
+	app_state.camera.zoom = 1.0f;
+
+	app_state.cars = calloc(MAX_CAR_COUNT, sizeof(Car));
+	app_state.car_sensors = calloc(MAX_CAR_COUNT, sizeof(Sensor_Data));
+	app_state.controller_states = calloc(MAX_CAR_COUNT, sizeof(Controller_State));
+	app_state.car_inputs = calloc(MAX_CAR_COUNT, sizeof(Control_Input));
+	app_state.controller_reply_sequences = calloc(MAX_CAR_COUNT, sizeof(u32));
+	app_state.controller_sequence = 1; // Newer than the zeroed reply sequences
+	if (!app_state.cars || !app_state.car_sensors || !app_state.controller_states || !app_state.car_inputs ||
+		!app_state.controller_reply_sequences)
+	{
+		panic("Could not allocate cars.\n");
+	}
+	app_state.car_count = 1;
+	app_state.controller_states[0] = controller_state_initial();
+
+	app_state.lidar_enabled = lidar_enabled;
+	app_state.lidar_config = lidar_config;
+	app_state.lidar_bodies = malloc(MAX_CAR_COUNT*sizeof(Lidar_Body));
+	app_state.lidar_distances = malloc((umm)MAX_CAR_COUNT*lidar_config.ray_count*sizeof(float));
+	if (!app_state.lidar_bodies || !app_state.lidar_distances) {
+		panic("Could not allocate lidar readings.\n");
+	}
+
 	Car *car = &app_state.cars[0];
 
-	car->x = 0.5f*window_width;
-	car->y = 0.5f*window_height;
-	car->width = 96.0f;
-	car->length = 2.0f*car->width;
-	car->half_wheel_base = car->length*0.97*0.5f;
-	car->direction = 0;
-	car->velocity = 0.0f;
-	car->acceleration = 0.09f;
-	car->turning_rate = 0.34f;
-	car->turning_span = 1.2f;
-	car->rolling_resistance = 0.005f;
-	car->breaking_resistance = 0.035f;
+	*car = car_default(0.5f*window_width, 0.5f*window_height);
 	car->target_x = (rand() / (float)(RAND_MAX))*1024;
 	car->target_y = (rand() / (float)(RAND_MAX))*768;
 
 	{
 		s8 file[1024] = "car.bmp";
-		SDL_Surface *surface = SDL_LoadBMP(file);
-		if (!surface) panic("Also no!\n");
-		car->texture = SDL_CreateTextureFromSurface(renderer, surface);
-		SDL_SetTextureColorMod(car->texture, 255, 200, 200);
-		SDL_FreeSurface(surface);
+		SDL_Texture *car_texture = NULL;
+
+		// Prefer the baked cache, uploaded straight from the mapping. Fall
+		// back to decoding the BMP if the cache is missing or stale.
+		Asset_Cache asset_cache;
+		if (asset_cache_open(&asset_cache, ASSET_CACHE_PATH)) {
+			Asset_Cache_Image *image = asset_cache_find(&asset_cache, file);
+			if (image && !asset_cache_image_current(image)) {
+				printf("Asset cache '%s' is out of date for '%s'.\n", ASSET_CACHE_PATH, file);
+				image = NULL;
+			}
+			if (image) {
+				car_texture = SDL_CreateTexture(renderer, asset_cache.header->pixel_format, SDL_TEXTUREACCESS_STATIC, image->width, image->height);
+				if (car_texture) {
+					SDL_UpdateTexture(car_texture, NULL, asset_cache_pixels(&asset_cache, image), image->pitch);
+					SDL_SetTextureBlendMode(car_texture, (image->flags & ASSET_IMAGE_HAS_ALPHA) ? SDL_BLENDMODE_BLEND : SDL_BLENDMODE_NONE);
+				}
+			}
+			asset_cache_close(&asset_cache);
+		}
+
+		if (!car_texture) {
+			printf("Asset cache '%s' unusable, loading '%s'.\n", ASSET_CACHE_PATH, file);
+			SDL_Surface *surface = SDL_LoadBMP(file);
+			if (!surface) panic("Also no!\n");
+			car_texture = SDL_CreateTextureFromSurface(renderer, surface);
+			SDL_FreeSurface(surface);
+		}
+
+		lod_renderer_init(&app_state.lod_renderer, renderer, car_texture);
 	}
 
-	app_state.cars[1] = *car;
+	trail_layer_init(&app_state.trail_layer, renderer, app_state.camera.x, app_state.camera.y);
+
+	occupancy_grid_init(&app_state.world_grid, WORLD_GRID_WIDTH, WORLD_GRID_HEIGHT, WORLD_GRID_CELL_SIZE,
+		app_state.camera.x - 0.5f*WORLD_GRID_WIDTH*WORLD_GRID_CELL_SIZE,
+		app_state.camera.y - 0.5f*WORLD_GRID_HEIGHT*WORLD_GRID_CELL_SIZE);
+
+	{
+		// Inflate obstacles by half the car width, and put waypoints beyond the
+		// turning circle so the controller can still turn onto them
+		float turning_radius = 2.0f*car->half_wheel_base/tanf(car->turning_span);
+		s32 inflation_radius = (s32)ceilf(0.5f*car->width/WORLD_GRID_CELL_SIZE);
+		path_planner_init(&app_state.planner, &app_state.world_grid, inflation_radius);
+		app_state.planner_lookahead = (u32)ceilf((turning_radius + 0.5f*car->length)/WORLD_GRID_CELL_SIZE);
+	}
+
+	job_system_init(&app_state.jobs, 0);
+	rewind_init(&app_state.rewind, REWIND_DEFAULT_CAPACITY, REWIND_DEFAULT_FRAME_CAPACITY);
+	mpc_controller_init(&app_state.mpc, mpc_default_config(), &app_state.jobs, &app_state.world_grid);
 
 	app_state.udp_socket = SDLNet_UDP_Open(0);
 	if (!app_state.udp_socket) {
 		panic("ERROR: Could not open UDP socket.\n");
 	}
 
-	const char *controller_ip = argc > 1 ? argv[1] : "127.0.0.1";
-	u16 controller_port = argc > 2 ? atoi(argv[2]) : 9001;
 	printf("Connecting to controller on socket (%s:%d)\n", controller_ip, controller_port);
 	SDLNet_ResolveHost(&app_state.controller_address, controller_ip, controller_port);
 
-	app_state.udp_packet = SDLNet_AllocPacket(32);
+	app_state.udp_packet = SDLNet_AllocPacket(CONTROLLER_MAX_PACKET_SIZE);
 
 	s32 frame_count = 0;
 
+	// The first frame needs the starting state, and a recording has to begin
+	// with it, so this is where the startup loads are waited for. The policy
+	// completes first, as a scenario may ask for it.
+	file_loader_wait(&app_state.loader);
+	double load_ms = 1000.0*(SDL_GetPerformanceCounter() - load_start)/SDL_GetPerformanceFrequency();
+
+	if (scenario_path) {
+		Scenario *scenario = &startup_scenario.scenario;
+		if (!scenario->header) {
+			panic("Could not open scenario '%s'.\n", scenario_path);
+		}
+		if (!app_state_start_scenario(&app_state, scenario)) {
+			panic("Could not start scenario '%s'.\n", scenario_path);
+		}
+		scenario_close(scenario);
+		printf("Started scenario '%s' with %u cars, %.2f ms after its load began\n", scenario_path, app_state.car_count, load_ms);
+	}
+
+	// Start warmed up from the checkpoint asked for. Without --checkpoint
+	// every launch starts fresh.
+	else if (app_state.restore_requested) {
+		app_state.restore_requested = false;
+		u64 tick;
+		if (app_state_restore(&app_state, &app_state.snapshot, &tick)) {
+			frame_count = (s32)tick;
+			printf("Started from checkpoint '%s' at tick %d with %u cars, %.2f ms after its load began\n",
+				checkpoint_path, frame_count, app_state.car_count, load_ms);
+		}
+	}
+	else if (start_from_checkpoint && !app_state.replaying) {
+		fprintf(stderr, "Starting fresh.\n");
+	}
+
 	SDL_Event e;
 	b32 quit = false;
+	b32 divergence_reported = false;
 
 	while (!quit) {
 
+		frame_timing_begin_frame(&app_state.frame_timing);
+
 		//
 		// Input:
 		//
@@ -423,6 +1669,15 @@ int main(int argc, char **argv) {
 			if (e.type == SDL_QUIT){
 				quit = true;
 			}
+			else if (e.type == SDL_MOUSEWHEEL) {
+				s32 wheel_x, wheel_y;
+				SDL_GetMouseState(&wheel_x, &wheel_y);
+				camera_zoom_at(&app_state.camera, window_width, window_height, wheel_x, wheel_y, powf(1.25f, (float)e.wheel.y));
+			}
+			else if (e.type == SDL_MOUSEMOTION && (e.motion.state & SDL_BUTTON_RMASK)) {
+				app_state.camera.x -= e.motion.xrel/app_state.camera.zoom;
+				app_state.camera.y -= e.motion.yrel/app_state.camera.zoom;
+			}
 			else if (e.type == SDL_KEYDOWN)
 			{
 				switch (e.key.keysym.sym)
@@ -432,8 +1687,187 @@ int main(int argc, char **argv) {
 						// car->y = 0.5f*window_height;
 						// car->velocity = 0.0f;
 						// car->direction = 0.0f;
-						car->target_x = (rand() / (float)(RAND_MAX))*window_width;
-						car->target_y = (rand() / (float)(RAND_MAX))*window_height;
+						// Scatter every car's target over the visible part of the world
+						for (u32 i = 0; i < app_state.car_count; ++i) {
+							camera_screen_to_world(&app_state.camera, window_width, window_height,
+								(rand() / (float)(RAND_MAX))*window_width,
+								(rand() / (float)(RAND_MAX))*window_height,
+								&app_state.cars[i].target_x, &app_state.cars[i].target_y);
+						}
+					} break;
+
+					case SDLK_SPACE: {
+						app_state.replay_paused = !app_state.replay_paused;
+					} break;
+
+					case SDLK_HOME:
+					case SDLK_COMMA:
+					case SDLK_PERIOD: {
+						// Seek 10 seconds, or 60 with shift
+						if (app_state.replaying) {
+							Replayer *replayer = &app_state.replayer;
+							b32 shift = keys[SDL_SCANCODE_LSHIFT] || keys[SDL_SCANCODE_RSHIFT];
+							u64 step = shift ? 3600 : 600;
+							u64 tick = replayer->tick;
+							if (e.key.keysym.sym == SDLK_HOME) tick = 0;
+							else if (e.key.keysym.sym == SDLK_COMMA) tick = tick > step ? tick - step : 0;
+							else tick += step;
+
+							u64 seek_start = SDL_GetPerformanceCounter();
+							replayer_seek(replayer, tick);
+							double seek_ms = 1000.0*(SDL_GetPerformanceCounter() - seek_start)/SDL_GetPerformanceFrequency();
+							printf("replay: tick %llu (seek %.1f ms)\n", (unsigned long long)replayer->tick, seek_ms);
+						}
+					} break;
+
+					case SDLK_BACKSPACE: {
+						// Stops the simulation to scrub back with the arrow keys,
+						// pressed again resumes from the tick shown
+						Rewind_Buffer *rewind = &app_state.rewind;
+						if (app_state.replaying || app_state.recording) break;
+						if (!app_state.rewinding) {
+							if (!rewind->frame_count) break;
+							app_state.rewinding = true;
+							app_state.rewind_tick = rewind_last_tick(rewind);
+							printf("rewind: ticks %llu to %llu held in %.1f MB, %.1f bytes per car per tick, %.1f MB allocated\n",
+								(unsigned long long)rewind_first_tick(rewind), (unsigned long long)rewind_last_tick(rewind),
+								rewind->held_bytes/(1024.0*1024.0), rewind->held_car_ticks ? (double)rewind->held_bytes/rewind->held_car_ticks : 0.0,
+								rewind_memory_used(rewind)/(1024.0*1024.0));
+						}
+						else {
+							app_state.rewinding = false;
+							if (app_state.rewind_tick != rewind_last_tick(rewind)) {
+								rewind_truncate(rewind, app_state.rewind_tick);
+							}
+							frame_count = (s32)app_state.rewind_tick + 1;
+							printf("rewind: resumed after tick %llu\n", (unsigned long long)app_state.rewind_tick);
+						}
+					} break;
+
+					case SDLK_LEFT:
+					case SDLK_RIGHT: {
+						// One tick, or a second with shift
+						if (app_state.rewinding) {
+							Rewind_Buffer *rewind = &app_state.rewind;
+							b32 shift = keys[SDL_SCANCODE_LSHIFT] || keys[SDL_SCANCODE_RSHIFT];
+							u64 step = shift ? 60 : 1;
+							u64 tick = app_state.rewind_tick;
+							u64 first = rewind_first_tick(rewind), last = rewind_last_tick(rewind);
+							if (e.key.keysym.sym == SDLK_LEFT) tick = tick > first + step ? tick - step : first;
+							else tick = tick + step < last ? tick + step : last;
+
+							u64 load_start = SDL_GetPerformanceCounter();
+							rewind_load(rewind, tick, app_state.cars, app_state.controller_states, app_state.car_inputs, &app_state.car_count);
+							double load_ms = 1000.0*(SDL_GetPerformanceCounter() - load_start)/SDL_GetPerformanceFrequency();
+							app_state.rewind_tick = tick;
+							printf("rewind: tick %llu, %lld back (%.2f ms)\n", (unsigned long long)tick, (long long)(tick - last), load_ms);
+						}
+					} break;
+
+					case SDLK_f: {
+						// The rewind buffer only knows the cars it recorded
+						if (app_state.rewinding) break;
+						b32 shift = keys[SDL_SCANCODE_LSHIFT] || keys[SDL_SCANCODE_RSHIFT];
+						spawn_fleet(&app_state, shift ? 16*FLEET_SPAWN_COUNT : FLEET_SPAWN_COUNT);
+						printf("car_count: %u\n", app_state.car_count);
+					} break;
+
+					case SDLK_F1: debug_draw_toggle(&app_state.debug_draw, DEBUG_DRAW_TARGET); break;
+					case SDLK_F2: debug_draw_toggle(&app_state.debug_draw, DEBUG_DRAW_TARGET_LINE); break;
+					case SDLK_F3: debug_draw_toggle(&app_state.debug_draw, DEBUG_DRAW_HEADING); break;
+					case SDLK_F4: debug_draw_toggle(&app_state.debug_draw, DEBUG_DRAW_FRAME_GRAPH); break;
+					case SDLK_F5: debug_draw_toggle(&app_state.debug_draw, DEBUG_DRAW_PATH); break;
+					case SDLK_F6: debug_draw_toggle(&app_state.debug_draw, DEBUG_DRAW_LIDAR); break;
+
+					// F7 snapshots the simulation and F8 goes back to it, as
+					// often as wanted to branch from the same state. F9 and
+					// F10 save and load the checkpoint file.
+					case SDLK_F7:
+					case SDLK_F9: {
+						if (app_state.replaying || app_state.rewinding) break;
+						u64 start = SDL_GetPerformanceCounter();
+						app_state_capture(&app_state, frame_count, &app_state.snapshot);
+						app_state.has_snapshot = true;
+						b32 saved = e.key.keysym.sym == SDLK_F9 && checkpoint_save(&app_state.snapshot, checkpoint_path);
+						double ms = 1000.0*(SDL_GetPerformanceCounter() - start)/SDL_GetPerformanceFrequency();
+						if (e.key.keysym.sym == SDLK_F9 && !saved) {
+							fprintf(stderr, "Could not write checkpoint '%s'.\n", checkpoint_path);
+						}
+						printf("checkpoint: tick %d, %u cars, %.1f KB%s%s (%.2f ms)\n", frame_count, app_state.car_count,
+							app_state.snapshot.header.payload_length/1024.0, saved ? " saved to " : "", saved ? checkpoint_path : "", ms);
+					} break;
+
+					case SDLK_F8: {
+						app_state.restore_requested = app_state.has_snapshot;
+					} break;
+
+					case SDLK_F10: {
+						if (!app_state.checkpoint_loading) {
+							app_state.checkpoint_loading = file_loader_request(&app_state.loader, checkpoint_path,
+								checkpoint_file_process, checkpoint_file_complete, &app_state);
+						}
+					} break;
+
+					case SDLK_i: {
+						app_state.lidar_enabled = !app_state.lidar_enabled;
+						printf("lidar: %s\n", app_state.lidar_enabled ? "on" : "off");
+					} break;
+
+					case SDLK_g: {
+						app_state.planning = !app_state.planning;
+						printf("path planning: %s\n", app_state.planning ? "on" : "off");
+					} break;
+
+					case SDLK_h: {
+						Trail_Layer *trail = &app_state.trail_layer;
+						trail_layer_set_mode(trail, (trail->mode + 1) % COUNT_TRAIL_MODE);
+					} break;
+
+					case SDLK_l: {
+						b32 use_lookup = app_state.fleet_control_function != lookup_table_input_from_sensor_data;
+						app_state.fleet_control_function = use_lookup ? lookup_table_input_from_sensor_data : local_ai_input_from_sensor_data;
+						printf("fleet controller: %s\n", use_lookup ? "lookup table" : "built-in pursuit");
+					} break;
+
+					case SDLK_m: {
+						// Shift+M switches the fleet, M the player car
+						if (keys[SDL_SCANCODE_LSHIFT] || keys[SDL_SCANCODE_RSHIFT]) {
+							b32 use_mpc = app_state.fleet_control_function != mpc_input_from_sensor_data;
+							app_state.fleet_control_function = use_mpc ? mpc_input_from_sensor_data : local_ai_input_from_sensor_data;
+							printf("fleet controller: %s\n", use_mpc ? "mpc" : "built-in pursuit");
+						}
+						else if (app_state.control_function != mpc_input_from_sensor_data) {
+							app_state.control_function = mpc_input_from_sensor_data;
+							printf("player controller: mpc\n");
+						}
+						else {
+							app_state.control_function = app_state.human_control ? local_human_input_from_sensor_data : remote_ai_input_from_sensor_data;
+							printf("player controller: %s\n", app_state.human_control ? "human" : "remote");
+						}
+					} break;
+
+					case SDLK_n: {
+						// Shift+N switches between float and int8 weights, N the fleet
+						if (app_state.policy.layer_count) {
+							if (keys[SDL_SCANCODE_LSHIFT] || keys[SDL_SCANCODE_RSHIFT]) {
+								app_state.policy.quantized = !app_state.policy.quantized;
+								printf("policy weights: %s\n", app_state.policy.quantized ? "int8" : "float");
+							}
+							else {
+								b32 use_policy = app_state.fleet_control_function != policy_input_from_sensor_data;
+								app_state.fleet_control_function = use_policy ? policy_input_from_sensor_data : local_ai_input_from_sensor_data;
+								printf("fleet controller: %s\n", use_policy ? "policy" : "built-in pursuit");
+							}
+						}
+					} break;
+
+					case SDLK_p: {
+						if (app_state.controller_plugin.api) {
+							b32 use_plugin = app_state.fleet_control_function != plugin_input_from_sensor_data;
+							app_state.fleet_control_function = use_plugin ? plugin_input_from_sensor_data : local_ai_input_from_sensor_data;
+							const char *name = app_state.controller_plugin.api->name ? app_state.controller_plugin.api->name : "unnamed plugin";
+							printf("fleet controller: %s\n", use_plugin ? name : "built-in pursuit");
+						}
 					} break;
 
 					case SDLK_t: {
@@ -449,29 +1883,157 @@ int main(int argc, char **argv) {
 			}
 		}
 
+		file_loader_poll(&app_state.loader);
+
+		// Recordings must stay one continuous run
+		if (app_state.restore_requested) {
+			app_state.restore_requested = false;
+			u64 tick;
+			if (!app_state.replaying && !app_state.recording && app_state_restore(&app_state, &app_state.snapshot, &tick)) {
+				frame_count = (s32)tick;
+				app_state.rewinding = false;
+				rewind_clear(&app_state.rewind);
+				printf("checkpoint: restored tick %d with %u cars\n", frame_count, app_state.car_count);
+			}
+		}
+
 		SDL_PumpEvents();
 
 		SDL_GetWindowSize(window, &window_width, &window_height);
 
 		s32 mouse_x, mouse_y;
-		SDL_GetMouseState(&mouse_x, &mouse_y);
+		u32 mouse_buttons = SDL_GetMouseState(&mouse_x, &mouse_y);
 
 #if 1
-		car->target_x = mouse_x;
-		car->target_y = mouse_y;
+		camera_screen_to_world(&app_state.camera, window_width, window_height, mouse_x, mouse_y, &car->target_x, &car->target_y);
 #endif
 
 		b32 key_modifier_control = keys[SDL_SCANCODE_LCTRL] || keys[SDL_SCANCODE_RCTRL];
 
-		Sensor_Data car_sensors = car_get_sensor_data(car);
-		car_sensors.time = frame_count;
-		app_state.car_input = app_state.control_function(&app_state, car_sensors);
+		// Left drag paints obstacles, with control held it erases them
+		if (mouse_buttons & SDL_BUTTON_LMASK) {
+			float world_x, world_y;
+			s32 cell_x, cell_y;
+			camera_screen_to_world(&app_state.camera, window_width, window_height, mouse_x, mouse_y, &world_x, &world_y);
+			occupancy_grid_cell_at(&app_state.world_grid, world_x, world_y, &cell_x, &cell_y);
+			for (s32 y = cell_y - 1; y <= cell_y + 1; ++y) {
+				for (s32 x = cell_x - 1; x <= cell_x + 1; ++x) {
+					path_planner_set_occupied(&app_state.planner, x, y, !key_modifier_control);
+				}
+			}
+		}
+
+		frame_timing_end_phase(&app_state.frame_timing, FRAME_PHASE_EVENTS);
+
+		if ((frame_count % 30) == 0) {
+			controller_plugin_reload_if_changed(&app_state.controller_plugin);
+		}
+
+		if (app_state.replaying) {
+			Replayer *replayer = &app_state.replayer;
+			if (!app_state.replay_paused && !replayer_step(replayer)) {
+				app_state.replay_paused = true;
+				printf("replay: %s at tick %llu\n", replayer->rejected ? "stopped, too many cars" : "end",
+					(unsigned long long)replayer->tick);
+			}
+			if (replayer->diverged && !divergence_reported) {
+				printf("replay: diverged from the recording at tick %llu, car %d\n",
+					(unsigned long long)replayer->divergent_tick, replayer->divergent_car);
+				divergence_reported = true;
+			}
+			app_state.car_count = replayer->car_count;
+			memcpy(app_state.cars, replayer->cars, replayer->car_count*sizeof(Car));
+			memcpy(app_state.controller_states, replayer->states, replayer->car_count*sizeof(Controller_State));
+			memcpy(app_state.car_inputs, replayer->inputs, replayer->car_count*sizeof(Control_Input));
+		}
+
+		if (app_state.recording && recorder_keyframe_due(&app_state.recorder, frame_count, app_state.car_count)) {
+			recorder_write_keyframe(&app_state.recorder, frame_count, app_state.car_count, app_state.cars, app_state.controller_states);
+		}
+
+		for (u32 i = 0; i < app_state.car_count; ++i) {
+			app_state.car_sensors[i] = car_get_sensor_data(&app_state.cars[i]);
+			app_state.car_sensors[i].time = frame_count;
+		}
+
+		if (app_state.lidar_enabled) {
+			for (u32 i = 0; i < app_state.car_count; ++i) {
+				Car *scanning_car = &app_state.cars[i];
+				app_state.lidar_bodies[i] = (Lidar_Body){
+					scanning_car->x,
+					scanning_car->y,
+					cosf(scanning_car->direction),
+					sinf(scanning_car->direction),
+					0.5f*scanning_car->length,
+					0.5f*scanning_car->width,
+					0.0f,
+				};
+			}
+
+			Lidar_Scene *scene = &app_state.lidar_scene;
+			lidar_scene_build(scene, &app_state.world_grid, app_state.lidar_bodies, app_state.car_count);
+			lidar_scan(scene, app_state.lidar_config, 0, lidar_scene_bin_count(scene), app_state.lidar_distances);
+		}
+
+		if (app_state.planning) {
+			Path_Planner *planner = &app_state.planner;
+			path_planner_set_target(planner, car->target_x, car->target_y);
+			path_planner_set_focus(planner, car->x, car->y);
+			path_planner_update(planner, PLANNER_EXPANSIONS_PER_FRAME);
+
+			// Steer at the next waypoint instead of the target. Cars off the
+			// grid or without a path yet keep steering at the target.
+			for (u32 i = 0; i < app_state.car_count; ++i) {
+				Car *planned_car = &app_state.cars[i];
+				float waypoint_x = car->target_x;
+				float waypoint_y = car->target_y;
+				path_planner_waypoint(planner, planned_car->x, planned_car->y, app_state.planner_lookahead, &waypoint_x, &waypoint_y);
+				app_state.car_sensors[i].delta_x = waypoint_x - planned_car->x;
+				app_state.car_sensors[i].delta_y = waypoint_y - planned_car->y;
+			}
+		}
+
+		// A replay has applied the recorded inputs already
+		b32 simulating = !app_state.replaying && !app_state.rewinding;
+		if (simulating) {
+			const float *lidar = app_state.lidar_enabled ? app_state.lidar_distances : NULL;
+			u32 ray_count = app_state.lidar_config.ray_count;
+			app_state.control_function(&app_state, 1, app_state.car_sensors, lidar, app_state.controller_states, app_state.car_inputs);
+			if (app_state.car_count > 1) {
+				app_state.fleet_control_function(&app_state, app_state.car_count - 1,
+					app_state.car_sensors + 1, lidar ? lidar + ray_count : NULL, app_state.controller_states + 1, app_state.car_inputs + 1);
+			}
+		}
+
+		frame_timing_end_phase(&app_state.frame_timing, FRAME_PHASE_CONTROL);
 
 		//
 		// Update:
 		//
 
-		update_car(car, app_state.car_input);
+		if (simulating) {
+			for (u32 i = 0; i < app_state.car_count; ++i) {
+				update_car(&app_state.cars[i], app_state.car_inputs[i]);
+			}
+		}
+
+		frame_timing_end_phase(&app_state.frame_timing, FRAME_PHASE_PHYSICS);
+
+		if (app_state.recording) {
+			recorder_write_tick(&app_state.recorder, frame_count, app_state.car_count, app_state.car_sensors, app_state.car_inputs);
+			recorder_write_hash(&app_state.recorder, frame_count, app_state.car_count, app_state.cars);
+		}
+
+		if (simulating) {
+			rewind_push(&app_state.rewind, frame_count, app_state.cars, app_state.controller_states, app_state.car_inputs, app_state.car_count);
+		}
+
+		frame_timing_end_phase(&app_state.frame_timing, FRAME_PHASE_RECORD);
+
+		// Scrubbing back would stamp the past again
+		if (!app_state.rewinding) {
+			trail_layer_update(&app_state.trail_layer, app_state.cars, app_state.car_count);
+		}
 
 		//
 		// Rendering:
@@ -481,61 +2043,133 @@ int main(int argc, char **argv) {
 
 		SDL_RenderClear(renderer);
 
-		SDL_Rect car_rect = {
-			(s32)(car->x - 0.5f*car->length),
-			(s32)(car->y - 0.5f*car->width),
-			(s32)(car->length),
-			(s32)(car->width),
-		};
+		render_trail_layer(&app_state.trail_layer, renderer, &app_state.camera, window_width, window_height);
 
-		SDL_RenderCopyEx(renderer,
-			car->texture,
-			NULL,
-			&car_rect,
-			car->direction * RAD_TO_DEG,
-			NULL,
-			SDL_FLIP_NONE);
-
-#if 0
-		car_rect.x = 0.5*(window_width - car->length);
-		car_rect.y = 0.5*(window_height - car->width) + 130;
-
-		SDL_RenderCopyEx(renderer, car->texture, NULL, &car_rect, 0, NULL, SDL_FLIP_NONE);
-		car_rect.x -= 3*(car->length);
-		SDL_RenderCopyEx(renderer, car->texture, NULL, &car_rect, 0, NULL, SDL_FLIP_NONE);
-#endif
+		render_occupancy_grid(&app_state.world_grid, renderer, &app_state.camera, window_width, window_height);
 
-		SDL_Rect target_rect = {
-			(s32)(car->target_x - 10),
-			(s32)(car->target_y - 10),
-			20,
-			20,
-		};
-		SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
-		SDL_RenderFillRect(renderer, &target_rect);
+		render_cars(&app_state.lod_renderer, renderer, &app_state.camera, app_state.cars, app_state.car_count, window_width, window_height);
 
+		Camera *camera = &app_state.camera;
+		Debug_Draw *debug_draw = &app_state.debug_draw;
+		float half_window_width = 0.5f*window_width;
+		float half_window_height = 0.5f*window_height;
 
-		SDL_SetRenderDrawColor(renderer, 255, 0, 255, 255);
-		SDL_RenderDrawLine(renderer, car->x, car->y, car->target_x, car->target_y);
+		if (debug_draw_enabled(debug_draw, DEBUG_DRAW_TARGET)) {
+			debug_draw_rect(debug_draw, 0xffff00ff, mouse_x - 10, mouse_y - 10, 20, 20);
+		}
 
+		if (debug_draw_enabled(debug_draw, DEBUG_DRAW_TARGET_LINE)) {
+			float car_screen_x = (car->x - camera->x)*camera->zoom + half_window_width;
+			float car_screen_y = (car->y - camera->y)*camera->zoom + half_window_height;
+			debug_draw_line(debug_draw, 0xff00ffff, car_screen_x, car_screen_y, mouse_x, mouse_y);
+		}
 
-		SDL_SetRenderDrawColor(renderer, 0, 255, 255, 255);
-		{
-			float heading_x = cosf(car->direction)*car->velocity;
-			float heading_y = sinf(car->direction)*car->velocity;
-			SDL_RenderDrawLine(renderer, car->x, car->y, car->x + heading_x*50, car->y + heading_y*50);
+		// Heading lines would be sub-pixel once cars are drawn as points or density cells
+		if (debug_draw_enabled(debug_draw, DEBUG_DRAW_HEADING) && car->length*camera->zoom >= LOD_RECT_MIN_PIXELS) {
+			for (u32 i = 0; i < app_state.car_count; ++i) {
+				Car *heading_car = &app_state.cars[i];
+				float car_screen_x = (heading_car->x - camera->x)*camera->zoom + half_window_width;
+				float car_screen_y = (heading_car->y - camera->y)*camera->zoom + half_window_height;
+				float heading_x = cosf(heading_car->direction)*heading_car->velocity*camera->zoom;
+				float heading_y = sinf(heading_car->direction)*heading_car->velocity*camera->zoom;
+				debug_draw_line(debug_draw, 0x00ffffff, car_screen_x, car_screen_y, car_screen_x + heading_x*50, car_screen_y + heading_y*50);
+			}
+		}
+
+		if (debug_draw_enabled(debug_draw, DEBUG_DRAW_PATH) && app_state.planning) {
+			Path_Planner *planner = &app_state.planner;
+			s32 cell_x, cell_y;
+			if (occupancy_grid_cell_at(planner->grid, car->x, car->y, &cell_x, &cell_y)) {
+				u32 cell = cell_y*planner->grid->width + cell_x;
+				float previous_x = (car->x - camera->x)*camera->zoom + half_window_width;
+				float previous_y = (car->y - camera->y)*camera->zoom + half_window_height;
+
+				for (u32 step = 0; step < (u32)(planner->grid->width*planner->grid->height) && planner_step(planner, &cell); ++step) {
+					float x, y;
+					occupancy_grid_cell_center(planner->grid, cell % planner->grid->width, cell / planner->grid->width, &x, &y);
+					x = (x - camera->x)*camera->zoom + half_window_width;
+					y = (y - camera->y)*camera->zoom + half_window_height;
+					debug_draw_line(debug_draw, 0x80ff80ff, previous_x, previous_y, x, y);
+					previous_x = x;
+					previous_y = y;
+				}
+			}
+		}
 
+		if (debug_draw_enabled(debug_draw, DEBUG_DRAW_LIDAR) && app_state.lidar_enabled) {
+			Lidar_Config *config = &app_state.lidar_config;
+			float car_screen_x = (car->x - camera->x)*camera->zoom + half_window_width;
+			float car_screen_y = (car->y - camera->y)*camera->zoom + half_window_height;
+
+			for (u32 ray = 0; ray < config->ray_count; ++ray) {
+				float distance = app_state.lidar_distances[ray];
+				float angle = car->direction + (config->ray_count > 1 ? config->fan_angle*((float)ray/(config->ray_count - 1) - 0.5f) : 0.0f);
+				b32 hit = distance < config->range;
+				float end_x = car_screen_x + cosf(angle)*distance*camera->zoom;
+				float end_y = car_screen_y + sinf(angle)*distance*camera->zoom;
+				debug_draw_line(debug_draw, hit ? 0xff4040c0 : 0x40ff4060, car_screen_x, car_screen_y, end_x, end_y);
+				if (hit) {
+					debug_draw_point(debug_draw, 0xffffffff, end_x, end_y);
+				}
+			}
 		}
 
-		if ((frame_count & 0xff) == 0) {
-			float fps_average = frame_count / ( SDL_GetTicks() / 1000.0f );
-			printf("fps_average: %.2f\n", fps_average);
+		if (debug_draw_enabled(debug_draw, DEBUG_DRAW_FRAME_GRAPH)) {
+			frame_timing_draw_graph(&app_state.frame_timing, debug_draw, window_height);
 		}
 
+		debug_draw_flush(debug_draw, renderer);
+
+		frame_timing_end_phase(&app_state.frame_timing, FRAME_PHASE_RENDER);
+
 		SDL_RenderPresent(renderer);
+
+		frame_timing_end_phase(&app_state.frame_timing, FRAME_PHASE_PRESENT);
+		frame_timing_end_frame(&app_state.frame_timing);
+
+		if ((app_state.frame_timing.frame_count % FRAME_TIMING_HISTORY) == 0) {
+			u32 *lod_counts = app_state.lod_renderer.lod_counts;
+			frame_timing_print_summary(&app_state.frame_timing);
+			printf("  cars: %u (sprites: %u, rects: %u, points: %u, density: %u)\n", app_state.car_count,
+				lod_counts[CAR_LOD_SPRITE], lod_counts[CAR_LOD_RECT], lod_counts[CAR_LOD_POINT], lod_counts[CAR_LOD_DENSITY]);
+			if (app_state.planning) {
+				printf("  planner: %u expansions, %u queued\n", app_state.planner.expansion_count, app_state.planner.queue_count);
+			}
+			Rewind_Buffer *rewind = &app_state.rewind;
+			if (rewind->frame_count) {
+				printf("  rewind: %u ticks, %.1f of %.1f MB, %.1f bytes per car per tick\n", rewind->frame_count,
+					rewind->held_bytes/(1024.0*1024.0), rewind_memory_used(rewind)/(1024.0*1024.0),
+					rewind->held_car_ticks ? (double)rewind->held_bytes/rewind->held_car_ticks : 0.0);
+			}
+		}
+
 		++frame_count;
 	}
 
+	if (app_state.recording) {
+		u32 stall_count = app_state.recorder.stall_count;
+		Recording_Header header;
+		if (!recorder_close(&app_state.recorder, &header)) {
+			fprintf(stderr, "Could not truncate recording '%s'.\n", recording_path);
+		}
+		printf("Recorded %llu ticks, %.1f MB (%.1f MB uncompressed, %u compressor stalls) to '%s'\n",
+			(unsigned long long)header.tick_count, header.data_length/(1024.0*1024.0),
+			header.raw_length/(1024.0*1024.0), stall_count, recording_path);
+	}
+
+	replayer_close(&app_state.replayer);
+	file_loader_shutdown(&app_state.loader);
+	rewind_free(&app_state.rewind);
+	checkpoint_free(&app_state.snapshot);
+	checkpoint_free(&app_state.loaded_checkpoint);
+	controller_plugin_close(&app_state.controller_plugin);
+	lookup_table_free(&app_state.lookup_table);
+	path_planner_free(&app_state.planner);
+	lidar_scene_free(&app_state.lidar_scene);
+	mpc_controller_free(&app_state.mpc);
+	policy_controller_free(&app_state.policy);
+	job_system_shutdown(&app_state.jobs);
+	occupancy_grid_free(&app_state.world_grid);
 	SDLNet_UDP_Close(app_state.udp_socket);
 	SDL_Quit();
 	return 0;
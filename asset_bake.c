@@ -0,0 +1,103 @@
+#include "car_common.h"
+#include "car_assets.h"
+
+#include <SDL2/SDL.h>
+
+// Converts images to the renderer's pixel format and packs them into an
+// asset cache file. Usage: asset_bake <cache file> <image.bmp>...
+
+#define ASSET_BAKE_PIXEL_FORMAT SDL_PIXELFORMAT_ARGB8888
+
+static umm align_up(umm value, umm alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+int main(int argc, char **argv) {
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <cache file> <image.bmp>...\n", argv[0]);
+		return 1;
+	}
+
+	const char *cache_path = argv[1];
+	u32 image_count = argc - 2;
+
+	SDL_Surface **surfaces = calloc(image_count, sizeof(SDL_Surface *));
+	Asset_Cache_Image *images = calloc(image_count, sizeof(Asset_Cache_Image));
+	if (!surfaces || !images) {
+		panic("Out of memory.\n");
+	}
+
+	umm offset = align_up(sizeof(Asset_Cache_Header) + image_count*sizeof(Asset_Cache_Image), ASSET_CACHE_ALIGNMENT);
+
+	for (u32 i = 0; i < image_count; ++i) {
+		const char *path = argv[i + 2];
+
+		if (strlen(path) >= ASSET_NAME_LENGTH) {
+			panic("Asset name too long: '%s'\n", path);
+		}
+
+		SDL_Surface *source = SDL_LoadBMP(path);
+		if (!source) {
+			panic("Could not load '%s': %s\n", path, SDL_GetError());
+		}
+
+		b32 has_alpha = SDL_ISPIXELFORMAT_ALPHA(source->format->format) || source->format->Amask;
+
+		SDL_Surface *converted = SDL_ConvertSurfaceFormat(source, ASSET_BAKE_PIXEL_FORMAT, 0);
+		SDL_FreeSurface(source);
+		if (!converted) {
+			panic("Could not convert '%s': %s\n", path, SDL_GetError());
+		}
+
+		Asset_Cache_Image *image = &images[i];
+		strcpy(image->name, path);
+		image->width = converted->w;
+		image->height = converted->h;
+		image->pitch = converted->pitch;
+		image->flags = has_alpha ? ASSET_IMAGE_HAS_ALPHA : 0;
+		image->offset = offset;
+		image->source_size = file_size(path);
+		image->source_modified_time = file_modified_time(path);
+
+		offset = align_up(offset + (umm)image->pitch*image->height, ASSET_CACHE_ALIGNMENT);
+		surfaces[i] = converted;
+	}
+
+	umm file_length = offset;
+	u8 *contents = calloc(file_length, 1);
+	if (!contents) {
+		panic("Out of memory.\n");
+	}
+
+	Asset_Cache_Header *header = (Asset_Cache_Header *)contents;
+	header->magic = ASSET_CACHE_MAGIC;
+	header->version = ASSET_CACHE_VERSION;
+	header->pixel_format = ASSET_BAKE_PIXEL_FORMAT;
+	header->image_count = image_count;
+	header->file_length = file_length;
+
+	memcpy(header + 1, images, image_count*sizeof(Asset_Cache_Image));
+
+	for (u32 i = 0; i < image_count; ++i) {
+		SDL_Surface *surface = surfaces[i];
+		SDL_LockSurface(surface);
+		memcpy(contents + images[i].offset, surface->pixels, (umm)images[i].pitch*images[i].height);
+		SDL_UnlockSurface(surface);
+		SDL_FreeSurface(surface);
+	}
+
+	header->content_hash = hash64(contents + sizeof(Asset_Cache_Header), file_length - sizeof(Asset_Cache_Header), ASSET_CACHE_MAGIC);
+
+	FILE *file = fopen(cache_path, "wb");
+	if (!file || fwrite(contents, 1, file_length, file) != file_length || fclose(file) != 0) {
+		panic("Could not write '%s'\n", cache_path);
+	}
+
+	printf("Baked %u image(s) into '%s' (%llu bytes).\n", image_count, cache_path, file_length);
+
+	free(contents);
+	free(images);
+	free(surfaces);
+	return 0;
+}
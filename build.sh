@@ -7,7 +7,17 @@ compile_flags="$defines -g -O0 -std=c99 -Wall -Wextra -pedantic $(pkg-config --c
 link_flags="$(pkg-config --libs sdl2 SDL2_net) -lm"
 
 gcc $compile_flags fake_controller_server.c -o fake_controller_server.program $link_flags
+gcc $compile_flags controller_load.c -o controller_load.program $link_flags
 gcc $compile_flags 2d_car_main.c -o 2d_car.program $link_flags
+gcc $compile_flags asset_bake.c -o asset_bake.program $link_flags
+gcc $compile_flags scenario_bake.c -o scenario_bake.program $link_flags
+gcc $compile_flags controller_sweep.c -o controller_sweep.program $link_flags
+gcc $compile_flags controller_train.c -o controller_train.program $link_flags
+gcc $compile_flags recording_replay.c -o recording_replay.program $link_flags
+gcc $compile_flags recording_export.c -o recording_export.program $link_flags
+gcc $compile_flags -shared -fPIC example_controller_plugin.c -o example_controller_plugin.so $link_flags
+
+./asset_bake.program assets.cache car.bmp
 
 termite -e 'bash -c "./fake_controller_server.program"' &
 termite -e 'bash -c "./2d_car.program"'
\ No newline at end of file
@@ -0,0 +1,127 @@
+#ifndef CAR_ASSETS_H
+#define CAR_ASSETS_H
+
+#include "car_common.h"
+#include "car_file.h"
+
+//
+// Prebaked asset cache. asset_bake converts source images to the renderer's
+// pixel format once and packs them into a single file:
+//
+//   Asset_Cache_Header
+//   Asset_Cache_Image[image_count]
+//   pixels, each image starting on an ASSET_CACHE_ALIGNMENT boundary
+//
+// The simulator maps the file and uploads the pixels straight from the
+// mapping. Everything after the header is covered by content_hash. Each
+// image records its source's size and modification time at bake time, and
+// an image whose source has since changed is ignored.
+//
+
+#define ASSET_CACHE_MAGIC 0x31534143 // "CAS1"
+#define ASSET_CACHE_VERSION 2
+#define ASSET_CACHE_ALIGNMENT 64
+#define ASSET_NAME_LENGTH 48
+
+enum {
+	ASSET_IMAGE_HAS_ALPHA = 0x1,
+};
+
+typedef struct Asset_Cache_Header {
+	u32 magic;
+	u32 version;
+	u32 pixel_format; // SDL_PIXELFORMAT_* of all images
+	u32 image_count;
+	u64 file_length;
+	u64 content_hash; // hash64 of everything after the header
+} Asset_Cache_Header;
+
+typedef struct Asset_Cache_Image {
+	char name[ASSET_NAME_LENGTH]; // Source file name, zero terminated
+	u32 width;
+	u32 height;
+	u32 pitch;
+	u32 flags;
+	u64 offset; // From the start of the file
+	u64 source_size;
+	u64 source_modified_time; // In file_modified_time's units
+} Asset_Cache_Image;
+
+typedef struct Asset_Cache {
+	Mapped_File file;
+	Asset_Cache_Header *header;
+	Asset_Cache_Image *images;
+} Asset_Cache;
+
+static inline b32 asset_cache_open(Asset_Cache *cache, const char *path) {
+
+	*cache = (Asset_Cache){0};
+
+	if (!map_file_read_only(path, &cache->file)) {
+		return false;
+	}
+
+	Mapped_File *file = &cache->file;
+	Asset_Cache_Header *header = (Asset_Cache_Header *)file->data;
+
+	b32 valid = file->length >= sizeof(Asset_Cache_Header) &&
+		header->magic == ASSET_CACHE_MAGIC &&
+		header->version == ASSET_CACHE_VERSION &&
+		header->file_length == file->length &&
+		sizeof(Asset_Cache_Header) + (umm)header->image_count*sizeof(Asset_Cache_Image) <= file->length;
+
+	if (valid) {
+		u8 *content = file->data + sizeof(Asset_Cache_Header);
+		valid = header->content_hash == hash64(content, file->length - sizeof(Asset_Cache_Header), ASSET_CACHE_MAGIC);
+	}
+
+	if (valid) {
+		Asset_Cache_Image *images = (Asset_Cache_Image *)(header + 1);
+		for (u32 i = 0; i < header->image_count && valid; ++i) {
+			Asset_Cache_Image *image = &images[i];
+			valid = image->name[ASSET_NAME_LENGTH - 1] == 0 &&
+				image->offset + (umm)image->pitch*image->height <= file->length;
+		}
+	}
+
+	if (!valid) {
+		unmap_file(file);
+		return false;
+	}
+
+	cache->header = header;
+	cache->images = (Asset_Cache_Image *)(header + 1);
+	return true;
+}
+
+static inline void asset_cache_close(Asset_Cache *cache) {
+	unmap_file(&cache->file);
+	*cache = (Asset_Cache){0};
+}
+
+static inline Asset_Cache_Image *asset_cache_find(Asset_Cache *cache, const char *name) {
+	if (cache->header) {
+		for (u32 i = 0; i < cache->header->image_count; ++i) {
+			if (strcmp(cache->images[i].name, name) == 0) {
+				return &cache->images[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+// False if the source file has changed since the image was baked. A
+// missing source leaves the cache as the only copy, so it counts as current.
+static inline b32 asset_cache_image_current(Asset_Cache_Image *image) {
+	u64 modified_time = file_modified_time(image->name);
+	if (!modified_time) {
+		return true;
+	}
+	return modified_time == image->source_modified_time && file_size(image->name) == image->source_size;
+}
+
+static inline void *asset_cache_pixels(Asset_Cache *cache, Asset_Cache_Image *image) {
+	return cache->file.data + image->offset;
+}
+
+#endif // CAR_ASSETS_H
@@ -0,0 +1,251 @@
+#ifndef CAR_CHECKPOINT_H
+#define CAR_CHECKPOINT_H
+
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_compress.h"
+
+//
+// Checkpoints of the simulation: everything that decides how it continues,
+// so restoring one and stepping gives the same ticks as the original run.
+// A checkpoint is a Checkpoint_Header and one allocation holding the
+// arrays, each section starting on a CHECKPOINT_ALIGNMENT boundary:
+//
+//   CHECKPOINT_CARS               Car[car_count]
+//   CHECKPOINT_CONTROLLER_STATES  Controller_State[car_count]
+//   CHECKPOINT_INPUTS             Control_Input[car_count], the last tick's
+//   CHECKPOINT_GRID               u8[grid_width*grid_height] occupancy
+//   CHECKPOINT_MPC_PLANS          Control_Input[mpc_plan_count*mpc_horizon]
+//   CHECKPOINT_PLUGIN_STATES      plugin_state_size bytes per plugin state
+//
+// The caller fills the header counts, calls checkpoint_prepare for the
+// sections and copies its state in. Snapshots are reused without
+// allocating once they are large enough, and checkpoint_copy forks one
+// into as many branches as needed.
+//
+// Files are the header followed by the sections compressed with
+// lz_compress, which mostly saves on the occupancy grid and on idle cars.
+//
+
+#define CHECKPOINT_MAGIC 0x31504b43 // "CKP1"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_ALIGNMENT 64
+#define CHECKPOINT_NAME_LENGTH 64
+
+// Bounds on what a file may ask for, checked before anything is allocated
+#define CHECKPOINT_MAX_GRID_CELLS (1u << 28)
+#define CHECKPOINT_MAX_MPC_HORIZON (1u << 16)
+#define CHECKPOINT_MAX_PLUGIN_STATE_SIZE (1u << 20)
+
+typedef enum Checkpoint_Section {
+	CHECKPOINT_CARS,
+	CHECKPOINT_CONTROLLER_STATES,
+	CHECKPOINT_INPUTS,
+	CHECKPOINT_GRID,
+	CHECKPOINT_MPC_PLANS,
+	CHECKPOINT_PLUGIN_STATES,
+	CHECKPOINT_SECTION_COUNT
+} Checkpoint_Section;
+
+enum {
+	CHECKPOINT_HUMAN_CONTROL = 0x1,
+	CHECKPOINT_PLANNING = 0x2,
+	CHECKPOINT_LIDAR = 0x4,
+	CHECKPOINT_POLICY_QUANTIZED = 0x8,
+};
+
+typedef struct Checkpoint_Header {
+	u32 magic;
+	u32 version;
+	u32 car_size; // sizeof(Car), sizeof(Controller_State) and sizeof(Control_Input) of the writer
+	u32 controller_state_size;
+	u32 input_size;
+	u32 flags;
+
+	u64 tick; // The next tick to simulate
+	u32 car_count;
+	u32 player_controller; // Controller_Id
+	u32 fleet_controller;
+	u32 planner_lookahead;
+	float target_radius;
+
+	float camera_x;
+	float camera_y;
+	float camera_zoom;
+
+	s32 grid_width;
+	s32 grid_height;
+	float grid_cell_size;
+	float grid_origin_x;
+	float grid_origin_y;
+
+	u32 mpc_horizon;
+	u32 mpc_plan_count; // In cars
+	u64 mpc_seed;
+
+	char plugin_name[CHECKPOINT_NAME_LENGTH]; // Zero terminated, empty without plugin states
+	u32 plugin_state_size;
+	u32 plugin_state_count;
+
+	u64 payload_length;    // Of the sections, uncompressed
+	u64 compressed_length; // Of the payload in a file
+	u64 payload_hash;      // hash64 of the uncompressed sections
+} Checkpoint_Header;
+
+typedef struct Checkpoint {
+	Checkpoint_Header header;
+	umm offsets[CHECKPOINT_SECTION_COUNT];
+	u8 *data;
+	umm capacity;
+} Checkpoint;
+
+static inline umm checkpoint_section_length(Checkpoint_Header *header, Checkpoint_Section section) {
+	switch (section) {
+	case CHECKPOINT_CARS: return (umm)header->car_count*sizeof(Car);
+	case CHECKPOINT_CONTROLLER_STATES: return (umm)header->car_count*sizeof(Controller_State);
+	case CHECKPOINT_INPUTS: return (umm)header->car_count*sizeof(Control_Input);
+	case CHECKPOINT_GRID: return (umm)header->grid_width*header->grid_height;
+	case CHECKPOINT_MPC_PLANS: return (umm)header->mpc_plan_count*header->mpc_horizon*sizeof(Control_Input);
+	case CHECKPOINT_PLUGIN_STATES: return (umm)header->plugin_state_count*header->plugin_state_size;
+	case CHECKPOINT_SECTION_COUNT: break;
+	}
+	return 0;
+}
+
+static inline void *checkpoint_section(Checkpoint *checkpoint, Checkpoint_Section section) {
+	return checkpoint->data + checkpoint->offsets[section];
+}
+
+// Fills the section offsets for the counts in the header. Returns the
+// payload length.
+static inline umm checkpoint_layout(Checkpoint_Header *header, umm *offsets) {
+	umm offset = 0;
+	for (u32 i = 0; i < CHECKPOINT_SECTION_COUNT; ++i) {
+		offsets[i] = offset;
+		offset += checkpoint_section_length(header, i);
+		offset = (offset + CHECKPOINT_ALIGNMENT - 1) & ~(umm)(CHECKPOINT_ALIGNMENT - 1);
+	}
+	return offset;
+}
+
+// Lays out the sections for the counts in the header and makes room for them
+static inline void checkpoint_prepare(Checkpoint *checkpoint) {
+
+	Checkpoint_Header *header = &checkpoint->header;
+	header->magic = CHECKPOINT_MAGIC;
+	header->version = CHECKPOINT_VERSION;
+	header->car_size = sizeof(Car);
+	header->controller_state_size = sizeof(Controller_State);
+	header->input_size = sizeof(Control_Input);
+
+	umm offset = checkpoint_layout(header, checkpoint->offsets);
+	header->payload_length = offset;
+
+	if (offset > checkpoint->capacity) {
+		free(checkpoint->data);
+		checkpoint->data = malloc(offset);
+		checkpoint->capacity = offset;
+		if (!checkpoint->data) {
+			panic("Could not allocate %llu bytes for a checkpoint.\n", (unsigned long long)offset);
+		}
+	}
+
+	// Zero the padding, so equal states hash and compress the same
+	for (u32 i = 0; i < CHECKPOINT_SECTION_COUNT; ++i) {
+		umm end = checkpoint->offsets[i] + checkpoint_section_length(header, i);
+		umm next = i + 1 < CHECKPOINT_SECTION_COUNT ? checkpoint->offsets[i + 1] : offset;
+		memset(checkpoint->data + end, 0, next - end);
+	}
+}
+
+static inline void checkpoint_copy(Checkpoint *destination, Checkpoint *source) {
+	destination->header = source->header;
+	checkpoint_prepare(destination);
+	memcpy(destination->data, source->data, source->header.payload_length);
+}
+
+static inline void checkpoint_free(Checkpoint *checkpoint) {
+	free(checkpoint->data);
+	*checkpoint = (Checkpoint){0};
+}
+
+static inline b32 checkpoint_save(Checkpoint *checkpoint, const char *path) {
+
+	Checkpoint_Header header = checkpoint->header;
+	umm length = header.payload_length;
+
+	u8 *compressed = malloc(lz_bound(length));
+	u32 *hash_table = malloc(sizeof(u32) << LZ_HASH_BITS);
+	if (!compressed || !hash_table) {
+		panic("Could not allocate checkpoint compression buffers.\n");
+	}
+
+	header.compressed_length = lz_compress(checkpoint->data, length, compressed, hash_table);
+	header.payload_hash = hash64(checkpoint->data, length, CHECKPOINT_MAGIC);
+
+	FILE *file = fopen(path, "wb");
+	b32 result = file &&
+		fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(compressed, 1, header.compressed_length, file) == header.compressed_length;
+	if (file && fclose(file) != 0) {
+		result = false;
+	}
+
+	free(hash_table);
+	free(compressed);
+	return result;
+}
+
+// Decodes a checkpoint file held in memory. Leaves the checkpoint untouched
+// if it was written by a different build or is damaged.
+static inline b32 checkpoint_read(Checkpoint *checkpoint, const u8 *data, umm length) {
+
+	Checkpoint_Header header;
+	b32 valid = length >= sizeof(header);
+	if (valid) {
+		memcpy(&header, data, sizeof(header));
+		valid = header.magic == CHECKPOINT_MAGIC &&
+			header.version == CHECKPOINT_VERSION &&
+			header.car_size == sizeof(Car) &&
+			header.controller_state_size == sizeof(Controller_State) &&
+			header.input_size == sizeof(Control_Input) &&
+			header.car_count <= CONTROLLER_MAX_CARS &&
+			header.grid_width >= 0 && header.grid_height >= 0 &&
+			(u64)header.grid_width*header.grid_height <= CHECKPOINT_MAX_GRID_CELLS &&
+			header.mpc_plan_count <= header.car_count &&
+			header.mpc_horizon <= CHECKPOINT_MAX_MPC_HORIZON &&
+			header.plugin_state_count <= header.car_count &&
+			header.plugin_state_size <= CHECKPOINT_MAX_PLUGIN_STATE_SIZE &&
+			header.plugin_name[CHECKPOINT_NAME_LENGTH - 1] == 0 &&
+			header.compressed_length == length - sizeof(header) &&
+			// LZ expands by a bit under 256 times at best, which bounds the allocation
+			header.payload_length/512 <= header.compressed_length;
+	}
+
+	// With the counts bounded the layout cannot overflow, and it has to agree
+	// with the file before the payload is allocated
+	Checkpoint loaded = {0};
+	if (valid) {
+		loaded.header = header;
+		valid = checkpoint_layout(&header, loaded.offsets) == header.payload_length;
+	}
+	if (valid) {
+		loaded.data = malloc(header.payload_length);
+		loaded.capacity = header.payload_length;
+		valid = loaded.data &&
+			lz_decompress(data + sizeof(header), header.compressed_length, loaded.data, header.payload_length) == header.payload_length &&
+			hash64(loaded.data, header.payload_length, CHECKPOINT_MAGIC) == header.payload_hash;
+	}
+
+	if (!valid) {
+		checkpoint_free(&loaded);
+		return false;
+	}
+
+	checkpoint_free(checkpoint);
+	*checkpoint = loaded;
+	return true;
+}
+
+#endif // CAR_CHECKPOINT_H
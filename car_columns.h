@@ -0,0 +1,380 @@
+#ifndef CAR_COLUMNS_H
+#define CAR_COLUMNS_H
+
+#include "car_common.h"
+#include "car_file.h"
+
+//
+// Columnar telemetry files for offline analysis. Rows are cut into blocks of
+// up to block_rows rows, and each block stores every column as one
+// contiguous array:
+//
+//   Column_File_Header
+//   Column_Description[column_count]
+//   blocks, each column array starting on a COLUMN_ALIGNMENT boundary
+//   block table: per block a Column_Block and Column_Chunk[column_count]
+//
+// A chunk carries the minimum and maximum of its values, so a scan that
+// filters on a column skips whole blocks without touching their data, and
+// reading one column only pages in that column's arrays of the mapped file.
+// The bounds are doubles, exact for every type but u64, whose bounds are
+// rounded outwards so that skipping on them never loses a value.
+//
+// The block table and header.block_table_offset are written last, so a file
+// cut short by a crash is rejected rather than read partially.
+//
+
+#define COLUMN_FILE_MAGIC 0x314c4f43 // "COL1"
+#define COLUMN_FILE_VERSION 1
+#define COLUMN_ALIGNMENT 64
+#define COLUMN_NAME_LENGTH 24
+#define COLUMN_DEFAULT_BLOCK_ROWS 65536
+#define COLUMN_INITIAL_FILE_LENGTH (64ull << 20)
+
+typedef enum Column_Type {
+	COLUMN_U64 = 1,
+	COLUMN_U32 = 2,
+	COLUMN_F32 = 3,
+	COLUMN_S16 = 4,
+} Column_Type;
+
+typedef struct Column_File_Header {
+	u32 magic;
+	u32 version;
+	u32 column_count;
+	u32 block_count;
+	u64 row_count;
+	u64 block_table_offset; // From the start of the file, 0 until the file is complete
+	u32 block_rows;         // Rows per block, the last block may have fewer
+	u8 reserved[28];
+} Column_File_Header;
+
+typedef struct Column_Description {
+	char name[COLUMN_NAME_LENGTH]; // Zero terminated
+	u32 type;
+	u32 reserved;
+} Column_Description;
+
+typedef struct Column_Block {
+	u64 first_row;
+	u32 row_count;
+	u32 reserved;
+} Column_Block;
+
+typedef struct Column_Chunk {
+	u64 offset; // Of the column's values in the block, from the start of the file
+	double minimum;
+	double maximum;
+} Column_Chunk;
+
+typedef int check_column_file_header_size[sizeof(Column_File_Header) == 64 ? 1 : -1];
+
+static inline u32 column_type_size(Column_Type type) {
+	switch (type) {
+	case COLUMN_U64: return 8;
+	case COLUMN_U32: return 4;
+	case COLUMN_F32: return 4;
+	case COLUMN_S16: return 2;
+	}
+	return 0;
+}
+
+static inline double column_value(Column_Type type, const void *values, umm index) {
+	switch (type) {
+	case COLUMN_U64: return (double)((const u64 *)values)[index];
+	case COLUMN_U32: return ((const u32 *)values)[index];
+	case COLUMN_F32: return ((const float *)values)[index];
+	case COLUMN_S16: return ((const s16 *)values)[index];
+	}
+	return 0.0;
+}
+
+// The minimum and maximum of count >= 1 values, compared in their own type
+static inline void column_range(Column_Type type, const void *values, u32 count, double *minimum, double *maximum) {
+
+	if (type == COLUMN_U64) {
+		const u64 *integers = values;
+		u64 low = integers[0], high = integers[0];
+		for (u32 i = 1; i < count; ++i) {
+			low = integers[i] < low ? integers[i] : low;
+			high = integers[i] > high ? integers[i] : high;
+		}
+
+		// 2^64 is the only rounding result that does not convert back
+		double two_64 = 18446744073709551616.0;
+		*minimum = (double)low;
+		if (*minimum >= two_64 || (u64)*minimum > low) {
+			*minimum = nextafter(*minimum, 0.0);
+		}
+		*maximum = (double)high;
+		if (*maximum < two_64 && (u64)*maximum < high) {
+			*maximum = nextafter(*maximum, two_64);
+		}
+		return;
+	}
+
+	*minimum = *maximum = column_value(type, values, 0);
+	for (u32 i = 1; i < count; ++i) {
+		double value = column_value(type, values, i);
+		*minimum = value < *minimum ? value : *minimum;
+		*maximum = value > *maximum ? value : *maximum;
+	}
+}
+
+static inline umm column_block_table_stride(u32 column_count) {
+	return sizeof(Column_Block) + column_count*sizeof(Column_Chunk);
+}
+
+static inline Column_Chunk *column_block_chunks(Column_Block *block) {
+	return (Column_Chunk *)(block + 1);
+}
+
+
+//
+// Writing
+//
+
+typedef struct Column_Writer {
+	Mapped_Write_File file;
+	umm write_offset;
+
+	Column_Description *columns;
+	u32 column_count;
+	u32 block_rows;
+
+	u8 **staging;    // Per column, a block of values not written yet
+	u32 staged_rows;
+	u64 row_count;
+
+	u8 *block_table; // Grows with the blocks written
+	u32 block_count;
+	u32 block_capacity;
+} Column_Writer;
+
+static inline b32 column_writer_open(Column_Writer *writer, const char *path, const Column_Description *columns, u32 column_count, u32 block_rows) {
+
+	*writer = (Column_Writer){0};
+
+	if (!map_file_read_write(path, COLUMN_INITIAL_FILE_LENGTH, &writer->file)) {
+		return false;
+	}
+
+	writer->column_count = column_count;
+	writer->block_rows = block_rows;
+	writer->columns = malloc(column_count*sizeof(Column_Description));
+	writer->staging = calloc(column_count, sizeof(u8 *));
+	if (!writer->columns || !writer->staging) {
+		panic("Could not allocate column writer.\n");
+	}
+	memcpy(writer->columns, columns, column_count*sizeof(Column_Description));
+
+	for (u32 i = 0; i < column_count; ++i) {
+		writer->staging[i] = malloc((umm)block_rows*column_type_size(columns[i].type));
+		if (!writer->staging[i]) {
+			panic("Could not allocate column writer.\n");
+		}
+	}
+
+	Column_File_Header *header = (Column_File_Header *)writer->file.data;
+	*header = (Column_File_Header){0};
+	header->magic = COLUMN_FILE_MAGIC;
+	header->version = COLUMN_FILE_VERSION;
+	header->column_count = column_count;
+	header->block_rows = block_rows;
+	memcpy(header + 1, columns, column_count*sizeof(Column_Description));
+
+	writer->write_offset = sizeof(Column_File_Header) + column_count*sizeof(Column_Description);
+	return true;
+}
+
+// Returns room for length bytes at the end of the file, aligned to COLUMN_ALIGNMENT
+static inline u8 *column_writer_reserve(Column_Writer *writer, umm length) {
+
+	umm offset = (writer->write_offset + COLUMN_ALIGNMENT - 1) & ~(umm)(COLUMN_ALIGNMENT - 1);
+	umm needed = offset + length;
+
+	if (needed > writer->file.length) {
+		umm new_length = writer->file.length + writer->file.length/2;
+		new_length = new_length > needed ? new_length : needed;
+		if (!remap_write_file(&writer->file, new_length)) {
+			panic("Could not grow column file to %llu bytes.\n", (unsigned long long)new_length);
+		}
+	}
+
+	// Alignment padding stays zero, as the file is extended with zeros
+	writer->write_offset = needed;
+	return writer->file.data + offset;
+}
+
+static inline void column_writer_flush_block(Column_Writer *writer) {
+
+	if (writer->staged_rows == 0) {
+		return;
+	}
+
+	umm stride = column_block_table_stride(writer->column_count);
+	if (writer->block_count == writer->block_capacity) {
+		writer->block_capacity = writer->block_capacity ? 2*writer->block_capacity : 256;
+		writer->block_table = realloc(writer->block_table, writer->block_capacity*stride);
+		if (!writer->block_table) {
+			panic("Could not allocate column block table.\n");
+		}
+	}
+
+	Column_Block *block = (Column_Block *)(writer->block_table + writer->block_count*stride);
+	block->first_row = writer->row_count - writer->staged_rows;
+	block->row_count = writer->staged_rows;
+	block->reserved = 0;
+
+	for (u32 c = 0; c < writer->column_count; ++c) {
+		Column_Type type = writer->columns[c].type;
+		umm length = (umm)writer->staged_rows*column_type_size(type);
+		u8 *values = column_writer_reserve(writer, length);
+		memcpy(values, writer->staging[c], length);
+
+		Column_Chunk *chunk = &column_block_chunks(block)[c];
+		chunk->offset = values - writer->file.data;
+		column_range(type, values, writer->staged_rows, &chunk->minimum, &chunk->maximum);
+	}
+
+	++writer->block_count;
+	writer->staged_rows = 0;
+}
+
+// Appends count rows, given as one array per column
+static inline void column_writer_append(Column_Writer *writer, const void **columns, u32 count) {
+
+	u32 done = 0;
+	while (done < count) {
+		u32 room = writer->block_rows - writer->staged_rows;
+		u32 rows = count - done < room ? count - done : room;
+
+		for (u32 c = 0; c < writer->column_count; ++c) {
+			u32 size = column_type_size(writer->columns[c].type);
+			memcpy(writer->staging[c] + (umm)writer->staged_rows*size, (const u8 *)columns[c] + (umm)done*size, (umm)rows*size);
+		}
+
+		writer->staged_rows += rows;
+		writer->row_count += rows;
+		done += rows;
+
+		if (writer->staged_rows == writer->block_rows) {
+			column_writer_flush_block(writer);
+		}
+	}
+}
+
+// Writes the last block and the block table, then truncates the file.
+// Returns false if the file could not be completed.
+static inline b32 column_writer_close(Column_Writer *writer) {
+
+	b32 result = true;
+	if (writer->file.data) {
+		column_writer_flush_block(writer);
+
+		umm table_length = writer->block_count*column_block_table_stride(writer->column_count);
+		u8 *table = column_writer_reserve(writer, table_length);
+		memcpy(table, writer->block_table, table_length);
+
+		Column_File_Header *header = (Column_File_Header *)writer->file.data;
+		header->block_count = writer->block_count;
+		header->row_count = writer->row_count;
+		header->block_table_offset = table - writer->file.data;
+
+		result = unmap_write_file(&writer->file, writer->write_offset);
+	}
+
+	for (u32 c = 0; c < writer->column_count; ++c) {
+		free(writer->staging[c]);
+	}
+	free(writer->staging);
+	free(writer->columns);
+	free(writer->block_table);
+	*writer = (Column_Writer){0};
+	return result;
+}
+
+
+//
+// Reading
+//
+
+typedef struct Column_File {
+	Mapped_File file;
+	Column_File_Header *header;
+	Column_Description *columns;
+	u8 *block_table;
+	umm block_stride;
+} Column_File;
+
+static inline b32 column_file_open(Column_File *columns, const char *path) {
+
+	*columns = (Column_File){0};
+
+	if (!map_file_read_only(path, &columns->file)) {
+		return false;
+	}
+
+	Mapped_File *file = &columns->file;
+	Column_File_Header *header = (Column_File_Header *)file->data;
+	b32 valid = file->length >= sizeof(Column_File_Header) &&
+		header->magic == COLUMN_FILE_MAGIC &&
+		header->version == COLUMN_FILE_VERSION &&
+		header->block_table_offset != 0 &&
+		sizeof(Column_File_Header) + (umm)header->column_count*sizeof(Column_Description) <= file->length;
+
+	umm stride = valid ? column_block_table_stride(header->column_count) : 0;
+	valid = valid &&
+		header->block_table_offset <= file->length &&
+		(file->length - header->block_table_offset)/stride >= header->block_count;
+
+	Column_Description *descriptions = (Column_Description *)(header + 1);
+	for (u32 c = 0; valid && c < header->column_count; ++c) {
+		valid = descriptions[c].name[COLUMN_NAME_LENGTH - 1] == 0 && column_type_size(descriptions[c].type) != 0;
+	}
+
+	for (u32 b = 0; valid && b < header->block_count; ++b) {
+		Column_Block *block = (Column_Block *)(file->data + header->block_table_offset + b*stride);
+		for (u32 c = 0; valid && c < header->column_count; ++c) {
+			Column_Chunk *chunk = &column_block_chunks(block)[c];
+			valid = chunk->offset <= file->length &&
+				(file->length - chunk->offset)/column_type_size(descriptions[c].type) >= block->row_count;
+		}
+	}
+
+	if (!valid) {
+		unmap_file(file);
+		return false;
+	}
+
+	columns->header = header;
+	columns->columns = descriptions;
+	columns->block_table = file->data + header->block_table_offset;
+	columns->block_stride = stride;
+	return true;
+}
+
+static inline void column_file_close(Column_File *columns) {
+	unmap_file(&columns->file);
+	*columns = (Column_File){0};
+}
+
+// Index of the named column, or -1 if there is none
+static inline s32 column_file_find(Column_File *columns, const char *name) {
+	for (u32 c = 0; c < columns->header->column_count; ++c) {
+		if (strcmp(columns->columns[c].name, name) == 0) {
+			return (s32)c;
+		}
+	}
+	return -1;
+}
+
+static inline Column_Block *column_file_block(Column_File *columns, u32 index) {
+	return (Column_Block *)(columns->block_table + index*columns->block_stride);
+}
+
+static inline void *column_file_values(Column_File *columns, Column_Block *block, u32 column) {
+	return columns->file.data + column_block_chunks(block)[column].offset;
+}
+
+#endif // CAR_COLUMNS_H
@@ -0,0 +1,118 @@
+#ifndef CAR_COMMON_H
+#define CAR_COMMON_H
+
+// Shared by the simulator and the command line tools. Include this before
+// any other header so the feature test macro below takes effect.
+
+#ifndef _WIN32
+#define _DEFAULT_SOURCE // mmap, ftruncate and friends under -std=c99
+#endif
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define DEG_TO_RAD 0.017453292519943295f
+#define RAD_TO_DEG 57.29577951308232f
+#define TAU 6.283185307179586f
+#define PI 3.141592653589793f
+#define SQRT2 1.4142135623730951f
+
+#define LERP(a,b,t) ((1.0f-(t))*(a) + (t)*(b))
+
+typedef char s8;
+typedef short s16;
+typedef int s32;
+typedef long long s64;
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+typedef u32 b32;
+#ifndef __cplusplus
+enum {false = 0, true = 1};
+#endif
+
+typedef u64 umm;
+typedef s64 smm;
+
+typedef int check_size8[sizeof(u8)==1&&sizeof(s8)==1 ? 1 : -1];
+typedef int check_size16[sizeof(u16)==2&&sizeof(s16)==2 ? 1 : -1];
+typedef int check_size32[sizeof(u32)==4&&sizeof(s32)==4 ? 1 : -1];
+typedef int check_size64[sizeof(u64)==8&&sizeof(s64)==8 ? 1 : -1];
+typedef int check_sizeumm[sizeof(umm)==sizeof((void *)0) ? 1 : -1];
+typedef int check_sizesmm[sizeof(smm)==sizeof((void *)0) ? 1 : -1];
+
+
+typedef struct Length_Buffer {
+	umm length;
+	u8 *data;
+} Length_Buffer;
+
+
+__attribute__((noreturn)) static inline void panic(const char *format, ...) {
+	fprintf(stderr, "[ERROR] ");
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	exit(-1);
+}
+
+// Fast non-cryptographic 64 bit hash, eight bytes per step
+static inline u64 hash64(const void *data, umm length, u64 seed) {
+
+	const u8 *bytes = data;
+	u64 hash = seed ^ (length * 0x9e3779b97f4a7c15ull);
+
+	while (length >= 8) {
+		u64 word;
+		memcpy(&word, bytes, 8);
+		hash = (hash ^ word) * 0xbf58476d1ce4e5b9ull;
+		hash ^= hash >> 31;
+		bytes += 8;
+		length -= 8;
+	}
+
+	u64 tail = 0;
+	memcpy(&tail, bytes, length);
+	hash = (hash ^ tail) * 0x94d049bb133111ebull;
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ull;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+// Small seedable generator (PCG32) for tools that need repeatable runs
+typedef struct Random_Series {
+	u64 state;
+} Random_Series;
+
+static inline Random_Series random_seed(u64 seed) {
+	return (Random_Series){hash64(&seed, sizeof(seed), 0x72616e64)};
+}
+
+static inline u32 random_next(Random_Series *series) {
+	u64 state = series->state;
+	series->state = state*6364136223846793005ull + 1442695040888963407ull;
+	u32 shifted = (u32)(((state >> 18) ^ state) >> 27);
+	u32 rotation = (u32)(state >> 59);
+	return (shifted >> rotation) | (shifted << ((32 - rotation) & 31));
+}
+
+// [0, 1)
+static inline float random_unit(Random_Series *series) {
+	return (random_next(series) >> 8)*(1.0f/16777216.0f);
+}
+
+// [-1, 1)
+static inline float random_bilateral(Random_Series *series) {
+	return 2.0f*random_unit(series) - 1.0f;
+}
+
+#endif // CAR_COMMON_H
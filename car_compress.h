@@ -0,0 +1,177 @@
+#ifndef CAR_COMPRESS_H
+#define CAR_COMPRESS_H
+
+#include "car_common.h"
+
+//
+// Byte oriented LZ77 in the LZ4 block format: a sequence is a token whose
+// high nibble is the literal count and low nibble the match length minus
+// LZ_MIN_MATCH, either of which continues in 255-valued bytes when it is 15,
+// then the literals, then a 16 bit little endian match offset. The last
+// sequence has literals only. Greedy matching on a hash of four bytes, with
+// the search step growing over incompressible data.
+//
+// Runs compress to a match at offset 1, so zero planes cost a few bytes
+// per 64 KB.
+//
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 16
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 // The format ends in at least this many literals
+
+// Worst case compressed size
+static inline umm lz_bound(umm length) {
+	return length + length/255 + 16;
+}
+
+static inline u32 lz_read32(const u8 *p) {
+	u32 result;
+	memcpy(&result, p, 4);
+	return result;
+}
+
+static inline u32 lz_hash(u32 value) {
+	return (value*2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline u8 *lz_write_length(u8 *out, umm length) {
+	for (; length >= 255; length -= 255) {
+		*out++ = 255;
+	}
+	*out++ = (u8)length;
+	return out;
+}
+
+// hash_table holds 1 << LZ_HASH_BITS entries and needs no initialization.
+// destination must hold lz_bound(length) bytes. Returns the compressed size.
+static inline umm lz_compress(const u8 *source, umm length, u8 *destination, u32 *hash_table) {
+
+	const u8 *in = source;
+	const u8 *end = source + length;
+	const u8 *match_limit = length > LZ_LAST_LITERALS + LZ_MIN_MATCH ? end - LZ_LAST_LITERALS : source;
+	const u8 *literal_start = source;
+	u8 *out = destination;
+
+	memset(hash_table, 0, sizeof(u32) << LZ_HASH_BITS);
+
+	u32 misses = 0;
+	while (in + LZ_MIN_MATCH <= match_limit) {
+		u32 value = lz_read32(in);
+		u32 *slot = &hash_table[lz_hash(value)];
+		const u8 *candidate = source + *slot;
+		*slot = (u32)(in - source);
+
+		if (candidate >= in || in - candidate > LZ_MAX_OFFSET || lz_read32(candidate) != value) {
+			// Step further the longer nothing matched
+			in += 1 + (misses++ >> 6);
+			continue;
+		}
+		misses = 0;
+
+		// Extend backwards over pending literals, then forwards
+		while (in > literal_start && candidate > source && in[-1] == candidate[-1]) {
+			--in;
+			--candidate;
+		}
+		const u8 *match_end = in + LZ_MIN_MATCH;
+		const u8 *candidate_end = candidate + LZ_MIN_MATCH;
+		while (match_end < match_limit && *match_end == *candidate_end) {
+			++match_end;
+			++candidate_end;
+		}
+
+		umm literal_count = in - literal_start;
+		umm match_length = match_end - in - LZ_MIN_MATCH;
+		u8 *token = out++;
+		*token = (u8)((literal_count < 15 ? literal_count : 15) << 4 | (match_length < 15 ? match_length : 15));
+		if (literal_count >= 15) {
+			out = lz_write_length(out, literal_count - 15);
+		}
+		memcpy(out, literal_start, literal_count);
+		out += literal_count;
+
+		u16 offset = (u16)(in - candidate);
+		*out++ = (u8)offset;
+		*out++ = (u8)(offset >> 8);
+		if (match_length >= 15) {
+			out = lz_write_length(out, match_length - 15);
+		}
+
+		in = match_end;
+		literal_start = in;
+
+		// Index the end of the match so runs keep chaining
+		if (in - 2 >= source && in + 2 <= end) {
+			hash_table[lz_hash(lz_read32(in - 2))] = (u32)(in - 2 - source);
+		}
+	}
+
+	umm literal_count = end - literal_start;
+	*out++ = (u8)((literal_count < 15 ? literal_count : 15) << 4);
+	if (literal_count >= 15) {
+		out = lz_write_length(out, literal_count - 15);
+	}
+	memcpy(out, literal_start, literal_count);
+	out += literal_count;
+
+	return out - destination;
+}
+
+// Returns the decompressed size, or 0 if the input is malformed or does not
+// fit in capacity
+static inline umm lz_decompress(const u8 *source, umm length, u8 *destination, umm capacity) {
+
+	const u8 *in = source;
+	const u8 *end = source + length;
+	u8 *out = destination;
+	u8 *out_end = destination + capacity;
+
+	while (in < end) {
+		u8 token = *in++;
+
+		umm literal_count = token >> 4;
+		if (literal_count == 15) {
+			u8 byte;
+			do {
+				if (in >= end) return 0;
+				byte = *in++;
+				literal_count += byte;
+			} while (byte == 255);
+		}
+		if ((umm)(end - in) < literal_count || (umm)(out_end - out) < literal_count) return 0;
+		memcpy(out, in, literal_count);
+		in += literal_count;
+		out += literal_count;
+
+		if (in == end) break; // The last sequence has no match
+
+		if (end - in < 2) return 0;
+		umm offset = in[0] | (umm)in[1] << 8;
+		in += 2;
+
+		umm match_length = (token & 15);
+		if (match_length == 15) {
+			u8 byte;
+			do {
+				if (in >= end) return 0;
+				byte = *in++;
+				match_length += byte;
+			} while (byte == 255);
+		}
+		match_length += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > (umm)(out - destination) || (umm)(out_end - out) < match_length) return 0;
+
+		// Byte by byte, the source may overlap what is being written
+		const u8 *match = out - offset;
+		for (umm i = 0; i < match_length; ++i) {
+			out[i] = match[i];
+		}
+		out += match_length;
+	}
+
+	return out - destination;
+}
+
+#endif // CAR_COMPRESS_H
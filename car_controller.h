@@ -0,0 +1,336 @@
+#ifndef CAR_CONTROLLER_H
+#define CAR_CONTROLLER_H
+
+#include "car_common.h"
+
+#include <SDL2/SDL.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONTROLLER_HAS_AVX2_KERNEL 1
+#else
+#define CONTROLLER_HAS_AVX2_KERNEL 0
+#endif
+
+//
+// Controller data shared by the simulator, the controller server and the tools.
+//
+
+typedef struct Control_Input {
+	// Control_Input_Button_Flags buttons;
+	s16 acceleration_axis;
+	s16 turn_axis;
+} __attribute__((packed)) Control_Input;
+
+typedef struct Sensor_Data {
+	float delta_x;
+	float delta_y;
+	float heading_direction;
+	float velocity;
+	u64 time;
+} __attribute__((packed)) Sensor_Data;
+
+typedef struct Controller_State {
+	float acceleration_direction; // -1 for backwards or 1 for forwards
+	u32 mode_switch_time;
+} Controller_State;
+
+static inline Controller_State controller_state_initial(void) {
+	return (Controller_State){
+		1,
+		0
+	};
+}
+
+// Stable ids of the simulator's controllers, for files that name one
+typedef enum Controller_Id {
+	CONTROLLER_HUMAN,
+	CONTROLLER_PURSUIT,
+	CONTROLLER_REMOTE,
+	CONTROLLER_LOOKUP_TABLE,
+	CONTROLLER_MPC,
+	CONTROLLER_POLICY,
+	CONTROLLER_PLUGIN,
+	CONTROLLER_ID_COUNT
+} Controller_Id;
+
+//
+// UDP protocol. A request carries a batch of consecutive cars, the reply
+// echoes the header followed by one Control_Input per car. first_car lets
+// the server keep hysteresis state per car of each client.
+//
+
+#define CONTROLLER_DEFAULT_PORT 9001
+#define CONTROLLER_MAX_BATCH 48 // Keeps requests below a typical 1500 byte MTU
+#define CONTROLLER_MAX_CARS (1 << 17) // Per client, cars past it are refused
+
+typedef struct Controller_Packet_Header {
+	u32 sequence;
+	u32 first_car;
+	u32 count;
+} __attribute__((packed)) Controller_Packet_Header;
+
+#define CONTROLLER_MAX_PACKET_SIZE (sizeof(Controller_Packet_Header) + CONTROLLER_MAX_BATCH*sizeof(Sensor_Data))
+
+
+// A pure batch controller: the only state it may keep is Controller_State
+typedef void Controller_Kernel(u32 count, Sensor_Data *sensor_data, Controller_State *states, Control_Input *inputs);
+
+
+//
+// Pursuit controller
+//
+
+typedef struct Pursuit_Gains {
+	float slowdown_radius;  // Per unit of velocity, where braking for the target starts
+	float slowdown_scale;   // Throttle at the slowdown radius
+	float turn_threshold;   // Angle beyond which the wheel is turned fully
+	float turn_scale;       // Wheel turn at the threshold
+	float reverse_dot;      // Switch to reverse when the target is this far behind
+	float forward_dot;      // Switch back to forwards when it is this far ahead
+	float arrive_distance;  // Inputs stop within this distance
+} Pursuit_Gains;
+
+static inline Pursuit_Gains pursuit_gains_default(void) {
+	return (Pursuit_Gains){
+		200.0f,
+		0.5f,
+		0.75f*PI,
+		0.9f,
+		-0.8f,
+		0.5f,
+		10.0f,
+	};
+}
+
+// Reference implementation, also used where AVX2 is unavailable
+static inline void pursuit_controller_evaluate_scalar(const Pursuit_Gains *gains, u32 count, Sensor_Data *sensor_data, Controller_State *states, Control_Input *inputs) {
+
+	for (u32 i = 0; i < count; ++i) {
+		Sensor_Data sensors = sensor_data[i];
+		float acceleration_direction = states[i].acceleration_direction;
+
+		float angle_to_target = atan2f(sensors.delta_y, sensors.delta_x);
+		float angle_delta = angle_to_target - sensors.heading_direction;
+		if (angle_delta > PI) {
+			angle_delta -= TAU;
+		}
+		else if (angle_delta < -PI) {
+			angle_delta += TAU;
+		}
+
+		float abs_angle_delta = fabsf(angle_delta);
+		assert(abs_angle_delta < (TAU+0.0001f));
+
+
+		float heading_x = cosf(sensors.heading_direction);
+		float heading_y = sinf(sensors.heading_direction);
+		float distance_to_target = sqrtf(sensors.delta_x*sensors.delta_x + sensors.delta_y*sensors.delta_y);
+		float dot = (sensors.delta_x*heading_x + sensors.delta_y*heading_y) / distance_to_target;
+
+		float acceleration_factor = 1.0f;
+		if (distance_to_target < gains->slowdown_radius*sensors.velocity) {
+			acceleration_factor = distance_to_target/(gains->slowdown_radius*sensors.velocity);
+			acceleration_factor *= acceleration_factor * acceleration_factor * gains->slowdown_scale;
+		}
+
+		float turn_factor = 1.0;
+		{
+			float threshold = gains->turn_threshold;
+			if (abs_angle_delta < threshold) {
+				turn_factor = abs_angle_delta/threshold;
+				turn_factor *= turn_factor * turn_factor * gains->turn_scale;
+			}
+		}
+
+		Control_Input result = {0};
+
+		if (distance_to_target > gains->arrive_distance) {
+
+			assert(dot > -1.00001f && dot < 1.00001f);
+
+			if (acceleration_direction > 0.0f && (dot < gains->reverse_dot)) {
+				acceleration_direction = -1.0f;
+			}
+			else if (acceleration_direction < 0.0f && (dot > gains->forward_dot)) {
+				acceleration_direction = 1.0f;
+			}
+
+			result.acceleration_axis = 0x7fff * acceleration_factor * acceleration_direction;
+			result.turn_axis = 0x7fff * turn_factor * acceleration_direction * ((angle_delta > 0) ? 1.0f : -1.0f);
+		}
+
+		states[i].acceleration_direction = acceleration_direction;
+		inputs[i] = result;
+	}
+}
+
+#if CONTROLLER_HAS_AVX2_KERNEL
+
+#define CONTROLLER_AVX2 __attribute__((target("avx2")))
+
+// The gathers and the packed store below rely on these layouts
+typedef int check_sensor_stride[sizeof(Sensor_Data) == 6*sizeof(float) ? 1 : -1];
+typedef int check_state_stride[sizeof(Controller_State) == 2*sizeof(float) ? 1 : -1];
+typedef int check_input_size[sizeof(Control_Input) == sizeof(u32) ? 1 : -1];
+
+// atan2 with a minimax polynomial on [0, 1], about 1e-5 rad max error
+CONTROLLER_AVX2 static inline __m256 atan2_approx_avx2(__m256 y, __m256 x) {
+	__m256 sign_mask = _mm256_set1_ps(-0.0f);
+	__m256 abs_x = _mm256_andnot_ps(sign_mask, x);
+	__m256 abs_y = _mm256_andnot_ps(sign_mask, y);
+
+	__m256 numerator = _mm256_min_ps(abs_x, abs_y);
+	__m256 denominator = _mm256_max_ps(_mm256_max_ps(abs_x, abs_y), _mm256_set1_ps(1e-30f));
+	__m256 a = _mm256_div_ps(numerator, denominator);
+	__m256 s = _mm256_mul_ps(a, a);
+
+	__m256 r = _mm256_set1_ps(-0.0117212f);
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(0.05265332f));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(-0.11643287f));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(0.19354346f));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(-0.33262347f));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(0.99997726f));
+	r = _mm256_mul_ps(r, a);
+
+	r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(0.5f*PI), r), _mm256_cmp_ps(abs_y, abs_x, _CMP_GT_OQ));
+	r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(PI), r), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+	r = _mm256_or_ps(r, _mm256_and_ps(y, sign_mask));
+
+	return r;
+}
+
+// cos on [-pi, pi], folded to [0, pi/2] and evaluated with a Taylor polynomial
+CONTROLLER_AVX2 static inline __m256 cos_approx_avx2(__m256 x) {
+	__m256 abs_x = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+	__m256 upper_half = _mm256_cmp_ps(abs_x, _mm256_set1_ps(0.5f*PI), _CMP_GT_OQ);
+	abs_x = _mm256_blendv_ps(abs_x, _mm256_sub_ps(_mm256_set1_ps(PI), abs_x), upper_half);
+
+	__m256 s = _mm256_mul_ps(abs_x, abs_x);
+	__m256 r = _mm256_set1_ps(1.0f/40320.0f);
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(-1.0f/720.0f));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(1.0f/24.0f));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(-0.5f));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(1.0f));
+
+	return _mm256_xor_ps(r, _mm256_and_ps(upper_half, _mm256_set1_ps(-0.0f)));
+}
+
+// Eight cars per iteration. The direction-to-target dot product is
+// cos(angle_delta), which saves evaluating sin and cos of the heading.
+// The tail is padded into a full group so every car sees the same math.
+CONTROLLER_AVX2 static void pursuit_controller_evaluate_avx2(const Pursuit_Gains *gains, u32 count, Sensor_Data *sensor_data, Controller_State *states, Control_Input *inputs) {
+
+	__m256i sensor_index = _mm256_setr_epi32(0, 6, 12, 18, 24, 30, 36, 42);
+	__m256i state_index = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+
+	__m256 zero = _mm256_setzero_ps();
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 minus_one = _mm256_set1_ps(-1.0f);
+	__m256 pi = _mm256_set1_ps(PI);
+	__m256 tau = _mm256_set1_ps(TAU);
+	__m256 threshold = _mm256_set1_ps(gains->turn_threshold);
+	__m256 inverse_threshold = _mm256_set1_ps(1.0f/gains->turn_threshold);
+	__m256 axis_scale = _mm256_set1_ps(0x7fff);
+
+	for (u32 i = 0; i < count; i += 8) {
+
+		Sensor_Data padded_sensors[8];
+		Controller_State padded_states[8];
+		Sensor_Data *group_sensors = sensor_data + i;
+		Controller_State *group_states = states + i;
+		u32 lanes = count - i < 8 ? count - i : 8;
+
+		if (lanes < 8) {
+			for (u32 lane = 0; lane < 8; ++lane) {
+				padded_sensors[lane] = lane < lanes ? group_sensors[lane] : (Sensor_Data){1, 0, 0, 0, 0};
+				padded_states[lane] = lane < lanes ? group_states[lane] : controller_state_initial();
+			}
+			group_sensors = padded_sensors;
+			group_states = padded_states;
+		}
+
+		u8 *sensor_bytes = (u8 *)group_sensors; // Gathers need no alignment
+		float *sensor_base = (float *)sensor_bytes;
+		__m256 delta_x = _mm256_i32gather_ps(sensor_base + 0, sensor_index, 4);
+		__m256 delta_y = _mm256_i32gather_ps(sensor_base + 1, sensor_index, 4);
+		__m256 heading = _mm256_i32gather_ps(sensor_base + 2, sensor_index, 4);
+		__m256 velocity = _mm256_i32gather_ps(sensor_base + 3, sensor_index, 4);
+		__m256 direction = _mm256_i32gather_ps((float *)group_states, state_index, 4);
+
+		__m256 angle_delta = _mm256_sub_ps(atan2_approx_avx2(delta_y, delta_x), heading);
+		angle_delta = _mm256_sub_ps(angle_delta, _mm256_and_ps(_mm256_cmp_ps(angle_delta, pi, _CMP_GT_OQ), tau));
+		angle_delta = _mm256_add_ps(angle_delta, _mm256_and_ps(_mm256_cmp_ps(angle_delta, _mm256_sub_ps(zero, pi), _CMP_LT_OQ), tau));
+		__m256 abs_angle_delta = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), angle_delta);
+
+		__m256 distance = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(delta_x, delta_x), _mm256_mul_ps(delta_y, delta_y)));
+		__m256 dot = cos_approx_avx2(angle_delta);
+
+		__m256 slowdown_radius = _mm256_mul_ps(_mm256_set1_ps(gains->slowdown_radius), velocity);
+		__m256 ratio = _mm256_div_ps(distance, slowdown_radius);
+		__m256 acceleration_factor = _mm256_mul_ps(_mm256_mul_ps(ratio, ratio), _mm256_mul_ps(ratio, _mm256_set1_ps(gains->slowdown_scale)));
+		acceleration_factor = _mm256_blendv_ps(one, acceleration_factor, _mm256_cmp_ps(distance, slowdown_radius, _CMP_LT_OQ));
+
+		__m256 turn_ratio = _mm256_mul_ps(abs_angle_delta, inverse_threshold);
+		__m256 turn_factor = _mm256_mul_ps(_mm256_mul_ps(turn_ratio, turn_ratio), _mm256_mul_ps(turn_ratio, _mm256_set1_ps(gains->turn_scale)));
+		turn_factor = _mm256_blendv_ps(one, turn_factor, _mm256_cmp_ps(abs_angle_delta, threshold, _CMP_LT_OQ));
+
+		// Hysteresis: switch to reverse below reverse_dot, back to forwards above forward_dot
+		__m256 active = _mm256_cmp_ps(distance, _mm256_set1_ps(gains->arrive_distance), _CMP_GT_OQ);
+		__m256 forwards = _mm256_cmp_ps(direction, zero, _CMP_GT_OQ);
+		__m256 backwards = _mm256_cmp_ps(direction, zero, _CMP_LT_OQ);
+		__m256 to_reverse = _mm256_and_ps(active, _mm256_and_ps(forwards, _mm256_cmp_ps(dot, _mm256_set1_ps(gains->reverse_dot), _CMP_LT_OQ)));
+		__m256 to_forwards = _mm256_and_ps(active, _mm256_and_ps(backwards, _mm256_cmp_ps(dot, _mm256_set1_ps(gains->forward_dot), _CMP_GT_OQ)));
+		direction = _mm256_blendv_ps(direction, minus_one, to_reverse);
+		direction = _mm256_blendv_ps(direction, one, to_forwards);
+
+		__m256 turn_sign = _mm256_blendv_ps(minus_one, one, _mm256_cmp_ps(angle_delta, zero, _CMP_GT_OQ));
+		__m256 acceleration_axis = _mm256_and_ps(active, _mm256_mul_ps(_mm256_mul_ps(axis_scale, acceleration_factor), direction));
+		__m256 turn_axis = _mm256_and_ps(active, _mm256_mul_ps(_mm256_mul_ps(axis_scale, turn_factor), _mm256_mul_ps(direction, turn_sign)));
+
+		// Truncate like the scalar float to s16 conversion and pack both axes into one u32 per car
+		__m256i acceleration_bits = _mm256_and_si256(_mm256_cvttps_epi32(acceleration_axis), _mm256_set1_epi32(0xffff));
+		__m256i turn_bits = _mm256_slli_epi32(_mm256_cvttps_epi32(turn_axis), 16);
+		__m256i packed = _mm256_or_si256(acceleration_bits, turn_bits);
+
+		float new_direction[8];
+		_mm256_storeu_ps(new_direction, direction);
+
+		if (lanes == 8) {
+			_mm256_storeu_si256((__m256i *)(inputs + i), packed);
+		}
+		else {
+			u32 packed_inputs[8];
+			_mm256_storeu_si256((__m256i *)packed_inputs, packed);
+			memcpy(inputs + i, packed_inputs, lanes*sizeof(Control_Input));
+		}
+
+		for (u32 lane = 0; lane < lanes; ++lane) {
+			states[i + lane].acceleration_direction = new_direction[lane];
+		}
+	}
+}
+
+#endif // CONTROLLER_HAS_AVX2_KERNEL
+
+// Picks the AVX2 kernel when the CPU supports it
+static inline void pursuit_controller_evaluate_with_gains(const Pursuit_Gains *gains, u32 count, Sensor_Data *sensor_data, Controller_State *states, Control_Input *inputs) {
+#if CONTROLLER_HAS_AVX2_KERNEL
+	static int has_avx2 = -1;
+	if (has_avx2 < 0) {
+		has_avx2 = SDL_HasAVX2();
+	}
+	if (has_avx2) {
+		pursuit_controller_evaluate_avx2(gains, count, sensor_data, states, inputs);
+		return;
+	}
+#endif
+	pursuit_controller_evaluate_scalar(gains, count, sensor_data, states, inputs);
+}
+
+static inline void pursuit_controller_evaluate(u32 count, Sensor_Data *sensor_data, Controller_State *states, Control_Input *inputs) {
+	Pursuit_Gains gains = pursuit_gains_default();
+	pursuit_controller_evaluate_with_gains(&gains, count, sensor_data, states, inputs);
+}
+
+#endif // CAR_CONTROLLER_H
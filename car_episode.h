@@ -0,0 +1,231 @@
+#ifndef CAR_EPISODE_H
+#define CAR_EPISODE_H
+
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+
+#include <stddef.h>
+
+//
+// Headless episodes for the tuning tools: one car per scenario, driven by a
+// batch controller from a start pose to a fixed target for a number of
+// ticks. All scenarios of a run step together so the controller sees them
+// as one batch.
+//
+
+typedef struct Episode_Scenario {
+	float start_direction;
+	float start_velocity;
+	float target_x; // Relative to the start, which is the origin
+	float target_y;
+} Episode_Scenario;
+
+typedef struct Episode_Metrics {
+	b32 reached;
+	u32 ticks_to_target; // First tick within the arrive radius, max_ticks if never
+	float overshoot;     // Furthest the car strayed from the target after reaching it
+	float path_length;   // Distance driven until reaching the target, or in total
+	float final_distance;
+} Episode_Metrics;
+
+typedef struct Episode_Settings {
+	u32 max_ticks;
+	float arrive_radius;
+} Episode_Settings;
+
+// Mean metrics over a run of scenarios
+typedef struct Episode_Summary {
+	float success_rate;
+	float mean_ticks_to_target; // Over the scenarios that reached the target
+	float mean_overshoot;
+	float mean_path_length;
+	float mean_final_distance;
+	float cost; // Lower is better, see episode_summarize
+} Episode_Summary;
+
+// Everything the tools tune: the pursuit gains and the car
+typedef struct Episode_Configuration {
+	Pursuit_Gains gains;
+	Car car;
+} Episode_Configuration;
+
+typedef struct Episode_Parameter {
+	const char *name;
+	umm offset; // Of the float in Episode_Configuration
+	float minimum;
+	float maximum;
+} Episode_Parameter;
+
+static const Episode_Parameter episode_parameters[] = {
+	{"slowdown_radius", offsetof(Episode_Configuration, gains.slowdown_radius),  50.0f,    400.0f},
+	{"slowdown_scale",  offsetof(Episode_Configuration, gains.slowdown_scale),   0.1f,     1.0f},
+	{"turn_threshold",  offsetof(Episode_Configuration, gains.turn_threshold),   0.25f*PI, PI},
+	{"turn_scale",      offsetof(Episode_Configuration, gains.turn_scale),       0.3f,     1.0f},
+	{"reverse_dot",     offsetof(Episode_Configuration, gains.reverse_dot),      -1.0f,    -0.3f},
+	{"forward_dot",     offsetof(Episode_Configuration, gains.forward_dot),      0.0f,     0.9f},
+	{"acceleration",    offsetof(Episode_Configuration, car.acceleration),       0.04f,    0.16f},
+	{"turning_rate",    offsetof(Episode_Configuration, car.turning_rate),       0.1f,     0.6f},
+	{"turning_span",    offsetof(Episode_Configuration, car.turning_span),       0.6f,     1.5f},
+};
+
+#define EPISODE_PARAMETER_COUNT (sizeof(episode_parameters)/sizeof(episode_parameters[0]))
+
+static inline Episode_Configuration episode_default_configuration(void) {
+	return (Episode_Configuration){pursuit_gains_default(), car_default(0.0f, 0.0f)};
+}
+
+static inline float *episode_parameter_field(Episode_Configuration *configuration, u32 parameter) {
+	return (float *)((u8 *)configuration + episode_parameters[parameter].offset);
+}
+
+typedef void Episode_Controller(void *user_data, u32 count, Sensor_Data *sensor_data, Controller_State *states, Control_Input *inputs);
+
+static inline Episode_Settings episode_default_settings(void) {
+	return (Episode_Settings){1200, 60.0f};
+}
+
+// Targets between min_distance and max_distance in any direction, random
+// initial heading and a little initial speed
+static inline void episode_generate_scenarios(Episode_Scenario *scenarios, u32 count, u64 seed, float min_distance, float max_distance) {
+	Random_Series series = random_seed(seed);
+	for (u32 i = 0; i < count; ++i) {
+		float angle = TAU*random_unit(&series);
+		float distance = LERP(min_distance, max_distance, random_unit(&series));
+		scenarios[i].start_direction = PI*random_bilateral(&series);
+		scenarios[i].start_velocity = 2.0f*random_unit(&series);
+		scenarios[i].target_x = cosf(angle)*distance;
+		scenarios[i].target_y = sinf(angle)*distance;
+	}
+}
+
+// One scenario per car: its start heading and speed, and its target relative
+// to where it starts
+static inline void episode_scenarios_from_cars(Episode_Scenario *scenarios, const Car *cars, u32 count) {
+	for (u32 i = 0; i < count; ++i) {
+		scenarios[i].start_direction = cars[i].direction;
+		scenarios[i].start_velocity = cars[i].velocity;
+		scenarios[i].target_x = cars[i].target_x - cars[i].x;
+		scenarios[i].target_y = cars[i].target_y - cars[i].y;
+	}
+}
+
+static inline void episode_run(Car model, Episode_Scenario *scenarios, u32 count, Episode_Settings settings,
+	Episode_Controller *controller, void *user_data, Episode_Metrics *metrics) {
+
+	Car *cars = malloc(count*sizeof(Car));
+	Sensor_Data *sensors = malloc(count*sizeof(Sensor_Data));
+	Controller_State *states = malloc(count*sizeof(Controller_State));
+	Control_Input *inputs = malloc(count*sizeof(Control_Input));
+	if (!cars || !sensors || !states || !inputs) {
+		panic("Could not allocate episode.\n");
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		cars[i] = model;
+		cars[i].x = 0.0f;
+		cars[i].y = 0.0f;
+		cars[i].direction = scenarios[i].start_direction;
+		cars[i].velocity = scenarios[i].start_velocity;
+		cars[i].target_x = scenarios[i].target_x;
+		cars[i].target_y = scenarios[i].target_y;
+		states[i] = controller_state_initial();
+		inputs[i] = (Control_Input){0};
+		metrics[i] = (Episode_Metrics){0};
+		metrics[i].ticks_to_target = settings.max_ticks;
+	}
+
+	for (u32 tick = 0; tick < settings.max_ticks; ++tick) {
+		for (u32 i = 0; i < count; ++i) {
+			sensors[i] = (Sensor_Data){
+				cars[i].target_x - cars[i].x,
+				cars[i].target_y - cars[i].y,
+				cars[i].direction,
+				cars[i].velocity,
+				tick,
+			};
+		}
+
+		controller(user_data, count, sensors, states, inputs);
+
+		for (u32 i = 0; i < count; ++i) {
+			Car *car = &cars[i];
+			Episode_Metrics *car_metrics = &metrics[i];
+			float previous_x = car->x;
+			float previous_y = car->y;
+
+			update_car(car, inputs[i]);
+
+			if (!car_metrics->reached) {
+				car_metrics->path_length += sqrtf((car->x - previous_x)*(car->x - previous_x) + (car->y - previous_y)*(car->y - previous_y));
+			}
+
+			float dx = car->target_x - car->x;
+			float dy = car->target_y - car->y;
+			float distance = sqrtf(dx*dx + dy*dy);
+
+			if (!car_metrics->reached && distance < settings.arrive_radius) {
+				car_metrics->reached = true;
+				car_metrics->ticks_to_target = tick + 1;
+			}
+			else if (car_metrics->reached && distance > car_metrics->overshoot) {
+				car_metrics->overshoot = distance;
+			}
+			car_metrics->final_distance = distance;
+		}
+	}
+
+	free(inputs);
+	free(states);
+	free(sensors);
+	free(cars);
+}
+
+// The cost charges a failed scenario the whole episode plus its remaining
+// distance, so any success beats any failure, then adds half the overshoot
+static inline Episode_Summary episode_summarize(Episode_Metrics *metrics, u32 count, Episode_Settings settings) {
+	Episode_Summary summary = {0};
+	u32 reached_count = 0;
+
+	for (u32 i = 0; i < count; ++i) {
+		if (metrics[i].reached) {
+			++reached_count;
+			summary.mean_ticks_to_target += metrics[i].ticks_to_target;
+			summary.mean_overshoot += metrics[i].overshoot;
+			summary.cost += metrics[i].ticks_to_target + 0.5f*metrics[i].overshoot;
+		}
+		else {
+			summary.cost += settings.max_ticks + metrics[i].final_distance;
+		}
+		summary.mean_path_length += metrics[i].path_length;
+		summary.mean_final_distance += metrics[i].final_distance;
+	}
+
+	summary.success_rate = (float)reached_count/count;
+	summary.mean_ticks_to_target = reached_count ? summary.mean_ticks_to_target/reached_count : (float)settings.max_ticks;
+	summary.mean_overshoot = reached_count ? summary.mean_overshoot/reached_count : 0.0f;
+	summary.mean_path_length /= count;
+	summary.mean_final_distance /= count;
+	summary.cost /= count;
+	return summary;
+}
+
+static inline void episode_pursuit_controller(void *user_data, u32 count, Sensor_Data *sensor_data, Controller_State *states, Control_Input *inputs) {
+	pursuit_controller_evaluate_with_gains(user_data, count, sensor_data, states, inputs);
+}
+
+// Runs every scenario with the configuration's car and the pursuit controller
+static inline Episode_Summary episode_evaluate(Episode_Configuration *configuration, Episode_Scenario *scenarios, u32 count, Episode_Settings settings) {
+	Episode_Metrics *metrics = malloc(count*sizeof(Episode_Metrics));
+	if (!metrics) {
+		panic("Could not allocate episode metrics.\n");
+	}
+
+	episode_run(configuration->car, scenarios, count, settings, episode_pursuit_controller, &configuration->gains, metrics);
+	Episode_Summary summary = episode_summarize(metrics, count, settings);
+
+	free(metrics);
+	return summary;
+}
+
+#endif // CAR_EPISODE_H
@@ -0,0 +1,333 @@
+#ifndef CAR_FILE_H
+#define CAR_FILE_H
+
+#include "car_common.h"
+
+#if defined(_WIN32) || defined(WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A read-only view of a whole file. The pages are shared with the OS file
+// cache, so nothing is copied until the data is touched.
+typedef struct Mapped_File {
+	umm length;
+	u8 *data;
+#if defined(_WIN32) || defined(WIN32)
+	HANDLE file_handle;
+	HANDLE mapping_handle;
+#endif
+} Mapped_File;
+
+// A shared writable mapping of a file being written. The file is sized to
+// the mapping, so callers grow it in large steps and truncate it to the used
+// length when done. Stores land in the OS file cache and survive the
+// process crashing.
+//
+// On POSIX the mapping reserves MAPPED_WRITE_FILE_RESERVE of address space
+// up front and growing only extends the file, so data never moves. Windows
+// cannot map past the end of a file and remaps instead.
+#define MAPPED_WRITE_FILE_RESERVE (1ull << 40)
+
+typedef struct Mapped_Write_File {
+	umm length;
+	u8 *data;
+#if defined(_WIN32) || defined(WIN32)
+	HANDLE file_handle;
+	HANDLE mapping_handle;
+#else
+	int fd;
+	umm reserved; // Bytes of address space mapped
+#endif
+} Mapped_Write_File;
+
+static inline Length_Buffer read_entire_file(const char *path) {
+
+	Length_Buffer result = {0};
+
+	FILE *file = fopen(path, "rb");
+
+	if (file) {
+
+		fseek(file, 0, SEEK_END);
+		long length = ftell(file);
+		fseek(file, 0, SEEK_SET);
+
+		// One byte for empty files, so success always has data
+		u8 *contents = length >= 0 ? malloc(length ? (umm)length : 1) : NULL;
+
+		if (contents && fread(contents, 1, (umm)length, file) == (umm)length) {
+			result.length = (umm)length;
+			result.data = contents;
+		} else {
+			free(contents);
+		}
+		fclose(file);
+	}
+
+	return result;
+}
+
+#if defined(_WIN32) || defined(WIN32)
+
+// Last modification time in platform units, 0 if the file does not exist
+static inline u64 file_modified_time(const char *path) {
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attributes)) {
+		return 0;
+	}
+	return ((u64)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+}
+
+// Size in bytes, 0 if the file does not exist
+static inline u64 file_size(const char *path) {
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attributes)) {
+		return 0;
+	}
+	return ((u64)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+}
+
+static inline b32 map_file_read_only(const char *path, Mapped_File *result) {
+
+	*result = (Mapped_File){0};
+
+	result->file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (result->file_handle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(result->file_handle, &size) || size.QuadPart == 0) {
+		CloseHandle(result->file_handle);
+		return false;
+	}
+
+	result->mapping_handle = CreateFileMappingA(result->file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!result->mapping_handle) {
+		CloseHandle(result->file_handle);
+		return false;
+	}
+
+	result->data = MapViewOfFile(result->mapping_handle, FILE_MAP_READ, 0, 0, 0);
+	if (!result->data) {
+		CloseHandle(result->mapping_handle);
+		CloseHandle(result->file_handle);
+		return false;
+	}
+
+	result->length = size.QuadPart;
+	return true;
+}
+
+static inline void unmap_file(Mapped_File *file) {
+	if (file->data) {
+		UnmapViewOfFile(file->data);
+		CloseHandle(file->mapping_handle);
+		CloseHandle(file->file_handle);
+	}
+	*file = (Mapped_File){0};
+}
+
+// Maps [0, length) of the open file, extending it as needed
+static inline b32 map_write_file_view(Mapped_Write_File *file, umm length) {
+	file->mapping_handle = CreateFileMappingA(file->file_handle, NULL, PAGE_READWRITE, (DWORD)(length >> 32), (DWORD)length, NULL);
+	if (!file->mapping_handle) {
+		return false;
+	}
+	file->data = MapViewOfFile(file->mapping_handle, FILE_MAP_WRITE, 0, 0, length);
+	if (!file->data) {
+		CloseHandle(file->mapping_handle);
+		file->mapping_handle = NULL;
+		return false;
+	}
+	file->length = length;
+	return true;
+}
+
+static inline void unmap_write_file_view(Mapped_Write_File *file) {
+	if (file->data) {
+		UnmapViewOfFile(file->data);
+		CloseHandle(file->mapping_handle);
+	}
+	file->data = NULL;
+	file->mapping_handle = NULL;
+}
+
+// Creates or truncates the file and maps its first `length` bytes
+static inline b32 map_file_read_write(const char *path, umm length, Mapped_Write_File *result) {
+
+	*result = (Mapped_Write_File){0};
+
+	result->file_handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (result->file_handle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	if (!map_write_file_view(result, length)) {
+		CloseHandle(result->file_handle);
+		*result = (Mapped_Write_File){0};
+		return false;
+	}
+	return true;
+}
+
+// The mapping may move, so pointers into data are invalidated
+static inline b32 remap_write_file(Mapped_Write_File *file, umm length) {
+	unmap_write_file_view(file);
+	return map_write_file_view(file, length);
+}
+
+// Returns false if the file could not be truncated to final_length
+static inline b32 unmap_write_file(Mapped_Write_File *file, umm final_length) {
+	b32 result = true;
+	if (file->file_handle && file->file_handle != INVALID_HANDLE_VALUE) {
+		unmap_write_file_view(file);
+
+		LARGE_INTEGER end;
+		end.QuadPart = final_length;
+		result = SetFilePointerEx(file->file_handle, end, NULL, FILE_BEGIN) && SetEndOfFile(file->file_handle);
+		CloseHandle(file->file_handle);
+	}
+	*file = (Mapped_Write_File){0};
+	return result;
+}
+
+#else
+
+// Last modification time in platform units, 0 if the file does not exist
+static inline u64 file_modified_time(const char *path) {
+	struct stat file_stat;
+	if (stat(path, &file_stat) != 0) {
+		return 0;
+	}
+	return (u64)file_stat.st_mtim.tv_sec*1000000000ull + file_stat.st_mtim.tv_nsec;
+}
+
+// Size in bytes, 0 if the file does not exist
+static inline u64 file_size(const char *path) {
+	struct stat file_stat;
+	if (stat(path, &file_stat) != 0) {
+		return 0;
+	}
+	return (u64)file_stat.st_size;
+}
+
+static inline b32 map_file_read_only(const char *path, Mapped_File *result) {
+
+	*result = (Mapped_File){0};
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	void *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps its own reference
+
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	result->length = file_stat.st_size;
+	result->data = data;
+	return true;
+}
+
+static inline void unmap_file(Mapped_File *file) {
+	if (file->data) {
+		munmap(file->data, file->length);
+	}
+	*file = (Mapped_File){0};
+}
+
+// Creates or truncates the file and maps its first `length` bytes
+static inline b32 map_file_read_write(const char *path, umm length, Mapped_Write_File *result) {
+
+	*result = (Mapped_Write_File){0};
+
+	result->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (result->fd < 0) {
+		return false;
+	}
+
+	umm reserved = length > MAPPED_WRITE_FILE_RESERVE ? length : MAPPED_WRITE_FILE_RESERVE;
+	void *data = MAP_FAILED;
+	if (ftruncate(result->fd, length) == 0) {
+		data = mmap(NULL, reserved, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, result->fd, 0);
+	}
+	if (data == MAP_FAILED) {
+		close(result->fd);
+		*result = (Mapped_Write_File){0};
+		return false;
+	}
+
+	result->length = length;
+	result->data = data;
+	result->reserved = reserved;
+	return true;
+}
+
+// The mapping may move, so pointers into data are invalidated
+static inline b32 remap_write_file(Mapped_Write_File *file, umm length) {
+	if (ftruncate(file->fd, length) != 0) {
+		return false;
+	}
+
+	if (length > file->reserved) {
+		void *data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, file->fd, 0);
+		if (data == MAP_FAILED) {
+			return false;
+		}
+		munmap(file->data, file->reserved);
+		file->data = data;
+		file->reserved = length;
+	}
+
+	file->length = length;
+	return true;
+}
+
+// Returns false if the file could not be truncated to final_length
+static inline b32 unmap_write_file(Mapped_Write_File *file, umm final_length) {
+	b32 result = true;
+	if (file->data) {
+		munmap(file->data, file->reserved);
+		result = ftruncate(file->fd, final_length) == 0;
+		close(file->fd);
+	}
+	*file = (Mapped_Write_File){0};
+	return result;
+}
+
+#endif
+
+static inline b32 copy_file(const char *source_path, const char *destination_path) {
+
+	Length_Buffer contents = read_entire_file(source_path);
+	if (!contents.data) {
+		return false;
+	}
+
+	FILE *file = fopen(destination_path, "wb");
+	b32 result = file && fwrite(contents.data, 1, contents.length, file) == contents.length;
+	if (file && fclose(file) != 0) {
+		result = false;
+	}
+
+	free(contents.data);
+	return result;
+}
+
+#endif // CAR_FILE_H
@@ -0,0 +1,59 @@
+#ifndef CAR_GRID_H
+#define CAR_GRID_H
+
+#include "car_common.h"
+
+//
+// Occupancy grid: the static world cars drive around. Cells are square and
+// axis aligned. Cars and lidar rays treat everything outside the grid as
+// open, but the planner only searches inside it and counts the outside as
+// blocked, so paths never leave the grid.
+//
+
+typedef struct Occupancy_Grid {
+	s32 width;
+	s32 height;
+	float cell_size;
+	float origin_x; // World position of the corner of cell (0, 0)
+	float origin_y;
+	u8 *cells; // Non-zero when occupied
+} Occupancy_Grid;
+
+static inline void occupancy_grid_init(Occupancy_Grid *grid, s32 width, s32 height, float cell_size, float origin_x, float origin_y) {
+	grid->width = width;
+	grid->height = height;
+	grid->cell_size = cell_size;
+	grid->origin_x = origin_x;
+	grid->origin_y = origin_y;
+	grid->cells = calloc((umm)width*height, 1);
+	if (!grid->cells) {
+		panic("Could not allocate occupancy grid.\n");
+	}
+}
+
+static inline void occupancy_grid_free(Occupancy_Grid *grid) {
+	free(grid->cells);
+	grid->cells = NULL;
+}
+
+static inline b32 occupancy_grid_inside(Occupancy_Grid *grid, s32 cell_x, s32 cell_y) {
+	return cell_x >= 0 && cell_y >= 0 && cell_x < grid->width && cell_y < grid->height;
+}
+
+// Returns false if the position is outside the grid; the cell is still filled in
+static inline b32 occupancy_grid_cell_at(Occupancy_Grid *grid, float x, float y, s32 *cell_x, s32 *cell_y) {
+	*cell_x = (s32)floorf((x - grid->origin_x)/grid->cell_size);
+	*cell_y = (s32)floorf((y - grid->origin_y)/grid->cell_size);
+	return occupancy_grid_inside(grid, *cell_x, *cell_y);
+}
+
+static inline void occupancy_grid_cell_center(Occupancy_Grid *grid, s32 cell_x, s32 cell_y, float *x, float *y) {
+	*x = grid->origin_x + (cell_x + 0.5f)*grid->cell_size;
+	*y = grid->origin_y + (cell_y + 0.5f)*grid->cell_size;
+}
+
+static inline b32 occupancy_grid_occupied(Occupancy_Grid *grid, s32 cell_x, s32 cell_y) {
+	return occupancy_grid_inside(grid, cell_x, cell_y) && grid->cells[cell_y*grid->width + cell_x];
+}
+
+#endif // CAR_GRID_H
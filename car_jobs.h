@@ -0,0 +1,162 @@
+#ifndef CAR_JOBS_H
+#define CAR_JOBS_H
+
+#include "car_common.h"
+
+#include <SDL2/SDL.h>
+
+//
+// Fork-join thread pool on SDL threads. job_system_parallel_for splits
+// [0, count) into chunks of `grain` items that the workers and the calling
+// thread pull from a shared counter, and returns once every chunk is done.
+// One parallel for runs at a time.
+//
+
+#define JOB_SYSTEM_MAX_THREADS 64
+
+// Processes items [first, end). worker is 0 for the calling thread and
+// 1..thread_count for the workers, for indexing per thread scratch memory.
+typedef void Job_Function(void *data, u32 first, u32 end, u32 worker);
+
+typedef struct Job_System {
+	SDL_Thread *threads[JOB_SYSTEM_MAX_THREADS];
+	u32 thread_count;
+
+	SDL_mutex *mutex;
+	SDL_cond *work_ready;
+	SDL_cond *work_done;
+
+	Job_Function *function;
+	void *data;
+	u32 count;
+	u32 grain;
+	SDL_atomic_t next;
+
+	u32 generation; // Bumped for every parallel for so sleeping workers notice new work
+	u32 busy_workers;
+	b32 quit;
+} Job_System;
+
+typedef struct Job_Worker_Start {
+	Job_System *system;
+	u32 worker;
+} Job_Worker_Start;
+
+static inline void job_system_run_chunks(Job_System *system, u32 worker) {
+	for (;;) {
+		u32 first = (u32)SDL_AtomicAdd(&system->next, (int)system->grain);
+		if (first >= system->count) break;
+		u32 end = system->count - first < system->grain ? system->count : first + system->grain;
+		system->function(system->data, first, end, worker);
+	}
+}
+
+static inline int job_system_worker(void *data) {
+	Job_Worker_Start start = *(Job_Worker_Start *)data;
+	free(data);
+
+	Job_System *system = start.system;
+	u32 seen_generation = 0;
+
+	SDL_LockMutex(system->mutex);
+	for (;;) {
+		while (!system->quit && system->generation == seen_generation) {
+			SDL_CondWait(system->work_ready, system->mutex);
+		}
+		if (system->quit) break;
+		seen_generation = system->generation;
+		SDL_UnlockMutex(system->mutex);
+
+		job_system_run_chunks(system, start.worker);
+
+		SDL_LockMutex(system->mutex);
+		if (--system->busy_workers == 0) {
+			SDL_CondSignal(system->work_done);
+		}
+	}
+	SDL_UnlockMutex(system->mutex);
+
+	return 0;
+}
+
+// thread_count is the number of extra threads; 0 picks one per remaining core
+static inline void job_system_init(Job_System *system, u32 thread_count) {
+	*system = (Job_System){0};
+
+	if (thread_count == 0) {
+		s32 cpu_count = SDL_GetCPUCount();
+		thread_count = cpu_count > 1 ? cpu_count - 1 : 0;
+	}
+	thread_count = thread_count < JOB_SYSTEM_MAX_THREADS ? thread_count : JOB_SYSTEM_MAX_THREADS;
+
+	system->mutex = SDL_CreateMutex();
+	system->work_ready = SDL_CreateCond();
+	system->work_done = SDL_CreateCond();
+	if (!system->mutex || !system->work_ready || !system->work_done) {
+		panic("Could not create job system: %s\n", SDL_GetError());
+	}
+
+	for (u32 i = 0; i < thread_count; ++i) {
+		Job_Worker_Start *start = malloc(sizeof(Job_Worker_Start));
+		if (!start) {
+			panic("Could not allocate job worker.\n");
+		}
+		*start = (Job_Worker_Start){system, i + 1};
+
+		system->threads[i] = SDL_CreateThread(job_system_worker, "job worker", start);
+		if (!system->threads[i]) {
+			panic("Could not create job worker: %s\n", SDL_GetError());
+		}
+		++system->thread_count;
+	}
+}
+
+static inline void job_system_parallel_for(Job_System *system, u32 count, u32 grain, Job_Function *function, void *data) {
+	if (count == 0) return;
+	grain = grain ? grain : 1;
+
+	// Not worth waking anyone for a single chunk
+	if (system->thread_count == 0 || count <= grain) {
+		function(data, 0, count, 0);
+		return;
+	}
+
+	SDL_LockMutex(system->mutex);
+	system->function = function;
+	system->data = data;
+	system->count = count;
+	system->grain = grain;
+	SDL_AtomicSet(&system->next, 0);
+	system->busy_workers = system->thread_count;
+	++system->generation;
+	SDL_CondBroadcast(system->work_ready);
+	SDL_UnlockMutex(system->mutex);
+
+	job_system_run_chunks(system, 0);
+
+	SDL_LockMutex(system->mutex);
+	while (system->busy_workers) {
+		SDL_CondWait(system->work_done, system->mutex);
+	}
+	SDL_UnlockMutex(system->mutex);
+}
+
+static inline void job_system_shutdown(Job_System *system) {
+	if (!system->mutex) return;
+
+	SDL_LockMutex(system->mutex);
+	system->quit = true;
+	SDL_CondBroadcast(system->work_ready);
+	SDL_UnlockMutex(system->mutex);
+
+	for (u32 i = 0; i < system->thread_count; ++i) {
+		SDL_WaitThread(system->threads[i], NULL);
+	}
+
+	SDL_DestroyCond(system->work_done);
+	SDL_DestroyCond(system->work_ready);
+	SDL_DestroyMutex(system->mutex);
+	*system = (Job_System){0};
+}
+
+#endif // CAR_JOBS_H
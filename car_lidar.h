@@ -0,0 +1,332 @@
+#ifndef CAR_LIDAR_H
+#define CAR_LIDAR_H
+
+#include "car_common.h"
+#include "car_grid.h"
+
+//
+// Simulated lidar. Every car casts a fan of rays against the occupancy grid
+// and the other cars; each ray reports the distance to the first hit, or the
+// range if nothing was hit. The readings are a flat array of ray_count
+// floats per car, indexed like the sensor array but kept out of Sensor_Data:
+// that is the packed format of the controller protocol, the plugin ABI and
+// recordings, and has no room for a configurable number of rays. The
+// simulator hands them to its in-process controllers next to the sensor
+// data; the remote controller and plugins only get Sensor_Data.
+//
+// Both the grid and the cars are walked with the same DDA traversal. Cars
+// are binned into a coarse grid every frame (a counting sort, so each bin's
+// cars are contiguous), and the scan visits cars bin by bin so that
+// neighbouring rays touch the same bins and grid rows.
+//
+
+#define LIDAR_MAX_RAYS 256
+#define LIDAR_MAX_BINS_PER_AXIS 256
+
+typedef struct Lidar_Config {
+	u32 ray_count;
+	float fan_angle; // Radians, centered on the heading
+	float range;
+} Lidar_Config;
+
+// What the lidar sees of a car: an oriented box
+typedef struct Lidar_Body {
+	float x;
+	float y;
+	float cos_direction;
+	float sin_direction;
+	float half_length;
+	float half_width;
+	float radius; // Bounding circle, filled in by lidar_scene_build
+} Lidar_Body;
+
+typedef struct Lidar_Scene {
+	Occupancy_Grid *grid;
+	Lidar_Body *bodies;
+	u32 body_count;
+
+	float bin_origin_x;
+	float bin_origin_y;
+	float bin_size;
+	s32 bin_width;
+	s32 bin_height;
+
+	u32 *bin_starts; // bin_width*bin_height + 1 offsets into bin_items
+	u32 *bin_items;  // Body indices; a body is in every bin its bounding circle touches
+	u32 *home_bins;  // The bin holding each body's center
+	u32 bin_capacity;
+	u32 item_capacity;
+	u32 body_capacity;
+} Lidar_Scene;
+
+static inline Lidar_Config lidar_default_config(void) {
+	return (Lidar_Config){32, 270.0f*DEG_TO_RAD, 1024.0f};
+}
+
+//
+// DDA grid traversal (Amanatides & Woo)
+//
+
+typedef struct Lidar_Traversal {
+	s32 x;
+	s32 y;
+	s32 step_x;
+	s32 step_y;
+	s32 width;
+	s32 height;
+	float t;       // Where the ray enters the current cell
+	float t_max_x; // Where it crosses the next vertical cell boundary
+	float t_max_y;
+	float t_delta_x;
+	float t_delta_y;
+	float t_end;
+} Lidar_Traversal;
+
+static inline float lidar_traversal_exit(Lidar_Traversal *traversal) {
+	return traversal->t_max_x < traversal->t_max_y ? traversal->t_max_x : traversal->t_max_y;
+}
+
+// Clips the ray to the grid and finds the first cell. Returns false if the
+// ray misses the grid within t_end.
+static inline b32 lidar_traversal_begin(Lidar_Traversal *traversal, float origin_x, float origin_y, float cell_size, s32 width, s32 height,
+	float x, float y, float dx, float dy, float t_end) {
+
+	float inverse_dx = dx != 0.0f ? 1.0f/dx : 1e30f;
+	float inverse_dy = dy != 0.0f ? 1.0f/dy : 1e30f;
+
+	// Slab test against the grid bounds
+	float tx0 = (origin_x - x)*inverse_dx;
+	float tx1 = (origin_x + width*cell_size - x)*inverse_dx;
+	float ty0 = (origin_y - y)*inverse_dy;
+	float ty1 = (origin_y + height*cell_size - y)*inverse_dy;
+	float t_enter = fmaxf(fmaxf(fminf(tx0, tx1), fminf(ty0, ty1)), 0.0f);
+	float t_exit = fminf(fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1)), t_end);
+	if (t_enter > t_exit) return false;
+
+	s32 cell_x = (s32)floorf((x + dx*t_enter - origin_x)/cell_size);
+	s32 cell_y = (s32)floorf((y + dy*t_enter - origin_y)/cell_size);
+	cell_x = cell_x < 0 ? 0 : (cell_x >= width ? width - 1 : cell_x);
+	cell_y = cell_y < 0 ? 0 : (cell_y >= height ? height - 1 : cell_y);
+
+	traversal->x = cell_x;
+	traversal->y = cell_y;
+	traversal->step_x = dx < 0.0f ? -1 : 1;
+	traversal->step_y = dy < 0.0f ? -1 : 1;
+	traversal->width = width;
+	traversal->height = height;
+	traversal->t = t_enter;
+	traversal->t_delta_x = fabsf(cell_size*inverse_dx);
+	traversal->t_delta_y = fabsf(cell_size*inverse_dy);
+	traversal->t_max_x = dx != 0.0f ? (origin_x + (cell_x + (dx > 0.0f))*cell_size - x)*inverse_dx : 1e30f;
+	traversal->t_max_y = dy != 0.0f ? (origin_y + (cell_y + (dy > 0.0f))*cell_size - y)*inverse_dy : 1e30f;
+	traversal->t_end = t_exit;
+	return true;
+}
+
+static inline b32 lidar_traversal_next(Lidar_Traversal *traversal) {
+	if (traversal->t_max_x < traversal->t_max_y) {
+		traversal->t = traversal->t_max_x;
+		traversal->t_max_x += traversal->t_delta_x;
+		traversal->x += traversal->step_x;
+		if (traversal->x < 0 || traversal->x >= traversal->width) return false;
+	}
+	else {
+		traversal->t = traversal->t_max_y;
+		traversal->t_max_y += traversal->t_delta_y;
+		traversal->y += traversal->step_y;
+		if (traversal->y < 0 || traversal->y >= traversal->height) return false;
+	}
+	return traversal->t <= traversal->t_end;
+}
+
+//
+// Scene
+//
+
+static inline void *lidar_reserve(void *items, u32 *capacity, u32 count, umm item_size) {
+	if (count <= *capacity) return items;
+	*capacity = count + count/2;
+	items = realloc(items, (umm)*capacity*item_size);
+	if (!items) {
+		panic("Could not allocate lidar scene.\n");
+	}
+	return items;
+}
+
+static inline void lidar_scene_free(Lidar_Scene *scene) {
+	free(scene->bin_starts);
+	free(scene->bin_items);
+	free(scene->home_bins);
+	*scene = (Lidar_Scene){0};
+}
+
+// Bins the bodies over their bounding box, with bins at least as large as
+// the biggest body so each one lands in at most four bins
+static inline void lidar_scene_build(Lidar_Scene *scene, Occupancy_Grid *grid, Lidar_Body *bodies, u32 body_count) {
+	scene->grid = grid;
+	scene->bodies = bodies;
+	scene->body_count = body_count;
+
+	float min_x = 1e30f, min_y = 1e30f, max_x = -1e30f, max_y = -1e30f, max_radius = 1.0f;
+	for (u32 i = 0; i < body_count; ++i) {
+		min_x = fminf(min_x, bodies[i].x);
+		min_y = fminf(min_y, bodies[i].y);
+		max_x = fmaxf(max_x, bodies[i].x);
+		max_y = fmaxf(max_y, bodies[i].y);
+		bodies[i].radius = sqrtf(bodies[i].half_length*bodies[i].half_length + bodies[i].half_width*bodies[i].half_width);
+		max_radius = fmaxf(max_radius, bodies[i].radius);
+	}
+	if (!body_count) {
+		min_x = min_y = max_x = max_y = 0.0f;
+	}
+
+	float extent = fmaxf(max_x - min_x, max_y - min_y) + 2.0f*max_radius;
+	scene->bin_size = fmaxf(2.0f*max_radius, extent/LIDAR_MAX_BINS_PER_AXIS);
+	scene->bin_origin_x = min_x - max_radius;
+	scene->bin_origin_y = min_y - max_radius;
+	scene->bin_width = (s32)((max_x - min_x + 2.0f*max_radius)/scene->bin_size) + 1;
+	scene->bin_height = (s32)((max_y - min_y + 2.0f*max_radius)/scene->bin_size) + 1;
+
+	u32 bin_count = scene->bin_width*scene->bin_height;
+	scene->bin_starts = lidar_reserve(scene->bin_starts, &scene->bin_capacity, bin_count + 1, sizeof(u32));
+	scene->home_bins = lidar_reserve(scene->home_bins, &scene->body_capacity, body_count, sizeof(u32));
+	memset(scene->bin_starts, 0, (bin_count + 1)*sizeof(u32));
+
+	// Count, prefix sum, then fill: two passes over the bounding circles
+	for (u32 pass = 0; pass < 2; ++pass) {
+		for (u32 i = 0; i < body_count; ++i) {
+			Lidar_Body *body = &bodies[i];
+			float radius = body->radius;
+			s32 x0 = (s32)((body->x - radius - scene->bin_origin_x)/scene->bin_size);
+			s32 y0 = (s32)((body->y - radius - scene->bin_origin_y)/scene->bin_size);
+			s32 x1 = (s32)((body->x + radius - scene->bin_origin_x)/scene->bin_size);
+			s32 y1 = (s32)((body->y + radius - scene->bin_origin_y)/scene->bin_size);
+			x1 = x1 < scene->bin_width ? x1 : scene->bin_width - 1;
+			y1 = y1 < scene->bin_height ? y1 : scene->bin_height - 1;
+
+			for (s32 y = y0; y <= y1; ++y) {
+				for (s32 x = x0; x <= x1; ++x) {
+					u32 bin = y*scene->bin_width + x;
+					if (pass == 0) ++scene->bin_starts[bin + 1];
+					else scene->bin_items[scene->bin_starts[bin]++] = i;
+				}
+			}
+
+			if (pass == 0) {
+				s32 home_x = (s32)((body->x - scene->bin_origin_x)/scene->bin_size);
+				s32 home_y = (s32)((body->y - scene->bin_origin_y)/scene->bin_size);
+				scene->home_bins[i] = home_y*scene->bin_width + home_x;
+			}
+		}
+
+		if (pass == 0) {
+			for (u32 bin = 0; bin < bin_count; ++bin) {
+				scene->bin_starts[bin + 1] += scene->bin_starts[bin];
+			}
+			scene->bin_items = lidar_reserve(scene->bin_items, &scene->item_capacity, scene->bin_starts[bin_count], sizeof(u32));
+		}
+	}
+
+	// The fill pass advanced every start to the next bin's start
+	memmove(scene->bin_starts + 1, scene->bin_starts, bin_count*sizeof(u32));
+	scene->bin_starts[0] = 0;
+}
+
+// Distance along a unit ray to an oriented box, or the limit if it misses.
+// Rays starting inside the box ignore it.
+static inline float lidar_ray_body(Lidar_Body *body, float x, float y, float dx, float dy, float limit) {
+	float relative_x = x - body->x;
+	float relative_y = y - body->y;
+
+	// Most bodies in a bin are nowhere near the ray, reject those against the
+	// bounding circle before paying for the box
+	float along = -(relative_x*dx + relative_y*dy);
+	float across = relative_x*dy - relative_y*dx;
+	if (along + body->radius < 0.0f || along - body->radius >= limit || across*across > body->radius*body->radius) {
+		return limit;
+	}
+
+	float local_x = relative_x*body->cos_direction + relative_y*body->sin_direction;
+	float local_y = relative_y*body->cos_direction - relative_x*body->sin_direction;
+	float local_dx = dx*body->cos_direction + dy*body->sin_direction;
+	float local_dy = dy*body->cos_direction - dx*body->sin_direction;
+
+	float inverse_dx = local_dx != 0.0f ? 1.0f/local_dx : 1e30f;
+	float inverse_dy = local_dy != 0.0f ? 1.0f/local_dy : 1e30f;
+	float tx0 = (-body->half_length - local_x)*inverse_dx;
+	float tx1 = (body->half_length - local_x)*inverse_dx;
+	float ty0 = (-body->half_width - local_y)*inverse_dy;
+	float ty1 = (body->half_width - local_y)*inverse_dy;
+	float t_enter = fmaxf(fminf(tx0, tx1), fminf(ty0, ty1));
+	float t_exit = fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1));
+
+	return (t_enter <= t_exit && t_enter > 0.0f && t_enter < limit) ? t_enter : limit;
+}
+
+static inline float lidar_cast_ray(Lidar_Scene *scene, u32 self, float x, float y, float dx, float dy, float range) {
+	float nearest = range;
+	Lidar_Traversal traversal;
+
+	Occupancy_Grid *grid = scene->grid;
+	if (grid && lidar_traversal_begin(&traversal, grid->origin_x, grid->origin_y, grid->cell_size, grid->width, grid->height, x, y, dx, dy, range)) {
+		do {
+			if (grid->cells[traversal.y*grid->width + traversal.x]) {
+				nearest = traversal.t;
+				break;
+			}
+		} while (lidar_traversal_next(&traversal));
+	}
+
+	if (lidar_traversal_begin(&traversal, scene->bin_origin_x, scene->bin_origin_y, scene->bin_size, scene->bin_width, scene->bin_height, x, y, dx, dy, nearest)) {
+		do {
+			u32 bin = traversal.y*scene->bin_width + traversal.x;
+			for (u32 item = scene->bin_starts[bin]; item < scene->bin_starts[bin + 1]; ++item) {
+				u32 body = scene->bin_items[item];
+				if (body == self) continue;
+				nearest = lidar_ray_body(&scene->bodies[body], x, y, dx, dy, nearest);
+			}
+
+			// Hits in later bins can't be closer than this bin's exit
+			if (nearest <= lidar_traversal_exit(&traversal)) break;
+		} while (lidar_traversal_next(&traversal));
+	}
+
+	return nearest;
+}
+
+// Scans every body whose center is in bins [first_bin, end_bin), writing
+// config.ray_count distances per body to distances[body*ray_count...]
+static inline void lidar_scan(Lidar_Scene *scene, Lidar_Config config, u32 first_bin, u32 end_bin, float *distances) {
+	assert(config.ray_count >= 1 && config.ray_count <= LIDAR_MAX_RAYS);
+
+	float ray_cos[LIDAR_MAX_RAYS];
+	float ray_sin[LIDAR_MAX_RAYS];
+	for (u32 ray = 0; ray < config.ray_count; ++ray) {
+		float angle = config.ray_count > 1 ? config.fan_angle*((float)ray/(config.ray_count - 1) - 0.5f) : 0.0f;
+		ray_cos[ray] = cosf(angle);
+		ray_sin[ray] = sinf(angle);
+	}
+
+	for (u32 bin = first_bin; bin < end_bin; ++bin) {
+		for (u32 item = scene->bin_starts[bin]; item < scene->bin_starts[bin + 1]; ++item) {
+			u32 index = scene->bin_items[item];
+			if (scene->home_bins[index] != bin) continue;
+
+			Lidar_Body *body = &scene->bodies[index];
+			float *body_distances = distances + (umm)index*config.ray_count;
+
+			for (u32 ray = 0; ray < config.ray_count; ++ray) {
+				// Rotate the fan offsets by the heading
+				float dx = body->cos_direction*ray_cos[ray] - body->sin_direction*ray_sin[ray];
+				float dy = body->sin_direction*ray_cos[ray] + body->cos_direction*ray_sin[ray];
+				body_distances[ray] = lidar_cast_ray(scene, index, body->x, body->y, dx, dy, config.range);
+			}
+		}
+	}
+}
+
+static inline u32 lidar_scene_bin_count(Lidar_Scene *scene) {
+	return scene->bin_width*scene->bin_height;
+}
+
+#endif // CAR_LIDAR_H
@@ -0,0 +1,255 @@
+#ifndef CAR_LOADER_H
+#define CAR_LOADER_H
+
+#include "car_common.h"
+#include "car_file.h"
+
+#include <SDL2/SDL.h>
+
+//
+// Background file loading. file_loader_request queues a file for the loader
+// thread, which brings it into memory and runs the request's process
+// function on it, so parsing and decompressing happen off the frame too.
+// The complete function runs later, in file_loader_poll on the thread that
+// made the request, where it can safely touch the simulation.
+//
+// Files of FILE_MAP_THRESHOLD bytes or more are mapped instead of read and
+// their pages touched on the loader thread, so the first access to the data
+// does not fault in the middle of a frame. Smaller files are copied out of
+// the mapping into an allocation.
+//
+// Requests complete in the order they were made. file_loader_request and
+// file_loader_poll must be called from the same thread.
+//
+
+#define FILE_LOADER_QUEUE_LENGTH 32
+#define FILE_LOADER_PATH_LENGTH 512
+#define FILE_MAP_THRESHOLD (1u << 20)
+#define FILE_PAGE_SIZE 4096
+
+typedef struct Loaded_File {
+	umm length;
+	u8 *data;
+	Mapped_File mapping; // Owns data when the file was mapped
+} Loaded_File;
+
+// Returns false if the file is missing or unreadable
+static inline b32 load_file(const char *path, Loaded_File *result) {
+
+	*result = (Loaded_File){0};
+
+	Mapped_File mapping;
+	if (!map_file_read_only(path, &mapping)) {
+		// Empty files cannot be mapped
+		Length_Buffer contents = read_entire_file(path);
+		result->length = contents.length;
+		result->data = contents.data;
+		return contents.data != NULL;
+	}
+
+	if (mapping.length >= FILE_MAP_THRESHOLD) {
+		result->length = mapping.length;
+		result->data = mapping.data;
+		result->mapping = mapping;
+		return true;
+	}
+
+	result->data = malloc(mapping.length);
+	if (result->data) {
+		memcpy(result->data, mapping.data, mapping.length);
+		result->length = mapping.length;
+	}
+	unmap_file(&mapping);
+	return result->data != NULL;
+}
+
+// Faults in the pages of a mapped file, so later reads find them resident
+static inline void loaded_file_touch(Loaded_File *file) {
+	if (file->mapping.data) {
+		volatile u8 sum = 0;
+		for (umm offset = 0; offset < file->length; offset += FILE_PAGE_SIZE) {
+			sum += file->data[offset];
+		}
+		(void)sum;
+	}
+}
+
+static inline void loaded_file_free(Loaded_File *file) {
+	if (file->mapping.data) {
+		unmap_file(&file->mapping);
+	}
+	else {
+		free(file->data);
+	}
+	*file = (Loaded_File){0};
+}
+
+
+//
+// Loader thread
+//
+
+// Runs on the loader thread once the file is in memory. Returns false if
+// the contents are unusable. May free the file early with loaded_file_free.
+typedef b32 File_Process_Function(Loaded_File *file, void *data);
+
+// Runs in file_loader_poll. The file is freed afterwards unless the function
+// takes it over by zeroing *file.
+typedef void File_Complete_Function(const char *path, Loaded_File *file, b32 success, void *data);
+
+typedef struct File_Load_Request {
+	char path[FILE_LOADER_PATH_LENGTH];
+	File_Process_Function *process; // May be NULL
+	File_Complete_Function *complete;
+	void *data;
+
+	Loaded_File file;
+	b32 success;
+	double seconds; // Spent on the loader thread
+} File_Load_Request;
+
+typedef struct File_Loader {
+	SDL_Thread *thread;
+	SDL_mutex *mutex;
+	SDL_cond *work_ready;
+	SDL_cond *work_done;
+
+	// Requests [delivered, loaded) wait for file_loader_poll and
+	// [loaded, submitted) for the loader thread
+	File_Load_Request requests[FILE_LOADER_QUEUE_LENGTH];
+	u32 submitted;
+	u32 loaded;
+	u32 delivered;
+	b32 quit;
+} File_Loader;
+
+static inline int file_loader_thread(void *data) {
+
+	File_Loader *loader = data;
+
+	SDL_LockMutex(loader->mutex);
+	for (;;) {
+		while (!loader->quit && loader->loaded == loader->submitted) {
+			SDL_CondWait(loader->work_ready, loader->mutex);
+		}
+		if (loader->quit) break;
+		File_Load_Request *request = &loader->requests[loader->loaded % FILE_LOADER_QUEUE_LENGTH];
+		SDL_UnlockMutex(loader->mutex);
+
+		// The slot is the loader's alone until loaded moves past it
+		u64 start = SDL_GetPerformanceCounter();
+		request->success = load_file(request->path, &request->file);
+		if (request->success) {
+			loaded_file_touch(&request->file);
+			if (request->process) {
+				request->success = request->process(&request->file, request->data);
+			}
+		}
+		request->seconds = (double)(SDL_GetPerformanceCounter() - start)/SDL_GetPerformanceFrequency();
+
+		SDL_LockMutex(loader->mutex);
+		++loader->loaded;
+		SDL_CondBroadcast(loader->work_done);
+	}
+	SDL_UnlockMutex(loader->mutex);
+
+	return 0;
+}
+
+static inline void file_loader_init(File_Loader *loader) {
+
+	*loader = (File_Loader){0};
+
+	loader->mutex = SDL_CreateMutex();
+	loader->work_ready = SDL_CreateCond();
+	loader->work_done = SDL_CreateCond();
+	if (!loader->mutex || !loader->work_ready || !loader->work_done) {
+		panic("Could not create file loader: %s\n", SDL_GetError());
+	}
+
+	loader->thread = SDL_CreateThread(file_loader_thread, "file loader", loader);
+	if (!loader->thread) {
+		panic("Could not create file loader thread: %s\n", SDL_GetError());
+	}
+}
+
+// Returns false if the queue is full or the path too long
+static inline b32 file_loader_request(File_Loader *loader, const char *path, File_Process_Function *process, File_Complete_Function *complete, void *data) {
+
+	if (strlen(path) >= FILE_LOADER_PATH_LENGTH) {
+		return false;
+	}
+
+	SDL_LockMutex(loader->mutex);
+	b32 result = loader->submitted - loader->delivered < FILE_LOADER_QUEUE_LENGTH;
+	if (result) {
+		File_Load_Request *request = &loader->requests[loader->submitted % FILE_LOADER_QUEUE_LENGTH];
+		*request = (File_Load_Request){0};
+		strcpy(request->path, path);
+		request->process = process;
+		request->complete = complete;
+		request->data = data;
+
+		++loader->submitted;
+		SDL_CondSignal(loader->work_ready);
+	}
+	SDL_UnlockMutex(loader->mutex);
+
+	return result;
+}
+
+// Runs the complete functions of the finished requests. Returns their number.
+static inline u32 file_loader_poll(File_Loader *loader) {
+
+	SDL_LockMutex(loader->mutex);
+	u32 loaded = loader->loaded;
+	SDL_UnlockMutex(loader->mutex);
+
+	u32 count = 0;
+	for (; loader->delivered != loaded; ++count) {
+		File_Load_Request *request = &loader->requests[loader->delivered % FILE_LOADER_QUEUE_LENGTH];
+		if (request->complete) {
+			request->complete(request->path, &request->file, request->success, request->data);
+		}
+		loaded_file_free(&request->file);
+
+		SDL_LockMutex(loader->mutex);
+		++loader->delivered;
+		SDL_UnlockMutex(loader->mutex);
+	}
+	return count;
+}
+
+// Blocks until every request made so far has completed
+static inline void file_loader_wait(File_Loader *loader) {
+	SDL_LockMutex(loader->mutex);
+	while (loader->loaded != loader->submitted) {
+		SDL_CondWait(loader->work_done, loader->mutex);
+	}
+	SDL_UnlockMutex(loader->mutex);
+
+	file_loader_poll(loader);
+}
+
+// Finishes the load in progress, then drops the rest without completing them
+static inline void file_loader_shutdown(File_Loader *loader) {
+
+	if (loader->thread) {
+		SDL_LockMutex(loader->mutex);
+		loader->quit = true;
+		SDL_CondSignal(loader->work_ready);
+		SDL_UnlockMutex(loader->mutex);
+		SDL_WaitThread(loader->thread, NULL);
+
+		for (; loader->delivered != loader->loaded; ++loader->delivered) {
+			loaded_file_free(&loader->requests[loader->delivered % FILE_LOADER_QUEUE_LENGTH].file);
+		}
+
+		SDL_DestroyCond(loader->work_done);
+		SDL_DestroyCond(loader->work_ready);
+		SDL_DestroyMutex(loader->mutex);
+	}
+	*loader = (File_Loader){0};
+}
+
+#endif // CAR_LOADER_H
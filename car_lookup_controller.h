@@ -0,0 +1,194 @@
+#ifndef CAR_LOOKUP_CONTROLLER_H
+#define CAR_LOOKUP_CONTROLLER_H
+
+#include "car_common.h"
+#include "car_controller.h"
+
+//
+// Bakes a Controller_Kernel into a table over (angle delta, distance,
+// velocity) for each direction state, and evaluates it with trilinear
+// interpolation of the axes and the nearest sample of the next direction.
+// The only math left per car is two square roots, for the distance and for
+// its place on the distance axis; atan2 is a table lookup too.
+//
+// The distance axis is sampled on a square root scale so that resolution
+// concentrates near the target, where the controller changes fastest.
+//
+
+#define LOOKUP_ATAN_STEPS 1024
+
+typedef struct Lookup_Table_Config {
+	u32 angle_steps;    // Samples over [-pi, pi]
+	u32 distance_steps; // Samples over [0, max_distance]
+	u32 velocity_steps; // Samples over [min_velocity, max_velocity]
+	float max_distance;
+	float min_velocity;
+	float max_velocity;
+} Lookup_Table_Config;
+
+typedef struct Lookup_Table_Entry {
+	float acceleration_axis;
+	float turn_axis;
+} Lookup_Table_Entry;
+
+typedef struct Lookup_Table_Controller {
+	Lookup_Table_Config config;
+	float angle_scale;    // Table steps per unit, per axis
+	float distance_scale;
+	float velocity_scale;
+
+	Lookup_Table_Entry *entries; // [direction][velocity][distance][angle]
+	s8 *next_directions;         // Same layout, direction state after the step
+	float atan_table[LOOKUP_ATAN_STEPS + 1]; // atan(t) for t in [0, 1]
+} Lookup_Table_Controller;
+
+static inline Lookup_Table_Config lookup_table_default_config(void) {
+	return (Lookup_Table_Config){
+		128,
+		64,
+		32,
+		4096.0f,
+		-10.0f,
+		20.0f,
+	};
+}
+
+static inline void lookup_table_bake(Lookup_Table_Controller *table, Lookup_Table_Config config, Controller_Kernel *kernel) {
+
+	assert(config.angle_steps >= 2 && config.distance_steps >= 2 && config.velocity_steps >= 2);
+
+	table->config = config;
+	table->angle_scale = (config.angle_steps - 1)/TAU;
+	table->distance_scale = (config.distance_steps - 1)/sqrtf(config.max_distance);
+	table->velocity_scale = (config.velocity_steps - 1)/(config.max_velocity - config.min_velocity);
+
+	for (u32 i = 0; i <= LOOKUP_ATAN_STEPS; ++i) {
+		table->atan_table[i] = atanf((float)i/LOOKUP_ATAN_STEPS);
+	}
+
+	umm row_length = config.angle_steps;
+	umm entry_count = 2*row_length*config.distance_steps*config.velocity_steps;
+
+	free(table->entries);
+	free(table->next_directions);
+	table->entries = malloc(entry_count*sizeof(Lookup_Table_Entry));
+	table->next_directions = malloc(entry_count);
+	Sensor_Data *sensors = malloc(row_length*sizeof(Sensor_Data));
+	Controller_State *states = malloc(row_length*sizeof(Controller_State));
+	Control_Input *inputs = malloc(row_length*sizeof(Control_Input));
+	if (!table->entries || !table->next_directions || !sensors || !states || !inputs) {
+		panic("Could not allocate lookup table.\n");
+	}
+
+	// One kernel call per row of angles, with the car heading along +x
+	umm entry_index = 0;
+	for (u32 direction = 0; direction < 2; ++direction) {
+		for (u32 v = 0; v < config.velocity_steps; ++v) {
+			float velocity = config.min_velocity + v/table->velocity_scale;
+			for (u32 d = 0; d < config.distance_steps; ++d) {
+				float distance = d/table->distance_scale;
+				distance *= distance;
+
+				for (u32 a = 0; a < row_length; ++a) {
+					float angle = -PI + a/table->angle_scale;
+					sensors[a] = (Sensor_Data){cosf(angle)*distance, sinf(angle)*distance, 0.0f, velocity, 0};
+					states[a] = controller_state_initial();
+					states[a].acceleration_direction = direction ? 1.0f : -1.0f;
+				}
+
+				kernel(row_length, sensors, states, inputs);
+
+				for (u32 a = 0; a < row_length; ++a, ++entry_index) {
+					table->entries[entry_index].acceleration_axis = inputs[a].acceleration_axis;
+					table->entries[entry_index].turn_axis = inputs[a].turn_axis;
+					table->next_directions[entry_index] = states[a].acceleration_direction > 0.0f ? 1 : -1;
+				}
+			}
+		}
+	}
+
+	free(inputs);
+	free(states);
+	free(sensors);
+}
+
+static inline void lookup_table_free(Lookup_Table_Controller *table) {
+	free(table->entries);
+	free(table->next_directions);
+	table->entries = NULL;
+	table->next_directions = NULL;
+}
+
+static inline float lookup_atan2(Lookup_Table_Controller *table, float y, float x) {
+	float abs_x = fabsf(x);
+	float abs_y = fabsf(y);
+	b32 steep = abs_y > abs_x;
+	float maximum = steep ? abs_y : abs_x;
+	float minimum = steep ? abs_x : abs_y;
+
+	float t = minimum/(maximum + 1e-30f)*LOOKUP_ATAN_STEPS;
+	u32 index = (u32)t;
+	index = index < LOOKUP_ATAN_STEPS ? index : LOOKUP_ATAN_STEPS - 1;
+	float result = LERP(table->atan_table[index], table->atan_table[index + 1], t - index);
+
+	result = steep ? 0.5f*PI - result : result;
+	result = x < 0.0f ? PI - result : result;
+	return y < 0.0f ? -result : result;
+}
+
+// Clamps a continuous table coordinate into [0, steps - 1] and splits it
+// into the lower sample index and the fraction towards the next one
+static inline u32 lookup_axis(float coordinate, u32 steps, float *fraction) {
+	float maximum = (float)(steps - 1);
+	coordinate = coordinate > 0.0f ? coordinate : 0.0f;
+	coordinate = coordinate < maximum ? coordinate : maximum;
+	u32 cell = (u32)coordinate;
+	cell = cell < steps - 2 ? cell : steps - 2;
+	*fraction = coordinate - cell;
+	return cell;
+}
+
+static inline void lookup_table_evaluate(Lookup_Table_Controller *table, u32 count, Sensor_Data *sensor_data, Controller_State *states, Control_Input *inputs) {
+
+	Lookup_Table_Config *config = &table->config;
+	umm distance_stride = config->angle_steps;
+	umm velocity_stride = distance_stride*config->distance_steps;
+	umm direction_stride = velocity_stride*config->velocity_steps;
+
+	for (u32 i = 0; i < count; ++i) {
+		Sensor_Data sensors = sensor_data[i];
+
+		float angle_delta = lookup_atan2(table, sensors.delta_y, sensors.delta_x) - sensors.heading_direction;
+		angle_delta -= angle_delta > PI ? TAU : 0.0f;
+		angle_delta += angle_delta < -PI ? TAU : 0.0f;
+
+		float distance = sqrtf(sensors.delta_x*sensors.delta_x + sensors.delta_y*sensors.delta_y);
+
+		float fa, fd, fv;
+		u32 a = lookup_axis((angle_delta + PI)*table->angle_scale, config->angle_steps, &fa);
+		u32 d = lookup_axis(sqrtf(distance)*table->distance_scale, config->distance_steps, &fd);
+		u32 v = lookup_axis((sensors.velocity - config->min_velocity)*table->velocity_scale, config->velocity_steps, &fv);
+		u32 direction = states[i].acceleration_direction > 0.0f;
+
+		umm index = direction*direction_stride + v*velocity_stride + d*distance_stride + a;
+		Lookup_Table_Entry *c00 = table->entries + index;
+		Lookup_Table_Entry *c01 = c00 + distance_stride;
+		Lookup_Table_Entry *c10 = c00 + velocity_stride;
+		Lookup_Table_Entry *c11 = c10 + distance_stride;
+
+		// Interpolate along angle, then distance, then velocity
+		float acceleration_0 = LERP(LERP(c00[0].acceleration_axis, c00[1].acceleration_axis, fa), LERP(c01[0].acceleration_axis, c01[1].acceleration_axis, fa), fd);
+		float acceleration_1 = LERP(LERP(c10[0].acceleration_axis, c10[1].acceleration_axis, fa), LERP(c11[0].acceleration_axis, c11[1].acceleration_axis, fa), fd);
+		float turn_0 = LERP(LERP(c00[0].turn_axis, c00[1].turn_axis, fa), LERP(c01[0].turn_axis, c01[1].turn_axis, fa), fd);
+		float turn_1 = LERP(LERP(c10[0].turn_axis, c10[1].turn_axis, fa), LERP(c11[0].turn_axis, c11[1].turn_axis, fa), fd);
+
+		// The direction state is discrete, take the nearest sample
+		umm nearest = index + (fa >= 0.5f) + (fd >= 0.5f)*distance_stride + (fv >= 0.5f)*velocity_stride;
+
+		inputs[i].acceleration_axis = (s16)LERP(acceleration_0, acceleration_1, fv);
+		inputs[i].turn_axis = (s16)LERP(turn_0, turn_1, fv);
+		states[i].acceleration_direction = table->next_directions[nearest];
+	}
+}
+
+#endif // CAR_LOOKUP_CONTROLLER_H
@@ -0,0 +1,398 @@
+#ifndef CAR_MPC_H
+#define CAR_MPC_H
+
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_grid.h"
+#include "car_jobs.h"
+
+//
+// Sampling based model predictive controller (random shooting).
+//
+// Every tick each car draws candidate input sequences, rolls its own model
+// forward over the horizon and applies the first input of the cheapest one.
+// Candidates are piecewise constant over a few segments, either uniform
+// samples or perturbations of last tick's winner; candidate 0 is last tick's
+// winner itself, shifted by one tick, so the plan only changes when
+// something better turns up.
+//
+// Candidates are a pure function of (seed, car, candidate), so rollouts only
+// return a cost and the winner is regenerated afterwards. Rollouts run eight
+// candidates at a time: through update_car on a scratch fleet, or on AVX2
+// lanes with the same model transcribed to vector math. Chunks of cars are
+// spread over the job system.
+//
+
+#define MPC_MAX_HORIZON 128
+#define MPC_MAX_SEGMENTS 16
+#define MPC_LANES 8
+
+typedef struct Mpc_Config {
+	u32 candidate_count; // Rounded up to a multiple of MPC_LANES
+	u32 horizon;         // Ticks rolled out
+	u32 segment_count;   // Input changes per candidate
+	float perturbation;  // Noise around the previous plan, as a fraction of full axis
+	float terminal_weight; // Final distance to target, relative to the mean distance over the rollout
+	float obstacle_cost; // Per tick spent inside an occupied cell
+} Mpc_Config;
+
+typedef struct Mpc_Controller {
+	Mpc_Config config;
+	Job_System *jobs;
+	Occupancy_Grid *grid; // Optional
+
+	u64 seed; // Advanced every evaluation
+
+	Control_Input *plans; // horizon inputs per car, the previous winner
+	u32 plan_capacity;    // In cars
+	float *costs;         // candidate_count per car in the current batch
+	u32 cost_capacity;    // In cars
+} Mpc_Controller;
+
+static inline Mpc_Config mpc_default_config(void) {
+	return (Mpc_Config){
+		256,
+		48,
+		4,
+		0.25f,
+		4.0f,
+		1e6f,
+	};
+}
+
+static inline void mpc_controller_init(Mpc_Controller *mpc, Mpc_Config config, Job_System *jobs, Occupancy_Grid *grid) {
+	*mpc = (Mpc_Controller){0};
+
+	config.candidate_count = (config.candidate_count + MPC_LANES - 1)/MPC_LANES*MPC_LANES;
+	config.horizon = config.horizon < MPC_MAX_HORIZON ? config.horizon : MPC_MAX_HORIZON;
+	config.segment_count = config.segment_count < MPC_MAX_SEGMENTS ? config.segment_count : MPC_MAX_SEGMENTS;
+	config.segment_count = config.segment_count < config.horizon ? config.segment_count : config.horizon;
+	assert(config.candidate_count >= MPC_LANES && config.horizon >= 1 && config.segment_count >= 1);
+
+	mpc->config = config;
+	mpc->jobs = jobs;
+	mpc->grid = grid;
+}
+
+// Makes sure cars [0, count) have a plan, new plans are all zero inputs
+static inline void mpc_controller_reserve_plans(Mpc_Controller *mpc, u32 count) {
+	u32 horizon = mpc->config.horizon;
+	if (count > mpc->plan_capacity) {
+		u32 capacity = count*2;
+		mpc->plans = realloc(mpc->plans, (umm)capacity*horizon*sizeof(Control_Input));
+		if (!mpc->plans) {
+			panic("Could not allocate controller plans.\n");
+		}
+		memset(mpc->plans + (umm)mpc->plan_capacity*horizon, 0, (umm)(capacity - mpc->plan_capacity)*horizon*sizeof(Control_Input));
+		mpc->plan_capacity = capacity;
+	}
+}
+
+static inline void mpc_controller_free(Mpc_Controller *mpc) {
+	free(mpc->plans);
+	free(mpc->costs);
+	mpc->plans = NULL;
+	mpc->costs = NULL;
+	mpc->plan_capacity = 0;
+	mpc->cost_capacity = 0;
+}
+
+//
+// Candidates
+//
+
+static inline float mpc_random_axis(u64 *state) {
+	*state = *state*6364136223846793005ull + 1442695040888963407ull;
+	return (float)(s32)(*state >> 32)/2147483648.0f; // [-1, 1)
+}
+
+static inline s16 mpc_axis(float value) {
+	value = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+	return (s16)(value*0x7fff);
+}
+
+// Fills the candidate's inputs for the whole horizon
+static inline void mpc_candidate_inputs(Mpc_Controller *mpc, u32 car, u32 candidate, Control_Input *plan, Control_Input *inputs) {
+	Mpc_Config *config = &mpc->config;
+
+	// Winner from last tick, moved on by the tick that has passed
+	for (u32 t = 0; t < config->horizon; ++t) {
+		inputs[t] = plan[t + 1 < config->horizon ? t + 1 : t];
+	}
+	if (candidate == 0) return;
+
+	u64 key[3] = {mpc->seed, car, candidate};
+	u64 state = hash64(key, sizeof(key), 0x6d7063);
+	b32 perturb = candidate & 1;
+
+	for (u32 segment = 0; segment < config->segment_count; ++segment) {
+		float acceleration = mpc_random_axis(&state);
+		float turn = mpc_random_axis(&state);
+		u32 first = segment*config->horizon/config->segment_count;
+		u32 end = (segment + 1)*config->horizon/config->segment_count;
+
+		for (u32 t = first; t < end; ++t) {
+			if (perturb) {
+				inputs[t].acceleration_axis = mpc_axis(inputs[t].acceleration_axis/32767.0f + acceleration*config->perturbation);
+				inputs[t].turn_axis = mpc_axis(inputs[t].turn_axis/32767.0f + turn*config->perturbation);
+			}
+			else {
+				inputs[t].acceleration_axis = mpc_axis(acceleration);
+				inputs[t].turn_axis = mpc_axis(turn);
+			}
+		}
+	}
+}
+
+static inline float mpc_step_cost(Mpc_Controller *mpc, float x, float y, float target_x, float target_y) {
+	float dx = target_x - x;
+	float dy = target_y - y;
+	float cost = sqrtf(dx*dx + dy*dy)/mpc->config.horizon;
+
+	s32 cell_x, cell_y;
+	if (mpc->grid && occupancy_grid_cell_at(mpc->grid, x, y, &cell_x, &cell_y) && mpc->grid->cells[cell_y*mpc->grid->width + cell_x]) {
+		cost += mpc->config.obstacle_cost;
+	}
+	return cost;
+}
+
+static inline float mpc_terminal_cost(Mpc_Controller *mpc, float x, float y, float target_x, float target_y) {
+	float dx = target_x - x;
+	float dy = target_y - y;
+	return mpc->config.terminal_weight*sqrtf(dx*dx + dy*dy);
+}
+
+//
+// Rollouts
+//
+
+// Reference rollout: the simulator's own update_car on a scratch fleet
+static inline void mpc_rollout_scalar(Mpc_Controller *mpc, Car *car, float target_x, float target_y,
+	Control_Input inputs[MPC_LANES][MPC_MAX_HORIZON], float *costs) {
+
+	Car scratch[MPC_LANES];
+	for (u32 lane = 0; lane < MPC_LANES; ++lane) {
+		scratch[lane] = *car;
+		costs[lane] = 0.0f;
+	}
+
+	for (u32 t = 0; t < mpc->config.horizon; ++t) {
+		for (u32 lane = 0; lane < MPC_LANES; ++lane) {
+			update_car(&scratch[lane], inputs[lane][t]);
+			costs[lane] += mpc_step_cost(mpc, scratch[lane].x, scratch[lane].y, target_x, target_y);
+		}
+	}
+
+	for (u32 lane = 0; lane < MPC_LANES; ++lane) {
+		costs[lane] += mpc_terminal_cost(mpc, scratch[lane].x, scratch[lane].y, target_x, target_y);
+	}
+}
+
+#if CONTROLLER_HAS_AVX2_KERNEL
+
+CONTROLLER_AVX2 static inline __m256 mpc_wrap_angle_avx2(__m256 angle) {
+	__m256 turns = _mm256_round_ps(_mm256_mul_ps(angle, _mm256_set1_ps(1.0f/TAU)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	return _mm256_sub_ps(angle, _mm256_mul_ps(turns, _mm256_set1_ps(TAU)));
+}
+
+CONTROLLER_AVX2 static inline __m256 mpc_sin_avx2(__m256 angle) {
+	return cos_approx_avx2(mpc_wrap_angle_avx2(_mm256_sub_ps(angle, _mm256_set1_ps(0.5f*PI))));
+}
+
+// update_car for eight copies of one car, one lane each. Keep in step with
+// update_car: the only differences are the trig approximations.
+CONTROLLER_AVX2 static inline void mpc_rollout_avx2(Mpc_Controller *mpc, Car *car, float target_x, float target_y,
+	Control_Input inputs[MPC_LANES][MPC_MAX_HORIZON], float *costs) {
+
+	__m256 zero = _mm256_setzero_ps();
+	__m256 sign_mask = _mm256_set1_ps(-0.0f);
+	__m256 acceleration = _mm256_set1_ps(car->acceleration);
+	__m256 turning_rate = _mm256_set1_ps(car->turning_rate);
+	__m256 turning_span = _mm256_set1_ps(car->turning_span);
+	__m256 rolling_resistance = _mm256_set1_ps(car->rolling_resistance);
+	__m256 breaking_resistance = _mm256_set1_ps(car->breaking_resistance);
+	__m256 half_wheel_base = _mm256_set1_ps(car->half_wheel_base);
+	__m256 axis_scale = _mm256_set1_ps(1.0f/32768.0f);
+	__m256 half = _mm256_set1_ps(0.5f);
+
+	__m256 x = _mm256_set1_ps(car->x);
+	__m256 y = _mm256_set1_ps(car->y);
+	__m256 direction = _mm256_set1_ps(car->direction);
+	__m256 velocity = _mm256_set1_ps(car->velocity);
+	__m256 front_wheel_angle = _mm256_set1_ps(car->front_wheel_angle);
+
+	__m256 target_x_lanes = _mm256_set1_ps(target_x);
+	__m256 target_y_lanes = _mm256_set1_ps(target_y);
+	__m256 distance_sum = zero;
+	__m256 inverse_horizon = _mm256_set1_ps(1.0f/mpc->config.horizon);
+
+	__m256i input_index = _mm256_setr_epi32(0, MPC_MAX_HORIZON, 2*MPC_MAX_HORIZON, 3*MPC_MAX_HORIZON,
+		4*MPC_MAX_HORIZON, 5*MPC_MAX_HORIZON, 6*MPC_MAX_HORIZON, 7*MPC_MAX_HORIZON);
+
+	u32 obstacle_ticks[MPC_LANES] = {0};
+
+	for (u32 t = 0; t < mpc->config.horizon; ++t) {
+		// One packed Control_Input per lane: acceleration in the low half, turn in the high half
+		__m256i packed = _mm256_i32gather_epi32((const int *)&inputs[0][t], input_index, 4);
+		__m256 acceleration_axis = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(packed, 16), 16));
+		__m256 turn_axis = _mm256_cvtepi32_ps(_mm256_srai_epi32(packed, 16));
+
+		__m256 accelerating = _mm256_cmp_ps(acceleration_axis, zero, _CMP_GT_OQ);
+		velocity = _mm256_add_ps(velocity, _mm256_and_ps(accelerating, _mm256_mul_ps(acceleration, _mm256_mul_ps(acceleration_axis, axis_scale))));
+
+		front_wheel_angle = _mm256_add_ps(front_wheel_angle, _mm256_mul_ps(turning_rate, _mm256_mul_ps(turn_axis, axis_scale)));
+		__m256 effective_turning_span = _mm256_sub_ps(turning_span, _mm256_andnot_ps(sign_mask, _mm256_mul_ps(velocity, _mm256_set1_ps(0.07f))));
+		front_wheel_angle = _mm256_max_ps(front_wheel_angle, _mm256_sub_ps(zero, effective_turning_span));
+		front_wheel_angle = _mm256_min_ps(front_wheel_angle, effective_turning_span);
+
+		__m256 reverse = _mm256_cmp_ps(acceleration_axis, zero, _CMP_LT_OQ);
+		__m256 breaking = _mm256_or_ps(
+			_mm256_and_ps(reverse, _mm256_cmp_ps(velocity, zero, _CMP_GT_OQ)),
+			_mm256_andnot_ps(reverse, _mm256_cmp_ps(velocity, zero, _CMP_LT_OQ)));
+
+		__m256 resistance = _mm256_add_ps(rolling_resistance, _mm256_and_ps(breaking, breaking_resistance));
+		velocity = _mm256_sub_ps(velocity, _mm256_and_ps(reverse, _mm256_mul_ps(_mm256_set1_ps(0.45f), acceleration)));
+		resistance = _mm256_add_ps(resistance, _mm256_mul_ps(_mm256_set1_ps(0.002f), _mm256_andnot_ps(sign_mask, front_wheel_angle)));
+		velocity = _mm256_mul_ps(velocity, _mm256_sub_ps(_mm256_set1_ps(1.0f), resistance));
+
+		__m256 centering = _mm256_cmp_ps(_mm256_andnot_ps(sign_mask, turn_axis), _mm256_set1_ps(15.0f), _CMP_LT_OQ);
+		front_wheel_angle = _mm256_blendv_ps(front_wheel_angle, _mm256_mul_ps(front_wheel_angle, _mm256_set1_ps(0.9f)), centering);
+
+		__m256 wrapped_direction = mpc_wrap_angle_avx2(direction);
+		__m256 cos_direction = cos_approx_avx2(wrapped_direction);
+		__m256 sin_direction = mpc_sin_avx2(wrapped_direction);
+		__m256 wheel_direction = mpc_wrap_angle_avx2(_mm256_add_ps(direction, front_wheel_angle));
+		__m256 cos_wheel = cos_approx_avx2(wheel_direction);
+		__m256 sin_wheel = mpc_sin_avx2(wheel_direction);
+
+		__m256 wheel_offset_x = _mm256_mul_ps(cos_direction, half_wheel_base);
+		__m256 wheel_offset_y = _mm256_mul_ps(sin_direction, half_wheel_base);
+		__m256 new_front_wheel_x = _mm256_add_ps(_mm256_add_ps(x, wheel_offset_x), _mm256_mul_ps(cos_wheel, velocity));
+		__m256 new_front_wheel_y = _mm256_add_ps(_mm256_add_ps(y, wheel_offset_y), _mm256_mul_ps(sin_wheel, velocity));
+		__m256 new_rear_wheel_x = _mm256_add_ps(_mm256_sub_ps(x, wheel_offset_x), _mm256_mul_ps(cos_direction, velocity));
+		__m256 new_rear_wheel_y = _mm256_add_ps(_mm256_sub_ps(y, wheel_offset_y), _mm256_mul_ps(sin_direction, velocity));
+
+		x = _mm256_mul_ps(_mm256_add_ps(new_front_wheel_x, new_rear_wheel_x), half);
+		y = _mm256_mul_ps(_mm256_add_ps(new_front_wheel_y, new_rear_wheel_y), half);
+		direction = atan2_approx_avx2(_mm256_sub_ps(new_front_wheel_y, new_rear_wheel_y), _mm256_sub_ps(new_front_wheel_x, new_rear_wheel_x));
+
+		__m256 dx = _mm256_sub_ps(target_x_lanes, x);
+		__m256 dy = _mm256_sub_ps(target_y_lanes, y);
+		distance_sum = _mm256_add_ps(distance_sum, _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy))));
+
+		if (mpc->grid) {
+			float lane_x[MPC_LANES], lane_y[MPC_LANES];
+			_mm256_storeu_ps(lane_x, x);
+			_mm256_storeu_ps(lane_y, y);
+			for (u32 lane = 0; lane < MPC_LANES; ++lane) {
+				s32 cell_x, cell_y;
+				if (occupancy_grid_cell_at(mpc->grid, lane_x[lane], lane_y[lane], &cell_x, &cell_y)) {
+					obstacle_ticks[lane] += mpc->grid->cells[cell_y*mpc->grid->width + cell_x] != 0;
+				}
+			}
+		}
+	}
+
+	__m256 dx = _mm256_sub_ps(target_x_lanes, x);
+	__m256 dy = _mm256_sub_ps(target_y_lanes, y);
+	__m256 terminal = _mm256_mul_ps(_mm256_set1_ps(mpc->config.terminal_weight), _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy))));
+	_mm256_storeu_ps(costs, _mm256_add_ps(_mm256_mul_ps(distance_sum, inverse_horizon), terminal));
+
+	for (u32 lane = 0; lane < MPC_LANES; ++lane) {
+		costs[lane] += obstacle_ticks[lane]*mpc->config.obstacle_cost;
+	}
+}
+
+#endif // CONTROLLER_HAS_AVX2_KERNEL
+
+typedef struct Mpc_Batch {
+	Mpc_Controller *mpc;
+	Car *cars;
+	Sensor_Data *sensor_data;
+	u32 first_car; // Index of cars[0] in the fleet, for the plans
+	b32 use_avx2;
+} Mpc_Batch;
+
+// Job items are (car, group of eight candidates) pairs
+static inline void mpc_rollout_job(void *data, u32 first, u32 end, u32 worker) {
+	(void)worker; // Unused
+
+	Mpc_Batch *batch = data;
+	Mpc_Controller *mpc = batch->mpc;
+	u32 group_count = mpc->config.candidate_count/MPC_LANES;
+	Control_Input inputs[MPC_LANES][MPC_MAX_HORIZON];
+
+	for (u32 item = first; item < end; ++item) {
+		u32 car = item/group_count;
+		u32 group = item%group_count;
+		u32 fleet_car = batch->first_car + car;
+		Car *model = &batch->cars[car];
+		Control_Input *plan = mpc->plans + (umm)fleet_car*mpc->config.horizon;
+
+		// The target is wherever the sensors point, so waypoints from the planner carry over
+		float target_x = model->x + batch->sensor_data[car].delta_x;
+		float target_y = model->y + batch->sensor_data[car].delta_y;
+
+		for (u32 lane = 0; lane < MPC_LANES; ++lane) {
+			mpc_candidate_inputs(mpc, fleet_car, group*MPC_LANES + lane, plan, inputs[lane]);
+		}
+
+		float *costs = mpc->costs + (umm)car*mpc->config.candidate_count + group*MPC_LANES;
+#if CONTROLLER_HAS_AVX2_KERNEL
+		if (batch->use_avx2) {
+			mpc_rollout_avx2(mpc, model, target_x, target_y, inputs, costs);
+			continue;
+		}
+#endif
+		mpc_rollout_scalar(mpc, model, target_x, target_y, inputs, costs);
+	}
+}
+
+// Plans for cars [first_car, first_car + count) of a fleet. cars and
+// sensor_data point at the first of them.
+static inline void mpc_controller_evaluate(Mpc_Controller *mpc, Car *cars, Sensor_Data *sensor_data, u32 first_car, u32 count, Control_Input *inputs) {
+	Mpc_Config *config = &mpc->config;
+
+	mpc_controller_reserve_plans(mpc, first_car + count);
+	if (count > mpc->cost_capacity) {
+		mpc->cost_capacity = count*2;
+		mpc->costs = realloc(mpc->costs, (umm)mpc->cost_capacity*config->candidate_count*sizeof(float));
+		if (!mpc->costs) {
+			panic("Could not allocate controller costs.\n");
+		}
+	}
+
+	Mpc_Batch batch = {mpc, cars, sensor_data, first_car, false};
+#if CONTROLLER_HAS_AVX2_KERNEL
+	batch.use_avx2 = SDL_HasAVX2();
+#endif
+
+	u32 group_count = config->candidate_count/MPC_LANES;
+	if (mpc->jobs) {
+		job_system_parallel_for(mpc->jobs, count*group_count, group_count, mpc_rollout_job, &batch);
+	}
+	else {
+		mpc_rollout_job(&batch, 0, count*group_count, 0);
+	}
+
+	// Regenerate each winner and keep it as the next tick's warm start
+	for (u32 car = 0; car < count; ++car) {
+		float *costs = mpc->costs + (umm)car*config->candidate_count;
+		u32 best = 0;
+		for (u32 candidate = 1; candidate < config->candidate_count; ++candidate) {
+			best = costs[candidate] < costs[best] ? candidate : best;
+		}
+
+		Control_Input winner[MPC_MAX_HORIZON];
+		Control_Input *plan = mpc->plans + (umm)(first_car + car)*config->horizon;
+		mpc_candidate_inputs(mpc, first_car + car, best, plan, winner);
+		memcpy(plan, winner, config->horizon*sizeof(Control_Input));
+
+		inputs[car] = winner[0];
+	}
+
+	++mpc->seed;
+}
+
+#endif // CAR_MPC_H
@@ -0,0 +1,100 @@
+#ifndef CAR_PHYSICS_H
+#define CAR_PHYSICS_H
+
+#include "car_common.h"
+#include "car_controller.h"
+
+//
+// Vehicle model shared by the simulator and everything that rolls it forward.
+//
+
+typedef struct Car {
+	float x;
+	float y;
+	float length;
+	float width;
+	float direction;
+	float velocity;
+	float acceleration;
+	float turning_rate;
+	float turning_span;
+	float rolling_resistance;
+	float breaking_resistance;
+	float front_wheel_angle;
+	float rear_wheel_angle;
+	float half_wheel_base;
+
+	float target_x;
+	float target_y;
+} Car;
+
+// The player car's parameters, standing still and facing +x
+static inline Car car_default(float x, float y) {
+	Car car = {0};
+	car.x = x;
+	car.y = y;
+	car.width = 96.0f;
+	car.length = 2.0f*car.width;
+	car.half_wheel_base = car.length*0.97f*0.5f;
+	car.acceleration = 0.09f;
+	car.turning_rate = 0.34f;
+	car.turning_span = 1.2f;
+	car.rolling_resistance = 0.005f;
+	car.breaking_resistance = 0.035f;
+	car.target_x = x;
+	car.target_y = y;
+	return car;
+}
+
+static inline void update_car(Car *car, Control_Input input) {
+
+	if (input.acceleration_axis > 0) {
+		car->velocity += car->acceleration * ((float)input.acceleration_axis/32768.0f);
+	}
+
+	car->front_wheel_angle += car->turning_rate * ((float)input.turn_axis/32768.0f);
+	float effective_turning_span = car->turning_span - fabsf(car->velocity * 0.07f);
+	if (car->front_wheel_angle < -effective_turning_span) car->front_wheel_angle = -effective_turning_span;
+	if (car->front_wheel_angle > effective_turning_span) car->front_wheel_angle = effective_turning_span;
+
+	float resistance = car->rolling_resistance;
+
+	b32 reverse = input.acceleration_axis < 0;
+	b32 breaking = (reverse && car->velocity > 0) || (!reverse && car->velocity < 0);//input.buttons & (CAR_INPUT_BUTTON_BREAK);
+
+	if (breaking) {
+		resistance += car->breaking_resistance;
+	}
+	if (reverse) {
+		car->velocity -= 0.45f*car->acceleration;
+	}
+
+	resistance += 0.002f*((car->front_wheel_angle < 0) ? -car->front_wheel_angle : car->front_wheel_angle);
+
+	car->velocity *= (1.0f - resistance);
+
+	if (abs(input.turn_axis) < 0xf) {
+		car->front_wheel_angle *= 0.9f;
+	}
+
+	float sin_direction = sinf(car->direction);
+	float cos_direction = cosf(car->direction);
+
+	float wheel_offset_x = cos_direction*car->half_wheel_base;
+	float wheel_offset_y = sin_direction*car->half_wheel_base;
+	float rear_wheel_x = car->x - wheel_offset_x;
+	float rear_wheel_y = car->y - wheel_offset_y;
+	float front_wheel_x = car->x + wheel_offset_x;
+	float front_wheel_y = car->y + wheel_offset_y;
+	float new_front_wheel_x = front_wheel_x + cosf(car->direction + car->front_wheel_angle) * car->velocity;
+	float new_front_wheel_y = front_wheel_y + sinf(car->direction + car->front_wheel_angle) * car->velocity;
+	float new_rear_wheel_x = rear_wheel_x + cos_direction * car->velocity;
+	float new_rear_wheel_y = rear_wheel_y + sin_direction * car->velocity;
+
+	car->x = (new_front_wheel_x + new_rear_wheel_x)*0.5f;
+	car->y = (new_front_wheel_y + new_rear_wheel_y)*0.5f;
+
+	car->direction = atan2f((new_front_wheel_y - new_rear_wheel_y), (new_front_wheel_x - new_rear_wheel_x));
+}
+
+#endif // CAR_PHYSICS_H
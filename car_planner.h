@@ -0,0 +1,391 @@
+#ifndef CAR_PLANNER_H
+#define CAR_PLANNER_H
+
+#include "car_common.h"
+#include "car_grid.h"
+
+//
+// Incremental grid planner (D* Lite).
+//
+// The search runs backwards from the target, so g[cell] is the cost to go
+// from any cell and every car can read its path off the same field.
+// Painting an obstacle only changes the edges around the affected cells and
+// repairs incrementally. Moving the target changes the cost to go of nearly
+// every cell, which costs more to repair than to search again, so it
+// restarts the search from the new target cell instead.
+//
+// Keys use the octile distance to a focus cell (the player car), with the
+// usual key modifier when the focus moves, so the search settles the
+// player's path first and spends the rest of the frame budget on the others.
+// Car kinematics enter through the footprint: occupied cells are inflated
+// by the car's half width, and waypoints are taken far enough along the
+// path for the car to turn onto them.
+//
+
+#define PLANNER_INFINITY 1e30f
+#define PLANNER_NOT_QUEUED 0xffffffffu
+
+typedef struct Planner_Key {
+	float primary;   // min(g, rhs) + h(focus, cell) + key_modifier
+	float secondary; // min(g, rhs)
+} Planner_Key;
+
+typedef struct Planner_Queue_Entry {
+	Planner_Key key;
+	u32 cell;
+} Planner_Queue_Entry;
+
+typedef struct Path_Planner {
+	Occupancy_Grid *grid;
+	s32 inflation_radius; // In cells
+	u16 *blocking_count;  // Occupied cells within the inflation radius of each cell
+
+	float *g;   // Cost to go
+	float *rhs; // One step lookahead of g
+	u32 *queue_index;
+
+	Planner_Queue_Entry *queue; // Binary min heap
+	u32 queue_count;
+
+	u32 target;
+	float target_x;
+	float target_y;
+	b32 has_target;
+
+	u32 focus;
+	float key_modifier;
+
+	u32 expansion_count; // Expansions during the last update
+} Path_Planner;
+
+static const s32 planner_neighbor_dx[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+static const s32 planner_neighbor_dy[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+
+static inline b32 planner_blocked(Path_Planner *planner, s32 x, s32 y) {
+	return !occupancy_grid_inside(planner->grid, x, y) || planner->blocking_count[y*planner->grid->width + x] != 0;
+}
+
+// Cost of moving between neighboring cells. Diagonal moves may not cut
+// the corner of a blocked cell.
+static inline float planner_edge_cost(Path_Planner *planner, s32 x, s32 y, u32 direction) {
+	s32 dx = planner_neighbor_dx[direction];
+	s32 dy = planner_neighbor_dy[direction];
+	if (planner_blocked(planner, x, y) || planner_blocked(planner, x + dx, y + dy)) {
+		return PLANNER_INFINITY;
+	}
+	if (dx && dy) {
+		if (planner_blocked(planner, x + dx, y) || planner_blocked(planner, x, y + dy)) {
+			return PLANNER_INFINITY;
+		}
+		return SQRT2*planner->grid->cell_size;
+	}
+	return planner->grid->cell_size;
+}
+
+static inline float planner_heuristic(Path_Planner *planner, u32 a, u32 b) {
+	s32 width = planner->grid->width;
+	s32 dx = abs((s32)(a % width) - (s32)(b % width));
+	s32 dy = abs((s32)(a / width) - (s32)(b / width));
+	s32 minimum = dx < dy ? dx : dy;
+	s32 maximum = dx < dy ? dy : dx;
+	return ((maximum - minimum) + SQRT2*minimum)*planner->grid->cell_size;
+}
+
+static inline Planner_Key planner_key(Path_Planner *planner, u32 cell) {
+	float cost = planner->g[cell] < planner->rhs[cell] ? planner->g[cell] : planner->rhs[cell];
+	return (Planner_Key){cost + planner_heuristic(planner, planner->focus, cell) + planner->key_modifier, cost};
+}
+
+static inline b32 planner_key_less(Planner_Key a, Planner_Key b) {
+	return a.primary < b.primary || (a.primary == b.primary && a.secondary < b.secondary);
+}
+
+//
+// Queue
+//
+
+static inline void planner_queue_swap(Path_Planner *planner, u32 a, u32 b) {
+	Planner_Queue_Entry entry = planner->queue[a];
+	planner->queue[a] = planner->queue[b];
+	planner->queue[b] = entry;
+	planner->queue_index[planner->queue[a].cell] = a;
+	planner->queue_index[planner->queue[b].cell] = b;
+}
+
+static inline void planner_queue_sift(Path_Planner *planner, u32 index) {
+	Planner_Queue_Entry *queue = planner->queue;
+
+	while (index > 0 && planner_key_less(queue[index].key, queue[(index - 1)/2].key)) {
+		planner_queue_swap(planner, index, (index - 1)/2);
+		index = (index - 1)/2;
+	}
+
+	for (;;) {
+		u32 smallest = index;
+		u32 left = 2*index + 1;
+		u32 right = left + 1;
+		if (left < planner->queue_count && planner_key_less(queue[left].key, queue[smallest].key)) smallest = left;
+		if (right < planner->queue_count && planner_key_less(queue[right].key, queue[smallest].key)) smallest = right;
+		if (smallest == index) break;
+		planner_queue_swap(planner, index, smallest);
+		index = smallest;
+	}
+}
+
+static inline void planner_queue_set(Path_Planner *planner, u32 cell, Planner_Key key) {
+	u32 index = planner->queue_index[cell];
+	if (index == PLANNER_NOT_QUEUED) {
+		index = planner->queue_count++;
+		planner->queue[index].cell = cell;
+		planner->queue_index[cell] = index;
+	}
+	planner->queue[index].key = key;
+	planner_queue_sift(planner, index);
+}
+
+static inline void planner_queue_remove(Path_Planner *planner, u32 cell) {
+	u32 index = planner->queue_index[cell];
+	if (index == PLANNER_NOT_QUEUED) return;
+
+	u32 last = --planner->queue_count;
+	if (index != last) {
+		planner_queue_swap(planner, index, last);
+		planner->queue_index[cell] = PLANNER_NOT_QUEUED;
+		planner_queue_sift(planner, index);
+	}
+	else {
+		planner->queue_index[cell] = PLANNER_NOT_QUEUED;
+	}
+}
+
+//
+// D* Lite
+//
+
+static inline void planner_update_cell(Path_Planner *planner, u32 cell) {
+	s32 width = planner->grid->width;
+	s32 x = cell % width;
+	s32 y = cell / width;
+
+	float rhs = PLANNER_INFINITY;
+	if (planner->has_target && cell == planner->target && !planner_blocked(planner, x, y)) {
+		rhs = 0.0f; // Edge to the virtual goal
+	}
+	else {
+		for (u32 direction = 0; direction < 8; ++direction) {
+			float cost = planner_edge_cost(planner, x, y, direction);
+			if (cost >= PLANNER_INFINITY) continue;
+			u32 neighbor = cell + planner_neighbor_dy[direction]*width + planner_neighbor_dx[direction];
+			float candidate = cost + planner->g[neighbor];
+			rhs = candidate < rhs ? candidate : rhs;
+		}
+	}
+	planner->rhs[cell] = rhs;
+
+	if (planner->g[cell] != rhs) {
+		planner_queue_set(planner, cell, planner_key(planner, cell));
+	}
+	else {
+		planner_queue_remove(planner, cell);
+	}
+}
+
+static inline void planner_update_neighbors(Path_Planner *planner, u32 cell) {
+	s32 width = planner->grid->width;
+	s32 x = cell % width;
+	s32 y = cell / width;
+	for (u32 direction = 0; direction < 8; ++direction) {
+		s32 neighbor_x = x + planner_neighbor_dx[direction];
+		s32 neighbor_y = y + planner_neighbor_dy[direction];
+		if (occupancy_grid_inside(planner->grid, neighbor_x, neighbor_y)) {
+			planner_update_cell(planner, neighbor_y*width + neighbor_x);
+		}
+	}
+}
+
+static inline void path_planner_init(Path_Planner *planner, Occupancy_Grid *grid, s32 inflation_radius) {
+	umm cell_count = (umm)grid->width*grid->height;
+
+	*planner = (Path_Planner){0};
+	planner->grid = grid;
+	planner->inflation_radius = inflation_radius;
+	planner->blocking_count = calloc(cell_count, sizeof(u16));
+	planner->g = malloc(cell_count*sizeof(float));
+	planner->rhs = malloc(cell_count*sizeof(float));
+	planner->queue_index = malloc(cell_count*sizeof(u32));
+	planner->queue = malloc(cell_count*sizeof(Planner_Queue_Entry));
+	if (!planner->blocking_count || !planner->g || !planner->rhs || !planner->queue_index || !planner->queue) {
+		panic("Could not allocate path planner.\n");
+	}
+
+	for (umm i = 0; i < cell_count; ++i) {
+		planner->g[i] = PLANNER_INFINITY;
+		planner->rhs[i] = PLANNER_INFINITY;
+		planner->queue_index[i] = PLANNER_NOT_QUEUED;
+	}
+}
+
+static inline void path_planner_free(Path_Planner *planner) {
+	free(planner->blocking_count);
+	free(planner->g);
+	free(planner->rhs);
+	free(planner->queue_index);
+	free(planner->queue);
+	*planner = (Path_Planner){0};
+}
+
+// Forgets the cost to go field, keeping the inflated obstacles
+static inline void planner_restart(Path_Planner *planner) {
+	umm cell_count = (umm)planner->grid->width*planner->grid->height;
+	for (umm i = 0; i < cell_count; ++i) {
+		planner->g[i] = PLANNER_INFINITY;
+		planner->rhs[i] = PLANNER_INFINITY;
+	}
+	for (u32 i = 0; i < planner->queue_count; ++i) {
+		planner->queue_index[planner->queue[i].cell] = PLANNER_NOT_QUEUED;
+	}
+	planner->queue_count = 0;
+	planner->key_modifier = 0.0f;
+}
+
+// Marks a grid cell occupied or free, and queues the cells whose edges changed
+static inline void path_planner_set_occupied(Path_Planner *planner, s32 cell_x, s32 cell_y, b32 occupied) {
+	Occupancy_Grid *grid = planner->grid;
+	if (!occupancy_grid_inside(grid, cell_x, cell_y)) return;
+
+	u8 *cell = &grid->cells[cell_y*grid->width + cell_x];
+	if (!*cell == !occupied) return;
+	*cell = occupied ? 1 : 0;
+
+	s32 radius = planner->inflation_radius;
+	for (s32 y = cell_y - radius; y <= cell_y + radius; ++y) {
+		for (s32 x = cell_x - radius; x <= cell_x + radius; ++x) {
+			if (!occupancy_grid_inside(grid, x, y)) continue;
+			if ((x - cell_x)*(x - cell_x) + (y - cell_y)*(y - cell_y) > radius*radius) continue;
+
+			u32 index = y*grid->width + x;
+			u16 previous = planner->blocking_count[index];
+			planner->blocking_count[index] += occupied ? 1 : -1;
+
+			if (!previous != !planner->blocking_count[index]) {
+				planner_update_cell(planner, index);
+				planner_update_neighbors(planner, index);
+			}
+		}
+	}
+}
+
+static inline void path_planner_set_target(Path_Planner *planner, float x, float y) {
+	s32 cell_x, cell_y;
+	planner->target_x = x;
+	planner->target_y = y;
+
+	if (!occupancy_grid_cell_at(planner->grid, x, y, &cell_x, &cell_y)) {
+		cell_x = cell_x < 0 ? 0 : (cell_x >= planner->grid->width ? planner->grid->width - 1 : cell_x);
+		cell_y = cell_y < 0 ? 0 : (cell_y >= planner->grid->height ? planner->grid->height - 1 : cell_y);
+	}
+
+	u32 target = cell_y*planner->grid->width + cell_x;
+	if (planner->has_target && target == planner->target) return;
+
+	if (planner->has_target) {
+		planner_restart(planner);
+	}
+	planner->target = target;
+	planner->has_target = true;
+	planner_update_cell(planner, target);
+}
+
+static inline void path_planner_set_focus(Path_Planner *planner, float x, float y) {
+	s32 cell_x, cell_y;
+	if (!occupancy_grid_cell_at(planner->grid, x, y, &cell_x, &cell_y)) return;
+
+	u32 focus = cell_y*planner->grid->width + cell_x;
+	if (focus == planner->focus) return;
+
+	// Keys already in the queue are lower bounds for the new focus once
+	// they are offset by how far it moved
+	planner->key_modifier += planner_heuristic(planner, planner->focus, focus);
+	planner->focus = focus;
+}
+
+// Repairs the cost to go field, expanding at most max_expansions cells.
+// Returns true once every cell is consistent.
+static inline b32 path_planner_update(Path_Planner *planner, u32 max_expansions) {
+	planner->expansion_count = 0;
+
+	while (planner->queue_count && planner->expansion_count < max_expansions) {
+		u32 cell = planner->queue[0].cell;
+		Planner_Key old_key = planner->queue[0].key;
+		Planner_Key new_key = planner_key(planner, cell);
+
+		if (planner_key_less(old_key, new_key)) {
+			planner_queue_set(planner, cell, new_key);
+		}
+		else if (planner->g[cell] > planner->rhs[cell]) {
+			planner->g[cell] = planner->rhs[cell];
+			planner_queue_remove(planner, cell);
+			planner_update_neighbors(planner, cell);
+		}
+		else {
+			planner->g[cell] = PLANNER_INFINITY;
+			planner_update_cell(planner, cell);
+			planner_update_neighbors(planner, cell);
+		}
+
+		++planner->expansion_count;
+	}
+
+	return planner->queue_count == 0;
+}
+
+// Steps from a cell to its cheapest neighbor. Returns false at the target or
+// when the cell has no path.
+static inline b32 planner_step(Path_Planner *planner, u32 *cell) {
+	if (*cell == planner->target || planner->g[*cell] >= PLANNER_INFINITY) return false;
+
+	s32 width = planner->grid->width;
+	s32 x = *cell % width;
+	s32 y = *cell / width;
+
+	u32 best = *cell;
+	float best_cost = PLANNER_INFINITY;
+	for (u32 direction = 0; direction < 8; ++direction) {
+		float cost = planner_edge_cost(planner, x, y, direction);
+		if (cost >= PLANNER_INFINITY) continue;
+		u32 neighbor = *cell + planner_neighbor_dy[direction]*width + planner_neighbor_dx[direction];
+		cost += planner->g[neighbor];
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = neighbor;
+		}
+	}
+
+	if (best == *cell) return false;
+	*cell = best;
+	return true;
+}
+
+// Finds the point `lookahead` cells down the path from (x, y). Returns false
+// if the position is off the grid or has no path, in which case the caller
+// should steer straight at the target.
+static inline b32 path_planner_waypoint(Path_Planner *planner, float x, float y, u32 lookahead, float *waypoint_x, float *waypoint_y) {
+	s32 cell_x, cell_y;
+	if (!planner->has_target || !occupancy_grid_cell_at(planner->grid, x, y, &cell_x, &cell_y)) return false;
+
+	u32 cell = cell_y*planner->grid->width + cell_x;
+	if (planner->g[cell] >= PLANNER_INFINITY) return false;
+
+	for (u32 i = 0; i < lookahead && planner_step(planner, &cell); ++i);
+
+	if (cell == planner->target) {
+		*waypoint_x = planner->target_x;
+		*waypoint_y = planner->target_y;
+	}
+	else {
+		occupancy_grid_cell_center(planner->grid, cell % planner->grid->width, cell / planner->grid->width, waypoint_x, waypoint_y);
+	}
+	return true;
+}
+
+#endif // CAR_PLANNER_H
@@ -0,0 +1,177 @@
+#ifndef CAR_PLUGIN_H
+#define CAR_PLUGIN_H
+
+#include "car_common.h"
+#include "car_file.h"
+#include "car_controller.h"
+
+#include <SDL2/SDL.h>
+
+//
+// Controller plugins are shared objects exporting CONTROLLER_PLUGIN_ENTRY,
+// which returns a Controller_Plugin_API. The host owns the per-car state
+// memory: one contiguous array with state_size bytes per car, initialized
+// with create_state and released with destroy_state. evaluate is called
+// once per tick with parallel arrays for a batch of cars.
+//
+// The ABI only uses fixed size types and the packed protocol structs from
+// car_controller.h. Any incompatible change must bump the version.
+//
+
+#define CONTROLLER_PLUGIN_API_VERSION 1
+#define CONTROLLER_PLUGIN_ENTRY "controller_plugin_get_api"
+
+#if defined(_WIN32) || defined(WIN32)
+#define CONTROLLER_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define CONTROLLER_PLUGIN_EXPORT __attribute__((visibility("default")))
+#endif
+
+typedef struct Controller_Plugin_API {
+	u32 api_version; // CONTROLLER_PLUGIN_API_VERSION
+	u32 state_size;  // Bytes of state per car, may be 0
+	const char *name;
+
+	void (*create_state)(void *state);
+	void (*destroy_state)(void *state);
+	void (*evaluate)(u32 count, const Sensor_Data *sensor_data, void *states, Control_Input *inputs);
+} Controller_Plugin_API;
+
+typedef const Controller_Plugin_API *Controller_Plugin_Get_API(void);
+
+
+//
+// Host side
+//
+
+#define CONTROLLER_PLUGIN_PATH_LENGTH 1024
+
+typedef struct Controller_Plugin {
+	char path[CONTROLLER_PLUGIN_PATH_LENGTH];
+	char loaded_path[CONTROLLER_PLUGIN_PATH_LENGTH + 16]; // Private copy that is actually loaded
+	u64 modified_time;
+	u32 generation;
+
+	void *library;
+	const Controller_Plugin_API *api;
+
+	u8 *states;
+	u32 state_count;
+	umm state_capacity; // In bytes, as the state size changes with reloads
+} Controller_Plugin;
+
+static inline void controller_plugin_destroy_states(Controller_Plugin *plugin) {
+	if (plugin->api && plugin->api->destroy_state) {
+		for (u32 i = 0; i < plugin->state_count; ++i) {
+			plugin->api->destroy_state(plugin->states + (umm)i*plugin->api->state_size);
+		}
+	}
+	plugin->state_count = 0;
+}
+
+// Makes sure cars [0, count) have initialized state
+static inline void *controller_plugin_states(Controller_Plugin *plugin, u32 count) {
+
+	umm state_size = plugin->api->state_size;
+
+	umm needed = (umm)count*state_size;
+	if (needed > plugin->state_capacity) {
+		umm new_capacity = plugin->state_capacity ? plugin->state_capacity : 64*state_size;
+		while (new_capacity < needed) new_capacity *= 2;
+		plugin->states = realloc(plugin->states, new_capacity + 1);
+		if (!plugin->states) {
+			panic("Could not allocate controller plugin states.\n");
+		}
+		plugin->state_capacity = new_capacity;
+	}
+
+	for (; plugin->state_count < count; ++plugin->state_count) {
+		void *state = plugin->states + (umm)plugin->state_count*state_size;
+		memset(state, 0, state_size);
+		if (plugin->api->create_state) {
+			plugin->api->create_state(state);
+		}
+	}
+
+	return plugin->states;
+}
+
+// Loads a private copy of the plugin, so the original can be rebuilt while
+// the simulator runs and the loader never hands back a cached library.
+// On failure the currently loaded plugin, if any, stays active.
+static inline b32 controller_plugin_load(Controller_Plugin *plugin) {
+
+	char copy_path[CONTROLLER_PLUGIN_PATH_LENGTH + 16];
+	snprintf(copy_path, sizeof(copy_path), "%s.live%u", plugin->path, plugin->generation + 1);
+
+	u64 modified_time = file_modified_time(plugin->path);
+	if (!modified_time || !copy_file(plugin->path, copy_path)) {
+		fprintf(stderr, "Could not copy controller plugin '%s'.\n", plugin->path);
+		return false;
+	}
+
+	void *library = SDL_LoadObject(copy_path);
+	Controller_Plugin_Get_API *get_api = NULL;
+	if (library) {
+		void *entry = SDL_LoadFunction(library, CONTROLLER_PLUGIN_ENTRY);
+		memcpy(&get_api, &entry, sizeof(entry)); // Object to function pointer, which ISO C can't spell
+	}
+	const Controller_Plugin_API *api = get_api ? get_api() : NULL;
+
+	if (!api || api->api_version != CONTROLLER_PLUGIN_API_VERSION || !api->evaluate) {
+		fprintf(stderr, "Could not load controller plugin '%s': %s\n", plugin->path,
+			api ? "API version mismatch" : SDL_GetError());
+		if (library) SDL_UnloadObject(library);
+		remove(copy_path);
+		return false;
+	}
+
+	if (plugin->library) {
+		controller_plugin_destroy_states(plugin);
+		SDL_UnloadObject(plugin->library);
+		remove(plugin->loaded_path);
+	}
+
+	plugin->library = library;
+	plugin->api = api;
+	plugin->modified_time = modified_time;
+	++plugin->generation;
+	strcpy(plugin->loaded_path, copy_path);
+
+	printf("Loaded controller plugin '%s' (%s).\n", api->name ? api->name : "unnamed", plugin->path);
+	return true;
+}
+
+static inline b32 controller_plugin_open(Controller_Plugin *plugin, const char *path) {
+	*plugin = (Controller_Plugin){0};
+	if (strlen(path) >= CONTROLLER_PLUGIN_PATH_LENGTH) {
+		return false;
+	}
+	strcpy(plugin->path, path);
+	return controller_plugin_load(plugin);
+}
+
+// Call periodically. Per-car state is recreated by the new code on reload.
+static inline void controller_plugin_reload_if_changed(Controller_Plugin *plugin) {
+	if (plugin->path[0]) {
+		u64 modified_time = file_modified_time(plugin->path);
+		if (modified_time && modified_time != plugin->modified_time) {
+			if (!controller_plugin_load(plugin)) {
+				// Probably still being written, don't retry until it changes again
+				plugin->modified_time = modified_time;
+			}
+		}
+	}
+}
+
+static inline void controller_plugin_close(Controller_Plugin *plugin) {
+	if (plugin->library) {
+		controller_plugin_destroy_states(plugin);
+		SDL_UnloadObject(plugin->library);
+		remove(plugin->loaded_path);
+	}
+	free(plugin->states);
+	*plugin = (Controller_Plugin){0};
+}
+
+#endif // CAR_PLUGIN_H
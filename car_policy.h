@@ -0,0 +1,469 @@
+#ifndef CAR_POLICY_H
+#define CAR_POLICY_H
+
+#include "car_common.h"
+#include "car_controller.h"
+
+//
+// Small multilayer perceptron policies trained offline. A policy file is
+//
+//   Policy_File_Header
+//   per layer: Policy_File_Layer, float weights[output_count][input_count],
+//              float biases[output_count]
+//
+// all little endian. The first layer takes the POLICY_INPUT_COUNT features
+// from policy_features, the last layer produces the acceleration and turn
+// axes in [-1, 1] and optionally a third output whose sign picks the
+// acceleration direction kept in Controller_State.
+//
+// Cars are evaluated in tiles of POLICY_TILE with the activations stored
+// feature-major, so every kernel step is one weight against a vector of cars.
+// The quantized kernel rounds weights to int8 per output row and activations
+// to int8 per car, and multiplies them as 16 bit pairs with madd, which is
+// exact where the 8 bit maddubs would saturate.
+//
+
+#define POLICY_FILE_MAGIC 0x31504c4d // "MLP1"
+#define POLICY_FILE_VERSION 1
+#define POLICY_MAX_LAYERS 8
+#define POLICY_MAX_WIDTH 256
+#define POLICY_TILE 32
+
+enum {
+	POLICY_INPUT_TARGET_COS,      // Of the target's bearing relative to the heading
+	POLICY_INPUT_TARGET_SIN,
+	POLICY_INPUT_DISTANCE,        // In units of 1000
+	POLICY_INPUT_VELOCITY,        // In units of 10
+	POLICY_INPUT_DIRECTION,       // Controller_State.acceleration_direction
+
+	POLICY_INPUT_COUNT
+};
+
+typedef enum Policy_Activation {
+	POLICY_ACTIVATION_LINEAR,
+	POLICY_ACTIVATION_RELU,
+	POLICY_ACTIVATION_TANH,
+
+	COUNT_POLICY_ACTIVATION
+} Policy_Activation;
+
+typedef struct Policy_File_Header {
+	u32 magic;
+	u32 version;
+	u32 layer_count;
+	u32 reserved;
+} Policy_File_Header;
+
+typedef struct Policy_File_Layer {
+	u32 input_count;
+	u32 output_count;
+	u32 activation;
+	u32 reserved;
+} Policy_File_Layer;
+
+typedef struct Policy_Layer {
+	u32 input_count;
+	u32 output_count;
+	u32 pair_count; // Inputs rounded up to pairs for the quantized kernel
+	Policy_Activation activation;
+
+	float *weights; // [output][input]
+	float *biases;
+
+	s32 *quantized_weights; // [output][pair], two s16 holding int8 values
+	float *weight_scales;   // Per output
+} Policy_Layer;
+
+typedef struct Policy_Controller {
+	Policy_Layer layers[POLICY_MAX_LAYERS];
+	u32 layer_count;
+	b32 quantized;
+	b32 use_avx2;
+
+	// Tile scratch, so a policy may only be evaluated by one thread at a time
+	float *activations[2];    // [POLICY_MAX_WIDTH][POLICY_TILE]
+	s32 *quantized_inputs;    // [POLICY_MAX_WIDTH/2][POLICY_TILE]
+	float *input_scales;      // [POLICY_TILE]
+} Policy_Controller;
+
+static inline void policy_controller_free(Policy_Controller *policy) {
+	for (u32 i = 0; i < policy->layer_count; ++i) {
+		Policy_Layer *layer = &policy->layers[i];
+		free(layer->weights);
+		free(layer->biases);
+		free(layer->quantized_weights);
+		free(layer->weight_scales);
+	}
+	free(policy->activations[0]);
+	free(policy->activations[1]);
+	free(policy->quantized_inputs);
+	free(policy->input_scales);
+	*policy = (Policy_Controller){0};
+}
+
+static inline void policy_quantize_layer(Policy_Layer *layer) {
+	for (u32 o = 0; o < layer->output_count; ++o) {
+		float *row = layer->weights + (umm)o*layer->input_count;
+
+		float max_weight = 0.0f;
+		for (u32 i = 0; i < layer->input_count; ++i) {
+			max_weight = fmaxf(max_weight, fabsf(row[i]));
+		}
+		float scale = max_weight > 0.0f ? max_weight/127.0f : 1.0f;
+		layer->weight_scales[o] = scale;
+
+		for (u32 p = 0; p < layer->pair_count; ++p) {
+			u32 i = 2*p;
+			s16 low = (s16)lrintf(row[i]/scale);
+			s16 high = i + 1 < layer->input_count ? (s16)lrintf(row[i + 1]/scale) : 0;
+			layer->quantized_weights[(umm)o*layer->pair_count + p] = (s32)(((u32)(u16)high << 16) | (u16)low);
+		}
+	}
+}
+
+// Parses a policy file's contents. Returns false, leaving the policy empty,
+// if they are malformed.
+static inline b32 policy_controller_read(Policy_Controller *policy, const u8 *data, umm length) {
+
+	*policy = (Policy_Controller){0};
+
+	b32 valid = length >= sizeof(Policy_File_Header);
+	const Policy_File_Header *header = (const Policy_File_Header *)data;
+	valid = valid &&
+		header->magic == POLICY_FILE_MAGIC &&
+		header->version == POLICY_FILE_VERSION &&
+		header->layer_count > 0 && header->layer_count <= POLICY_MAX_LAYERS;
+
+	umm offset = sizeof(Policy_File_Header);
+	u32 previous_output_count = POLICY_INPUT_COUNT;
+
+	for (u32 l = 0; valid && l < header->layer_count; ++l) {
+		if (length - offset < sizeof(Policy_File_Layer)) {
+			valid = false;
+			break;
+		}
+		Policy_File_Layer file_layer;
+		memcpy(&file_layer, data + offset, sizeof(file_layer));
+		offset += sizeof(file_layer);
+
+		b32 last = l + 1 == header->layer_count;
+		valid = file_layer.input_count == previous_output_count &&
+			file_layer.output_count > 0 && file_layer.output_count <= POLICY_MAX_WIDTH &&
+			file_layer.activation < COUNT_POLICY_ACTIVATION &&
+			(!last || file_layer.output_count == 2 || file_layer.output_count == 3);
+
+		umm weight_count = (umm)file_layer.output_count*file_layer.input_count;
+		umm layer_length = (weight_count + file_layer.output_count)*sizeof(float);
+		valid = valid && length - offset >= layer_length;
+		if (!valid) break;
+
+		Policy_Layer *layer = &policy->layers[policy->layer_count++];
+		layer->input_count = file_layer.input_count;
+		layer->output_count = file_layer.output_count;
+		layer->pair_count = (file_layer.input_count + 1)/2;
+		layer->activation = (Policy_Activation)file_layer.activation;
+
+		layer->weights = malloc(weight_count*sizeof(float));
+		layer->biases = malloc(layer->output_count*sizeof(float));
+		layer->quantized_weights = malloc((umm)layer->output_count*layer->pair_count*sizeof(s32));
+		layer->weight_scales = malloc(layer->output_count*sizeof(float));
+		if (!layer->weights || !layer->biases || !layer->quantized_weights || !layer->weight_scales) {
+			panic("Could not allocate policy layer.\n");
+		}
+
+		memcpy(layer->weights, data + offset, weight_count*sizeof(float));
+		offset += weight_count*sizeof(float);
+		memcpy(layer->biases, data + offset, layer->output_count*sizeof(float));
+		offset += layer->output_count*sizeof(float);
+
+		policy_quantize_layer(layer);
+		previous_output_count = layer->output_count;
+	}
+
+	valid = valid && offset == length;
+
+	if (!valid) {
+		policy_controller_free(policy);
+		return false;
+	}
+
+	policy->activations[0] = malloc(POLICY_MAX_WIDTH*POLICY_TILE*sizeof(float));
+	policy->activations[1] = malloc(POLICY_MAX_WIDTH*POLICY_TILE*sizeof(float));
+	policy->quantized_inputs = malloc(POLICY_MAX_WIDTH/2*POLICY_TILE*sizeof(s32));
+	policy->input_scales = malloc(POLICY_TILE*sizeof(float));
+	if (!policy->activations[0] || !policy->activations[1] || !policy->quantized_inputs || !policy->input_scales) {
+		panic("Could not allocate policy scratch.\n");
+	}
+
+#if CONTROLLER_HAS_AVX2_KERNEL
+	policy->use_avx2 = SDL_HasAVX2();
+#endif
+	return true;
+}
+
+// Writes the first tile_count cars' features feature-major into
+// activations, padding the rest of the tile with zeros
+static inline void policy_features(Sensor_Data *sensor_data, Controller_State *states, u32 tile_count, float *activations) {
+	for (u32 c = 0; c < POLICY_TILE; ++c) {
+		float target_cos = 0.0f, target_sin = 0.0f, distance = 0.0f, velocity = 0.0f, direction = 0.0f;
+
+		if (c < tile_count) {
+			Sensor_Data sensors = sensor_data[c];
+			float heading_x = cosf(sensors.heading_direction);
+			float heading_y = sinf(sensors.heading_direction);
+			distance = sqrtf(sensors.delta_x*sensors.delta_x + sensors.delta_y*sensors.delta_y);
+
+			if (distance > 0.0f) {
+				target_cos = (sensors.delta_x*heading_x + sensors.delta_y*heading_y)/distance;
+				target_sin = (sensors.delta_y*heading_x - sensors.delta_x*heading_y)/distance;
+			}
+			else {
+				target_cos = 1.0f;
+			}
+			velocity = sensors.velocity;
+			direction = states[c].acceleration_direction;
+		}
+
+		activations[POLICY_INPUT_TARGET_COS*POLICY_TILE + c] = target_cos;
+		activations[POLICY_INPUT_TARGET_SIN*POLICY_TILE + c] = target_sin;
+		activations[POLICY_INPUT_DISTANCE*POLICY_TILE + c] = distance/1000.0f;
+		activations[POLICY_INPUT_VELOCITY*POLICY_TILE + c] = velocity/10.0f;
+		activations[POLICY_INPUT_DIRECTION*POLICY_TILE + c] = direction;
+	}
+}
+
+// Rational approximation, within 1e-4 of tanh and clamped to +-1 beyond 4.97
+static inline float policy_tanh(float x) {
+	x = fmaxf(-4.97f, fminf(4.97f, x));
+	float s = x*x;
+	float p = x*(135135.0f + s*(17325.0f + s*(378.0f + s)));
+	float q = 135135.0f + s*(62370.0f + s*(3150.0f + s*28.0f));
+	return fmaxf(-1.0f, fminf(1.0f, p/q));
+}
+
+static inline float policy_activate(Policy_Activation activation, float x) {
+	switch (activation) {
+		case POLICY_ACTIVATION_RELU: return fmaxf(x, 0.0f);
+		case POLICY_ACTIVATION_TANH: return policy_tanh(x);
+		default: return x;
+	}
+}
+
+static inline void policy_layer_scalar(Policy_Layer *layer, float *input, float *output) {
+	for (u32 o = 0; o < layer->output_count; ++o) {
+		float *row = layer->weights + (umm)o*layer->input_count;
+		for (u32 c = 0; c < POLICY_TILE; ++c) {
+			float sum = layer->biases[o];
+			for (u32 i = 0; i < layer->input_count; ++i) {
+				sum += row[i]*input[i*POLICY_TILE + c];
+			}
+			output[o*POLICY_TILE + c] = policy_activate(layer->activation, sum);
+		}
+	}
+}
+
+// Rounds each car's activations to int8 with a per car scale, packed in
+// pairs of inputs as [pair][car]
+static inline void policy_quantize_inputs(Policy_Layer *layer, float *input, s32 *quantized, float *scales) {
+	for (u32 c = 0; c < POLICY_TILE; ++c) {
+		float max_input = 0.0f;
+		for (u32 i = 0; i < layer->input_count; ++i) {
+			max_input = fmaxf(max_input, fabsf(input[i*POLICY_TILE + c]));
+		}
+		float scale = max_input > 0.0f ? max_input/127.0f : 1.0f;
+		float inverse_scale = 1.0f/scale;
+		scales[c] = scale;
+
+		for (u32 p = 0; p < layer->pair_count; ++p) {
+			u32 i = 2*p;
+			s16 low = (s16)lrintf(input[i*POLICY_TILE + c]*inverse_scale);
+			s16 high = i + 1 < layer->input_count ? (s16)lrintf(input[(i + 1)*POLICY_TILE + c]*inverse_scale) : 0;
+			quantized[p*POLICY_TILE + c] = (s32)(((u32)(u16)high << 16) | (u16)low);
+		}
+	}
+}
+
+static inline void policy_layer_quantized_scalar(Policy_Layer *layer, s32 *quantized, float *scales, float *output) {
+	for (u32 o = 0; o < layer->output_count; ++o) {
+		s32 *row = layer->quantized_weights + (umm)o*layer->pair_count;
+		for (u32 c = 0; c < POLICY_TILE; ++c) {
+			s32 sum = 0;
+			for (u32 p = 0; p < layer->pair_count; ++p) {
+				s32 weights = row[p];
+				s32 inputs = quantized[p*POLICY_TILE + c];
+				sum += (s32)(s16)weights*(s16)inputs + (s32)(s16)(weights >> 16)*(s16)(inputs >> 16);
+			}
+			float value = (float)sum*(layer->weight_scales[o]*scales[c]) + layer->biases[o];
+			output[o*POLICY_TILE + c] = policy_activate(layer->activation, value);
+		}
+	}
+}
+
+#if CONTROLLER_HAS_AVX2_KERNEL
+
+typedef int check_policy_tile[POLICY_TILE % 32 == 0 ? 1 : -1];
+
+CONTROLLER_AVX2 static inline __m256 policy_activate_avx2(Policy_Activation activation, __m256 x) {
+	if (activation == POLICY_ACTIVATION_RELU) {
+		return _mm256_max_ps(x, _mm256_setzero_ps());
+	}
+	if (activation == POLICY_ACTIVATION_TANH) {
+		__m256 one = _mm256_set1_ps(1.0f);
+		x = _mm256_max_ps(_mm256_set1_ps(-4.97f), _mm256_min_ps(_mm256_set1_ps(4.97f), x));
+		__m256 s = _mm256_mul_ps(x, x);
+		__m256 p = _mm256_add_ps(_mm256_set1_ps(378.0f), s);
+		p = _mm256_add_ps(_mm256_set1_ps(17325.0f), _mm256_mul_ps(s, p));
+		p = _mm256_add_ps(_mm256_set1_ps(135135.0f), _mm256_mul_ps(s, p));
+		p = _mm256_mul_ps(x, p);
+		__m256 q = _mm256_add_ps(_mm256_set1_ps(3150.0f), _mm256_mul_ps(s, _mm256_set1_ps(28.0f)));
+		q = _mm256_add_ps(_mm256_set1_ps(62370.0f), _mm256_mul_ps(s, q));
+		q = _mm256_add_ps(_mm256_set1_ps(135135.0f), _mm256_mul_ps(s, q));
+		__m256 r = _mm256_div_ps(p, q);
+		return _mm256_max_ps(_mm256_sub_ps(_mm256_setzero_ps(), one), _mm256_min_ps(one, r));
+	}
+	return x;
+}
+
+// Four accumulators of eight cars per output; each weight is broadcast once
+// per tile
+CONTROLLER_AVX2 static void policy_layer_avx2(Policy_Layer *layer, float *input, float *output) {
+	for (u32 o = 0; o < layer->output_count; ++o) {
+		float *row = layer->weights + (umm)o*layer->input_count;
+		for (u32 c = 0; c < POLICY_TILE; c += 32) {
+			__m256 bias = _mm256_set1_ps(layer->biases[o]);
+			__m256 sum0 = bias, sum1 = bias, sum2 = bias, sum3 = bias;
+
+			for (u32 i = 0; i < layer->input_count; ++i) {
+				__m256 weight = _mm256_set1_ps(row[i]);
+				float *column = input + i*POLICY_TILE + c;
+				sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(weight, _mm256_loadu_ps(column)));
+				sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(weight, _mm256_loadu_ps(column + 8)));
+				sum2 = _mm256_add_ps(sum2, _mm256_mul_ps(weight, _mm256_loadu_ps(column + 16)));
+				sum3 = _mm256_add_ps(sum3, _mm256_mul_ps(weight, _mm256_loadu_ps(column + 24)));
+			}
+
+			float *out = output + o*POLICY_TILE + c;
+			_mm256_storeu_ps(out,      policy_activate_avx2(layer->activation, sum0));
+			_mm256_storeu_ps(out + 8,  policy_activate_avx2(layer->activation, sum1));
+			_mm256_storeu_ps(out + 16, policy_activate_avx2(layer->activation, sum2));
+			_mm256_storeu_ps(out + 24, policy_activate_avx2(layer->activation, sum3));
+		}
+	}
+}
+
+// The per car maximum is a vertical max over the feature rows. cvtps rounds
+// to nearest even like lrintf, so this matches policy_quantize_inputs.
+CONTROLLER_AVX2 static void policy_quantize_inputs_avx2(Policy_Layer *layer, float *input, s32 *quantized, float *scales) {
+	__m256 sign_mask = _mm256_set1_ps(-0.0f);
+	__m256 zero = _mm256_setzero_ps();
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256i low_mask = _mm256_set1_epi32(0xffff);
+
+	for (u32 c = 0; c < POLICY_TILE; c += 8) {
+		__m256 max_input = zero;
+		for (u32 i = 0; i < layer->input_count; ++i) {
+			max_input = _mm256_max_ps(max_input, _mm256_andnot_ps(sign_mask, _mm256_loadu_ps(input + i*POLICY_TILE + c)));
+		}
+		__m256 scale = _mm256_div_ps(max_input, _mm256_set1_ps(127.0f));
+		scale = _mm256_blendv_ps(scale, one, _mm256_cmp_ps(max_input, zero, _CMP_LE_OQ));
+		__m256 inverse_scale = _mm256_div_ps(one, scale);
+		_mm256_storeu_ps(scales + c, scale);
+
+		for (u32 p = 0; p < layer->pair_count; ++p) {
+			u32 i = 2*p;
+			__m256i low = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(input + i*POLICY_TILE + c), inverse_scale));
+			__m256i high = _mm256_setzero_si256();
+			if (i + 1 < layer->input_count) {
+				high = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(input + (i + 1)*POLICY_TILE + c), inverse_scale));
+			}
+			__m256i pair = _mm256_or_si256(_mm256_and_si256(low, low_mask), _mm256_slli_epi32(high, 16));
+			_mm256_storeu_si256((__m256i *)(quantized + p*POLICY_TILE + c), pair);
+		}
+	}
+}
+
+// Same accumulation pattern, two inputs of eight cars per madd
+CONTROLLER_AVX2 static void policy_layer_quantized_avx2(Policy_Layer *layer, s32 *quantized, float *scales, float *output) {
+	for (u32 o = 0; o < layer->output_count; ++o) {
+		s32 *row = layer->quantized_weights + (umm)o*layer->pair_count;
+		for (u32 c = 0; c < POLICY_TILE; c += 32) {
+			__m256i sum0 = _mm256_setzero_si256(), sum1 = sum0, sum2 = sum0, sum3 = sum0;
+
+			for (u32 p = 0; p < layer->pair_count; ++p) {
+				__m256i weights = _mm256_set1_epi32(row[p]);
+				__m256i *column = (__m256i *)(quantized + p*POLICY_TILE + c);
+				sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(weights, _mm256_loadu_si256(column)));
+				sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(weights, _mm256_loadu_si256(column + 1)));
+				sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(weights, _mm256_loadu_si256(column + 2)));
+				sum3 = _mm256_add_epi32(sum3, _mm256_madd_epi16(weights, _mm256_loadu_si256(column + 3)));
+			}
+
+			__m256 weight_scale = _mm256_set1_ps(layer->weight_scales[o]);
+			__m256 bias = _mm256_set1_ps(layer->biases[o]);
+			__m256i sums[4] = {sum0, sum1, sum2, sum3};
+			for (u32 k = 0; k < 4; ++k) {
+				__m256 scale = _mm256_mul_ps(weight_scale, _mm256_loadu_ps(scales + c + 8*k));
+				__m256 value = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(sums[k]), scale), bias);
+				_mm256_storeu_ps(output + o*POLICY_TILE + c + 8*k, policy_activate_avx2(layer->activation, value));
+			}
+		}
+	}
+}
+
+#endif // CONTROLLER_HAS_AVX2_KERNEL
+
+static inline void policy_controller_evaluate(Policy_Controller *policy, u32 count, Sensor_Data *sensor_data, Controller_State *states, Control_Input *inputs) {
+
+	for (u32 first = 0; first < count; first += POLICY_TILE) {
+		u32 tile_count = count - first < POLICY_TILE ? count - first : POLICY_TILE;
+
+		float *input = policy->activations[0];
+		float *output = policy->activations[1];
+		policy_features(sensor_data + first, states + first, tile_count, input);
+
+		for (u32 l = 0; l < policy->layer_count; ++l) {
+			Policy_Layer *layer = &policy->layers[l];
+
+			if (policy->quantized) {
+#if CONTROLLER_HAS_AVX2_KERNEL
+				if (policy->use_avx2) {
+					policy_quantize_inputs_avx2(layer, input, policy->quantized_inputs, policy->input_scales);
+					policy_layer_quantized_avx2(layer, policy->quantized_inputs, policy->input_scales, output);
+				}
+				else
+#endif
+				{
+					policy_quantize_inputs(layer, input, policy->quantized_inputs, policy->input_scales);
+					policy_layer_quantized_scalar(layer, policy->quantized_inputs, policy->input_scales, output);
+				}
+			}
+			else {
+#if CONTROLLER_HAS_AVX2_KERNEL
+				if (policy->use_avx2) {
+					policy_layer_avx2(layer, input, output);
+				}
+				else
+#endif
+				policy_layer_scalar(layer, input, output);
+			}
+
+			float *swap = input;
+			input = output;
+			output = swap;
+		}
+
+		b32 has_direction = policy->layers[policy->layer_count - 1].output_count == 3;
+		for (u32 c = 0; c < tile_count; ++c) {
+			float acceleration = fmaxf(-1.0f, fminf(1.0f, input[0*POLICY_TILE + c]));
+			float turn = fmaxf(-1.0f, fminf(1.0f, input[1*POLICY_TILE + c]));
+			inputs[first + c].acceleration_axis = (s16)(acceleration*32767.0f);
+			inputs[first + c].turn_axis = (s16)(turn*32767.0f);
+
+			if (has_direction) {
+				states[first + c].acceleration_direction = input[2*POLICY_TILE + c] < 0.0f ? -1.0f : 1.0f;
+			}
+		}
+	}
+}
+
+#endif // CAR_POLICY_H
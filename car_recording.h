@@ -0,0 +1,871 @@
+#ifndef CAR_RECORDING_H
+#define CAR_RECORDING_H
+
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_file.h"
+#include "car_compress.h"
+
+#include <SDL2/SDL.h>
+
+//
+// Session recordings. A recording is a Recording_Header followed by a stream
+// of chunks, each a Recording_Chunk and a payload padded to
+// RECORDING_ALIGNMENT:
+//
+//   RECORDING_CHUNK_TICK      Recording_Tick, Sensor_Data[car_count],
+//                             Control_Input[car_count]
+//   RECORDING_CHUNK_KEYFRAME  Recording_Keyframe, Car[car_count],
+//                             Controller_State[car_count]
+//   RECORDING_CHUNK_INDEX     Recording_Index_Entry per keyframe
+//   RECORDING_CHUNK_BLOCK     Recording_Block_Header, then a compressed run
+//                             of tick, keyframe and hash chunks
+//   RECORDING_CHUNK_HASH      Recording_Hash, u8[car_count]
+//
+// Readers skip chunk types they do not know, and iterate the chunks inside
+// blocks as if they were written out directly.
+//
+// A keyframe holds the whole state at the start of its tick, before the
+// controllers run, and the tick chunk the sensors and inputs of that tick.
+// Keyframes are written every keyframe_interval ticks and whenever the car
+// count changes, so replaying from any keyframe only needs the inputs. On
+// close the recorder appends an index of the keyframes and points
+// header.index_offset at it; readers rebuild it by scanning when it is
+// missing.
+//
+// A hash chunk follows each tick chunk with a hash of the car state after
+// the tick's physics, and the low byte of every car's own hash. A replay
+// recomputes them after simulating the tick, so the first tick that comes
+// out different, and the first car in it, are known. Only the simulated
+// part of a car is hashed: the targets a replay derives from the sensors
+// are not bit exact and do not feed back into the physics.
+//
+// The recorder writes straight into a shared mapping of the file, which it
+// grows geometrically, so a tick costs a copy of the arrays and no system
+// calls. header.data_length only moves past a chunk once the chunk is
+// complete, so a recording cut short by a crash is valid up to the last
+// complete chunk; the rest of the file is zeros up to the mapped length.
+//
+// Compressed recordings collect chunks in memory blocks of about
+// RECORDING_BLOCK_LENGTH instead, and a compressor thread writes them out
+// while the tick thread fills the next block of a small ring. A block
+// always starts at a keyframe when it holds one, so the index points at
+// blocks and a seek decompresses a single block. Before LZ, the arrays of
+// each tick are XORed with the previous tick's and split into byte planes,
+// which turns the bytes that barely change between ticks and cars into long
+// runs. A crash loses the blocks not written out yet, up to
+// RECORDING_BLOCK_COUNT*RECORDING_BLOCK_LENGTH of chunks, and the index,
+// which is why the simulator only compresses when asked to.
+//
+
+#define RECORDING_MAGIC 0x31434552 // "REC1"
+#define RECORDING_VERSION 1
+#define RECORDING_ALIGNMENT 8
+#define RECORDING_INITIAL_LENGTH (64ull << 20)
+#define RECORDING_DEFAULT_KEYFRAME_INTERVAL 300
+#define RECORDING_BLOCK_LENGTH (4u << 20)
+#define RECORDING_BLOCK_COUNT 4 // Keyframes cut blocks short, so a flush can follow a full block closely
+
+typedef enum Recording_Chunk_Type {
+	RECORDING_CHUNK_TICK = 1,
+	RECORDING_CHUNK_KEYFRAME = 2,
+	RECORDING_CHUNK_INDEX = 3,
+	RECORDING_CHUNK_BLOCK = 4,
+	RECORDING_CHUNK_HASH = 5,
+} Recording_Chunk_Type;
+
+typedef struct Recording_Header {
+	u32 magic;
+	u32 version;
+	u32 sensor_size; // sizeof(Sensor_Data) and sizeof(Control_Input) of the writer
+	u32 input_size;
+	u64 data_length; // Bytes of complete chunks after the header
+	u64 tick_count;
+	u64 first_tick;
+	u64 last_tick;
+	u64 index_offset; // Of the index chunk from the start of the file, 0 if none
+	u64 raw_length;   // Bytes of the chunks before block compression
+} Recording_Header;
+
+typedef struct Recording_Chunk {
+	u32 type;
+	u32 length; // Of the payload, including padding
+	u64 tick;
+} Recording_Chunk;
+
+typedef struct Recording_Tick {
+	u32 car_count;
+	u32 reserved;
+} Recording_Tick;
+
+typedef struct Recording_Keyframe {
+	u32 car_count;
+	u32 reserved;
+} Recording_Keyframe;
+
+typedef struct Recording_Hash {
+	u32 car_count;
+	u32 reserved;
+	u64 state_hash; // recording_state_hash of the cars after the tick
+} Recording_Hash;
+
+typedef struct Recording_Index_Entry {
+	u64 tick;
+	u64 offset; // Of the keyframe, or of the block starting with it, from the start of the file
+} Recording_Index_Entry;
+
+#define RECORDING_BLOCK_STARTS_WITH_KEYFRAME 0x1
+
+typedef struct Recording_Block_Header {
+	u32 raw_length;
+	u32 compressed_length; // The payload is padded past it
+	u32 tick_count;
+	u32 flags;
+	u64 first_tick;
+	u64 last_tick;
+} Recording_Block_Header;
+
+typedef int check_recording_header_size[sizeof(Recording_Header) == 64 ? 1 : -1];
+
+static inline u32 recording_padded_length(umm length) {
+	return (u32)((length + RECORDING_ALIGNMENT - 1) & ~(umm)(RECORDING_ALIGNMENT - 1));
+}
+
+static inline Sensor_Data *recording_tick_sensors(Recording_Tick *tick) {
+	return (Sensor_Data *)(tick + 1);
+}
+
+static inline Control_Input *recording_tick_inputs(Recording_Tick *tick) {
+	return (Control_Input *)(recording_tick_sensors(tick) + tick->car_count);
+}
+
+static inline Car *recording_keyframe_cars(Recording_Keyframe *keyframe) {
+	return (Car *)(keyframe + 1);
+}
+
+static inline Controller_State *recording_keyframe_states(Recording_Keyframe *keyframe) {
+	return (Controller_State *)(recording_keyframe_cars(keyframe) + keyframe->car_count);
+}
+
+static inline u8 *recording_hash_cars(Recording_Hash *hash) {
+	return (u8 *)(hash + 1);
+}
+
+// Of the bit patterns of the simulated fields, so any difference between
+// builds shows up
+static inline u64 recording_car_hash(Car *car) {
+	u32 bits[5];
+	memcpy(&bits[0], &car->x, 4);
+	memcpy(&bits[1], &car->y, 4);
+	memcpy(&bits[2], &car->direction, 4);
+	memcpy(&bits[3], &car->velocity, 4);
+	memcpy(&bits[4], &car->front_wheel_angle, 4);
+
+	u64 hash = (((u64)bits[0] << 32) | bits[1])*0x9e3779b97f4a7c15ull;
+	hash = (hash ^ (hash >> 31) ^ (((u64)bits[2] << 32) | bits[3]))*0xbf58476d1ce4e5b9ull;
+	hash = (hash ^ (hash >> 29) ^ bits[4])*0x94d049bb133111ebull;
+	return hash ^ (hash >> 32);
+}
+
+// Folds the cars' hashes in order, so swapped cars differ too. Writes each
+// car's low byte to car_hashes unless it is NULL.
+static inline u64 recording_state_hash(Car *cars, u32 count, u8 *car_hashes) {
+	u64 state = count;
+	for (u32 i = 0; i < count; ++i) {
+		u64 hash = recording_car_hash(&cars[i]);
+		if (car_hashes) {
+			car_hashes[i] = (u8)hash;
+		}
+		state = (state ^ hash)*0x9e3779b97f4a7c15ull;
+	}
+	return state ^ (state >> 29);
+}
+
+// Sets up a chunk header and zeroes the padding, so the file contents are
+// deterministic
+static inline void recording_init_chunk(Recording_Chunk *chunk, Recording_Chunk_Type type, u64 tick, umm length) {
+	chunk->type = type;
+	chunk->length = recording_padded_length(length);
+	chunk->tick = tick;
+	memset((u8 *)(chunk + 1) + length, 0, chunk->length - length);
+}
+
+// Returns the chunk at *offset in data[0, end) and advances *offset past it,
+// or NULL at the end or at a chunk that does not fit
+static inline Recording_Chunk *recording_chunk_at(u8 *data, umm end, umm *offset) {
+
+	if (*offset > end || end - *offset < sizeof(Recording_Chunk)) {
+		return NULL;
+	}
+
+	Recording_Chunk *chunk = (Recording_Chunk *)(data + *offset);
+	if (end - *offset - sizeof(Recording_Chunk) < chunk->length) {
+		return NULL;
+	}
+
+	if (chunk->type == RECORDING_CHUNK_TICK) {
+		Recording_Tick *tick = (Recording_Tick *)(chunk + 1);
+		if (chunk->length < sizeof(Recording_Tick) ||
+			(chunk->length - sizeof(Recording_Tick))/(sizeof(Sensor_Data) + sizeof(Control_Input)) < tick->car_count) {
+			return NULL;
+		}
+	}
+	else if (chunk->type == RECORDING_CHUNK_KEYFRAME) {
+		Recording_Keyframe *keyframe = (Recording_Keyframe *)(chunk + 1);
+		if (chunk->length < sizeof(Recording_Keyframe) ||
+			(chunk->length - sizeof(Recording_Keyframe))/(sizeof(Car) + sizeof(Controller_State)) < keyframe->car_count) {
+			return NULL;
+		}
+	}
+	else if (chunk->type == RECORDING_CHUNK_HASH) {
+		Recording_Hash *hash = (Recording_Hash *)(chunk + 1);
+		if (chunk->length < sizeof(Recording_Hash) || chunk->length - sizeof(Recording_Hash) < hash->car_count) {
+			return NULL;
+		}
+	}
+	else if (chunk->type == RECORDING_CHUNK_BLOCK) {
+		Recording_Block_Header *block = (Recording_Block_Header *)(chunk + 1);
+		if (chunk->length < sizeof(Recording_Block_Header) ||
+			chunk->length - sizeof(Recording_Block_Header) < block->compressed_length) {
+			return NULL;
+		}
+	}
+
+	*offset += sizeof(Recording_Chunk) + chunk->length;
+	return chunk;
+}
+
+// Byte planes of an array of count elements of size bytes, each XORed with
+// the same byte of reference when there is one
+static inline void recording_transform_array(const u8 *in, u8 *out, const u8 *reference, u32 count, u32 size, b32 encode) {
+	for (u32 i = 0; i < count; ++i) {
+		for (u32 b = 0; b < size; ++b) {
+			umm element = (umm)i*size + b;
+			umm plane = (umm)b*count + i;
+			u8 mask = reference ? reference[element] : 0;
+			if (encode) {
+				out[plane] = in[element] ^ mask;
+			}
+			else {
+				out[element] = in[plane] ^ mask;
+			}
+		}
+	}
+}
+
+// Applies or undoes the transform in front of LZ on the length bytes of
+// chunks at in. The chunk headers are left alone, so both directions walk
+// the same structure. Returns false if the chunks do not parse.
+static inline b32 recording_transform_block(u8 *in, u8 *out, umm length, b32 encode) {
+
+	const u8 *previous = NULL; // Untransformed arrays of the previous tick
+	u32 previous_count = 0;
+
+	umm offset = 0;
+	while (offset < length) {
+		umm chunk_offset = offset;
+		Recording_Chunk *chunk = recording_chunk_at(in, length, &offset);
+		if (!chunk) {
+			return false;
+		}
+
+		if (chunk->type != RECORDING_CHUNK_TICK) {
+			memcpy(out + chunk_offset, in + chunk_offset, offset - chunk_offset);
+			continue;
+		}
+
+		Recording_Tick *tick = (Recording_Tick *)(chunk + 1);
+		u32 count = tick->car_count;
+		umm arrays = chunk_offset + sizeof(Recording_Chunk) + sizeof(Recording_Tick);
+		umm sensors_length = (umm)count*sizeof(Sensor_Data);
+		umm arrays_end = arrays + sensors_length + (umm)count*sizeof(Control_Input);
+
+		memcpy(out + chunk_offset, in + chunk_offset, arrays - chunk_offset);
+		memcpy(out + arrays_end, in + arrays_end, offset - arrays_end);
+
+		// Only ticks with the same cars line up
+		const u8 *reference = previous && count == previous_count ? previous : NULL;
+		recording_transform_array(in + arrays, out + arrays, reference, count, sizeof(Sensor_Data), encode);
+		recording_transform_array(in + arrays + sensors_length, out + arrays + sensors_length,
+			reference ? reference + sensors_length : NULL, count, sizeof(Control_Input), encode);
+
+		previous = (encode ? in : out) + arrays;
+		previous_count = count;
+	}
+
+	return true;
+}
+
+
+//
+// Writing
+//
+
+typedef struct Recording_Block {
+	u8 *data;
+	umm length;
+	umm capacity;
+	u64 first_tick; // Of the tick chunks in the block
+	u64 last_tick;
+	u32 tick_count;
+	b32 starts_with_keyframe;
+} Recording_Block;
+
+typedef struct Recorder {
+	Mapped_Write_File file;
+	umm write_offset;       // End of the committed chunks, from the start of the file
+	Recording_Chunk *chunk; // Between begin and end, NULL otherwise
+
+	u32 keyframe_interval;
+	u32 keyframe_car_count; // Of the latest keyframe
+	u64 keyframe_tick;
+	b32 keyframe_written;
+
+	// Appended to by whichever thread writes the file
+	Recording_Index_Entry *keyframes;
+	u32 keyframe_count;
+	u32 keyframe_capacity;
+
+	// Block compression. The tick thread fills blocks[filling] while the
+	// compressor thread owns the full blocks and the file.
+	b32 compressed;
+	Recording_Block blocks[RECORDING_BLOCK_COUNT];
+	u32 filling;
+	SDL_Thread *compressor;
+	SDL_sem *full_blocks;
+	SDL_sem *free_blocks;
+	u32 stall_count; // Blocks the tick thread had to wait for
+
+	// Compressor thread only
+	u8 *transformed;
+	u8 *compressed_data;
+	umm transform_capacity;
+	u32 *hash_table;
+} Recorder;
+
+static inline Recording_Header *recorder_header(Recorder *recorder) {
+	return (Recording_Header *)recorder->file.data;
+}
+
+// Appends a chunk header for a payload of `length` bytes at the end of the
+// file, growing it if needed. Only the thread that owns the file calls this.
+static inline Recording_Chunk *recorder_append_chunk(Recorder *recorder, Recording_Chunk_Type type, u64 tick, umm length) {
+
+	umm needed = recorder->write_offset + sizeof(Recording_Chunk) + recording_padded_length(length);
+
+	if (needed > recorder->file.length) {
+		umm new_length = recorder->file.length + recorder->file.length/2;
+		new_length = new_length > needed ? new_length : needed;
+		if (!remap_write_file(&recorder->file, new_length)) {
+			panic("Could not grow recording to %llu bytes.\n", (unsigned long long)new_length);
+		}
+	}
+
+	Recording_Chunk *chunk = (Recording_Chunk *)(recorder->file.data + recorder->write_offset);
+	recording_init_chunk(chunk, type, tick, length);
+	return chunk;
+}
+
+// Moves the end of the data past an appended chunk, which stood for
+// raw_length bytes of chunks and tick_count ticks
+static inline void recorder_commit_chunk(Recorder *recorder, Recording_Chunk *chunk, umm raw_length, u32 tick_count, u64 first_tick, u64 last_tick) {
+
+	Recording_Header *header = recorder_header(recorder);
+
+	recorder->write_offset = (u8 *)(chunk + 1) + chunk->length - recorder->file.data;
+
+	if (tick_count) {
+		if (header->tick_count == 0) {
+			header->first_tick = first_tick;
+		}
+		header->last_tick = last_tick;
+		header->tick_count += tick_count;
+	}
+	header->raw_length += raw_length;
+	header->data_length = recorder->write_offset - sizeof(Recording_Header);
+}
+
+static inline void recorder_add_keyframe(Recorder *recorder, u64 tick, umm offset) {
+	if (recorder->keyframe_count == recorder->keyframe_capacity) {
+		recorder->keyframe_capacity = recorder->keyframe_capacity ? 2*recorder->keyframe_capacity : 256;
+		recorder->keyframes = realloc(recorder->keyframes, recorder->keyframe_capacity*sizeof(Recording_Index_Entry));
+		if (!recorder->keyframes) {
+			panic("Could not allocate recording index.\n");
+		}
+	}
+	recorder->keyframes[recorder->keyframe_count++] = (Recording_Index_Entry){tick, offset};
+}
+
+static inline void recorder_write_block(Recorder *recorder, Recording_Block *block) {
+
+	if (block->length > recorder->transform_capacity) {
+		recorder->transform_capacity = block->length;
+		free(recorder->transformed);
+		free(recorder->compressed_data);
+		recorder->transformed = malloc(block->length);
+		recorder->compressed_data = malloc(lz_bound(block->length));
+		if (!recorder->transformed || !recorder->compressed_data) {
+			panic("Could not allocate recording compression buffers.\n");
+		}
+	}
+
+	recording_transform_block(block->data, recorder->transformed, block->length, true);
+	umm compressed_length = lz_compress(recorder->transformed, block->length, recorder->compressed_data, recorder->hash_table);
+
+	Recording_Block_Header header = {0};
+	header.raw_length = (u32)block->length;
+	header.compressed_length = (u32)compressed_length;
+	header.tick_count = block->tick_count;
+	header.flags = block->starts_with_keyframe ? RECORDING_BLOCK_STARTS_WITH_KEYFRAME : 0;
+	header.first_tick = block->first_tick;
+	header.last_tick = block->last_tick;
+
+	u64 tick = ((Recording_Chunk *)block->data)->tick;
+	Recording_Chunk *chunk = recorder_append_chunk(recorder, RECORDING_CHUNK_BLOCK, tick, sizeof(header) + compressed_length);
+	memcpy(chunk + 1, &header, sizeof(header));
+	memcpy((u8 *)(chunk + 1) + sizeof(header), recorder->compressed_data, compressed_length);
+
+	if (block->starts_with_keyframe) {
+		recorder_add_keyframe(recorder, tick, (u8 *)chunk - recorder->file.data);
+	}
+	recorder_commit_chunk(recorder, chunk, block->length, block->tick_count, block->first_tick, block->last_tick);
+}
+
+static inline int recorder_compressor_thread(void *data) {
+	Recorder *recorder = data;
+	for (u32 next = 0;; next = (next + 1) % RECORDING_BLOCK_COUNT) {
+		SDL_SemWait(recorder->full_blocks);
+
+		// An empty block is the signal to stop
+		Recording_Block *block = &recorder->blocks[next];
+		if (block->length == 0) {
+			break;
+		}
+
+		recorder_write_block(recorder, block);
+
+		block->length = 0;
+		block->tick_count = 0;
+		block->starts_with_keyframe = false;
+		SDL_SemPost(recorder->free_blocks);
+	}
+	return 0;
+}
+
+// Hands the filling block to the compressor and returns the next one, which
+// only waits when the compressor is the whole ring behind
+static inline Recording_Block *recorder_flush_block(Recorder *recorder) {
+	SDL_SemPost(recorder->full_blocks);
+	recorder->filling = (recorder->filling + 1) % RECORDING_BLOCK_COUNT;
+	if (SDL_SemTryWait(recorder->free_blocks) != 0) {
+		++recorder->stall_count;
+		SDL_SemWait(recorder->free_blocks);
+	}
+	return &recorder->blocks[recorder->filling];
+}
+
+static inline b32 recorder_open(Recorder *recorder, const char *path, b32 compressed) {
+
+	*recorder = (Recorder){0};
+
+	if (!map_file_read_write(path, RECORDING_INITIAL_LENGTH, &recorder->file)) {
+		return false;
+	}
+
+	Recording_Header *header = recorder_header(recorder);
+	*header = (Recording_Header){0};
+	header->magic = RECORDING_MAGIC;
+	header->version = RECORDING_VERSION;
+	header->sensor_size = sizeof(Sensor_Data);
+	header->input_size = sizeof(Control_Input);
+
+	recorder->write_offset = sizeof(Recording_Header);
+	recorder->keyframe_interval = RECORDING_DEFAULT_KEYFRAME_INTERVAL;
+
+	if (compressed) {
+		recorder->compressed = true;
+		for (u32 i = 0; i < RECORDING_BLOCK_COUNT; ++i) {
+			Recording_Block *block = &recorder->blocks[i];
+			block->capacity = RECORDING_BLOCK_LENGTH;
+			block->data = malloc(block->capacity);
+			if (!block->data) {
+				panic("Could not allocate recording blocks.\n");
+			}
+		}
+		recorder->hash_table = malloc(sizeof(u32) << LZ_HASH_BITS);
+		if (!recorder->hash_table) {
+			panic("Could not allocate recording compression buffers.\n");
+		}
+
+		// The tick thread starts out owning block 0, the rest are free
+		recorder->full_blocks = SDL_CreateSemaphore(0);
+		recorder->free_blocks = SDL_CreateSemaphore(RECORDING_BLOCK_COUNT - 1);
+		recorder->compressor = SDL_CreateThread(recorder_compressor_thread, "recording compressor", recorder);
+		if (!recorder->full_blocks || !recorder->free_blocks || !recorder->compressor) {
+			panic("Could not start recording compressor: %s\n", SDL_GetError());
+		}
+	}
+
+	return true;
+}
+
+// Returns space for a payload of `length` bytes, valid until recorder_end_chunk
+static inline void *recorder_begin_chunk(Recorder *recorder, Recording_Chunk_Type type, u64 tick, umm length) {
+
+	assert(!recorder->chunk);
+
+	if (recorder->compressed) {
+		umm needed = sizeof(Recording_Chunk) + recording_padded_length(length);
+		Recording_Block *block = &recorder->blocks[recorder->filling];
+
+		if (block->length && block->length + needed > RECORDING_BLOCK_LENGTH) {
+			block = recorder_flush_block(recorder);
+		}
+
+		// A single chunk can outgrow a block, the block grows to fit it
+		if (block->length + needed > block->capacity) {
+			block->capacity = block->length + needed;
+			block->data = realloc(block->data, block->capacity);
+			if (!block->data) {
+				panic("Could not grow recording block to %llu bytes.\n", (unsigned long long)block->capacity);
+			}
+		}
+
+		recorder->chunk = (Recording_Chunk *)(block->data + block->length);
+		recording_init_chunk(recorder->chunk, type, tick, length);
+	}
+	else {
+		recorder->chunk = recorder_append_chunk(recorder, type, tick, length);
+	}
+
+	return recorder->chunk + 1;
+}
+
+static inline void recorder_end_chunk(Recorder *recorder) {
+
+	assert(recorder->chunk);
+
+	Recording_Chunk *chunk = recorder->chunk;
+	u32 tick_count = chunk->type == RECORDING_CHUNK_TICK;
+	recorder->chunk = NULL;
+
+	if (recorder->compressed) {
+		Recording_Block *block = &recorder->blocks[recorder->filling];
+		block->length += sizeof(Recording_Chunk) + chunk->length;
+		if (tick_count) {
+			if (block->tick_count++ == 0) {
+				block->first_tick = chunk->tick;
+			}
+			block->last_tick = chunk->tick;
+		}
+	}
+	else {
+		recorder_commit_chunk(recorder, chunk, sizeof(Recording_Chunk) + chunk->length, tick_count, chunk->tick, chunk->tick);
+	}
+}
+
+static inline void recorder_write_tick(Recorder *recorder, u64 tick, u32 car_count, Sensor_Data *sensors, Control_Input *inputs) {
+
+	umm length = sizeof(Recording_Tick) + (umm)car_count*(sizeof(Sensor_Data) + sizeof(Control_Input));
+	Recording_Tick *record = recorder_begin_chunk(recorder, RECORDING_CHUNK_TICK, tick, length);
+
+	record->car_count = car_count;
+	record->reserved = 0;
+	memcpy(recording_tick_sensors(record), sensors, car_count*sizeof(Sensor_Data));
+	memcpy(recording_tick_inputs(record), inputs, car_count*sizeof(Control_Input));
+
+	recorder_end_chunk(recorder);
+}
+
+// The state after simulating `tick`, written after its tick chunk
+static inline void recorder_write_hash(Recorder *recorder, u64 tick, u32 car_count, Car *cars) {
+
+	Recording_Hash *hash = recorder_begin_chunk(recorder, RECORDING_CHUNK_HASH, tick, sizeof(Recording_Hash) + car_count);
+
+	hash->car_count = car_count;
+	hash->reserved = 0;
+	hash->state_hash = recording_state_hash(cars, car_count, recording_hash_cars(hash));
+
+	recorder_end_chunk(recorder);
+}
+
+static inline b32 recorder_keyframe_due(Recorder *recorder, u64 tick, u32 car_count) {
+	return !recorder->keyframe_written || car_count != recorder->keyframe_car_count ||
+		tick - recorder->keyframe_tick >= recorder->keyframe_interval;
+}
+
+static inline void recorder_write_keyframe(Recorder *recorder, u64 tick, u32 car_count, Car *cars, Controller_State *states) {
+
+	// Start a block here, so seeking to the keyframe decompresses one block
+	if (recorder->compressed) {
+		Recording_Block *block = &recorder->blocks[recorder->filling];
+		if (block->length) {
+			block = recorder_flush_block(recorder);
+		}
+		block->starts_with_keyframe = true;
+	}
+
+	umm length = sizeof(Recording_Keyframe) + (umm)car_count*(sizeof(Car) + sizeof(Controller_State));
+	Recording_Keyframe *keyframe = recorder_begin_chunk(recorder, RECORDING_CHUNK_KEYFRAME, tick, length);
+
+	keyframe->car_count = car_count;
+	keyframe->reserved = 0;
+	memcpy(recording_keyframe_cars(keyframe), cars, car_count*sizeof(Car));
+	memcpy(recording_keyframe_states(keyframe), states, car_count*sizeof(Controller_State));
+
+	if (!recorder->compressed) {
+		recorder_add_keyframe(recorder, tick, (u8 *)recorder->chunk - recorder->file.data);
+	}
+	recorder->keyframe_tick = tick;
+	recorder->keyframe_car_count = car_count;
+	recorder->keyframe_written = true;
+
+	recorder_end_chunk(recorder);
+}
+
+// Writes out the pending block, appends the keyframe index, then truncates
+// the file to the recorded data. The final header is copied to final_header
+// when it is not NULL. Returns false if truncating failed, in which case the
+// recording is still valid but carries trailing zeros.
+static inline b32 recorder_close(Recorder *recorder, Recording_Header *final_header) {
+
+	if (recorder->compressed) {
+		Recording_Block *block = &recorder->blocks[recorder->filling];
+		if (block->length) {
+			block = recorder_flush_block(recorder);
+		}
+		// The compressor stops at the empty block after the pending one
+		SDL_SemPost(recorder->full_blocks);
+		SDL_WaitThread(recorder->compressor, NULL);
+		SDL_DestroySemaphore(recorder->full_blocks);
+		SDL_DestroySemaphore(recorder->free_blocks);
+
+		for (u32 i = 0; i < RECORDING_BLOCK_COUNT; ++i) {
+			free(recorder->blocks[i].data);
+		}
+		free(recorder->transformed);
+		free(recorder->compressed_data);
+		free(recorder->hash_table);
+	}
+
+	b32 result = true;
+	if (recorder->file.data) {
+		if (recorder->keyframe_count) {
+			umm length = recorder->keyframe_count*sizeof(Recording_Index_Entry);
+			Recording_Chunk *chunk = recorder_append_chunk(recorder, RECORDING_CHUNK_INDEX, recorder_header(recorder)->last_tick, length);
+			memcpy(chunk + 1, recorder->keyframes, length);
+			recorder_commit_chunk(recorder, chunk, 0, 0, 0, 0);
+			recorder_header(recorder)->index_offset = (u8 *)chunk - recorder->file.data;
+		}
+		if (final_header) {
+			*final_header = *recorder_header(recorder);
+		}
+		result = unmap_write_file(&recorder->file, recorder->write_offset);
+	}
+	free(recorder->keyframes);
+	*recorder = (Recorder){0};
+	return result;
+}
+
+
+//
+// Reading
+//
+
+typedef struct Recording_Reader {
+	Mapped_File file;
+	Recording_Header *header;
+	umm end; // Of the committed chunks, from the start of the file
+
+	Recording_Index_Entry *keyframes; // Into the file, or allocated when rebuilt
+	u32 keyframe_count;
+	b32 owns_keyframes;
+
+	// The block decompressed last
+	umm block; // Offset of its chunk, 0 if none
+	u8 *block_data;
+	umm block_length;
+	u8 *scratch;
+	umm block_capacity;
+} Recording_Reader;
+
+// A position in the chunk stream, which may be inside a block
+typedef struct Recording_Cursor {
+	umm offset;       // Of the next chunk in the file
+	umm block;        // Of the block chunk being read from, 0 if none
+	umm block_offset; // Of the next chunk in the decompressed block
+} Recording_Cursor;
+
+static inline void recording_reader_close(Recording_Reader *reader) {
+	if (reader->owns_keyframes) {
+		free(reader->keyframes);
+	}
+	free(reader->block_data);
+	free(reader->scratch);
+	unmap_file(&reader->file);
+	*reader = (Recording_Reader){0};
+}
+
+static inline umm recording_first_chunk(Recording_Reader *reader) {
+	(void)reader;
+	return sizeof(Recording_Header);
+}
+
+static inline Recording_Cursor recording_cursor_at(umm offset) {
+	return (Recording_Cursor){offset, 0, 0};
+}
+
+// Decompresses the block chunk at offset, unless it is the current one
+static inline b32 recording_load_block(Recording_Reader *reader, umm offset) {
+
+	if (reader->block == offset) {
+		return true;
+	}
+	reader->block = 0;
+
+	umm end = offset;
+	Recording_Chunk *chunk = recording_chunk_at(reader->file.data, reader->end, &end);
+	if (!chunk || chunk->type != RECORDING_CHUNK_BLOCK) {
+		return false;
+	}
+
+	Recording_Block_Header *header = (Recording_Block_Header *)(chunk + 1);
+	if (header->raw_length > reader->block_capacity) {
+		reader->block_capacity = header->raw_length;
+		free(reader->block_data);
+		free(reader->scratch);
+		reader->block_data = malloc(reader->block_capacity);
+		reader->scratch = malloc(reader->block_capacity);
+		if (!reader->block_data || !reader->scratch) {
+			panic("Could not allocate %u bytes for a recording block.\n", header->raw_length);
+		}
+	}
+
+	umm length = lz_decompress((u8 *)(header + 1), header->compressed_length, reader->scratch, header->raw_length);
+	if (length != header->raw_length || !recording_transform_block(reader->scratch, reader->block_data, length, false)) {
+		return false;
+	}
+
+	reader->block = offset;
+	reader->block_length = length;
+	return true;
+}
+
+// Returns the next tick, keyframe or other chunk and advances the cursor, or
+// NULL at the end of the data or at a chunk that does not fit. Chunks inside
+// blocks are valid until the next call.
+static inline Recording_Chunk *recording_next_chunk(Recording_Reader *reader, Recording_Cursor *cursor) {
+
+	for (;;) {
+		if (cursor->block) {
+			if (!recording_load_block(reader, cursor->block)) {
+				return NULL;
+			}
+			Recording_Chunk *chunk = recording_chunk_at(reader->block_data, reader->block_length, &cursor->block_offset);
+			// Leave the block as soon as it is done, so a copy of the cursor
+			// peeking ahead into the next block does not cost a reload
+			if (!chunk || cursor->block_offset >= reader->block_length) {
+				cursor->block = 0;
+			}
+			if (chunk) {
+				return chunk;
+			}
+		}
+
+		umm offset = cursor->offset;
+		Recording_Chunk *chunk = recording_chunk_at(reader->file.data, reader->end, &cursor->offset);
+		if (!chunk || chunk->type != RECORDING_CHUNK_BLOCK) {
+			return chunk;
+		}
+		cursor->block = offset;
+		cursor->block_offset = 0;
+	}
+}
+
+// Uses the index chunk if the recording was closed, otherwise scans the
+// chunk headers, which only touches one cache line per chunk and does not
+// decompress blocks
+static inline void recording_load_index(Recording_Reader *reader) {
+
+	umm index_offset = reader->header->index_offset;
+	if (index_offset >= recording_first_chunk(reader) && index_offset < reader->end) {
+		umm offset = index_offset;
+		Recording_Chunk *chunk = recording_chunk_at(reader->file.data, reader->end, &offset);
+		if (chunk && chunk->type == RECORDING_CHUNK_INDEX) {
+			reader->keyframes = (Recording_Index_Entry *)(chunk + 1);
+			reader->keyframe_count = chunk->length/sizeof(Recording_Index_Entry);
+			return;
+		}
+	}
+
+	u32 capacity = 0;
+	umm offset = recording_first_chunk(reader);
+	for (;;) {
+		umm chunk_offset = offset;
+		Recording_Chunk *chunk = recording_chunk_at(reader->file.data, reader->end, &offset);
+		if (!chunk) break;
+
+		b32 keyframe = chunk->type == RECORDING_CHUNK_KEYFRAME ||
+			(chunk->type == RECORDING_CHUNK_BLOCK &&
+			 (((Recording_Block_Header *)(chunk + 1))->flags & RECORDING_BLOCK_STARTS_WITH_KEYFRAME));
+		if (!keyframe) continue;
+
+		if (reader->keyframe_count == capacity) {
+			capacity = capacity ? 2*capacity : 256;
+			reader->keyframes = realloc(reader->keyframes, capacity*sizeof(Recording_Index_Entry));
+			if (!reader->keyframes) {
+				panic("Could not allocate recording index.\n");
+			}
+		}
+		reader->keyframes[reader->keyframe_count++] = (Recording_Index_Entry){chunk->tick, chunk_offset};
+	}
+	reader->owns_keyframes = true;
+}
+
+// Index of the last keyframe at or before tick, or -1 if there is none
+static inline s32 recording_find_keyframe(Recording_Reader *reader, u64 tick) {
+	s32 low = 0;
+	s32 high = (s32)reader->keyframe_count - 1;
+	s32 result = -1;
+	while (low <= high) {
+		s32 middle = low + (high - low)/2;
+		if (reader->keyframes[middle].tick <= tick) {
+			result = middle;
+			low = middle + 1;
+		}
+		else {
+			high = middle - 1;
+		}
+	}
+	return result;
+}
+
+static inline b32 recording_reader_open(Recording_Reader *reader, const char *path) {
+
+	*reader = (Recording_Reader){0};
+
+	if (!map_file_read_only(path, &reader->file)) {
+		return false;
+	}
+
+	Recording_Header *header = (Recording_Header *)reader->file.data;
+	b32 valid = reader->file.length >= sizeof(Recording_Header) &&
+		header->magic == RECORDING_MAGIC &&
+		header->version == RECORDING_VERSION &&
+		header->sensor_size == sizeof(Sensor_Data) &&
+		header->input_size == sizeof(Control_Input) &&
+		header->data_length <= reader->file.length - sizeof(Recording_Header);
+
+	if (!valid) {
+		unmap_file(&reader->file);
+		return false;
+	}
+
+	reader->header = header;
+	reader->end = sizeof(Recording_Header) + header->data_length;
+	recording_load_index(reader);
+	return true;
+}
+
+#endif // CAR_RECORDING_H
@@ -0,0 +1,233 @@
+#ifndef CAR_REPLAY_H
+#define CAR_REPLAY_H
+
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_recording.h"
+
+//
+// Replays a recording by re-simulating its inputs with update_car. Seeking
+// binary searches the keyframe index for the last keyframe at or before the
+// requested tick, loads it and simulates forwards from there, so a seek
+// costs at most one keyframe interval of physics.
+//
+// Controllers are not run again. Controller_State is as of the latest
+// keyframe loaded, and the targets follow the recorded sensors.
+//
+// Every tick with a recorded state hash is checked after it is simulated.
+// The first tick that does not match is kept, with the first car whose
+// hash byte differs, or -1 if only the combined hash caught it.
+//
+// Keyframes with more than REPLAY_MAX_CAR_COUNT cars are refused: opening
+// fails, or the replay stops before the keyframe with `rejected` set.
+//
+
+#define REPLAY_MAX_CAR_COUNT CONTROLLER_MAX_CARS
+
+typedef struct Replayer {
+	Recording_Reader reader;
+
+	Car *cars;
+	Controller_State *states;
+	Control_Input *inputs; // Of the tick simulated last
+	u32 car_count;
+	u32 car_capacity;
+
+	u64 tick; // The cars hold the state at the start of this tick
+	Recording_Cursor cursor;
+
+	u64 hashed_ticks; // Checked against a recorded hash
+	b32 diverged;
+	u64 divergent_tick;
+	s32 divergent_car;
+
+	b32 rejected; // A keyframe had too many cars
+} Replayer;
+
+// Leaves the replayer untouched if the keyframe has too many cars
+static inline b32 replayer_load_keyframe(Replayer *replayer, Recording_Chunk *chunk) {
+
+	Recording_Keyframe *keyframe = (Recording_Keyframe *)(chunk + 1);
+	u32 count = keyframe->car_count;
+
+	if (count > REPLAY_MAX_CAR_COUNT) {
+		replayer->rejected = true;
+		return false;
+	}
+
+	if (count > replayer->car_capacity) {
+		replayer->car_capacity = count;
+		replayer->cars = realloc(replayer->cars, count*sizeof(Car));
+		replayer->states = realloc(replayer->states, count*sizeof(Controller_State));
+		replayer->inputs = realloc(replayer->inputs, count*sizeof(Control_Input));
+		if (!replayer->cars || !replayer->states || !replayer->inputs) {
+			panic("Could not allocate replay cars.\n");
+		}
+	}
+
+	memcpy(replayer->cars, recording_keyframe_cars(keyframe), count*sizeof(Car));
+	memcpy(replayer->states, recording_keyframe_states(keyframe), count*sizeof(Controller_State));
+	memset(replayer->inputs, 0, count*sizeof(Control_Input));
+	replayer->car_count = count;
+	replayer->tick = chunk->tick;
+	return true;
+}
+
+// Loads keyframe `index` of the reader's index
+static inline b32 replayer_jump_to_keyframe(Replayer *replayer, s32 index) {
+	Recording_Cursor cursor = recording_cursor_at(replayer->reader.keyframes[index].offset);
+	Recording_Chunk *chunk = recording_next_chunk(&replayer->reader, &cursor);
+	if (!chunk || chunk->type != RECORDING_CHUNK_KEYFRAME || !replayer_load_keyframe(replayer, chunk)) {
+		return false;
+	}
+	replayer->cursor = cursor;
+	return true;
+}
+
+// Keyframes inside a run only matter where cars were added or removed,
+// otherwise the simulated state is already the same. They are applied when
+// the next tick starts, so between steps the cars and inputs are still
+// those of the tick just simulated. Returns false if the keyframe was
+// refused.
+static inline b32 replayer_apply_keyframe(Replayer *replayer) {
+	Recording_Cursor cursor = replayer->cursor;
+	Recording_Chunk *chunk = recording_next_chunk(&replayer->reader, &cursor);
+	if (chunk && chunk->type == RECORDING_CHUNK_KEYFRAME && chunk->tick >= replayer->tick) {
+		if (((Recording_Keyframe *)(chunk + 1))->car_count != replayer->car_count &&
+			!replayer_load_keyframe(replayer, chunk))
+		{
+			return false;
+		}
+		replayer->cursor = cursor;
+	}
+	return true;
+}
+
+static inline void replayer_check_hash(Replayer *replayer, Recording_Chunk *chunk) {
+
+	++replayer->hashed_ticks;
+	if (replayer->diverged) {
+		return;
+	}
+
+	Recording_Hash *hash = (Recording_Hash *)(chunk + 1);
+	u32 count = replayer->car_count;
+	if (hash->car_count == count && recording_state_hash(replayer->cars, count, NULL) == hash->state_hash) {
+		return;
+	}
+
+	replayer->diverged = true;
+	replayer->divergent_tick = chunk->tick;
+	replayer->divergent_car = -1;
+
+	u32 common = hash->car_count < count ? hash->car_count : count;
+	u8 *car_hashes = recording_hash_cars(hash);
+	for (u32 i = 0; i < common; ++i) {
+		if ((u8)recording_car_hash(&replayer->cars[i]) != car_hashes[i]) {
+			replayer->divergent_car = (s32)i;
+			return;
+		}
+	}
+	if (hash->car_count != count) {
+		replayer->divergent_car = (s32)common;
+	}
+}
+
+// Simulates one tick. Returns false at the end of the recording, or when a
+// keyframe was refused.
+static inline b32 replayer_step(Replayer *replayer) {
+
+	for (;;) {
+		if (!replayer_apply_keyframe(replayer)) {
+			return false;
+		}
+
+		Recording_Chunk *chunk = recording_next_chunk(&replayer->reader, &replayer->cursor);
+		if (!chunk) {
+			return false;
+		}
+
+		// Ticks are consecutive unless the simulator skipped some
+		if (chunk->type == RECORDING_CHUNK_TICK && chunk->tick >= replayer->tick) {
+			Recording_Tick *tick = (Recording_Tick *)(chunk + 1);
+			Sensor_Data *sensors = recording_tick_sensors(tick);
+			Control_Input *inputs = recording_tick_inputs(tick);
+			u32 count = tick->car_count < replayer->car_count ? tick->car_count : replayer->car_count;
+
+			for (u32 i = 0; i < count; ++i) {
+				Car *car = &replayer->cars[i];
+				car->target_x = car->x + sensors[i].delta_x;
+				car->target_y = car->y + sensors[i].delta_y;
+				update_car(car, inputs[i]);
+			}
+			memcpy(replayer->inputs, inputs, count*sizeof(Control_Input));
+
+			// The hash, if recorded, comes right after the tick
+			u64 simulated_tick = chunk->tick;
+			Recording_Cursor cursor = replayer->cursor;
+			Recording_Chunk *hash = recording_next_chunk(&replayer->reader, &cursor);
+			if (hash && hash->type == RECORDING_CHUNK_HASH && hash->tick == simulated_tick) {
+				replayer_check_hash(replayer, hash);
+				replayer->cursor = cursor;
+			}
+
+			replayer->tick = simulated_tick + 1;
+			return true;
+		}
+	}
+}
+
+// Leaves the cars at the start of `tick`, clamped to the recorded range.
+// Forward seeks within the current keyframe interval continue from the
+// current state.
+static inline void replayer_seek(Replayer *replayer, u64 tick) {
+
+	Recording_Header *header = replayer->reader.header;
+	u64 end_tick = header->tick_count ? header->last_tick + 1 : 0;
+	tick = tick < end_tick ? tick : end_tick;
+
+	s32 index = recording_find_keyframe(&replayer->reader, tick);
+	if (index < 0) {
+		index = 0;
+	}
+
+	if (tick < replayer->tick || replayer->reader.keyframes[index].tick > replayer->tick) {
+		if (!replayer_jump_to_keyframe(replayer, index)) {
+			return;
+		}
+	}
+
+	while (replayer->tick < tick && replayer_step(replayer)) {
+	}
+
+	// Cars spawned at `tick` are there at its start
+	replayer_apply_keyframe(replayer);
+}
+
+// Fails if the recording is unreadable or has no keyframes
+static inline b32 replayer_open(Replayer *replayer, const char *path) {
+
+	*replayer = (Replayer){0};
+
+	if (!recording_reader_open(&replayer->reader, path)) {
+		return false;
+	}
+
+	if (replayer->reader.keyframe_count == 0 || !replayer_jump_to_keyframe(replayer, 0)) {
+		recording_reader_close(&replayer->reader);
+		return false;
+	}
+
+	return true;
+}
+
+static inline void replayer_close(Replayer *replayer) {
+	recording_reader_close(&replayer->reader);
+	free(replayer->cars);
+	free(replayer->states);
+	free(replayer->inputs);
+	*replayer = (Replayer){0};
+}
+
+#endif // CAR_REPLAY_H
@@ -0,0 +1,375 @@
+#ifndef CAR_REWIND_H
+#define CAR_REWIND_H
+
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+
+//
+// Rewind buffer: the last seconds of the simulation in a fixed amount of
+// memory, for scrubbing back while debugging a controller and resuming from
+// any tick still held.
+//
+// Each tick the changing part of every car is quantized to integers: pose,
+// speed and wheel angle, target, controller state and inputs. A frame
+// stores per car a varint mask of the fields that changed since the
+// previous frame, followed by their zigzag varint deltas, which comes to a
+// few bytes per moving car. Every REWIND_KEYFRAME_INTERVAL frames the deltas
+// are taken against zero instead, so any frame decodes from the keyframe
+// before it.
+//
+// Frames live in a byte ring of fixed capacity and a frame ring of fixed
+// length. The oldest frames are dropped when either is full, always up to
+// the next keyframe so what is left still decodes. Deltas are taken between
+// quantized values, so the error stays within half a step however far a
+// frame is from its keyframe.
+//
+// Car parameters are not stored: cars are only ever added, so the current
+// parameters of car i are those it had at any earlier tick. Anything that
+// replaces the cars wholesale has to clear the buffer, which happens by
+// itself when ticks stop being consecutive.
+//
+
+#define REWIND_KEYFRAME_INTERVAL 60
+#define REWIND_DEFAULT_CAPACITY (64ull << 20)
+#define REWIND_DEFAULT_FRAME_CAPACITY 1800 // 30 seconds at 60 ticks per second
+
+// Ordered by how often they change, so the mask of a moving car fits a byte
+typedef enum Rewind_Field {
+	REWIND_X,
+	REWIND_Y,
+	REWIND_DIRECTION,
+	REWIND_VELOCITY,
+	REWIND_FRONT_WHEEL_ANGLE,
+	REWIND_TURN_AXIS,
+	REWIND_ACCELERATION_AXIS,
+	REWIND_TARGET_X,
+	REWIND_TARGET_Y,
+	REWIND_ACCELERATION_DIRECTION,
+	REWIND_MODE_SWITCH_TIME,
+	REWIND_FIELD_COUNT
+} Rewind_Field;
+
+#define REWIND_POSITION_SCALE 16.0f                // Steps per world unit
+#define REWIND_DIRECTION_SCALE (32768.0f/PI)       // Steps per radian, wrapping at +-PI
+#define REWIND_VELOCITY_SCALE 256.0f
+#define REWIND_WHEEL_ANGLE_SCALE 4096.0f
+
+// The direction sits in the top 16 bits, so its deltas wrap around the circle
+#define REWIND_DIRECTION_SHIFT 16
+
+// Worst case bytes of a car in a frame: the mask and every delta as 5 byte varints
+#define REWIND_MAX_CAR_BYTES (2 + 5*REWIND_FIELD_COUNT)
+
+typedef struct Rewind_Frame {
+	u64 tick;
+	umm offset; // In the byte ring
+	u32 length;
+	u32 car_count;
+	b32 keyframe;
+} Rewind_Frame;
+
+typedef struct Rewind_Buffer {
+	u8 *data;
+	umm capacity;
+	umm write_offset;
+	umm held_bytes;
+
+	Rewind_Frame *frames;
+	u32 frame_capacity;
+	u32 first_frame; // Index of the oldest frame in the frame ring
+	u32 frame_count;
+	u32 frames_since_keyframe;
+	u64 held_car_ticks;
+
+	// Quantized fields of the last frame pushed, REWIND_FIELD_COUNT per car,
+	// and scratch for decoding
+	u32 *reference;
+	u32 *decoded;
+	u32 reference_count;
+	u32 car_capacity;
+} Rewind_Buffer;
+
+static inline void rewind_init(Rewind_Buffer *rewind, umm capacity, u32 frame_capacity) {
+	*rewind = (Rewind_Buffer){0};
+	rewind->capacity = capacity;
+	rewind->frame_capacity = frame_capacity;
+	rewind->data = malloc(capacity);
+	rewind->frames = malloc(frame_capacity*sizeof(Rewind_Frame));
+	if (!rewind->data || !rewind->frames) {
+		panic("Could not allocate rewind buffer.\n");
+	}
+}
+
+static inline void rewind_free(Rewind_Buffer *rewind) {
+	free(rewind->data);
+	free(rewind->frames);
+	free(rewind->reference);
+	free(rewind->decoded);
+	*rewind = (Rewind_Buffer){0};
+}
+
+static inline void rewind_clear(Rewind_Buffer *rewind) {
+	rewind->write_offset = 0;
+	rewind->held_bytes = 0;
+	rewind->first_frame = 0;
+	rewind->frame_count = 0;
+	rewind->held_car_ticks = 0;
+	rewind->reference_count = 0;
+}
+
+// Everything the buffer has allocated
+static inline umm rewind_memory_used(Rewind_Buffer *rewind) {
+	return rewind->capacity + rewind->frame_capacity*sizeof(Rewind_Frame) +
+		2*(umm)rewind->car_capacity*REWIND_FIELD_COUNT*sizeof(u32);
+}
+
+static inline Rewind_Frame *rewind_frame(Rewind_Buffer *rewind, u32 index) {
+	return &rewind->frames[(rewind->first_frame + index) % rewind->frame_capacity];
+}
+
+static inline u64 rewind_first_tick(Rewind_Buffer *rewind) {
+	return rewind_frame(rewind, 0)->tick;
+}
+
+static inline u64 rewind_last_tick(Rewind_Buffer *rewind) {
+	return rewind_frame(rewind, rewind->frame_count - 1)->tick;
+}
+
+static inline b32 rewind_holds(Rewind_Buffer *rewind, u64 tick) {
+	return rewind->frame_count && tick >= rewind_first_tick(rewind) && tick <= rewind_last_tick(rewind);
+}
+
+static inline void rewind_quantize(Car *car, Controller_State *state, Control_Input *input, u32 *fields) {
+	fields[REWIND_X] = (u32)(s32)lroundf(car->x*REWIND_POSITION_SCALE);
+	fields[REWIND_Y] = (u32)(s32)lroundf(car->y*REWIND_POSITION_SCALE);
+	fields[REWIND_DIRECTION] = (u32)(u16)(s32)lroundf(car->direction*REWIND_DIRECTION_SCALE) << REWIND_DIRECTION_SHIFT;
+	fields[REWIND_VELOCITY] = (u32)(s32)lroundf(car->velocity*REWIND_VELOCITY_SCALE);
+	fields[REWIND_FRONT_WHEEL_ANGLE] = (u32)(s32)lroundf(car->front_wheel_angle*REWIND_WHEEL_ANGLE_SCALE);
+	fields[REWIND_TURN_AXIS] = (u32)(s32)input->turn_axis;
+	fields[REWIND_ACCELERATION_AXIS] = (u32)(s32)input->acceleration_axis;
+	fields[REWIND_TARGET_X] = (u32)(s32)lroundf(car->target_x*REWIND_POSITION_SCALE);
+	fields[REWIND_TARGET_Y] = (u32)(s32)lroundf(car->target_y*REWIND_POSITION_SCALE);
+	fields[REWIND_ACCELERATION_DIRECTION] = (u32)(s32)state->acceleration_direction;
+	fields[REWIND_MODE_SWITCH_TIME] = state->mode_switch_time;
+}
+
+static inline void rewind_dequantize(u32 *fields, Car *car, Controller_State *state, Control_Input *input) {
+	car->x = (s32)fields[REWIND_X]/REWIND_POSITION_SCALE;
+	car->y = (s32)fields[REWIND_Y]/REWIND_POSITION_SCALE;
+	car->direction = (s16)(fields[REWIND_DIRECTION] >> REWIND_DIRECTION_SHIFT)/REWIND_DIRECTION_SCALE;
+	car->velocity = (s32)fields[REWIND_VELOCITY]/REWIND_VELOCITY_SCALE;
+	car->front_wheel_angle = (s32)fields[REWIND_FRONT_WHEEL_ANGLE]/REWIND_WHEEL_ANGLE_SCALE;
+	input->turn_axis = (s16)fields[REWIND_TURN_AXIS];
+	input->acceleration_axis = (s16)fields[REWIND_ACCELERATION_AXIS];
+	car->target_x = (s32)fields[REWIND_TARGET_X]/REWIND_POSITION_SCALE;
+	car->target_y = (s32)fields[REWIND_TARGET_Y]/REWIND_POSITION_SCALE;
+	state->acceleration_direction = (float)(s32)fields[REWIND_ACCELERATION_DIRECTION];
+	state->mode_switch_time = fields[REWIND_MODE_SWITCH_TIME];
+}
+
+static inline u8 *rewind_put_varint(u8 *out, u32 value) {
+	while (value >= 0x80) {
+		*out++ = (u8)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (u8)value;
+	return out;
+}
+
+static inline const u8 *rewind_get_varint(const u8 *in, u32 *value) {
+	u32 result = 0;
+	for (u32 shift = 0;; shift += 7) {
+		u8 byte = *in++;
+		result |= (u32)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) break;
+	}
+	*value = result;
+	return in;
+}
+
+static inline void rewind_reserve_cars(Rewind_Buffer *rewind, u32 count) {
+	if (count > rewind->car_capacity) {
+		u32 capacity = rewind->car_capacity ? rewind->car_capacity : 1024;
+		while (capacity < count) capacity *= 2;
+		rewind->reference = realloc(rewind->reference, (umm)capacity*REWIND_FIELD_COUNT*sizeof(u32));
+		rewind->decoded = realloc(rewind->decoded, (umm)capacity*REWIND_FIELD_COUNT*sizeof(u32));
+		if (!rewind->reference || !rewind->decoded) {
+			panic("Could not allocate rewind state for %u cars.\n", capacity);
+		}
+		rewind->car_capacity = capacity;
+	}
+}
+
+static inline void rewind_drop_oldest(Rewind_Buffer *rewind) {
+	Rewind_Frame *frame = rewind_frame(rewind, 0);
+	rewind->held_bytes -= frame->length;
+	rewind->held_car_ticks -= frame->car_count;
+	rewind->first_frame = (rewind->first_frame + 1) % rewind->frame_capacity;
+	--rewind->frame_count;
+}
+
+// Drops frames until [offset, offset + length) is free and the oldest frame
+// left is a keyframe
+static inline void rewind_make_room(Rewind_Buffer *rewind, umm offset, umm length) {
+	while (rewind->frame_count) {
+		Rewind_Frame *oldest = rewind_frame(rewind, 0);
+		b32 overlaps = oldest->offset < offset + length && offset < oldest->offset + oldest->length;
+		if (!overlaps && rewind->frame_count < rewind->frame_capacity) break;
+		rewind_drop_oldest(rewind);
+	}
+	while (rewind->frame_count && !rewind_frame(rewind, 0)->keyframe) {
+		rewind_drop_oldest(rewind);
+	}
+}
+
+// Adds the state after simulating `tick`. Returns the bytes the frame took.
+static inline u32 rewind_push(Rewind_Buffer *rewind, u64 tick, Car *cars, Controller_State *states, Control_Input *inputs, u32 count) {
+
+	if (rewind->frame_count && tick != rewind_last_tick(rewind) + 1) {
+		rewind_clear(rewind);
+	}
+
+	umm worst_length = (umm)count*REWIND_MAX_CAR_BYTES;
+	if (worst_length > rewind->capacity) {
+		rewind_clear(rewind);
+		return 0;
+	}
+
+	b32 keyframe = rewind->frame_count == 0 || rewind->frames_since_keyframe + 1 >= REWIND_KEYFRAME_INTERVAL ||
+		count < rewind->reference_count;
+
+	umm offset = rewind->write_offset;
+	if (offset + worst_length > rewind->capacity) {
+		offset = 0;
+	}
+	rewind_make_room(rewind, offset, worst_length);
+	if (rewind->frame_count == 0) {
+		keyframe = true;
+	}
+
+	rewind_reserve_cars(rewind, count);
+	if (keyframe) {
+		rewind->reference_count = 0;
+	}
+	// New cars start from zero, as they do when decoding
+	memset(rewind->reference + (umm)rewind->reference_count*REWIND_FIELD_COUNT, 0,
+		(umm)(count - (count > rewind->reference_count ? rewind->reference_count : count))*REWIND_FIELD_COUNT*sizeof(u32));
+
+	u8 *start = rewind->data + offset;
+	u8 *out = start;
+	for (u32 i = 0; i < count; ++i) {
+		u32 fields[REWIND_FIELD_COUNT];
+		rewind_quantize(&cars[i], &states[i], &inputs[i], fields);
+
+		u32 *reference = rewind->reference + (umm)i*REWIND_FIELD_COUNT;
+		u32 deltas[REWIND_FIELD_COUNT];
+		u32 mask = 0;
+		for (u32 f = 0; f < REWIND_FIELD_COUNT; ++f) {
+			s32 delta = (s32)(fields[f] - reference[f]);
+			if (f == REWIND_DIRECTION) delta >>= REWIND_DIRECTION_SHIFT;
+			deltas[f] = ((u32)delta << 1) ^ (u32)(delta >> 31);
+			mask |= (u32)(delta != 0) << f;
+			reference[f] = fields[f];
+		}
+
+		out = rewind_put_varint(out, mask);
+		for (u32 f = 0; f < REWIND_FIELD_COUNT; ++f) {
+			if (mask & (1u << f)) {
+				out = rewind_put_varint(out, deltas[f]);
+			}
+		}
+	}
+	rewind->reference_count = count;
+
+	Rewind_Frame *frame = &rewind->frames[(rewind->first_frame + rewind->frame_count) % rewind->frame_capacity];
+	frame->tick = tick;
+	frame->offset = offset;
+	frame->length = (u32)(out - start);
+	frame->car_count = count;
+	frame->keyframe = keyframe;
+	++rewind->frame_count;
+
+	rewind->frames_since_keyframe = keyframe ? 0 : rewind->frames_since_keyframe + 1;
+	rewind->write_offset = offset + frame->length;
+	rewind->held_bytes += frame->length;
+	rewind->held_car_ticks += count;
+	return frame->length;
+}
+
+static inline void rewind_decode_frame(Rewind_Buffer *rewind, Rewind_Frame *frame, u32 previous_count) {
+	if (frame->keyframe) {
+		previous_count = 0;
+	}
+	if (frame->car_count > previous_count) {
+		memset(rewind->decoded + (umm)previous_count*REWIND_FIELD_COUNT, 0,
+			(umm)(frame->car_count - previous_count)*REWIND_FIELD_COUNT*sizeof(u32));
+	}
+
+	const u8 *in = rewind->data + frame->offset;
+	for (u32 i = 0; i < frame->car_count; ++i) {
+		u32 *fields = rewind->decoded + (umm)i*REWIND_FIELD_COUNT;
+		u32 mask;
+		in = rewind_get_varint(in, &mask);
+		for (u32 f = 0; mask; ++f, mask >>= 1) {
+			if (mask & 1) {
+				u32 zigzag;
+				in = rewind_get_varint(in, &zigzag);
+				u32 delta = (zigzag >> 1) ^ (0u - (zigzag & 1));
+				fields[f] += f == REWIND_DIRECTION ? delta << REWIND_DIRECTION_SHIFT : delta;
+			}
+		}
+	}
+}
+
+// Writes the state held for `tick` over the cars, keeping their parameters.
+// Returns false, changing nothing, if the tick is not held.
+static inline b32 rewind_load(Rewind_Buffer *rewind, u64 tick, Car *cars, Controller_State *states, Control_Input *inputs, u32 *count) {
+
+	if (!rewind_holds(rewind, tick)) {
+		return false;
+	}
+
+	u32 index = (u32)(tick - rewind_first_tick(rewind));
+	u32 keyframe = index;
+	while (!rewind_frame(rewind, keyframe)->keyframe) {
+		--keyframe;
+	}
+
+	u32 previous_count = 0;
+	for (u32 i = keyframe; i <= index; ++i) {
+		Rewind_Frame *frame = rewind_frame(rewind, i);
+		rewind_decode_frame(rewind, frame, previous_count);
+		previous_count = frame->car_count;
+	}
+
+	for (u32 i = 0; i < previous_count; ++i) {
+		rewind_dequantize(rewind->decoded + (umm)i*REWIND_FIELD_COUNT, &cars[i], &states[i], &inputs[i]);
+	}
+	*count = previous_count;
+	return true;
+}
+
+// Forgets the frames after `tick`, which must have just been loaded, so
+// pushing carries on from it
+static inline void rewind_truncate(Rewind_Buffer *rewind, u64 tick) {
+
+	u32 index = (u32)(tick - rewind_first_tick(rewind));
+	while (rewind->frame_count > index + 1) {
+		Rewind_Frame *frame = rewind_frame(rewind, --rewind->frame_count);
+		rewind->held_bytes -= frame->length;
+		rewind->held_car_ticks -= frame->car_count;
+	}
+
+	Rewind_Frame *last = rewind_frame(rewind, index);
+	rewind->write_offset = last->offset + last->length;
+	rewind->reference_count = last->car_count;
+	memcpy(rewind->reference, rewind->decoded, (umm)last->car_count*REWIND_FIELD_COUNT*sizeof(u32));
+
+	rewind->frames_since_keyframe = 0;
+	while (!rewind_frame(rewind, index - rewind->frames_since_keyframe)->keyframe) {
+		++rewind->frames_since_keyframe;
+	}
+}
+
+#endif // CAR_REWIND_H
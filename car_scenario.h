@@ -0,0 +1,158 @@
+#ifndef CAR_SCENARIO_H
+#define CAR_SCENARIO_H
+
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_file.h"
+
+//
+// Scenario files: the starting point of a simulation run, laid out so the
+// mapped file is used in place:
+//
+//   Scenario_Header
+//   Car[car_count]          at cars_offset, each car with its parameters,
+//                           start pose and target
+//   u8[grid_width*height]   at grid_offset, the occupancy of the world,
+//                           absent when grid_offset is 0
+//
+// Sections start on SCENARIO_ALIGNMENT boundaries. Opening a scenario only
+// validates the header and the hash, after which the cars and cells are
+// read straight from the mapping, so a batch of runs pays for no parsing.
+// Car 0 is driven by player_controller, the others by fleet_controller.
+//
+
+#define SCENARIO_MAGIC 0x314e4353 // "SCN1"
+#define SCENARIO_VERSION 1
+#define SCENARIO_ALIGNMENT 64
+
+typedef struct Scenario_Header {
+	u32 magic;
+	u32 version;
+	u32 car_size; // sizeof(Car) of the writer
+	u32 car_count;
+	u64 file_length;
+	u64 content_hash; // hash64 of everything after the header
+
+	u32 player_controller; // Controller_Id
+	u32 fleet_controller;
+	float target_radius;   // 0 for the simulator's default
+	u32 reserved;
+	u64 seed;              // For anything the run randomizes
+
+	float camera_x;        // camera_zoom 0 leaves the camera alone
+	float camera_y;
+	float camera_zoom;
+
+	s32 grid_width;
+	s32 grid_height;
+	float grid_cell_size;
+	float grid_origin_x;
+	float grid_origin_y;
+
+	u64 cars_offset; // From the start of the file
+	u64 grid_offset;
+} Scenario_Header;
+
+typedef int check_scenario_header_size[sizeof(Scenario_Header) == 104 ? 1 : -1];
+
+typedef struct Scenario {
+	Mapped_File file;
+	Scenario_Header *header;
+	Car *cars;
+	u8 *cells; // NULL without a grid
+} Scenario;
+
+static inline umm scenario_align(umm offset) {
+	return (offset + SCENARIO_ALIGNMENT - 1) & ~(umm)(SCENARIO_ALIGNMENT - 1);
+}
+
+static inline umm scenario_grid_length(Scenario_Header *header) {
+	return (umm)header->grid_width*header->grid_height;
+}
+
+static inline b32 scenario_open(Scenario *scenario, const char *path) {
+
+	*scenario = (Scenario){0};
+
+	if (!map_file_read_only(path, &scenario->file)) {
+		return false;
+	}
+
+	Mapped_File *file = &scenario->file;
+	Scenario_Header *header = (Scenario_Header *)file->data;
+
+	b32 valid = file->length >= sizeof(Scenario_Header) &&
+		header->magic == SCENARIO_MAGIC &&
+		header->version == SCENARIO_VERSION &&
+		header->car_size == sizeof(Car) &&
+		header->file_length == file->length &&
+		header->cars_offset % SCENARIO_ALIGNMENT == 0 &&
+		header->cars_offset <= file->length &&
+		(file->length - header->cars_offset)/sizeof(Car) >= header->car_count;
+
+	if (valid && header->grid_offset) {
+		valid = header->grid_width > 0 && header->grid_height > 0 &&
+			header->grid_offset <= file->length &&
+			file->length - header->grid_offset >= scenario_grid_length(header);
+	}
+
+	if (valid) {
+		u8 *content = file->data + sizeof(Scenario_Header);
+		valid = header->content_hash == hash64(content, file->length - sizeof(Scenario_Header), SCENARIO_MAGIC);
+	}
+
+	if (!valid) {
+		unmap_file(file);
+		return false;
+	}
+
+	scenario->header = header;
+	scenario->cars = (Car *)(file->data + header->cars_offset);
+	scenario->cells = header->grid_offset ? file->data + header->grid_offset : NULL;
+	return true;
+}
+
+static inline void scenario_close(Scenario *scenario) {
+	unmap_file(&scenario->file);
+	*scenario = (Scenario){0};
+}
+
+// Writes a scenario from the settings in header, which gets the layout
+// filled in. cells may be NULL for a world without obstacles.
+static inline b32 scenario_write(const char *path, Scenario_Header *header, const Car *cars, const u8 *cells) {
+
+	header->magic = SCENARIO_MAGIC;
+	header->version = SCENARIO_VERSION;
+	header->car_size = sizeof(Car);
+	header->cars_offset = scenario_align(sizeof(Scenario_Header));
+
+	umm end = header->cars_offset + (umm)header->car_count*sizeof(Car);
+	header->grid_offset = cells ? scenario_align(end) : 0;
+	if (cells) {
+		end = header->grid_offset + scenario_grid_length(header);
+	}
+	header->file_length = end;
+
+	u8 *data = calloc(1, end);
+	if (!data) {
+		panic("Could not allocate %llu bytes for a scenario.\n", (unsigned long long)end);
+	}
+	memcpy(data + header->cars_offset, cars, (umm)header->car_count*sizeof(Car));
+	if (cells) {
+		memcpy(data + header->grid_offset, cells, scenario_grid_length(header));
+	}
+	header->content_hash = hash64(data + sizeof(Scenario_Header), end - sizeof(Scenario_Header), SCENARIO_MAGIC);
+	memcpy(data, header, sizeof(Scenario_Header));
+
+	FILE *file = fopen(path, "wb");
+	b32 result = file && fwrite(data, 1, end, file) == end;
+	if (file && fclose(file) != 0) {
+		result = false;
+	}
+
+	free(data);
+	return result;
+}
+
+#endif // CAR_SCENARIO_H
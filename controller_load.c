@@ -0,0 +1,425 @@
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_recording.h"
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_net.h>
+
+// Headless load generator for a controller server. Opens many UDP flows,
+// each looking like one simulator to the server, sends a tick of sensor
+// data per flow at a fixed rate and measures how long the replies take and
+// how many never come back.
+//
+// Usage: controller_load [--host <ip>] [--port <port>] [--flows <count>]
+//                        [--cars <count per flow>] [--rate <ticks per second>]
+//                        [--duration <seconds>] [--timeout <ms>]
+//                        [--recording <file>] [--seed <seed>]
+//
+// Sensor data is replayed from the tick chunks of a recording, looping at
+// the end, with each flow taking its own slice of the cars. Without a
+// recording, cars circle their targets on synthetic tracks.
+//
+// A request counts as lost if no reply arrived within the timeout, and
+// replies arriving later are counted as late rather than as latency. The
+// server evicts the least recently seen simulator past its client limit,
+// which shows up as controller state resets rather than as loss.
+
+#define LOAD_SUB_BUCKET_BITS 4
+#define LOAD_SUB_BUCKETS (1 << LOAD_SUB_BUCKET_BITS)
+#define LOAD_BUCKET_COUNT (48*LOAD_SUB_BUCKETS)
+
+// Log-linear latency buckets in microseconds: exact below LOAD_SUB_BUCKETS,
+// then LOAD_SUB_BUCKETS per power of two, within about 6%
+typedef struct Latency_Histogram {
+	u64 counts[LOAD_BUCKET_COUNT];
+	u64 count;
+	u64 total;
+	u64 minimum;
+	u64 maximum;
+} Latency_Histogram;
+
+typedef struct Load_Flow {
+	UDPsocket socket;
+	u32 sequence;
+	u64 *send_times; // Per sequence slot, 0 when nothing is outstanding
+	u32 first_car;   // Of the flow's slice of the source
+} Load_Flow;
+
+typedef struct Load_Source {
+	b32 recorded;
+	Recording_Reader reader;
+	Recording_Cursor cursor;
+
+	Sensor_Data *sensors; // Of the current tick
+	u32 car_count;
+	u64 tick;
+
+	Sensor_Data *synthetic;
+	float *phases;
+	float *radii;
+} Load_Source;
+
+static u32 latency_bucket(u64 microseconds) {
+	if (microseconds < LOAD_SUB_BUCKETS) {
+		return (u32)microseconds;
+	}
+	u32 high_bit = 0;
+	while ((microseconds >> high_bit) > 1) {
+		++high_bit;
+	}
+	u32 shift = high_bit - LOAD_SUB_BUCKET_BITS;
+	u32 result = shift*LOAD_SUB_BUCKETS + (u32)(microseconds >> shift);
+	return result < LOAD_BUCKET_COUNT ? result : LOAD_BUCKET_COUNT - 1;
+}
+
+// Middle of the values that fall into a bucket
+static double latency_bucket_value(u32 bucket) {
+	if (bucket < 2*LOAD_SUB_BUCKETS) {
+		return bucket;
+	}
+	u32 shift = bucket/LOAD_SUB_BUCKETS - 1;
+	u64 low = (u64)(bucket - shift*LOAD_SUB_BUCKETS) << shift;
+	return low + 0.5*((1ull << shift) - 1);
+}
+
+static void histogram_add(Latency_Histogram *histogram, u64 microseconds) {
+	if (histogram->count == 0 || microseconds < histogram->minimum) histogram->minimum = microseconds;
+	if (microseconds > histogram->maximum) histogram->maximum = microseconds;
+	++histogram->counts[latency_bucket(microseconds)];
+	++histogram->count;
+	histogram->total += microseconds;
+}
+
+static double histogram_percentile(Latency_Histogram *histogram, double percentile) {
+	u64 rank = (u64)(percentile/100.0*histogram->count);
+	u64 seen = 0;
+	for (u32 i = 0; i < LOAD_BUCKET_COUNT; ++i) {
+		seen += histogram->counts[i];
+		if (seen > rank) {
+			double value = latency_bucket_value(i);
+			return value < histogram->maximum ? value : histogram->maximum;
+		}
+	}
+	return (double)histogram->maximum;
+}
+
+static void load_source_next_tick(Load_Source *source, u32 car_count) {
+
+	if (source->recorded) {
+		for (b32 restarted = false;;) {
+			Recording_Chunk *chunk = recording_next_chunk(&source->reader, &source->cursor);
+			if (!chunk) {
+				if (restarted) {
+					panic("Recording has no ticks.\n");
+				}
+				source->cursor = recording_cursor_at(recording_first_chunk(&source->reader));
+				restarted = true;
+				continue;
+			}
+			if (chunk->type == RECORDING_CHUNK_TICK && ((Recording_Tick *)(chunk + 1))->car_count) {
+				Recording_Tick *tick = (Recording_Tick *)(chunk + 1);
+				source->sensors = recording_tick_sensors(tick);
+				source->car_count = tick->car_count;
+				break;
+			}
+		}
+	}
+	else {
+		// Targets ahead of the car on a circle, with the heading and speed
+		// wandering, so the controllers see a spread of errors
+		for (u32 i = 0; i < car_count; ++i) {
+			float phase = source->phases[i] + 0.01f*source->tick;
+			Sensor_Data *sensor = &source->synthetic[i];
+			sensor->delta_x = source->radii[i]*cosf(phase);
+			sensor->delta_y = source->radii[i]*sinf(phase);
+			sensor->heading_direction = phase - 0.5f*PI + 0.3f*sinf(3.0f*phase);
+			sensor->velocity = 5.0f + 4.0f*sinf(0.5f*phase);
+			sensor->time = source->tick;
+		}
+		source->sensors = source->synthetic;
+		source->car_count = car_count;
+	}
+
+	++source->tick;
+}
+
+int main(int argc, char **argv) {
+
+	const char *host = "127.0.0.1";
+	u16 port = CONTROLLER_DEFAULT_PORT;
+	u32 flow_count = 16;
+	u32 cars_per_flow = 1000;
+	double rate = 60.0;
+	double duration = 10.0;
+	double timeout_ms = 1000.0;
+	const char *recording_path = NULL;
+	u64 seed = 1;
+
+	for (s32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+			host = argv[++i];
+		}
+		else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+			port = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--flows") == 0 && i + 1 < argc) {
+			flow_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--cars") == 0 && i + 1 < argc) {
+			cars_per_flow = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+			rate = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+			duration = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+			timeout_ms = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--recording") == 0 && i + 1 < argc) {
+			recording_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			seed = strtoull(argv[++i], NULL, 10);
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--host <ip>] [--port <port>] [--flows <count>] [--cars <count per flow>] "
+				"[--rate <ticks per second>] [--duration <seconds>] [--timeout <ms>] [--recording <file>] [--seed <seed>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (flow_count == 0 || cars_per_flow == 0 || rate <= 0.0 || duration <= 0.0 || timeout_ms <= 0.0) {
+		panic("Flows, cars, rate, duration and timeout must be positive.\n");
+	}
+
+	if (SDL_Init(0) != 0) {
+		panic("SDL_Init Error: %s\n", SDL_GetError());
+	}
+	if (SDLNet_Init() < 0) {
+		panic("SDLNet_Init Error: %s\n", SDL_GetError());
+	}
+
+	IPaddress server;
+	if (SDLNet_ResolveHost(&server, host, port) != 0) {
+		panic("Could not resolve '%s'.\n", host);
+	}
+
+	u32 packets_per_tick = (cars_per_flow + CONTROLLER_MAX_BATCH - 1)/CONTROLLER_MAX_BATCH;
+
+	// Enough sequence slots per flow for every request that can be in
+	// flight within the timeout, twice over
+	u32 window = 1024;
+	while (window < 2.0*packets_per_tick*rate*timeout_ms/1000.0) {
+		window *= 2;
+	}
+
+	Load_Flow *flows = calloc(flow_count, sizeof(Load_Flow));
+	SDLNet_SocketSet socket_set = SDLNet_AllocSocketSet(flow_count);
+	if (!flows || !socket_set) {
+		panic("Out of memory.\n");
+	}
+
+	for (u32 f = 0; f < flow_count; ++f) {
+		Load_Flow *flow = &flows[f];
+		flow->socket = SDLNet_UDP_Open(0);
+		if (!flow->socket) {
+			panic("Could not open UDP socket %u: %s\n", f, SDLNet_GetError());
+		}
+		SDLNet_UDP_AddSocket(socket_set, flow->socket);
+		flow->send_times = calloc(window, sizeof(u64));
+		if (!flow->send_times) {
+			panic("Out of memory.\n");
+		}
+		flow->first_car = f*cars_per_flow;
+	}
+
+	Load_Source source = {0};
+	if (recording_path) {
+		if (!recording_reader_open(&source.reader, recording_path)) {
+			panic("Could not open recording '%s'.\n", recording_path);
+		}
+		source.recorded = true;
+		source.cursor = recording_cursor_at(recording_first_chunk(&source.reader));
+	}
+	else {
+		u32 car_count = flow_count*cars_per_flow;
+		source.synthetic = malloc(car_count*sizeof(Sensor_Data));
+		source.phases = malloc(car_count*sizeof(float));
+		source.radii = malloc(car_count*sizeof(float));
+		if (!source.synthetic || !source.phases || !source.radii) {
+			panic("Out of memory.\n");
+		}
+		Random_Series series = random_seed(seed);
+		for (u32 i = 0; i < car_count; ++i) {
+			source.phases[i] = TAU*random_unit(&series);
+			source.radii[i] = 50.0f + 950.0f*random_unit(&series);
+		}
+	}
+
+	UDPpacket *packet = SDLNet_AllocPacket(CONTROLLER_MAX_PACKET_SIZE);
+	if (!packet) {
+		panic("Could not allocate packet.\n");
+	}
+
+	printf("Load: %u flows x %u cars (%u packets) at %g Hz for %g s against %s:%u, %s sensor data\n",
+		flow_count, cars_per_flow, packets_per_tick, rate, duration, host, port,
+		recording_path ? "recorded" : "synthetic");
+
+	static Latency_Histogram total, interval;
+	u64 sent = 0, received = 0, late = 0, unexpected = 0, overwritten = 0, behind_ticks = 0;
+	u64 interval_sent = 0;
+
+	u64 frequency = SDL_GetPerformanceFrequency();
+	u64 tick_interval = (u64)(frequency/rate);
+	u64 timeout = (u64)(frequency*timeout_ms/1000.0);
+	u64 start = SDL_GetPerformanceCounter();
+	u64 send_end = start + (u64)(frequency*duration);
+	u64 next_tick = start;
+	u64 next_report = start + frequency;
+
+	for (;;) {
+		u64 now = SDL_GetPerformanceCounter();
+		b32 sending = now < send_end;
+
+		if (sending && now >= next_tick) {
+			load_source_next_tick(&source, flow_count*cars_per_flow);
+
+			for (u32 f = 0; f < flow_count; ++f) {
+				Load_Flow *flow = &flows[f];
+				for (u32 offset = 0; offset < cars_per_flow; offset += CONTROLLER_MAX_BATCH) {
+					u32 batch_count = cars_per_flow - offset < CONTROLLER_MAX_BATCH ? cars_per_flow - offset : CONTROLLER_MAX_BATCH;
+
+					Controller_Packet_Header *header = (Controller_Packet_Header *)packet->data;
+					header->sequence = flow->sequence++;
+					header->first_car = offset;
+					header->count = batch_count;
+
+					Sensor_Data *sensors = (Sensor_Data *)(header + 1);
+					for (u32 i = 0; i < batch_count; ++i) {
+						sensors[i] = source.sensors[(flow->first_car + offset + i) % source.car_count];
+					}
+
+					packet->channel = -1;
+					packet->len = sizeof(Controller_Packet_Header) + batch_count*sizeof(Sensor_Data);
+					packet->address = server;
+
+					u64 *slot = &flow->send_times[header->sequence & (window - 1)];
+					if (*slot) {
+						++overwritten;
+					}
+					*slot = SDL_GetPerformanceCounter();
+
+					if (0 == SDLNet_UDP_Send(flow->socket, -1, packet)) {
+						panic("Could not send sensor data: %s\n", SDLNet_GetError());
+					}
+					++sent;
+					++interval_sent;
+				}
+			}
+
+			next_tick += tick_interval;
+			now = SDL_GetPerformanceCounter();
+			if (now > next_tick + tick_interval) {
+				// Drop the ticks the sender could not keep up with rather than bursting them
+				u64 missed = (now - next_tick)/tick_interval;
+				behind_ticks += missed;
+				next_tick += missed*tick_interval;
+			}
+		}
+
+		if (!sending && (received + late + overwritten >= sent || now >= send_end + timeout)) {
+			break;
+		}
+
+		// Wait for replies until the next tick is due
+		u64 wait_until = sending ? next_tick : send_end + timeout;
+		u32 wait_ms = wait_until > now ? (u32)((wait_until - now)*1000/frequency) : 0;
+		if (SDLNet_CheckSockets(socket_set, wait_ms) <= 0) {
+			continue;
+		}
+
+		for (u32 f = 0; f < flow_count; ++f) {
+			Load_Flow *flow = &flows[f];
+			if (!SDLNet_SocketReady(flow->socket)) {
+				continue;
+			}
+			while (SDLNet_UDP_Recv(flow->socket, packet) > 0) {
+				u64 arrival = SDL_GetPerformanceCounter();
+				Controller_Packet_Header *header = (Controller_Packet_Header *)packet->data;
+				if (packet->len < (s32)sizeof(Controller_Packet_Header) ||
+					header->count > CONTROLLER_MAX_BATCH ||
+					packet->len != (s32)(sizeof(Controller_Packet_Header) + header->count*sizeof(Control_Input)))
+				{
+					++unexpected;
+					continue;
+				}
+
+				u64 *slot = &flow->send_times[header->sequence & (window - 1)];
+				if (!*slot || flow->sequence - header->sequence > window) {
+					++unexpected;
+					continue;
+				}
+
+				u64 elapsed = arrival - *slot;
+				*slot = 0;
+				if (elapsed > timeout) {
+					++late;
+					continue;
+				}
+
+				u64 microseconds = elapsed*1000000/frequency;
+				histogram_add(&total, microseconds);
+				histogram_add(&interval, microseconds);
+				++received;
+			}
+		}
+
+		now = SDL_GetPerformanceCounter();
+		if (sending && now >= next_report) {
+			printf("%5.1f s: %llu requests/s, %llu replies, p50 %.0f us, p99 %.0f us, max %llu us\n",
+				(double)(now - start)/frequency, (unsigned long long)interval_sent, (unsigned long long)interval.count,
+				histogram_percentile(&interval, 50.0), histogram_percentile(&interval, 99.0), (unsigned long long)interval.maximum);
+			interval = (Latency_Histogram){0};
+			interval_sent = 0;
+			next_report += frequency;
+		}
+	}
+
+	u64 lost = sent - received - late;
+	printf("Sent %llu requests (%.0f/s, %.1f Mcars/s)\n", (unsigned long long)sent, sent/duration,
+		sent*(double)cars_per_flow/packets_per_tick/duration/1e6);
+	printf("Replies: %llu on time, %llu late, %llu lost (%.3f%%), %llu unexpected\n",
+		(unsigned long long)received, (unsigned long long)late, (unsigned long long)lost,
+		sent ? 100.0*lost/sent : 0.0, (unsigned long long)unexpected);
+	if (total.count) {
+		printf("Latency: min %llu us, mean %.0f us, p50 %.0f us, p90 %.0f us, p99 %.0f us, p99.9 %.0f us, max %llu us\n",
+			(unsigned long long)total.minimum, (double)total.total/total.count,
+			histogram_percentile(&total, 50.0), histogram_percentile(&total, 90.0),
+			histogram_percentile(&total, 99.0), histogram_percentile(&total, 99.9), (unsigned long long)total.maximum);
+	}
+	if (behind_ticks) {
+		printf("The sender fell behind and skipped %llu ticks; the rate is higher than this host can send\n",
+			(unsigned long long)behind_ticks);
+	}
+
+	SDLNet_FreePacket(packet);
+	for (u32 f = 0; f < flow_count; ++f) {
+		SDLNet_UDP_Close(flows[f].socket);
+		free(flows[f].send_times);
+	}
+	SDLNet_FreeSocketSet(socket_set);
+	free(flows);
+	if (source.recorded) {
+		recording_reader_close(&source.reader);
+	}
+	free(source.synthetic);
+	free(source.phases);
+	free(source.radii);
+
+	SDLNet_Quit();
+	SDL_Quit();
+	return 0;
+}
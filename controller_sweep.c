@@ -0,0 +1,255 @@
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_episode.h"
+#include "car_jobs.h"
+#include "car_scenario.h"
+
+#include <SDL2/SDL.h>
+
+// Runs headless episodes over a grid or a random sample of pursuit gains and
+// car parameters on every core, and writes one CSV row of metrics per
+// configuration. Parameters not listed with --params keep their defaults.
+// --scenario-file takes the episodes from the cars of a scenario file
+// instead of generating them.
+//
+// Usage: controller_sweep [--grid <steps> | --random <count>] [--params <name,...>]
+//                         [--scenarios <count> | --scenario-file <path>] [--ticks <count>]
+//                         [--seed <seed>] [--threads <count>] [--output <file.csv>]
+
+typedef struct Sweep_Result {
+	Episode_Configuration configuration;
+	Episode_Summary summary;
+} Sweep_Result;
+
+typedef struct Sweep {
+	b32 random;
+	u32 steps; // Per parameter on the grid
+	u32 configuration_count;
+	u64 seed;
+
+	u32 active_parameters[EPISODE_PARAMETER_COUNT];
+	u32 active_count;
+
+	Episode_Scenario *scenarios;
+	u32 scenario_count;
+	Episode_Settings settings;
+
+	Sweep_Result *results;
+} Sweep;
+
+static Episode_Configuration sweep_configuration(Sweep *sweep, u32 index) {
+	Episode_Configuration configuration = episode_default_configuration();
+	Random_Series series = random_seed(sweep->seed ^ ((u64)index << 32));
+	u32 grid_index = index;
+
+	for (u32 i = 0; i < sweep->active_count; ++i) {
+		u32 parameter = sweep->active_parameters[i];
+		float t;
+		if (sweep->random) {
+			t = random_unit(&series);
+		}
+		else {
+			t = sweep->steps > 1 ? (float)(grid_index % sweep->steps)/(sweep->steps - 1) : 0.5f;
+			grid_index /= sweep->steps;
+		}
+		*episode_parameter_field(&configuration, parameter) = LERP(episode_parameters[parameter].minimum, episode_parameters[parameter].maximum, t);
+	}
+
+	return configuration;
+}
+
+static void sweep_job(void *data, u32 first, u32 end, u32 worker) {
+	(void)worker; // Unused
+
+	Sweep *sweep = data;
+	for (u32 index = first; index < end; ++index) {
+		Sweep_Result *result = &sweep->results[index];
+		result->configuration = sweep_configuration(sweep, index);
+		result->summary = episode_evaluate(&result->configuration, sweep->scenarios, sweep->scenario_count, sweep->settings);
+	}
+}
+
+// Most scenarios reached first, then fastest
+static int compare_results(const void *a, const void *b) {
+	const Episode_Summary *summary_a = &(*(Sweep_Result *const *)a)->summary;
+	const Episode_Summary *summary_b = &(*(Sweep_Result *const *)b)->summary;
+	if (summary_a->success_rate != summary_b->success_rate) {
+		return summary_a->success_rate > summary_b->success_rate ? -1 : 1;
+	}
+	return (summary_a->mean_ticks_to_target > summary_b->mean_ticks_to_target) - (summary_a->mean_ticks_to_target < summary_b->mean_ticks_to_target);
+}
+
+static void print_configuration(FILE *file, Episode_Configuration *configuration, const char *separator) {
+	for (u32 i = 0; i < EPISODE_PARAMETER_COUNT; ++i) {
+		fprintf(file, "%s%g", i ? separator : "", *episode_parameter_field(configuration, i));
+	}
+}
+
+int main(int argc, char **argv) {
+
+	Sweep sweep = {0};
+	sweep.random = true;
+	sweep.configuration_count = 1024;
+	sweep.steps = 3;
+	sweep.seed = 1;
+	sweep.scenario_count = 32;
+	sweep.settings = episode_default_settings();
+
+	const char *output_path = "sweep.csv";
+	const char *parameter_list = NULL;
+	const char *scenario_path = NULL;
+	u32 thread_count = 0;
+
+	for (s32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--grid") == 0 && i + 1 < argc) {
+			sweep.random = false;
+			sweep.steps = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--random") == 0 && i + 1 < argc) {
+			sweep.random = true;
+			sweep.configuration_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--params") == 0 && i + 1 < argc) {
+			parameter_list = argv[++i];
+		}
+		else if (strcmp(argv[i], "--scenarios") == 0 && i + 1 < argc) {
+			sweep.scenario_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--scenario-file") == 0 && i + 1 < argc) {
+			scenario_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+			sweep.settings.max_ticks = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			sweep.seed = strtoull(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			thread_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			output_path = argv[++i];
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--grid <steps> | --random <count>] [--params <name,...>] [--scenarios <count> | --scenario-file <path>] "
+				"[--ticks <count>] [--seed <seed>] [--threads <count>] [--output <file.csv>]\n", argv[0]);
+			fprintf(stderr, "Parameters:");
+			for (u32 p = 0; p < EPISODE_PARAMETER_COUNT; ++p) {
+				fprintf(stderr, " %s", episode_parameters[p].name);
+			}
+			fprintf(stderr, "\n");
+			return 1;
+		}
+	}
+
+	Scenario scenario = {0};
+	if (scenario_path) {
+		if (!scenario_open(&scenario, scenario_path)) {
+			panic("Could not open scenario '%s'.\n", scenario_path);
+		}
+		sweep.scenario_count = scenario.header->car_count;
+	}
+
+	if (sweep.scenario_count == 0 || sweep.settings.max_ticks == 0 || (!sweep.random && sweep.steps == 0)) {
+		panic("Scenarios, ticks and grid steps must be positive.\n");
+	}
+
+	for (u32 p = 0; p < EPISODE_PARAMETER_COUNT; ++p) {
+		const char *name = episode_parameters[p].name;
+		umm length = strlen(name);
+		b32 active = !parameter_list;
+
+		// Match whole names only
+		for (const char *found = parameter_list ? strstr(parameter_list, name) : NULL; found && !active; found = strstr(found + 1, name)) {
+			active = (found == parameter_list || found[-1] == ',') && (found[length] == ',' || found[length] == 0);
+		}
+		if (active) {
+			sweep.active_parameters[sweep.active_count++] = p;
+		}
+	}
+	if (sweep.active_count == 0) {
+		panic("No known parameters in '%s'.\n", parameter_list);
+	}
+
+	if (!sweep.random) {
+		double count = pow(sweep.steps, sweep.active_count);
+		if (count > 1e7) {
+			panic("A %u step grid over %u parameters is %.0f configurations, use --params or --random.\n", sweep.steps, sweep.active_count, count);
+		}
+		sweep.configuration_count = (u32)count;
+	}
+
+	sweep.scenarios = malloc(sweep.scenario_count*sizeof(Episode_Scenario));
+	sweep.results = malloc(sweep.configuration_count*sizeof(Sweep_Result));
+	if (!sweep.scenarios || !sweep.results) {
+		panic("Out of memory.\n");
+	}
+	if (scenario.header) {
+		episode_scenarios_from_cars(sweep.scenarios, scenario.cars, sweep.scenario_count);
+		scenario_close(&scenario);
+	}
+	else {
+		episode_generate_scenarios(sweep.scenarios, sweep.scenario_count, sweep.seed, 300.0f, 1500.0f);
+	}
+
+	Job_System jobs;
+	job_system_init(&jobs, thread_count);
+
+	printf("Sweeping %u configurations x %u scenarios x %u ticks on %u threads\n",
+		sweep.configuration_count, sweep.scenario_count, sweep.settings.max_ticks, jobs.thread_count + 1);
+
+	u64 start = SDL_GetPerformanceCounter();
+	job_system_parallel_for(&jobs, sweep.configuration_count, 1, sweep_job, &sweep);
+	double seconds = (double)(SDL_GetPerformanceCounter() - start)/SDL_GetPerformanceFrequency();
+
+	job_system_shutdown(&jobs);
+
+	printf("Done in %.2f s (%.0f episodes/s)\n", seconds, sweep.configuration_count*sweep.scenario_count/seconds);
+
+	FILE *output = fopen(output_path, "w");
+	if (!output) {
+		panic("Could not open '%s' for writing.\n", output_path);
+	}
+
+	fprintf(output, "configuration,");
+	for (u32 p = 0; p < EPISODE_PARAMETER_COUNT; ++p) {
+		fprintf(output, "%s,", episode_parameters[p].name);
+	}
+	fprintf(output, "success_rate,mean_ticks_to_target,mean_overshoot,mean_path_length,mean_final_distance\n");
+
+	for (u32 i = 0; i < sweep.configuration_count; ++i) {
+		Sweep_Result *result = &sweep.results[i];
+		Episode_Summary *summary = &result->summary;
+		fprintf(output, "%u,", i);
+		print_configuration(output, &result->configuration, ",");
+		fprintf(output, ",%g,%g,%g,%g,%g\n", summary->success_rate, summary->mean_ticks_to_target,
+			summary->mean_overshoot, summary->mean_path_length, summary->mean_final_distance);
+	}
+	fclose(output);
+
+	Sweep_Result **ranking = malloc(sweep.configuration_count*sizeof(Sweep_Result *));
+	if (!ranking) {
+		panic("Out of memory.\n");
+	}
+	for (u32 i = 0; i < sweep.configuration_count; ++i) {
+		ranking[i] = &sweep.results[i];
+	}
+	qsort(ranking, sweep.configuration_count, sizeof(Sweep_Result *), compare_results);
+
+	printf("Wrote '%s'. Best configurations:\n", output_path);
+	for (u32 i = 0; i < 5 && i < sweep.configuration_count; ++i) {
+		Sweep_Result *result = ranking[i];
+		Episode_Summary *summary = &result->summary;
+		printf("  #%u: success %.0f%%, %.0f ticks, overshoot %.1f, path %.0f  [", (u32)(result - sweep.results),
+			100.0f*summary->success_rate, summary->mean_ticks_to_target, summary->mean_overshoot, summary->mean_path_length);
+		print_configuration(stdout, &result->configuration, " ");
+		printf("]\n");
+	}
+
+	free(ranking);
+	free(sweep.results);
+	free(sweep.scenarios);
+
+	return 0;
+}
@@ -0,0 +1,264 @@
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_episode.h"
+#include "car_jobs.h"
+
+#include <SDL2/SDL.h>
+
+// Optimises the pursuit gains and car parameters with an evolution strategy
+// over headless episodes, and prints the best parameter set found.
+//
+// Usage: controller_train [--generations <count>] [--population <count>]
+//                         [--scenarios <count>] [--ticks <count>] [--sigma <step>]
+//                         [--seed <seed>] [--threads <count>]
+//
+// The strategy is a separable (mu/mu_w, lambda)-ES: CMA-ES restricted to a
+// diagonal covariance, updated rank-mu only, without evolution paths.
+// Parameters are searched in [0, 1] over the same ranges the sweep uses.
+//
+// Each generation draws fresh scenarios that every individual shares, so
+// individuals are compared on the same episodes. An individual's sample is
+// seeded from (seed, generation, individual) rather than from the thread
+// that happens to run it, so a run is reproducible on any core count.
+
+#define TRAIN_MAX_POPULATION 4096
+
+typedef struct Train_Individual {
+	float z[EPISODE_PARAMETER_COUNT]; // Standard normal sample
+	float x[EPISODE_PARAMETER_COUNT]; // Normalized parameters
+	Episode_Summary summary;
+} Train_Individual;
+
+typedef struct Trainer {
+	u64 seed;
+	u32 generation;
+
+	float mean[EPISODE_PARAMETER_COUNT];
+	float sigma[EPISODE_PARAMETER_COUNT];
+
+	Train_Individual *population;
+	u32 population_count;
+	float weights[TRAIN_MAX_POPULATION];
+	u32 parent_count;
+
+	Episode_Scenario *scenarios;
+	u32 scenario_count;
+	Episode_Settings settings;
+} Trainer;
+
+static float random_gaussian(Random_Series *series) {
+	// Box-Muller, one of the pair
+	float u = 1.0f - random_unit(series);
+	float v = random_unit(series);
+	return sqrtf(-2.0f*logf(u))*cosf(TAU*v);
+}
+
+static Episode_Configuration configuration_from_normalized(float *x) {
+	Episode_Configuration configuration = episode_default_configuration();
+	for (u32 i = 0; i < EPISODE_PARAMETER_COUNT; ++i) {
+		*episode_parameter_field(&configuration, i) = LERP(episode_parameters[i].minimum, episode_parameters[i].maximum, x[i]);
+	}
+	return configuration;
+}
+
+static void train_job(void *data, u32 first, u32 end, u32 worker) {
+	(void)worker; // Unused: seeds come from the individual, not the thread
+
+	Trainer *trainer = data;
+	for (u32 index = first; index < end; ++index) {
+		Train_Individual *individual = &trainer->population[index];
+
+		u64 key[3] = {trainer->seed, trainer->generation, index};
+		Random_Series series = random_seed(hash64(key, sizeof(key), 0x747261696e));
+
+		for (u32 i = 0; i < EPISODE_PARAMETER_COUNT; ++i) {
+			individual->z[i] = random_gaussian(&series);
+			float x = trainer->mean[i] + trainer->sigma[i]*individual->z[i];
+			individual->x[i] = x < 0.0f ? 0.0f : (x > 1.0f ? 1.0f : x);
+		}
+
+		Episode_Configuration configuration = configuration_from_normalized(individual->x);
+		individual->summary = episode_evaluate(&configuration, trainer->scenarios, trainer->scenario_count, trainer->settings);
+	}
+}
+
+static int compare_individuals(const void *a, const void *b) {
+	float cost_a = ((const Train_Individual *)a)->summary.cost;
+	float cost_b = ((const Train_Individual *)b)->summary.cost;
+	return (cost_a > cost_b) - (cost_a < cost_b);
+}
+
+static void print_parameters(float *x) {
+	Episode_Configuration configuration = configuration_from_normalized(x);
+	for (u32 i = 0; i < EPISODE_PARAMETER_COUNT; ++i) {
+		printf("  %-16s %g\n", episode_parameters[i].name, *episode_parameter_field(&configuration, i));
+	}
+}
+
+int main(int argc, char **argv) {
+
+	Trainer trainer = {0};
+	trainer.seed = 1;
+	trainer.population_count = 64;
+	trainer.scenario_count = 64;
+	trainer.settings = episode_default_settings();
+
+	u32 generation_count = 50;
+	u32 thread_count = 0;
+	float initial_sigma = 0.2f;
+
+	for (s32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--generations") == 0 && i + 1 < argc) {
+			generation_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--population") == 0 && i + 1 < argc) {
+			trainer.population_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--scenarios") == 0 && i + 1 < argc) {
+			trainer.scenario_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+			trainer.settings.max_ticks = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--sigma") == 0 && i + 1 < argc) {
+			initial_sigma = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			trainer.seed = strtoull(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			thread_count = atoi(argv[++i]);
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--generations <count>] [--population <count>] [--scenarios <count>] "
+				"[--ticks <count>] [--sigma <step>] [--seed <seed>] [--threads <count>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (trainer.population_count < 4 || trainer.population_count > TRAIN_MAX_POPULATION) {
+		panic("Population must be between 4 and %d.\n", TRAIN_MAX_POPULATION);
+	}
+	if (trainer.scenario_count == 0 || trainer.settings.max_ticks == 0) {
+		panic("Scenarios and ticks must be positive.\n");
+	}
+
+	trainer.population = malloc(trainer.population_count*sizeof(Train_Individual));
+	trainer.scenarios = malloc(trainer.scenario_count*sizeof(Episode_Scenario));
+	if (!trainer.population || !trainer.scenarios) {
+		panic("Out of memory.\n");
+	}
+
+	// Start from the hand tuned values
+	Episode_Configuration defaults = episode_default_configuration();
+	for (u32 i = 0; i < EPISODE_PARAMETER_COUNT; ++i) {
+		const Episode_Parameter *parameter = &episode_parameters[i];
+		trainer.mean[i] = (*episode_parameter_field(&defaults, i) - parameter->minimum)/(parameter->maximum - parameter->minimum);
+		trainer.sigma[i] = initial_sigma;
+	}
+
+	// Log-rank weights over the better half
+	trainer.parent_count = trainer.population_count/2;
+	float weight_sum = 0.0f, weight_square_sum = 0.0f;
+	for (u32 i = 0; i < trainer.parent_count; ++i) {
+		trainer.weights[i] = logf(trainer.parent_count + 0.5f) - logf(i + 1.0f);
+		weight_sum += trainer.weights[i];
+	}
+	for (u32 i = 0; i < trainer.parent_count; ++i) {
+		trainer.weights[i] /= weight_sum;
+		weight_square_sum += trainer.weights[i]*trainer.weights[i];
+	}
+	float effective_parents = 1.0f/weight_square_sum;
+	float dimensions = (float)EPISODE_PARAMETER_COUNT;
+	// Learning rate of the separable rank-mu update
+	float variance_rate = fminf(1.0f, effective_parents*(dimensions + 2.0f)/(3.0f*(dimensions + 1.3f)*(dimensions + 1.3f)));
+
+	Job_System jobs;
+	job_system_init(&jobs, thread_count);
+
+	printf("Training %u parameters: %u generations x %u individuals x %u scenarios on %u threads\n",
+		(u32)EPISODE_PARAMETER_COUNT, generation_count, trainer.population_count, trainer.scenario_count, jobs.thread_count + 1);
+
+	// Costs are only comparable within a generation, so the candidate is the
+	// latest generation's elite rather than the lowest cost ever seen
+	float best_x[EPISODE_PARAMETER_COUNT];
+	memcpy(best_x, trainer.mean, sizeof(best_x));
+
+	u64 start = SDL_GetPerformanceCounter();
+
+	for (trainer.generation = 0; trainer.generation < generation_count; ++trainer.generation) {
+		episode_generate_scenarios(trainer.scenarios, trainer.scenario_count, trainer.seed*1000003ull + trainer.generation, 300.0f, 1500.0f);
+
+		job_system_parallel_for(&jobs, trainer.population_count, 1, train_job, &trainer);
+
+		qsort(trainer.population, trainer.population_count, sizeof(Train_Individual), compare_individuals);
+
+		Train_Individual *elite = &trainer.population[0];
+		memcpy(best_x, elite->x, sizeof(best_x));
+
+		float cost_sum = 0.0f;
+		for (u32 k = 0; k < trainer.population_count; ++k) {
+			cost_sum += trainer.population[k].summary.cost;
+		}
+
+		for (u32 i = 0; i < EPISODE_PARAMETER_COUNT; ++i) {
+			float mean = 0.0f;
+			float variance = 0.0f;
+			for (u32 k = 0; k < trainer.parent_count; ++k) {
+				Train_Individual *parent = &trainer.population[k];
+				mean += trainer.weights[k]*parent->x[i];
+				variance += trainer.weights[k]*parent->z[i]*parent->z[i];
+			}
+			trainer.mean[i] = mean;
+			trainer.sigma[i] *= sqrtf((1.0f - variance_rate) + variance_rate*variance);
+			trainer.sigma[i] = fmaxf(trainer.sigma[i], 1e-3f);
+		}
+
+		printf("generation %3u: best %.1f (success %.0f%%, %.0f ticks, overshoot %.1f), mean %.1f\n",
+			trainer.generation, elite->summary.cost, 100.0f*elite->summary.success_rate,
+			elite->summary.mean_ticks_to_target, elite->summary.mean_overshoot, cost_sum/trainer.population_count);
+	}
+
+	double seconds = (double)(SDL_GetPerformanceCounter() - start)/SDL_GetPerformanceFrequency();
+	u64 episode_count = (u64)generation_count*trainer.population_count*trainer.scenario_count;
+	printf("Ran %llu episodes in %.2f s (%.0f episodes/s)\n", (unsigned long long)episode_count, seconds, episode_count/seconds);
+
+	// Score the defaults, the final mean and the best individual on scenarios none of them trained on
+	episode_generate_scenarios(trainer.scenarios, trainer.scenario_count, ~trainer.seed, 300.0f, 1500.0f);
+
+	float default_x[EPISODE_PARAMETER_COUNT];
+	for (u32 i = 0; i < EPISODE_PARAMETER_COUNT; ++i) {
+		const Episode_Parameter *parameter = &episode_parameters[i];
+		default_x[i] = (*episode_parameter_field(&defaults, i) - parameter->minimum)/(parameter->maximum - parameter->minimum);
+	}
+
+	struct { const char *name; float *x; } candidates[] = {
+		{"defaults", default_x},
+		{"final mean", trainer.mean},
+		{"last elite", best_x},
+	};
+
+	float *winner = default_x;
+	float winner_cost = 1e30f;
+	printf("Validation:\n");
+	for (u32 i = 0; i < sizeof(candidates)/sizeof(candidates[0]); ++i) {
+		Episode_Configuration configuration = configuration_from_normalized(candidates[i].x);
+		Episode_Summary summary = episode_evaluate(&configuration, trainer.scenarios, trainer.scenario_count, trainer.settings);
+		printf("  %-16s cost %.1f (success %.0f%%, %.0f ticks, overshoot %.1f)\n", candidates[i].name,
+			summary.cost, 100.0f*summary.success_rate, summary.mean_ticks_to_target, summary.mean_overshoot);
+		if (summary.cost < winner_cost) {
+			winner_cost = summary.cost;
+			winner = candidates[i].x;
+		}
+	}
+
+	printf("Best parameter set:\n");
+	print_parameters(winner);
+
+	job_system_shutdown(&jobs);
+	free(trainer.scenarios);
+	free(trainer.population);
+
+	return 0;
+}
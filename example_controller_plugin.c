@@ -0,0 +1,27 @@
+#include "car_common.h"
+#include "car_plugin.h"
+
+// The built-in pursuit controller packaged as a plugin. Build with
+// -shared -fPIC and pass the result with --controller-plugin; rebuilding
+// it while the simulator runs swaps it in on the fly.
+
+static void create_state(void *state) {
+	*(Controller_State *)state = controller_state_initial();
+}
+
+static void evaluate(u32 count, const Sensor_Data *sensor_data, void *states, Control_Input *inputs) {
+	pursuit_controller_evaluate(count, (Sensor_Data *)sensor_data, states, inputs);
+}
+
+static const Controller_Plugin_API api = {
+	CONTROLLER_PLUGIN_API_VERSION,
+	sizeof(Controller_State),
+	"example pursuit",
+	create_state,
+	NULL,
+	evaluate,
+};
+
+CONTROLLER_PLUGIN_EXPORT const Controller_Plugin_API *controller_plugin_get_api(void) {
+	return &api;
+}
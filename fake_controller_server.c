@@ -1,61 +1,66 @@
-#include <stdio.h>
-#include <assert.h>
-#include <math.h>
+#include "car_common.h"
+#include "car_controller.h"
+
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_net.h>
 
-#define DEG_TO_RAD 0.017453292519943295f
-#define RAD_TO_DEG 57.29577951308232f
-#define TAU 6.283185307179586f
-#define PI 3.141592653589793f
-
-typedef char s8;
-typedef short s16;
-typedef int s32;
-typedef long long s64;
-typedef unsigned char u8;
-typedef unsigned short u16;
-typedef unsigned int u32;
-typedef unsigned long long u64;
-
-typedef u32 b32;
-#ifndef __cplusplus
-enum {false = 0, true = 1};
-#endif
-
-typedef u64 umm;
-typedef s64 smm;
-
-typedef int check_size8[sizeof(u8)==1&&sizeof(s8)==1 ? 1 : -1];
-typedef int check_size16[sizeof(u16)==2&&sizeof(s16)==2 ? 1 : -1];
-typedef int check_size32[sizeof(u32)==4&&sizeof(s32)==4 ? 1 : -1];
-typedef int check_size64[sizeof(u64)==8&&sizeof(s64)==8 ? 1 : -1];
-typedef int check_sizeumm[sizeof(umm)==sizeof((void *)0) ? 1 : -1];
-typedef int check_sizesmm[sizeof(smm)==sizeof((void *)0) ? 1 : -1];
-
-
-typedef struct Control_Input {
-	// Control_Input_Button_Flags buttons;
-	s16 acceleration_axis;
-	s16 turn_axis;
-} __attribute__((packed)) Control_Input;
-
-typedef struct Sensor_Data {
-	float delta_x;
-	float delta_y;
-	float heading_direction;
-	float velocity;
-	u64 time;
-} __attribute__((packed)) Sensor_Data;
-
-
-__attribute__((noreturn)) static void panic(const char *format, ...) {
-	fprintf(stderr, "[ERROR] ");
-	va_list args;
-	va_start(args, format);
-	vfprintf(stderr, format, args);
-	va_end(args);
-	exit((int)(intptr_t)format);
+#define MAX_CLIENTS 64
+
+// Hysteresis state for every car of one simulator
+typedef struct Controller_Client {
+	IPaddress address;
+	u32 state_count;
+	Controller_State *states;
+	u64 last_request; // For evicting the least recently seen client
+} Controller_Client;
+
+static Controller_Client *find_client(Controller_Client *clients, IPaddress address, u64 request_index) {
+
+	Controller_Client *result = NULL;
+
+	for (u32 i = 0; i < MAX_CLIENTS; ++i) {
+		Controller_Client *client = &clients[i];
+		if (client->states && client->address.host == address.host && client->address.port == address.port) {
+			result = client;
+			break;
+		}
+	}
+
+	if (!result) {
+		result = &clients[0];
+		for (u32 i = 1; i < MAX_CLIENTS; ++i) {
+			if (clients[i].last_request < result->last_request) {
+				result = &clients[i];
+			}
+		}
+		free(result->states);
+		*result = (Controller_Client){0};
+		result->address = address;
+	}
+
+	result->last_request = request_index;
+	return result;
+}
+
+// first_car + count is at most CONTROLLER_MAX_CARS
+static Controller_State *client_states(Controller_Client *client, u32 first_car, u32 count) {
+
+	u32 needed = first_car + count;
+	if (needed > client->state_count) {
+		u32 new_count = client->state_count ? client->state_count : 64;
+		while (new_count < needed) new_count *= 2;
+
+		client->states = realloc(client->states, new_count*sizeof(Controller_State));
+		if (!client->states) {
+			panic("Could not allocate controller states.\n");
+		}
+		for (u32 i = client->state_count; i < new_count; ++i) {
+			client->states[i] = controller_state_initial();
+		}
+		client->state_count = new_count;
+	}
+
+	return client->states + first_car;
 }
 
 int main() {
@@ -69,90 +74,51 @@ int main() {
 		panic("SDLNet_Init Error: %s\n", SDL_GetError());
 	}
 
-	UDPsocket udp_socket = SDLNet_UDP_Open(9001);
+	UDPsocket udp_socket = SDLNet_UDP_Open(CONTROLLER_DEFAULT_PORT);
 	if (!udp_socket) {
 		panic("ERROR: Could not open UDP socket.\n");
 	}
 	else {
-		fprintf(stderr, "Listening for UDP packets on port 9001.\n");
+		fprintf(stderr, "Listening for UDP packets on port %d.\n", CONTROLLER_DEFAULT_PORT);
 	}
 
 
-	UDPpacket *udp_packet = SDLNet_AllocPacket(32);
+	UDPpacket *udp_packet = SDLNet_AllocPacket(CONTROLLER_MAX_PACKET_SIZE);
+
+	static Controller_Client clients[MAX_CLIENTS];
+	u64 request_index = 0;
 
 	b32 running = true;
 
 	while (running) {
 
-		static struct {
-			float acceleration_direction; // -1 for backwards or 1 for forwards
-			u32 mode_switch_time;
-		} state = {
-			1,
-			0
-		};
-
-
-		Sensor_Data sensor_data;
-
 		while (0 == SDLNet_UDP_Recv(udp_socket, udp_packet)) {
 			// Spin
 		}
 
-		sensor_data = *(Sensor_Data *)udp_packet->data;
-
-		float angle_to_target = atan2f(sensor_data.delta_y, sensor_data.delta_x);
-		float angle_delta = angle_to_target - sensor_data.heading_direction;
-		if (angle_delta > PI) {
-			angle_delta -= TAU;
-		}
-		else if (angle_delta < -PI) {
-			angle_delta += TAU;
-		}
-
-		float abs_angle_delta = fabsf(angle_delta);
-		assert(abs_angle_delta < (TAU+0.0001f));
-
+		Controller_Packet_Header *header = (Controller_Packet_Header *)udp_packet->data;
 
-		float heading_x = cosf(sensor_data.heading_direction);
-		float heading_y = sinf(sensor_data.heading_direction);
-		float distance_to_target = sqrtf(sensor_data.delta_x*sensor_data.delta_x + sensor_data.delta_y*sensor_data.delta_y);
-		float dot = (sensor_data.delta_x*heading_x + sensor_data.delta_y*heading_y) / distance_to_target;
-
-		float acceleration_factor = 1.0f;
-		if (distance_to_target < 200*sensor_data.velocity) {
-			acceleration_factor = distance_to_target/(200*sensor_data.velocity);
-			acceleration_factor *= acceleration_factor * acceleration_factor * 0.5f;
-		}
-
-		float turn_factor = 1.0;
+		if (udp_packet->len < (s32)sizeof(Controller_Packet_Header) ||
+			header->count > CONTROLLER_MAX_BATCH ||
+			udp_packet->len != (s32)(sizeof(Controller_Packet_Header) + header->count*sizeof(Sensor_Data)) ||
+			(u64)header->first_car + header->count > CONTROLLER_MAX_CARS)
 		{
-			float threshold = 0.75f*PI;
-			if (abs_angle_delta < threshold) {
-				turn_factor = abs_angle_delta/threshold;
-				turn_factor *= turn_factor * turn_factor * 0.9f;
-			}
+			fprintf(stderr, "Ignoring malformed request (%d bytes).\n", udp_packet->len);
+			continue;
 		}
 
-		assert(dot > -1.00001f && dot < 1.00001f);
-
-		Control_Input result = {0};
+		Controller_Client *client = find_client(clients, udp_packet->address, ++request_index);
+		Controller_State *states = client_states(client, header->first_car, header->count);
 
-		if (distance_to_target > 10) {
+		Sensor_Data sensor_data[CONTROLLER_MAX_BATCH];
+		Control_Input inputs[CONTROLLER_MAX_BATCH];
+		memcpy(sensor_data, header + 1, header->count*sizeof(Sensor_Data));
 
-			if (state.acceleration_direction > 0.0f && (dot < -0.8f)) {
-				state.acceleration_direction = -1.0f;
-			}
-			else if (state.acceleration_direction < 0.0f && (dot > 0.5f)) {
-				state.acceleration_direction = 1.0f;
-			}
-
-			result.acceleration_axis = 0x7fff * acceleration_factor * state.acceleration_direction;
-			result.turn_axis = 0x7fff * turn_factor * state.acceleration_direction * ((angle_delta > 0) ? 1.0f : -1.0f);
-		}
+		pursuit_controller_evaluate(header->count, sensor_data, states, inputs);
 
-		*(Control_Input *)udp_packet->data = result;
-		udp_packet->len = sizeof(result);
+		// Reply in place: same header, inputs instead of sensor data
+		memcpy(header + 1, inputs, header->count*sizeof(Control_Input));
+		udp_packet->len = sizeof(Controller_Packet_Header) + header->count*sizeof(Control_Input);
 		if (0 == SDLNet_UDP_Send(udp_socket, -1, udp_packet)) {
 			panic("Error: Could not send sensor data. SDLNet Error: '%s'\n", SDLNet_GetError());
 		}
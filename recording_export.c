@@ -0,0 +1,234 @@
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_recording.h"
+#include "car_replay.h"
+#include "car_columns.h"
+
+#include <SDL2/SDL.h>
+#include <float.h>
+
+// Exports a recording to a columnar file, one row per car per tick, and
+// runs range queries over a single column of such a file.
+//
+// Usage: recording_export <recording> <columns file> [--block-rows <count>]
+//        recording_export --query <columns file> <column> <minimum> <maximum>
+//
+// A row holds the car's state after the tick was simulated, the target it
+// was pursuing and the inputs it was given. A query counts the rows whose
+// column lies in [minimum, maximum], skipping blocks by their ranges.
+
+enum {
+	EXPORT_TICK,
+	EXPORT_CAR,
+	EXPORT_X,
+	EXPORT_Y,
+	EXPORT_DIRECTION,
+	EXPORT_VELOCITY,
+	EXPORT_FRONT_WHEEL_ANGLE,
+	EXPORT_TARGET_X,
+	EXPORT_TARGET_Y,
+	EXPORT_ACCELERATION_AXIS,
+	EXPORT_TURN_AXIS,
+	EXPORT_COLUMN_COUNT
+};
+
+static const Column_Description export_columns[EXPORT_COLUMN_COUNT] = {
+	{"tick", COLUMN_U64, 0},
+	{"car", COLUMN_U32, 0},
+	{"x", COLUMN_F32, 0},
+	{"y", COLUMN_F32, 0},
+	{"direction", COLUMN_F32, 0},
+	{"velocity", COLUMN_F32, 0},
+	{"front_wheel_angle", COLUMN_F32, 0},
+	{"target_x", COLUMN_F32, 0},
+	{"target_y", COLUMN_F32, 0},
+	{"acceleration_axis", COLUMN_S16, 0},
+	{"turn_axis", COLUMN_S16, 0},
+};
+
+static double seconds_since(u64 start) {
+	return (double)(SDL_GetPerformanceCounter() - start)/SDL_GetPerformanceFrequency();
+}
+
+static s32 export_recording(const char *recording_path, const char *columns_path, u32 block_rows) {
+
+	Replayer replayer;
+	if (!replayer_open(&replayer, recording_path)) {
+		panic("Could not open recording '%s'.\n", recording_path);
+	}
+
+	Column_Writer writer;
+	if (!column_writer_open(&writer, columns_path, export_columns, EXPORT_COLUMN_COUNT, block_rows)) {
+		panic("Could not create '%s'.\n", columns_path);
+	}
+
+	// One tick of rows, transposed from the cars
+	u32 capacity = 0;
+	void *rows[EXPORT_COLUMN_COUNT] = {0};
+
+	u64 start = SDL_GetPerformanceCounter();
+
+	while (replayer_step(&replayer)) {
+		u32 count = replayer.car_count;
+
+		if (count > capacity) {
+			capacity = count;
+			for (u32 c = 0; c < EXPORT_COLUMN_COUNT; ++c) {
+				rows[c] = realloc(rows[c], (umm)capacity*column_type_size(export_columns[c].type));
+				if (!rows[c]) {
+					panic("Out of memory.\n");
+				}
+			}
+		}
+
+		u64 tick = replayer.tick - 1;
+		for (u32 i = 0; i < count; ++i) {
+			Car *car = &replayer.cars[i];
+			((u64 *)rows[EXPORT_TICK])[i] = tick;
+			((u32 *)rows[EXPORT_CAR])[i] = i;
+			((float *)rows[EXPORT_X])[i] = car->x;
+			((float *)rows[EXPORT_Y])[i] = car->y;
+			((float *)rows[EXPORT_DIRECTION])[i] = car->direction;
+			((float *)rows[EXPORT_VELOCITY])[i] = car->velocity;
+			((float *)rows[EXPORT_FRONT_WHEEL_ANGLE])[i] = car->front_wheel_angle;
+			((float *)rows[EXPORT_TARGET_X])[i] = car->target_x;
+			((float *)rows[EXPORT_TARGET_Y])[i] = car->target_y;
+			((s16 *)rows[EXPORT_ACCELERATION_AXIS])[i] = replayer.inputs[i].acceleration_axis;
+			((s16 *)rows[EXPORT_TURN_AXIS])[i] = replayer.inputs[i].turn_axis;
+		}
+
+		column_writer_append(&writer, (const void **)rows, count);
+	}
+
+	u64 row_count = writer.row_count;
+	u32 block_count = writer.block_count + (writer.staged_rows != 0);
+	if (!column_writer_close(&writer)) {
+		fprintf(stderr, "Could not truncate '%s'.\n", columns_path);
+	}
+
+	printf("Exported %llu rows in %u blocks to '%s' in %.2f s\n", (unsigned long long)row_count, block_count,
+		columns_path, seconds_since(start));
+
+	for (u32 c = 0; c < EXPORT_COLUMN_COUNT; ++c) {
+		free(rows[c]);
+	}
+	replayer_close(&replayer);
+	return 0;
+}
+
+// Compares in the column's own type, with the bounds narrowed to the values
+// of that type inside [minimum, maximum], so a value counts exactly when the
+// block ranges say it could
+static u64 count_in_range(Column_Type type, const void *values, u32 count, double minimum, double maximum) {
+	u64 result = 0;
+	if (type == COLUMN_F32) {
+		// The common case gets a loop the compiler can vectorize
+		float low = minimum > FLT_MAX ? INFINITY : minimum < -FLT_MAX ? -INFINITY : (float)minimum;
+		float high = maximum > FLT_MAX ? INFINITY : maximum < -FLT_MAX ? -INFINITY : (float)maximum;
+		if (low < minimum) low = nextafterf(low, INFINITY);
+		if (high > maximum) high = nextafterf(high, -INFINITY);
+
+		const float *floats = values;
+		for (u32 i = 0; i < count; ++i) {
+			result += floats[i] >= low && floats[i] <= high;
+		}
+	}
+	else if (type == COLUMN_U64) {
+		// Large ticks do not survive a trip through double
+		double two_64 = 18446744073709551616.0;
+		if (maximum < 0.0 || minimum >= two_64 || minimum > maximum) {
+			return 0;
+		}
+		u64 low = minimum > 0.0 ? (u64)ceil(minimum) : 0;
+		u64 high = maximum < two_64 ? (u64)floor(maximum) : ~0ull;
+
+		const u64 *integers = values;
+		for (u32 i = 0; i < count; ++i) {
+			result += integers[i] >= low && integers[i] <= high;
+		}
+	}
+	else {
+		// Doubles hold these exactly
+		for (u32 i = 0; i < count; ++i) {
+			double value = column_value(type, values, i);
+			result += value >= minimum && value <= maximum;
+		}
+	}
+	return result;
+}
+
+static s32 query_columns(const char *columns_path, const char *name, double minimum, double maximum) {
+
+	Column_File columns;
+	if (!column_file_open(&columns, columns_path)) {
+		panic("Could not open columns file '%s'.\n", columns_path);
+	}
+
+	s32 column = column_file_find(&columns, name);
+	if (column < 0) {
+		fprintf(stderr, "No column '%s' in '%s'. Columns:", name, columns_path);
+		for (u32 c = 0; c < columns.header->column_count; ++c) {
+			fprintf(stderr, " %s", columns.columns[c].name);
+		}
+		fprintf(stderr, "\n");
+		column_file_close(&columns);
+		return 1;
+	}
+
+	Column_Type type = columns.columns[column].type;
+	u64 start = SDL_GetPerformanceCounter();
+
+	u64 matches = 0;
+	u64 scanned_rows = 0;
+	u32 skipped_blocks = 0;
+	for (u32 b = 0; b < columns.header->block_count; ++b) {
+		Column_Block *block = column_file_block(&columns, b);
+		Column_Chunk *chunk = &column_block_chunks(block)[column];
+
+		if (chunk->maximum < minimum || chunk->minimum > maximum) {
+			++skipped_blocks;
+			continue;
+		}
+		if (chunk->minimum >= minimum && chunk->maximum <= maximum) {
+			matches += block->row_count;
+			++skipped_blocks;
+			continue;
+		}
+
+		matches += count_in_range(type, column_file_values(&columns, block, column), block->row_count, minimum, maximum);
+		scanned_rows += block->row_count;
+	}
+
+	double seconds = seconds_since(start);
+	printf("%llu of %llu rows with %s in [%g, %g]; scanned %llu rows, %u of %u blocks answered from their ranges, %.2f ms (%.0f M rows/s)\n",
+		(unsigned long long)matches, (unsigned long long)columns.header->row_count, name, minimum, maximum,
+		(unsigned long long)scanned_rows, skipped_blocks, columns.header->block_count, 1000.0*seconds,
+		columns.header->row_count/seconds/1e6);
+
+	column_file_close(&columns);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	if (argc == 6 && strcmp(argv[1], "--query") == 0) {
+		return query_columns(argv[2], argv[3], atof(argv[4]), atof(argv[5]));
+	}
+
+	u32 block_rows = COLUMN_DEFAULT_BLOCK_ROWS;
+	if (argc == 5 && strcmp(argv[3], "--block-rows") == 0) {
+		block_rows = atoi(argv[4]);
+	}
+	else if (argc != 3) {
+		block_rows = 0;
+	}
+
+	if (block_rows == 0) {
+		fprintf(stderr, "Usage: %s <recording> <columns file> [--block-rows <count>]\n"
+			"       %s --query <columns file> <column> <minimum> <maximum>\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	return export_recording(argv[1], argv[2], block_rows);
+}
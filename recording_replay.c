@@ -0,0 +1,159 @@
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_recording.h"
+#include "car_replay.h"
+
+#include <SDL2/SDL.h>
+
+// Headless replay of a recording at full speed, for scrubbing to a tick and
+// inspecting the cars there, and for timing seeks. --verify replays the
+// whole recording and reports the first tick whose state differs from the
+// hashes recorded with it, as a build of the simulator with different
+// floating point code would.
+//
+// Usage: recording_replay <file> [--seek <tick>] [--run <ticks>] [--car <index>]
+//                         [--benchmark-seeks <count>] [--verify]
+
+static double seconds_since(u64 start) {
+	return (double)(SDL_GetPerformanceCounter() - start)/SDL_GetPerformanceFrequency();
+}
+
+static void print_car(Replayer *replayer, u32 index) {
+	if (index >= replayer->car_count) {
+		printf("car %u: not present at tick %llu\n", index, (unsigned long long)replayer->tick);
+		return;
+	}
+	Car *car = &replayer->cars[index];
+	Control_Input input = replayer->inputs[index];
+	printf("car %u at tick %llu: position (%.2f, %.2f) direction %.4f velocity %.4f wheel %.4f target (%.1f, %.1f) input (%d, %d)\n",
+		index, (unsigned long long)replayer->tick, car->x, car->y, car->direction, car->velocity,
+		car->front_wheel_angle, car->target_x, car->target_y, input.acceleration_axis, input.turn_axis);
+}
+
+int main(int argc, char **argv) {
+
+	const char *path = NULL;
+	u64 seek_tick = 0;
+	b32 seek = false;
+	u64 run_ticks = 0;
+	u32 car_index = 0;
+	u32 benchmark_seeks = 0;
+	b32 verify = false;
+
+	for (s32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc) {
+			seek_tick = strtoull(argv[++i], NULL, 10);
+			seek = true;
+		}
+		else if (strcmp(argv[i], "--run") == 0 && i + 1 < argc) {
+			run_ticks = strtoull(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--car") == 0 && i + 1 < argc) {
+			car_index = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--benchmark-seeks") == 0 && i + 1 < argc) {
+			benchmark_seeks = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--verify") == 0) {
+			verify = true;
+		}
+		else if (!path && argv[i][0] != '-') {
+			path = argv[i];
+		}
+		else {
+			path = NULL;
+			break;
+		}
+	}
+
+	if (!path) {
+		fprintf(stderr, "Usage: %s <file> [--seek <tick>] [--run <ticks>] [--car <index>] [--benchmark-seeks <count>] [--verify]\n", argv[0]);
+		return 1;
+	}
+
+	Replayer replayer;
+	if (!replayer_open(&replayer, path)) {
+		panic("Could not open recording '%s'.\n", path);
+	}
+
+	Recording_Header *header = replayer.reader.header;
+	printf("'%s': ticks %llu to %llu (%llu recorded), %u keyframes%s, %.1f MB (%.1f MB uncompressed)\n", path,
+		(unsigned long long)header->first_tick, (unsigned long long)header->last_tick, (unsigned long long)header->tick_count,
+		replayer.reader.keyframe_count, replayer.reader.owns_keyframes ? " (index rebuilt, recording was not closed)" : "",
+		header->data_length/(1024.0*1024.0), header->raw_length/(1024.0*1024.0));
+
+	if (seek) {
+		u64 start = SDL_GetPerformanceCounter();
+		replayer_seek(&replayer, seek_tick);
+		printf("Seeked to tick %llu in %.2f ms\n", (unsigned long long)replayer.tick, 1000.0*seconds_since(start));
+	}
+
+	if (run_ticks) {
+		u64 start = SDL_GetPerformanceCounter();
+		u64 ticks = 0;
+		u64 car_ticks = 0;
+		while (ticks < run_ticks && replayer_step(&replayer)) {
+			++ticks;
+			car_ticks += replayer.car_count;
+		}
+		double seconds = seconds_since(start);
+		printf("Replayed %llu ticks in %.3f s (%.0f ticks/s, %.1f M car ticks/s)\n",
+			(unsigned long long)ticks, seconds, ticks/seconds, car_ticks/seconds/1e6);
+	}
+
+	if (verify) {
+		replayer_seek(&replayer, 0);
+		replayer.hashed_ticks = 0;
+		replayer.diverged = false;
+
+		u64 start = SDL_GetPerformanceCounter();
+		u64 ticks = 0;
+		while (replayer_step(&replayer)) {
+			++ticks;
+		}
+		double seconds = seconds_since(start);
+
+		// The hashing alone, over the final state as often as it ran
+		start = SDL_GetPerformanceCounter();
+		volatile u64 sum = 0;
+		for (u64 i = 0; i < replayer.hashed_ticks; ++i) {
+			sum += recording_state_hash(replayer.cars, replayer.car_count, NULL);
+		}
+		double hash_seconds = seconds_since(start);
+
+		printf("Verified %llu of %llu ticks in %.3f s, hashing %.3f s of it\n",
+			(unsigned long long)replayer.hashed_ticks, (unsigned long long)ticks, seconds, hash_seconds);
+		if (replayer.diverged) {
+			printf("Diverged at tick %llu, car %d\n", (unsigned long long)replayer.divergent_tick, replayer.divergent_car);
+			replayer_seek(&replayer, replayer.divergent_tick + 1);
+			if (replayer.divergent_car >= 0) {
+				car_index = replayer.divergent_car;
+			}
+		}
+		else if (replayer.hashed_ticks) {
+			printf("No divergence\n");
+		}
+	}
+
+	print_car(&replayer, car_index);
+
+	if (benchmark_seeks && header->tick_count) {
+		Random_Series series = random_seed(1);
+		u64 range = header->last_tick + 1 - header->first_tick;
+		double worst = 0.0;
+		double total = 0.0;
+		for (u32 i = 0; i < benchmark_seeks; ++i) {
+			u64 tick = header->first_tick + (u64)(random_unit(&series)*range);
+			u64 start = SDL_GetPerformanceCounter();
+			replayer_seek(&replayer, tick);
+			double seconds = seconds_since(start);
+			total += seconds;
+			worst = seconds > worst ? seconds : worst;
+		}
+		printf("%u random seeks: mean %.2f ms, worst %.2f ms\n", benchmark_seeks, 1000.0*total/benchmark_seeks, 1000.0*worst);
+	}
+
+	replayer_close(&replayer);
+	return 0;
+}
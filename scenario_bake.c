@@ -0,0 +1,177 @@
+#include "car_common.h"
+#include "car_controller.h"
+#include "car_physics.h"
+#include "car_scenario.h"
+
+// Generates a scenario file: the player car in the middle of the world, a
+// fleet spread around it and box obstacles on the occupancy grid.
+//
+// Usage: scenario_bake <scenario file> [--cars <count>] [--obstacles <count>]
+//                      [--seed <seed>] [--player <controller>] [--fleet <controller>]
+//
+// The world matches the simulator's default window and grid, so a scenario
+// with no obstacles and one car starts like a plain launch.
+
+#define BAKE_WORLD_WIDTH 1024.0f
+#define BAKE_WORLD_HEIGHT 768.0f
+#define BAKE_GRID_WIDTH 192
+#define BAKE_GRID_HEIGHT 144
+#define BAKE_GRID_CELL_SIZE 32.0f
+
+static const char *controller_names[CONTROLLER_ID_COUNT] = {
+	[CONTROLLER_HUMAN] = "human",
+	[CONTROLLER_PURSUIT] = "pursuit",
+	[CONTROLLER_REMOTE] = "remote",
+	[CONTROLLER_LOOKUP_TABLE] = "lookup",
+	[CONTROLLER_MPC] = "mpc",
+	[CONTROLLER_POLICY] = "policy",
+	[CONTROLLER_PLUGIN] = "plugin",
+};
+
+static u32 controller_from_name(const char *name) {
+	for (u32 i = 0; i < CONTROLLER_ID_COUNT; ++i) {
+		if (strcmp(controller_names[i], name) == 0) {
+			return i;
+		}
+	}
+	panic("Unknown controller '%s'.\n", name);
+}
+
+static b32 cell_occupied_at(Scenario_Header *header, u8 *cells, float x, float y) {
+	s32 cell_x = (s32)floorf((x - header->grid_origin_x)/header->grid_cell_size);
+	s32 cell_y = (s32)floorf((y - header->grid_origin_y)/header->grid_cell_size);
+	return cell_x >= 0 && cell_y >= 0 && cell_x < header->grid_width && cell_y < header->grid_height &&
+		cells[cell_y*header->grid_width + cell_x];
+}
+
+int main(int argc, char **argv) {
+
+	const char *path = NULL;
+	u32 car_count = 1;
+	u32 obstacle_count = 0;
+
+	Scenario_Header header = {0};
+	header.player_controller = CONTROLLER_REMOTE;
+	header.fleet_controller = CONTROLLER_PURSUIT;
+	header.seed = 1;
+
+	for (s32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--cars") == 0 && i + 1 < argc) {
+			car_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--obstacles") == 0 && i + 1 < argc) {
+			obstacle_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			header.seed = strtoull(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--player") == 0 && i + 1 < argc) {
+			header.player_controller = controller_from_name(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--fleet") == 0 && i + 1 < argc) {
+			header.fleet_controller = controller_from_name(argv[++i]);
+		}
+		else if (!path && argv[i][0] != '-') {
+			path = argv[i];
+		}
+		else {
+			path = NULL;
+			break;
+		}
+	}
+
+	if (!path || car_count == 0) {
+		fprintf(stderr, "Usage: %s <scenario file> [--cars <count>] [--obstacles <count>] [--seed <seed>] "
+			"[--player <controller>] [--fleet <controller>]\nControllers:", argv[0]);
+		for (u32 i = 0; i < CONTROLLER_ID_COUNT; ++i) {
+			fprintf(stderr, " %s", controller_names[i]);
+		}
+		fprintf(stderr, "\n");
+		return 1;
+	}
+
+	Random_Series series = random_seed(header.seed);
+
+	float center_x = 0.5f*BAKE_WORLD_WIDTH;
+	float center_y = 0.5f*BAKE_WORLD_HEIGHT;
+
+	header.car_count = car_count;
+	header.camera_x = center_x;
+	header.camera_y = center_y;
+	header.camera_zoom = 1.0f;
+	header.grid_width = BAKE_GRID_WIDTH;
+	header.grid_height = BAKE_GRID_HEIGHT;
+	header.grid_cell_size = BAKE_GRID_CELL_SIZE;
+	header.grid_origin_x = center_x - 0.5f*BAKE_GRID_WIDTH*BAKE_GRID_CELL_SIZE;
+	header.grid_origin_y = center_y - 0.5f*BAKE_GRID_HEIGHT*BAKE_GRID_CELL_SIZE;
+
+	Car *cars = malloc((umm)car_count*sizeof(Car));
+	u8 *cells = calloc((umm)BAKE_GRID_WIDTH*BAKE_GRID_HEIGHT, 1);
+	if (!cars || !cells) {
+		panic("Out of memory.\n");
+	}
+
+	Car *player = &cars[0];
+	*player = car_default(center_x, center_y);
+	player->target_x = BAKE_WORLD_WIDTH*random_unit(&series);
+	player->target_y = BAKE_WORLD_HEIGHT*random_unit(&series);
+
+	// Boxes of 2 to 8 cells a side, clear of the player's start
+	float clearance = 2.0f*player->length;
+	u32 placed_count = 0;
+	for (u32 i = 0; i < obstacle_count; ++i) {
+		s32 width = 2 + (s32)(random_unit(&series)*7.0f);
+		s32 height = 2 + (s32)(random_unit(&series)*7.0f);
+		s32 left = (s32)(random_unit(&series)*(BAKE_GRID_WIDTH - width));
+		s32 top = (s32)(random_unit(&series)*(BAKE_GRID_HEIGHT - height));
+
+		float box_x = header.grid_origin_x + (left + 0.5f*width)*BAKE_GRID_CELL_SIZE;
+		float box_y = header.grid_origin_y + (top + 0.5f*height)*BAKE_GRID_CELL_SIZE;
+		float reach = clearance + 0.5f*BAKE_GRID_CELL_SIZE*(width > height ? width : height);
+		if ((box_x - center_x)*(box_x - center_x) + (box_y - center_y)*(box_y - center_y) < reach*reach) {
+			continue;
+		}
+
+		for (s32 y = top; y < top + height; ++y) {
+			memset(cells + y*BAKE_GRID_WIDTH + left, 1, width);
+		}
+		++placed_count;
+	}
+
+	// The fleet on a disc that grows with its size, as the simulator spawns it,
+	// with starts and targets off the obstacles
+	float spread = 1.5f*player->length*sqrtf((float)car_count);
+	for (u32 i = 1; i < car_count; ++i) {
+		Car *car = &cars[i];
+		*car = *player;
+
+		for (u32 attempt = 0; attempt < 16; ++attempt) {
+			float angle = TAU*random_unit(&series);
+			float distance = spread*sqrtf(random_unit(&series));
+			car->x = center_x + cosf(angle)*distance;
+			car->y = center_y + sinf(angle)*distance;
+			if (!cell_occupied_at(&header, cells, car->x, car->y)) break;
+		}
+		for (u32 attempt = 0; attempt < 16; ++attempt) {
+			float angle = TAU*random_unit(&series);
+			float distance = spread*sqrtf(random_unit(&series));
+			car->target_x = center_x + cosf(angle)*distance;
+			car->target_y = center_y + sinf(angle)*distance;
+			if (!cell_occupied_at(&header, cells, car->target_x, car->target_y)) break;
+		}
+
+		car->direction = PI*random_bilateral(&series);
+		car->velocity = 8.0f*random_unit(&series);
+	}
+
+	if (!scenario_write(path, &header, cars, placed_count ? cells : NULL)) {
+		panic("Could not write '%s'.\n", path);
+	}
+
+	printf("Baked %u cars and %u obstacles into '%s' (%llu bytes).\n", car_count, placed_count, path,
+		(unsigned long long)header.file_length);
+
+	free(cells);
+	free(cars);
+	return 0;
+}